@@ -0,0 +1,176 @@
+import 'dart:convert';
+import 'dart:io';
+import 'dart:math';
+
+import 'package:flutter_build_hooks_ffi_example/flutter_build_hooks_ffi_example.dart';
+
+/// One generated block per language; the `$n`, `$k1` and `$k2` markers are
+/// replaced by [generateSource]. Kept in step with benchmark/native/ts_bench.c
+/// so the Dart and native numbers describe the same input.
+const _blocks = {
+  TreeSitterLanguage.c: r'''
+/* block $n */
+static int compute_$n(const int *values, int count) {
+  int total = $k1;
+  for (int i = 0; i < count; i++) {
+    if (values[i] % 2 == 0) {
+      total += values[i] * $k2;
+    } else {
+      total -= values[i];
+    }
+  }
+  const char *label = "item_$n";
+  return total + (int)strlen(label);
+}
+
+''',
+  TreeSitterLanguage.javascript: r'''
+// block $n
+export function compute$n(values) {
+  let total = $k1;
+  for (const value of values) {
+    total += value % 2 === 0 ? value * $k2 : -value;
+  }
+  const label = `item_${total}_$n`;
+  return { total, label, ok: total > 0 };
+}
+
+''',
+  TreeSitterLanguage.dart: r'''
+// block $n
+int compute$n(List<int> values) {
+  var total = $k1;
+  for (final value in values) {
+    total += value.isEven ? value * $k2 : -value;
+  }
+  final label = 'item_${total}_$n';
+  return total + label.length;
+}
+
+''',
+};
+
+/// Deterministic [language] source of at least [targetBytes] bytes.
+String generateSource(TreeSitterLanguage language, int targetBytes) {
+  final random = Random(language.index);
+  final buffer = StringBuffer();
+  for (var n = 0; buffer.length < targetBytes; n++) {
+    buffer.write(
+      _blocks[language]!
+          .replaceAll(r'$n', '$n')
+          .replaceAll(r'$k1', '${random.nextInt(1000)}')
+          .replaceAll(r'$k2', '${random.nextInt(97) + 1}'),
+    );
+  }
+  return buffer.toString();
+}
+
+/// The package's highlight query for [language], the one built into the
+/// native library. Benchmarks run from the package root.
+String highlightsQuery(TreeSitterLanguage language) =>
+    File('queries/${language.name}/highlights.scm').readAsStringSync();
+
+/// Sorted per-run durations of one measured stage.
+class Samples {
+  final List<int> micros;
+
+  Samples(List<int> micros) : micros = List.of(micros)..sort();
+
+  int percentile(int percent) =>
+      micros.isEmpty ? 0 : micros[(micros.length - 1) * percent ~/ 100];
+
+  int get median => percentile(50);
+
+  double get meanMicros => micros.isEmpty
+      ? 0
+      : micros.reduce((a, b) => a + b) / micros.length;
+}
+
+/// Runs [body] [warmup] times, then [iterations] timed times.
+Samples measure(void Function() body, {int iterations = 20, int warmup = 3}) {
+  for (var i = 0; i < warmup; i++) {
+    body();
+  }
+  final micros = <int>[];
+  final stopwatch = Stopwatch();
+  for (var i = 0; i < iterations; i++) {
+    stopwatch
+      ..reset()
+      ..start();
+    body();
+    stopwatch.stop();
+    micros.add(stopwatch.elapsedMicroseconds);
+  }
+  return Samples(micros);
+}
+
+/// Async variant of [measure].
+Future<Samples> measureAsync(
+  Future<void> Function() body, {
+  int iterations = 20,
+  int warmup = 3,
+}) async {
+  for (var i = 0; i < warmup; i++) {
+    await body();
+  }
+  final micros = <int>[];
+  final stopwatch = Stopwatch();
+  for (var i = 0; i < iterations; i++) {
+    stopwatch
+      ..reset()
+      ..start();
+    await body();
+    stopwatch.stop();
+    micros.add(stopwatch.elapsedMicroseconds);
+  }
+  return Samples(micros);
+}
+
+/// Command line shared by the benchmarks:
+///   --json           one JSON object per result line
+///   --sizes 16,256   source sizes in KiB
+///   --language dart  only run one language
+class BenchmarkOptions {
+  final bool json;
+  final List<int> sizesKib;
+  final List<TreeSitterLanguage> languages;
+
+  BenchmarkOptions._(this.json, this.sizesKib, this.languages);
+
+  factory BenchmarkOptions.parse(
+    List<String> args, {
+    List<int> defaultSizesKib = const [16, 256, 1024],
+  }) {
+    var json = false;
+    var sizes = defaultSizesKib;
+    var languages = TreeSitterLanguage.values;
+    for (var i = 0; i < args.length; i++) {
+      switch (args[i]) {
+        case '--json':
+          json = true;
+        case '--sizes' when i + 1 < args.length:
+          sizes = args[++i].split(',').map(int.parse).toList();
+        case '--language' when i + 1 < args.length:
+          languages = [TreeSitterLanguage.values.byName(args[++i])];
+        default:
+          throw ArgumentError('unknown argument ${args[i]}');
+      }
+    }
+    return BenchmarkOptions._(json, sizes, languages);
+  }
+
+  /// Writes one result line: [fields] as a JSON object with --json, otherwise
+  /// as aligned `key=value` text.
+  void report(String benchmark, Map<String, Object> fields) {
+    if (json) {
+      stdout.writeln(jsonEncode({'benchmark': benchmark, ...fields}));
+      return;
+    }
+    final values = fields.entries
+        .map((e) => '${e.key}=${e.value is double ? (e.value as double).toStringAsFixed(3) : e.value}')
+        .join('  ');
+    stdout.writeln('${benchmark.padRight(24)} $values');
+  }
+}
+
+double millis(int micros) => micros / 1000;
@@ -0,0 +1,171 @@
+// Per-stage cost of the Dart side of the FFI calls in
+// lib/flutter_build_hooks_ffi_example.dart.
+//
+// For each language and source size this times, separately:
+//   encode        source.toNativeUtf8() and freeing it
+//   native        ts_query_captures alone, on pre-encoded input
+//   decode        toDartString() of the native result
+//   split_parse   the split / int.tryParse loop of parseQueryCaptures
+//   sort          the capture sort of parseQueryCaptures (on a fresh copy)
+//   text / packed parseQueryCaptures and parseQueryCapturesPacked end to end
+//   tokens_*      parseTokens and parseTokensPacked end to end
+//   async         parseQueryCapturesAsync, and Isolate.run of an empty closure
+//
+// Run from the package root:
+//   dart run benchmark/ffi_boundary_benchmark.dart [--json] [--sizes 16,256]
+import 'dart:ffi' as ffi;
+import 'dart:isolate';
+
+import 'package:ffi/ffi.dart';
+import 'package:flutter_build_hooks_ffi_example/flutter_build_hooks_ffi_example.dart';
+import 'package:flutter_build_hooks_ffi_example/flutter_build_hooks_ffi_example_bindings_generated.dart'
+    as bindings;
+
+import 'common.dart';
+
+Future<void> main(List<String> args) async {
+  final options = BenchmarkOptions.parse(args);
+
+  final isolateRun = await measureAsync(() => Isolate.run(() => null));
+  options.report('isolate_run_empty', {
+    'median_ms': millis(isolateRun.median),
+    'p90_ms': millis(isolateRun.percentile(90)),
+  });
+
+  for (final language in options.languages) {
+    final query = highlightsQuery(language);
+    for (final kib in options.sizesKib) {
+      final source = generateSource(language, kib * 1024);
+      final iterations = kib >= 1024 ? 5 : 20;
+      await _benchmarkLanguage(options, language, source, query, iterations);
+    }
+  }
+}
+
+Future<void> _benchmarkLanguage(
+  BenchmarkOptions options,
+  TreeSitterLanguage language,
+  String source,
+  String query,
+  int iterations,
+) async {
+  final sourcePtr = source.toNativeUtf8();
+  final queryPtr = query.toNativeUtf8();
+  final bytes = sourcePtr.length;
+
+  // The end-to-end text path first, so every stage can be reported as a
+  // share of it.
+  final text = measure(
+    () => parseQueryCaptures(source, language: language, query: query),
+    iterations: iterations,
+  );
+
+  void report(String stage, Samples samples, [Map<String, Object> extra = const {}]) {
+    options.report(stage, {
+      'language': language.name,
+      'bytes': bytes,
+      'median_ms': millis(samples.median),
+      'p90_ms': millis(samples.percentile(90)),
+      'share_of_text': text.median == 0 ? 0.0 : samples.median / text.median,
+      ...extra,
+    });
+  }
+
+  report('text', text);
+
+  report(
+    'encode',
+    measure(() => malloc.free(source.toNativeUtf8()), iterations: iterations),
+  );
+
+  report(
+    'native',
+    measure(() {
+      final resultPtr = bindings.ts_query_captures(
+        sourcePtr.cast<ffi.Char>(),
+        language.index,
+        queryPtr.cast<ffi.Char>(),
+      );
+      bindings.ts_free(resultPtr.cast());
+    }, iterations: iterations),
+  );
+
+  final resultPtr = bindings.ts_query_captures(
+    sourcePtr.cast<ffi.Char>(),
+    language.index,
+    queryPtr.cast<ffi.Char>(),
+  );
+  if (resultPtr == ffi.nullptr) {
+    throw StateError('ts_query_captures failed');
+  }
+  final raw = resultPtr.cast<Utf8>().toDartString();
+  report(
+    'decode',
+    measure(() => resultPtr.cast<Utf8>().toDartString(), iterations: iterations),
+    {'result_bytes': resultPtr.cast<Utf8>().length},
+  );
+  bindings.ts_free(resultPtr.cast());
+
+  final captures = _splitParse(raw);
+  report(
+    'split_parse',
+    measure(() => _splitParse(raw), iterations: iterations),
+    {'captures': captures.length},
+  );
+  report('sort', measure(() => _sort(List.of(captures)), iterations: iterations));
+
+  report(
+    'packed',
+    measure(
+      () => parseQueryCapturesPacked(source, language: language, query: query),
+      iterations: iterations,
+    ),
+  );
+  report(
+    'tokens_text',
+    measure(() => parseTokens(source, language: language), iterations: iterations),
+  );
+  report(
+    'tokens_packed',
+    measure(
+      () => parseTokensPacked(source, language: language),
+      iterations: iterations,
+    ),
+  );
+  report(
+    'async',
+    await measureAsync(
+      () => parseQueryCapturesAsync(source, language: language, query: query),
+      iterations: iterations,
+    ),
+  );
+
+  malloc.free(sourcePtr);
+  malloc.free(queryPtr);
+}
+
+// Mirrors the parsing loop of parseQueryCaptures.
+List<TreeSitterCapture> _splitParse(String raw) {
+  final captures = <TreeSitterCapture>[];
+  for (final line in raw.split('\n')) {
+    if (line.isEmpty) continue;
+    final parts = line.split('\t');
+    if (parts.length < 3) continue;
+    final start = int.tryParse(parts[0]);
+    final end = int.tryParse(parts[1]);
+    final name = parts.sublist(2).join('\t');
+    if (start == null || end == null) continue;
+    if (end <= start) continue;
+    captures.add(TreeSitterCapture(startByte: start, endByte: end, name: name));
+  }
+  return captures;
+}
+
+// Mirrors the sort of parseQueryCaptures.
+void _sort(List<TreeSitterCapture> captures) {
+  captures.sort((a, b) {
+    final start = a.startByte.compareTo(b.startByte);
+    if (start != 0) return start;
+    return b.endByte.compareTo(a.endByte);
+  });
+}
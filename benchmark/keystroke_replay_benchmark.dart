@@ -0,0 +1,265 @@
+// End-to-end latency of editing a TreeSitterDocument, one keystroke at a time.
+//
+// Replays edit traces through replaceText + reparseText + queryCaptures with
+// the built-in highlights query, as the editor does per keystroke, and reports
+// p50/p95/p99/max of the whole step and of each part. The generated traces are:
+//   typing        a line of code typed a character at a time
+//   paste         a block of code pasted at once
+//   block_delete  a run of lines deleted at once
+//   indent        a run of lines indented (one edit per line, one reparse)
+// --trace FILE replays a recorded trace instead, a JSON object of the form
+//   {"language": "javascript", "text": "...", "steps": [[[start, end, "replacement"], ...], ...]}
+// with UTF-16 offsets into the text as it is before each edit.
+//
+// Every --verify-every steps and after the last one, the captures are compared
+// with a fresh full parse of the same text, queried with the highlights.scm
+// text; a mismatch fails the run. With
+// --budget-ms, the run also fails when a trace's p99 exceeds the budget.
+//
+// Run from the package root:
+//   dart run benchmark/keystroke_replay_benchmark.dart [--json] [--budget-ms 16]
+import 'dart:convert';
+import 'dart:io';
+import 'dart:math';
+
+import 'package:flutter_build_hooks_ffi_example/flutter_build_hooks_ffi_example.dart';
+
+import 'common.dart';
+
+typedef _Edit = (int start, int end, String replacement);
+
+class _Trace {
+  final String name;
+  final TreeSitterLanguage language;
+  final String text;
+  final List<List<_Edit>> steps;
+
+  _Trace(this.name, this.language, this.text, this.steps);
+
+  factory _Trace.load(String path) {
+    final json = jsonDecode(File(path).readAsStringSync()) as Map<String, Object?>;
+    return _Trace(
+      path,
+      TreeSitterLanguage.values.byName(json['language'] as String),
+      json['text'] as String,
+      [
+        for (final step in json['steps'] as List<Object?>)
+          [
+            for (final edit in step as List<Object?>)
+              switch (edit as List<Object?>) {
+                [final int start, final int end, final String replacement] =>
+                  (start, end, replacement),
+                _ => throw FormatException('bad edit $edit in $path'),
+              },
+          ],
+      ],
+    );
+  }
+}
+
+Future<void> main(List<String> args) async {
+  String? tracePath;
+  double? budgetMs;
+  var verifyEvery = 25;
+  final rest = <String>[];
+  for (var i = 0; i < args.length; i++) {
+    switch (args[i]) {
+      case '--trace' when i + 1 < args.length:
+        tracePath = args[++i];
+      case '--budget-ms' when i + 1 < args.length:
+        budgetMs = double.parse(args[++i]);
+      case '--verify-every' when i + 1 < args.length:
+        verifyEvery = int.parse(args[++i]);
+      default:
+        rest.add(args[i]);
+    }
+  }
+  final options = BenchmarkOptions.parse(rest, defaultSizesKib: const [64, 512]);
+
+  final traces = tracePath != null
+      ? [_Trace.load(tracePath)]
+      : [
+          for (final language in options.languages)
+            for (final kib in options.sizesKib)
+              ..._generateTraces(language, generateSource(language, kib * 1024)),
+        ];
+
+  var failed = false;
+  for (final trace in traces) {
+    final passed = _replay(options, trace, verifyEvery: verifyEvery, budgetMs: budgetMs);
+    failed = failed || !passed;
+  }
+  if (failed) {
+    exitCode = 1;
+  }
+}
+
+List<_Trace> _generateTraces(TreeSitterLanguage language, String text) {
+  final random = Random(text.length);
+
+  // Typed into the middle of the file, at a line start so it becomes a
+  // statement of its own.
+  const typed = {
+    TreeSitterLanguage.c: 'int extra = compute_1(values, count) * 2;\n',
+    TreeSitterLanguage.javascript: 'const extra = compute1(values).total * 2;\n',
+    TreeSitterLanguage.dart: 'final extra = compute1(values) * 2;\n',
+  };
+  final line = typed[language]!;
+  final typingAt = _lineStarts(text)[_lineStarts(text).length ~/ 2];
+  final typing = [
+    for (var i = 0; i < line.length; i++) [(typingAt + i, typingAt + i, line[i])],
+  ];
+
+  // Pasted after a blank line, i.e. between two generated blocks.
+  final block = generateSource(language, 1);
+  final pastes = _generateSteps(text, (text, starts) {
+    var at = starts[random.nextInt(starts.length - 40)];
+    while (at > 1 && !text.startsWith('\n\n', at - 2)) {
+      at = text.lastIndexOf('\n', at - 2) + 1;
+    }
+    return [(at, at, block)];
+  });
+
+  final deletes = _generateSteps(text, (text, starts) {
+    final first = random.nextInt(starts.length - 40);
+    return [(starts[first], starts[first + 5 + random.nextInt(15)], '')];
+  });
+
+  final indents = _generateSteps(text, (text, starts) {
+    final first = random.nextInt(starts.length - 40);
+    final count = 3 + random.nextInt(20);
+    // Bottom-up, so each edit's offset is still valid after the ones before.
+    return [
+      for (var line = first + count - 1; line >= first; line--) (starts[line], starts[line], '  '),
+    ];
+  });
+
+  final size = '${(text.length / 1024).round()}KiB';
+  return [
+    _Trace('typing/$size', language, text, typing),
+    _Trace('paste/$size', language, text, pastes),
+    _Trace('block_delete/$size', language, text, deletes),
+    _Trace('indent/$size', language, text, indents),
+  ];
+}
+
+List<int> _lineStarts(String text) => [
+  0,
+  for (var i = 0; i < text.length; i++)
+    if (text.codeUnitAt(i) == 0x0A) i + 1,
+];
+
+/// Twenty steps made by [next] from the text as it is after the steps before,
+/// so their offsets stay valid as the trace is applied.
+List<List<_Edit>> _generateSteps(
+  String text,
+  List<_Edit> Function(String text, List<int> lineStarts) next,
+) {
+  final steps = <List<_Edit>>[];
+  for (var i = 0; i < 20; i++) {
+    final step = next(text, _lineStarts(text));
+    steps.add(step);
+    text = _apply(text, step);
+  }
+  return steps;
+}
+
+String _apply(String text, List<_Edit> step) {
+  for (final (start, end, replacement) in step) {
+    text = text.replaceRange(start, end, replacement);
+  }
+  return text;
+}
+
+List<(int, int, String)> _captureKeys(TreeSitterDocument doc, String? query) =>
+    doc.queryCaptures(query).map((c) => (c.startByte, c.endByte, c.name)).toList();
+
+/// Replays [trace] and reports its latencies. Returns false when the
+/// incremental result diverged from a full parse or the budget was missed.
+bool _replay(
+  BenchmarkOptions options,
+  _Trace trace, {
+  required int verifyEvery,
+  required double? budgetMs,
+}) {
+  final query = highlightsQuery(trace.language);
+  final doc = TreeSitterDocument.create(language: trace.language);
+  doc.offsetEncoding = TreeSitterOffsetEncoding.utf16;
+  doc.selectQuery(TreeSitterQueryKind.highlights);
+  doc.setText(trace.text);
+  if (doc.reparseText() != TreeSitterReparseStatus.ok) {
+    doc.dispose();
+    throw StateError('initial parse of ${trace.name} failed');
+  }
+  doc.queryCaptures(null);
+
+  var text = trace.text;
+  final total = <int>[];
+  final edit = <int>[];
+  final reparse = <int>[];
+  final queried = <int>[];
+  var mismatches = 0;
+  final stopwatch = Stopwatch()..start();
+  for (var i = 0; i < trace.steps.length; i++) {
+    final step = trace.steps[i];
+    final start = stopwatch.elapsedMicroseconds;
+    for (final (editStart, editEnd, replacement) in step) {
+      doc.replaceText(editStart, editEnd, replacement);
+    }
+    final edited = stopwatch.elapsedMicroseconds;
+    final status = doc.reparseText();
+    final reparsed = stopwatch.elapsedMicroseconds;
+    doc.queryCaptures(null);
+    final end = stopwatch.elapsedMicroseconds;
+    if (status != TreeSitterReparseStatus.ok) {
+      doc.dispose();
+      throw StateError('reparse of ${trace.name} failed at step $i');
+    }
+    total.add(end - start);
+    edit.add(edited - start);
+    reparse.add(reparsed - edited);
+    queried.add(end - reparsed);
+
+    text = _apply(text, step);
+    if ((i + 1) % verifyEvery == 0 || i == trace.steps.length - 1) {
+      final fresh = TreeSitterDocument.create(language: trace.language);
+      fresh.offsetEncoding = TreeSitterOffsetEncoding.utf16;
+      fresh.reparse(text);
+      if (!_sameCaptures(_captureKeys(doc, null), _captureKeys(fresh, query))) {
+        mismatches++;
+        stderr.writeln('${trace.name}: captures differ from a full parse after step $i');
+      }
+      fresh.dispose();
+    }
+  }
+  final stats = doc.stats;
+  doc.dispose();
+
+  final steps = Samples(total);
+  final p99Ms = millis(steps.percentile(99));
+  final withinBudget = budgetMs == null || p99Ms <= budgetMs;
+  options.report('keystroke', {
+    'trace': trace.name,
+    'language': trace.language.name,
+    'steps': trace.steps.length,
+    'p50_ms': millis(steps.percentile(50)),
+    'p95_ms': millis(steps.percentile(95)),
+    'p99_ms': p99Ms,
+    'max_ms': millis(steps.percentile(100)),
+    'edit_p95_ms': millis(Samples(edit).percentile(95)),
+    'reparse_p95_ms': millis(Samples(reparse).percentile(95)),
+    'query_p95_ms': millis(Samples(queried).percentile(95)),
+    'reuse_ratio': stats.reuseRatio,
+    'mismatches': mismatches,
+    if (budgetMs != null) 'within_budget': withinBudget,
+  });
+  return mismatches == 0 && withinBudget;
+}
+
+bool _sameCaptures(List<(int, int, String)> a, List<(int, int, String)> b) {
+  if (a.length != b.length) return false;
+  for (var i = 0; i < a.length; i++) {
+    if (a[i] != b[i]) return false;
+  }
+  return true;
+}
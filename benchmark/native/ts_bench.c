@@ -0,0 +1,518 @@
+// Throughput benchmark of the native tree-sitter layer.
+//
+// Generates a corpus of C, JavaScript and Dart sources at several sizes and,
+// for each, measures through the library's exports:
+//   full_parse   - parsing the whole document from scratch (MB/s)
+//   incremental  - replace_text + ts_doc_edit + reparse of a one-byte edit
+//                  (latency percentiles)
+//   query        - the built-in highlights.scm over the whole document,
+//                  packed and as text, and the serialization share reported
+//                  by ts_doc_stats
+//
+// Results go to stdout, one line per benchmark; with --json each line is a
+// JSON object so runs can be diffed or collected by scripts.
+//
+// Usage: ts_bench [--json] [--sizes KiB,KiB,...] [--iterations N]
+//                 [--edits N] [--queries DIR] [--language c|javascript|dart]
+
+#include "flutter_build_hooks_ffi_example.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifndef TS_BENCH_QUERY_DIR
+#define TS_BENCH_QUERY_DIR "queries"
+#endif
+
+#define BENCH_MAX_SIZES 8
+#define BENCH_MAX_METRICS 12
+
+typedef struct BenchLanguage {
+  const char *name;
+  int32_t id;
+  // One generated block; every %u takes the same five arguments, see
+  // corpus_generate.
+  const char *block;
+} BenchLanguage;
+
+static const BenchLanguage bench_languages[] = {
+  {
+    "c",
+    0,
+    "/* block %u */\n"
+    "static int compute_%u(const int *values, int count) {\n"
+    "  int total = %u;\n"
+    "  for (int i = 0; i < count; i++) {\n"
+    "    if (values[i] %% 2 == 0) {\n"
+    "      total += values[i] * %u;\n"
+    "    } else {\n"
+    "      total -= values[i];\n"
+    "    }\n"
+    "  }\n"
+    "  const char *label = \"item_%u\";\n"
+    "  return total + (int)strlen(label);\n"
+    "}\n\n",
+  },
+  {
+    "javascript",
+    1,
+    "// block %u\n"
+    "export function compute%u(values) {\n"
+    "  let total = %u;\n"
+    "  for (const value of values) {\n"
+    "    total += value %% 2 === 0 ? value * %u : -value;\n"
+    "  }\n"
+    "  const label = `item_${total}_%u`;\n"
+    "  return { total, label, ok: total > 0 };\n"
+    "}\n\n",
+  },
+  {
+    "dart",
+    2,
+    "// block %u\n"
+    "int compute%u(List<int> values) {\n"
+    "  var total = %u;\n"
+    "  for (final value in values) {\n"
+    "    total += value.isEven ? value * %u : -value;\n"
+    "  }\n"
+    "  final label = 'item_${total}_%u';\n"
+    "  return total + label.length;\n"
+    "}\n\n",
+  },
+};
+
+#define BENCH_LANGUAGE_COUNT (sizeof(bench_languages) / sizeof(bench_languages[0]))
+
+typedef struct BenchOptions {
+  bool json;
+  uint32_t sizes_kib[BENCH_MAX_SIZES];
+  uint32_t size_count;
+  uint32_t iterations;
+  uint32_t edits;
+  const char *query_dir;
+  const char *language;
+} BenchOptions;
+
+typedef struct BenchMetric {
+  const char *name;
+  double value;
+} BenchMetric;
+
+static uint64_t bench_now_nanos(void) {
+#if _WIN32
+  static LARGE_INTEGER frequency;
+  if (frequency.QuadPart == 0) {
+    QueryPerformanceFrequency(&frequency);
+  }
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000000u +
+    (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000000u / (uint64_t)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+static uint32_t bench_random(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static int compare_uint64(const void *a, const void *b) {
+  const uint64_t left = *(const uint64_t *)a;
+  const uint64_t right = *(const uint64_t *)b;
+  return left < right ? -1 : (left > right ? 1 : 0);
+}
+
+// [samples] must be sorted.
+static uint64_t percentile(const uint64_t *samples, uint32_t count, uint32_t percent) {
+  if (count == 0) {
+    return 0;
+  }
+  return samples[(size_t)(count - 1) * percent / 100];
+}
+
+static double nanos_to_millis(uint64_t nanos) {
+  return (double)nanos / 1e6;
+}
+
+static double megabytes_per_second(size_t bytes, uint64_t nanos) {
+  return nanos == 0 ? 0 : ((double)bytes / (1024.0 * 1024.0)) / ((double)nanos / 1e9);
+}
+
+// Deterministic source of at least [target_bytes] bytes. Free with free().
+static char *corpus_generate(const BenchLanguage *language, size_t target_bytes, size_t *out_length) {
+  size_t capacity = target_bytes + 1024;
+  char *text = (char *)malloc(capacity);
+  if (text == NULL) {
+    return NULL;
+  }
+  uint32_t seed = 0x9E3779B9u ^ (uint32_t)language->id;
+  size_t length = 0;
+  for (uint32_t block = 0; length < target_bytes; block++) {
+    const uint32_t initial = bench_random(&seed) % 1000;
+    const uint32_t factor = bench_random(&seed) % 97 + 1;
+    char piece[1024];
+    const int written = snprintf(
+      piece,
+      sizeof(piece),
+      language->block,
+      block,
+      block,
+      initial,
+      factor,
+      block
+    );
+    if (written <= 0 || (size_t)written >= sizeof(piece)) {
+      free(text);
+      return NULL;
+    }
+    if (length + (size_t)written + 1 > capacity) {
+      capacity = (length + (size_t)written + 1) * 2;
+      char *grown = (char *)realloc(text, capacity);
+      if (grown == NULL) {
+        free(text);
+        return NULL;
+      }
+      text = grown;
+    }
+    memcpy(text + length, piece, (size_t)written);
+    length += (size_t)written;
+  }
+  text[length] = '\0';
+  *out_length = length;
+  return text;
+}
+
+static char *read_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  size_t capacity = 4096;
+  size_t length = 0;
+  char *data = (char *)malloc(capacity);
+  while (data != NULL) {
+    const size_t read = fread(data + length, 1, capacity - length - 1, file);
+    length += read;
+    if (length + 1 < capacity) {
+      break;
+    }
+    capacity *= 2;
+    char *grown = (char *)realloc(data, capacity);
+    if (grown == NULL) {
+      free(data);
+    }
+    data = grown;
+  }
+  fclose(file);
+  if (data != NULL) {
+    data[length] = '\0';
+  }
+  return data;
+}
+
+static void report(
+  const BenchOptions *options,
+  const char *benchmark,
+  const BenchLanguage *language,
+  size_t bytes,
+  const BenchMetric *metrics,
+  uint32_t metric_count
+) {
+  if (options->json) {
+    printf("{\"benchmark\":\"%s\",\"language\":\"%s\",\"bytes\":%zu", benchmark, language->name, bytes);
+    for (uint32_t i = 0; i < metric_count; i++) {
+      printf(",\"%s\":%.4f", metrics[i].name, metrics[i].value);
+    }
+    printf("}\n");
+  } else {
+    printf("%-12s %-10s %8zu KiB", benchmark, language->name, bytes / 1024);
+    for (uint32_t i = 0; i < metric_count; i++) {
+      printf("  %s=%.3f", metrics[i].name, metrics[i].value);
+    }
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+// Creates a document tracking [text] and parses it once.
+static void *open_document(const BenchLanguage *language, const char *text, size_t length) {
+  void *doc = ts_doc_new(language->id);
+  if (doc == NULL) {
+    return NULL;
+  }
+  uint32_t edit[TS_TEXT_EDIT_WORDS];
+  if (!ts_doc_set_text(doc, text, (uint32_t)length, edit) ||
+      ts_doc_reparse_with_budget(doc, NULL, 0) != TS_REPARSE_OK) {
+    ts_doc_delete(doc);
+    return NULL;
+  }
+  return doc;
+}
+
+static bool bench_full_parse(
+  const BenchOptions *options,
+  const BenchLanguage *language,
+  const char *text,
+  size_t length
+) {
+  uint64_t *samples = (uint64_t *)calloc(options->iterations, sizeof(uint64_t));
+  if (samples == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < options->iterations; i++) {
+    void *doc = ts_doc_new(language->id);
+    uint32_t edit[TS_TEXT_EDIT_WORDS];
+    if (doc == NULL || !ts_doc_set_text(doc, text, (uint32_t)length, edit)) {
+      ts_doc_delete(doc);
+      free(samples);
+      return false;
+    }
+    const uint64_t start = bench_now_nanos();
+    const int32_t status = ts_doc_reparse_with_budget(doc, NULL, 0);
+    samples[i] = bench_now_nanos() - start;
+    ts_doc_delete(doc);
+    if (status != TS_REPARSE_OK) {
+      free(samples);
+      return false;
+    }
+  }
+  qsort(samples, options->iterations, sizeof(uint64_t), compare_uint64);
+  const uint64_t median = percentile(samples, options->iterations, 50);
+  const BenchMetric metrics[] = {
+    { "mb_per_s", megabytes_per_second(length, median) },
+    { "median_ms", nanos_to_millis(median) },
+    { "min_ms", nanos_to_millis(samples[0]) },
+  };
+  report(options, "full_parse", language, length, metrics, 3);
+  free(samples);
+  return true;
+}
+
+// Inserts a space at a random offset and removes it again on the next edit,
+// so the text never drifts from the generated corpus.
+static bool bench_incremental(
+  const BenchOptions *options,
+  const BenchLanguage *language,
+  const char *text,
+  size_t length
+) {
+  void *doc = open_document(language, text, length);
+  uint64_t *samples = (uint64_t *)calloc(options->edits, sizeof(uint64_t));
+  if (doc == NULL || samples == NULL) {
+    if (doc != NULL) {
+      ts_doc_delete(doc);
+    }
+    free(samples);
+    return false;
+  }
+  uint32_t seed = 0x2545F491u;
+  uint32_t inserted_at = UINT32_MAX;
+  double reused = 0;
+  bool ok = true;
+  for (uint32_t i = 0; i < options->edits && ok; i++) {
+    uint32_t edit[TS_TEXT_EDIT_WORDS];
+    const uint64_t start = bench_now_nanos();
+    if (inserted_at == UINT32_MAX) {
+      inserted_at = bench_random(&seed) % (uint32_t)length;
+      ok = ts_doc_replace_text(doc, inserted_at, inserted_at, " ", 1, edit);
+    } else {
+      ok = ts_doc_replace_text(doc, inserted_at, inserted_at + 1, "", 0, edit);
+      inserted_at = UINT32_MAX;
+    }
+    if (ok) {
+      ts_doc_edit(doc, edit[0], edit[1], edit[2], edit[3], edit[4], edit[5], edit[6], edit[7], edit[8]);
+      ok = ts_doc_reparse_with_budget(doc, NULL, 0) == TS_REPARSE_OK;
+    }
+    samples[i] = bench_now_nanos() - start;
+
+    TsDocStats stats;
+    if (ok && ts_doc_stats(doc, &stats) && stats.node_count > 0) {
+      reused += (double)stats.reused_nodes / (double)stats.node_count;
+    }
+  }
+  ts_doc_delete(doc);
+  if (!ok) {
+    free(samples);
+    return false;
+  }
+  qsort(samples, options->edits, sizeof(uint64_t), compare_uint64);
+  const BenchMetric metrics[] = {
+    { "p50_ms", nanos_to_millis(percentile(samples, options->edits, 50)) },
+    { "p90_ms", nanos_to_millis(percentile(samples, options->edits, 90)) },
+    { "p99_ms", nanos_to_millis(percentile(samples, options->edits, 99)) },
+    { "max_ms", nanos_to_millis(samples[options->edits - 1]) },
+    { "reused_ratio", options->edits == 0 ? 0 : reused / options->edits },
+  };
+  report(options, "incremental", language, length, metrics, 5);
+  free(samples);
+  return true;
+}
+
+static bool bench_query(
+  const BenchOptions *options,
+  const BenchLanguage *language,
+  const char *text,
+  size_t length,
+  const char *query
+) {
+  void *doc = open_document(language, text, length);
+  if (doc == NULL) {
+    return false;
+  }
+  uint64_t packed_total = 0;
+  uint64_t text_total = 0;
+  uint64_t serialize_total = 0;
+  uint32_t capture_count = 0;
+  bool ok = true;
+  for (uint32_t i = 0; i < options->iterations && ok; i++) {
+    uint64_t start = bench_now_nanos();
+    uint32_t *records = ts_doc_query_captures_packed(doc, query, &capture_count, NULL);
+    packed_total += bench_now_nanos() - start;
+    ok = records != NULL;
+    ts_free(records);
+
+    TsDocStats stats;
+    if (ok && ts_doc_stats(doc, &stats)) {
+      serialize_total += stats.last_serialize_micros * 1000u;
+    }
+
+    start = bench_now_nanos();
+    char *captures = ts_doc_query_captures(doc, query);
+    text_total += bench_now_nanos() - start;
+    ok = ok && captures != NULL;
+    ts_free(captures);
+  }
+  ts_doc_delete(doc);
+  if (!ok || options->iterations == 0) {
+    return ok;
+  }
+  const uint64_t packed = packed_total / options->iterations;
+  const uint64_t as_text = text_total / options->iterations;
+  const BenchMetric metrics[] = {
+    { "mb_per_s", megabytes_per_second(length, packed) },
+    { "captures_per_ms", packed == 0 ? 0 : capture_count / nanos_to_millis(packed) },
+    { "captures", (double)capture_count },
+    { "packed_ms", nanos_to_millis(packed) },
+    { "serialize_ms", nanos_to_millis(serialize_total / options->iterations) },
+    { "text_ms", nanos_to_millis(as_text) },
+  };
+  report(options, "query", language, length, metrics, 6);
+  return true;
+}
+
+static bool parse_sizes(const char *list, BenchOptions *options) {
+  options->size_count = 0;
+  while (*list != '\0' && options->size_count < BENCH_MAX_SIZES) {
+    char *end = NULL;
+    const unsigned long kib = strtoul(list, &end, 10);
+    if (end == list || kib == 0 || kib > 1024 * 1024) {
+      return false;
+    }
+    options->sizes_kib[options->size_count++] = (uint32_t)kib;
+    list = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0') {
+      return false;
+    }
+  }
+  return options->size_count > 0;
+}
+
+static bool parse_options(int argc, char **argv, BenchOptions *options) {
+  options->json = false;
+  options->sizes_kib[0] = 16;
+  options->sizes_kib[1] = 256;
+  options->sizes_kib[2] = 4096;
+  options->size_count = 3;
+  options->iterations = 5;
+  options->edits = 200;
+  options->query_dir = TS_BENCH_QUERY_DIR;
+  options->language = NULL;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(arg, "--json") == 0) {
+      options->json = true;
+      continue;
+    }
+    if (value == NULL) {
+      return false;
+    }
+    i++;
+    if (strcmp(arg, "--sizes") == 0) {
+      if (!parse_sizes(value, options)) {
+        return false;
+      }
+    } else if (strcmp(arg, "--iterations") == 0) {
+      options->iterations = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(arg, "--edits") == 0) {
+      options->edits = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(arg, "--queries") == 0) {
+      options->query_dir = value;
+    } else if (strcmp(arg, "--language") == 0) {
+      options->language = value;
+    } else {
+      return false;
+    }
+  }
+  return options->iterations > 0 && options->edits > 0;
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options;
+  if (!parse_options(argc, argv, &options)) {
+    fprintf(
+      stderr,
+      "usage: %s [--json] [--sizes KiB,KiB,...] [--iterations N] [--edits N]\n"
+      "          [--queries DIR] [--language c|javascript|dart]\n",
+      argv[0]
+    );
+    return 2;
+  }
+
+  int failures = 0;
+  for (size_t l = 0; l < BENCH_LANGUAGE_COUNT; l++) {
+    const BenchLanguage *language = &bench_languages[l];
+    if (options.language != NULL && strcmp(options.language, language->name) != 0) {
+      continue;
+    }
+    char query_path[4096];
+    snprintf(query_path, sizeof(query_path), "%s/%s/highlights.scm", options.query_dir, language->name);
+    char *query = read_file(query_path);
+    if (query == NULL) {
+      fprintf(stderr, "%s: no query at %s, skipping query benchmark\n", language->name, query_path);
+    }
+
+    for (uint32_t s = 0; s < options.size_count; s++) {
+      size_t length = 0;
+      char *text = corpus_generate(language, (size_t)options.sizes_kib[s] * 1024, &length);
+      if (text == NULL) {
+        fprintf(stderr, "%s: could not generate %u KiB\n", language->name, options.sizes_kib[s]);
+        failures++;
+        continue;
+      }
+      if (!bench_full_parse(&options, language, text, length)) {
+        fprintf(stderr, "%s: full_parse failed\n", language->name);
+        failures++;
+      }
+      if (!bench_incremental(&options, language, text, length)) {
+        fprintf(stderr, "%s: incremental failed\n", language->name);
+        failures++;
+      }
+      if (query != NULL && !bench_query(&options, language, text, length, query)) {
+        fprintf(stderr, "%s: query failed\n", language->name);
+        failures++;
+      }
+      free(text);
+    }
+    free(query);
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -1,7 +1,6 @@
 import 'dart:async';
 
 import 'package:flutter/material.dart';
-import 'package:flutter/services.dart';
 import 'package:re_editor/re_editor.dart';
 import 'package:re_highlight/languages/c.dart';
 import 'package:re_highlight/languages/dart.dart';
@@ -11,7 +10,19 @@ import 'package:re_highlight/styles/vs2015.dart';
 import 'package:flutter_build_hooks_ffi_example/flutter_build_hooks_ffi_example.dart'
     as ts;
 
+/// Completes once the native highlight queries are compiled and parsers are
+/// pooled. Started before the first frame so that work happens on a native
+/// thread while the app starts, not in the first highlight pass.
+final Future<bool> _treeSitterWarmUp = ts.treeSitterWarmUp();
+
+/// Owns the native documents of all tabs. Tabs not shown recently lose their
+/// tree once the documents exceed the budget, and get it back when selected.
+final ts.TreeSitterWorkspace _treeSitterWorkspace = ts.TreeSitterWorkspace(
+  memoryBudgetBytes: 64 * 1024 * 1024,
+);
+
 void main() {
+  unawaited(_treeSitterWarmUp);
   runApp(const VsCodeLikeApp());
 }
 
@@ -70,6 +81,8 @@ class _EditorFile {
         highlighter.schedule(
           controller.text,
           onUpdated: controller.forceRepaint,
+          previous: pre,
+          current: controller.value,
         );
       }
     });
@@ -131,36 +144,24 @@ class _VsCodeLikeAppState extends State<VsCodeLikeApp> {
         initialText: _seedDart,
       ),
     ];
-    unawaited(_loadHighlightQueries());
+    // The highlight queries are built into the native library; the first
+    // pass waits for the warm-up so it doesn't compile them on this isolate.
+    unawaited(
+      _treeSitterWarmUp.then((_) {
+        if (!mounted) return;
+        for (final f in _files) {
+          f.highlighter.schedule(
+            f.controller.text,
+            onUpdated: f.controller.forceRepaint,
+          );
+        }
+      }),
+    );
   }
 
-  Future<void> _loadHighlightQueries() async {
-    try {
-      final c = await rootBundle.loadString(
-        'assets/tree_sitter/c/highlights.scm',
-      );
-      final js = await rootBundle.loadString(
-        'assets/tree_sitter/javascript/highlights.scm',
-      );
-      final dart = await rootBundle.loadString(
-        'assets/tree_sitter/dart/highlights.scm',
-      );
-
-      for (final f in _files) {
-        final query = switch (f.language) {
-          _FileLanguage.c => c,
-          _FileLanguage.javascript => js,
-          _FileLanguage.dart => dart,
-        };
-        f.highlighter.setQuery(query);
-        f.highlighter.schedule(
-          f.controller.text,
-          onUpdated: f.controller.forceRepaint,
-        );
-      }
-    } catch (_) {
-      // If assets fail to load, we'll fall back to token-based highlighting.
-    }
+  void _select(int index) {
+    setState(() => _activeIndex = index);
+    _files[index].highlighter.activate();
   }
 
   @override
@@ -199,7 +200,7 @@ class _VsCodeLikeAppState extends State<VsCodeLikeApp> {
                   _Explorer(
                     files: _files,
                     activeIndex: _activeIndex,
-                    onOpen: (i) => setState(() => _activeIndex = i),
+                    onOpen: _select,
                   ),
                   Expanded(
                     child: Column(
@@ -207,7 +208,7 @@ class _VsCodeLikeAppState extends State<VsCodeLikeApp> {
                         _Tabs(
                           files: _files,
                           activeIndex: _activeIndex,
-                          onSelect: (i) => setState(() => _activeIndex = i),
+                          onSelect: _select,
                         ),
                         Expanded(
                           child: _EditorSurface(file: _files[_activeIndex]),
@@ -549,8 +550,16 @@ class _StatusBar extends StatelessWidget {
                   return ValueListenableBuilder<_TreeSitterHighlightStats>(
                     valueListenable: file.highlighter.stats,
                     builder: (context, stats, _) {
+                      final docStats = stats.doc;
                       final label = switch (stats.state) {
+                        _TreeSitterHighlightState.idle when docStats != null =>
+                          'tree-sitter · '
+                              '${stats.reason == null ? '' : '${stats.reason} · '}'
+                              '${_summarizeDocStats(docStats)}',
                         _TreeSitterHighlightState.idle => 'tree-sitter',
+                        _TreeSitterHighlightState.parsing
+                            when stats.reason != null =>
+                          'tree-sitter: parsing ${stats.reason}…',
                         _TreeSitterHighlightState.parsing =>
                           'tree-sitter: parsing…',
                         _TreeSitterHighlightState.disabled =>
@@ -561,9 +570,29 @@ class _StatusBar extends StatelessWidget {
                               : 'tree-sitter: error (details)',
                       };
                       return InkWell(
-                        onTap:
-                            (stats.state == _TreeSitterHighlightState.error &&
-                                stats.reason != null)
+                        onTap: docStats != null
+                            ? () {
+                                showDialog<void>(
+                                  context: context,
+                                  builder: (context) {
+                                    return AlertDialog(
+                                      title: const Text('tree-sitter stats'),
+                                      content: SelectableText(
+                                        _describeDocStats(docStats),
+                                      ),
+                                      actions: [
+                                        TextButton(
+                                          onPressed: () =>
+                                              Navigator.pop(context),
+                                          child: const Text('Close'),
+                                        ),
+                                      ],
+                                    );
+                                  },
+                                );
+                              }
+                            : (stats.state == _TreeSitterHighlightState.error &&
+                                  stats.reason != null)
                             ? () {
                                 showDialog<void>(
                                   context: context,
@@ -610,11 +639,51 @@ enum _TreeSitterHighlightState { idle, parsing, disabled, error }
 class _TreeSitterHighlightStats {
   final _TreeSitterHighlightState state;
   final String? reason;
-  const _TreeSitterHighlightStats(this.state, {this.reason});
+
+  /// Native counters of the document after the last finished pass.
+  final ts.TreeSitterDocumentStats? doc;
+  const _TreeSitterHighlightStats(this.state, {this.reason, this.doc});
 }
 
-class _TreeSitterHighlighter {
-  static const int _maxBytesForHighlight = 6 * 1024 * 1024;
+String _formatMillis(Duration duration) =>
+    '${(duration.inMicroseconds / 1000).toStringAsFixed(1)}ms';
+
+String _summarizeDocStats(ts.TreeSitterDocumentStats stats) =>
+    'parse ${_formatMillis(stats.lastParse)}'
+    ' · query ${_formatMillis(stats.lastQuery + stats.lastSerialize)}'
+    ' · ${(stats.reuseRatio * 100).round()}% reused';
+
+String _describeDocStats(ts.TreeSitterDocumentStats stats) => [
+  'parses: ${stats.parseCount}',
+  'parse: ${_formatMillis(stats.lastParse)} '
+      '(rolling ${_formatMillis(stats.rollingParse)})',
+  'queries: ${stats.queryCount}',
+  'query: ${_formatMillis(stats.lastQuery)} '
+      '(rolling ${_formatMillis(stats.rollingQuery)})',
+  'serialization: ${_formatMillis(stats.lastSerialize)} '
+      '(rolling ${_formatMillis(stats.rollingSerialize)})',
+  'nodes: ${stats.nodeCount} '
+      '(${stats.reusedNodes} reused, ${stats.recreatedNodes} recreated)',
+  'source: ${stats.sourceBytes} bytes',
+  'native memory: ${(stats.memoryBytes / 1024).round()} KiB',
+].join('\n');
+
+class _TreeSitterHighlighter with WidgetsBindingObserver {
+  /// Documents larger than this (in UTF-8 bytes) are handled in large-file
+  /// mode: parsed in [_largeFileParseSlice] slices on the document's thread,
+  /// highlighted [_regionLines] rows at a time around the viewport only, with
+  /// at most [_maxCachedRegions] regions kept, and the tree is dropped under
+  /// memory pressure.
+  static const int _largeFileBytes = 6 * 1024 * 1024;
+  static const Duration _largeFileParseSlice = Duration(milliseconds: 50);
+  static const int _regionLines = 1024;
+  static const int _maxCachedRegions = 16;
+
+  /// Documents with more lines than this are highlighted viewport-first: the
+  /// visible lines (plus [_viewportMarginLines]) are queried on the keystroke
+  /// frame and the rest of the file is filled in by a follow-up pass.
+  static const int _viewportQueryMinLines = 2000;
+  static const int _viewportMarginLines = 200;
 
   final _FileLanguage language;
   final ValueNotifier<bool> enabled = ValueNotifier(true);
@@ -625,15 +694,50 @@ class _TreeSitterHighlighter {
   int _revision = 0;
   bool _disposed = false;
   String _text = '';
-  List<int> _lineStarts = const [0];
+  int _textBytes = 0;
+  List<int> _lineStarts = [0];
+
+  /// The editor lines `_text` was last taken from, so that an edit reported
+  /// against them can be applied without comparing the whole texts.
+  CodeLines? _codeLines;
   List<_Span> _spans = const [];
-  String? _query;
+  /// Whether the document runs the built-in highlight query. Without it
+  /// token-based highlighting is used instead.
+  bool _hasQuery = false;
+
+  /// Whether [_spans] cover the whole document for the current tree. Only
+  /// then can a reparse be applied as a delta of its changed ranges.
+  bool _spansComplete = false;
   ts.TreeSitterDocument? _doc;
   bool _postFrameScheduled = false;
   bool _needsRun = false;
+  bool _running = false;
+  int? _builtFirstLine;
+  int? _builtLastLine;
+  int _viewportFirstLine = 0;
+  int _viewportLastLine = 0;
+
+  /// Large-file mode: highlighted regions by index, least recently viewed
+  /// first, and the rows [_spans] currently cover.
+  final Map<int, List<_Span>> _regionSpans = {};
+  int _spansFirstRow = 0;
+  int _spansEndRow = 0;
+  bool _regionQueryScheduled = false;
+  bool _dropTreeWhenIdle = false;
+  bool _treeDropped = false;
+
+  /// Whether the document has had a tree since it was created. Until then a
+  /// large file's first parse is running from byte 0; it is neither cancelled
+  /// nor cut short by newer revisions, and edits are held back from the
+  /// document ([_textBehind]) so that each slice resumes the same parse.
+  bool _hasTree = false;
+  bool _textBehind = false;
+  VoidCallback? _onUpdated;
 
   _TreeSitterHighlighter({required this.language});
 
+  bool get _largeFile => _textBytes > _largeFileBytes;
+
   void setEnabled(bool value) {
     if (_disposed) return;
     if (enabled.value == value) return;
@@ -641,6 +745,7 @@ class _TreeSitterHighlighter {
 
     if (!value) {
       _spans = const [];
+      _spansComplete = false;
       stats.value = const _TreeSitterHighlightStats(
         _TreeSitterHighlightState.disabled,
         reason: 'toggled off',
@@ -656,15 +761,13 @@ class _TreeSitterHighlighter {
     if (_text.isNotEmpty) return;
     _text = initialText;
     _lineStarts = _lineStartsUtf16ForText(initialText);
+    WidgetsBinding.instance.addObserver(this);
     try {
-      _doc = ts.TreeSitterDocument.create(
-        language: switch (language) {
-          _FileLanguage.c => ts.TreeSitterLanguage.c,
-          _FileLanguage.javascript => ts.TreeSitterLanguage.javascript,
-          _FileLanguage.dart => ts.TreeSitterLanguage.dart,
-        },
-      );
-      _doc!.reparse(initialText);
+      _doc = _createDocument();
+      // Large files are parsed in slices by the first highlight pass instead.
+      if (!_largeFile) {
+        _hasTree = _doc!.reparseText() == ts.TreeSitterReparseStatus.ok;
+      }
     } catch (e, st) {
       final details = '$e\n\n$st';
       debugPrint(details);
@@ -676,65 +779,147 @@ class _TreeSitterHighlighter {
     }
   }
 
+  /// A document tracking `_text`, not yet parsed.
+  ts.TreeSitterDocument _createDocument() {
+    final doc = _treeSitterWorkspace.open(
+      language: switch (language) {
+        _FileLanguage.c => ts.TreeSitterLanguage.c,
+        _FileLanguage.javascript => ts.TreeSitterLanguage.javascript,
+        _FileLanguage.dart => ts.TreeSitterLanguage.dart,
+      },
+    );
+    doc.setHighlightStyles(_nativeCaptureStyles);
+    // Queries run the built-in highlights.scm, compiled once per process, so
+    // no query text crosses FFI per keystroke.
+    try {
+      doc.selectQuery(ts.TreeSitterQueryKind.highlights);
+      _hasQuery = true;
+    } on StateError {
+      _hasQuery = false;
+    }
+    // Report UTF-16 offsets so spans index straight into `_text`.
+    doc.offsetEncoding = ts.TreeSitterOffsetEncoding.utf16;
+    // The edit from an empty text ends at the byte length.
+    _textBytes = doc.setText(_text).newEndByte;
+    _hasTree = false;
+    _textBehind = false;
+    return doc;
+  }
+
+  /// Called when the tab is selected: keeps its tree resident and lets the
+  /// workspace evict the trees of tabs not seen for longest. An evicted tree
+  /// is parsed again on the document's native thread; highlight passes
+  /// started meanwhile wait for it.
+  void activate() {
+    final doc = _doc;
+    if (_disposed || doc == null) return;
+    unawaited(_treeSitterWorkspace.activate(doc));
+  }
+
   void dispose() {
     _disposed = true;
+    WidgetsBinding.instance.removeObserver(this);
     _doc?.dispose();
     enabled.dispose();
     stats.dispose();
   }
 
-  void setQuery(String? query) {
-    _query = query;
+  /// In large-file mode the tree and the region cache are the bulk of the
+  /// memory, so they are dropped; the next edit or scroll rebuilds them from
+  /// `_text`.
+  @override
+  void didHaveMemoryPressure() {
+    if (_disposed || !_largeFile || _doc == null) return;
+    if (_running) {
+      _doc!.cancelReparse();
+      _dropTreeWhenIdle = true;
+      return;
+    }
+    _dropTree();
   }
 
-  void schedule(String text, {required VoidCallback onUpdated}) {
+  void _dropTree() {
+    _dropTreeWhenIdle = false;
+    _doc?.dispose();
+    _doc = null;
+    _treeDropped = true;
+    _regionSpans.clear();
+    _spans = const [];
+    _spansComplete = false;
+    _spansFirstRow = 0;
+    _spansEndRow = 0;
+    ts.treeSitterTrimMemory();
+    stats.value = const _TreeSitterHighlightStats(
+      _TreeSitterHighlightState.disabled,
+      reason: 'tree dropped under memory pressure',
+    );
+    _onUpdated?.call();
+  }
+
+  /// Applies the change to [text] and schedules a highlight pass. When the
+  /// editor's values before and after the change are passed as [previous]
+  /// and [current], the edit is found from the rows their selections touch,
+  /// and the cached line starts, spans and regions are shifted past it;
+  /// otherwise the whole texts are compared.
+  void schedule(
+    String text, {
+    required VoidCallback onUpdated,
+    CodeLineEditingValue? previous,
+    CodeLineEditingValue? current,
+  }) {
     if (_disposed) return;
     if (!enabled.value) return;
-
-    final change = _computeChange(_text, text);
-    _applyChangeToSpans(change);
-
-    // IMPORTANT: Apply `ts_tree_edit` immediately so the native document stays
-    // in sync even if we debounce/cancel reparses. Otherwise, the next debounced
-    // edit would be computed against the updated Dart text but applied to a
-    // stale native tree, causing unstable highlighting.
-    final docForEdit = _doc;
-    if (docForEdit != null &&
-        (change.startUtf16 != change.oldEndUtf16 ||
-            change.startUtf16 != change.newEndUtf16)) {
-      docForEdit.edit(
-        startByte: change.startByte,
-        oldEndByte: change.oldEndByte,
-        newEndByte: change.newEndByte,
-        startRow: change.startRow,
-        startCol: change.startCol,
-        oldEndRow: change.oldEndRow,
-        oldEndCol: change.oldEndCol,
-        newEndRow: change.newEndRow,
-        newEndCol: change.newEndCol,
-      );
+    _onUpdated = onUpdated;
+
+    if (!identical(text, _text)) {
+      final edit =
+          (previous != null &&
+                  current != null &&
+                  identical(previous.codeLines, _codeLines)
+              ? _editFromValues(previous, current, text)
+              : null) ??
+          _editFromTexts(text);
+      _applyEdit(text, edit);
+      _text = text;
+      _codeLines = current?.codeLines;
     }
 
-    _text = text;
-    _lineStarts = _lineStartsUtf16ForText(text);
+    // A reparse of an older revision would be thrown away; stop it. The
+    // first parse is let finish instead: stopping it would start it over.
+    if (_running && _hasTree) {
+      _doc?.cancelReparse();
+    }
 
     _revision++;
     _needsRun = true;
     if (_postFrameScheduled) return;
     _postFrameScheduled = true;
 
-    WidgetsBinding.instance.addPostFrameCallback((_) {
+    WidgetsBinding.instance.addPostFrameCallback((_) async {
       _postFrameScheduled = false;
       if (_disposed) return;
       if (!enabled.value) return;
       if (!_needsRun) return;
+      // A reparse is still in flight; it reschedules when it finishes.
+      if (_running) return;
       _needsRun = false;
 
       final rev = _revision;
 
+      // Dropped under memory pressure: start over from the text.
+      if (_treeDropped) {
+        _treeDropped = false;
+        try {
+          _doc = _createDocument();
+        } catch (e, st) {
+          debugPrint('$e\n\n$st');
+        }
+      }
+
       final doc = _doc;
       if (doc == null) {
         _spans = const [];
+        _spansComplete = false;
         stats.value = const _TreeSitterHighlightStats(
           _TreeSitterHighlightState.error,
           reason: 'tree-sitter document not initialized',
@@ -743,41 +928,106 @@ class _TreeSitterHighlighter {
         return;
       }
 
-      if (_text.length > _maxBytesForHighlight) {
-        _spans = const [];
-        stats.value = const _TreeSitterHighlightStats(
-          _TreeSitterHighlightState.disabled,
-          reason: '> 6MB',
-        );
-        WidgetsBinding.instance.addPostFrameCallback((_) => onUpdated());
-        return;
-      }
-
-      stats.value = const _TreeSitterHighlightStats(
+      final largeFile = _largeFile;
+      stats.value = _TreeSitterHighlightStats(
         _TreeSitterHighlightState.parsing,
+        reason: largeFile ? 'large file' : null,
       );
+      _running = true;
       try {
-        // Incremental parse on UI isolate: reuse the already-edited tree.
-        final ok = doc.reparse(_text);
-        if (!ok) {
-          throw StateError('ts_doc_reparse failed');
+        // Incremental parse on the document's native thread, reusing the
+        // already-edited tree. The UI isolate keeps running meanwhile; edits
+        // made in the meantime are queued by the document.
+        final status = largeFile
+            ? await _reparseInSlices(doc, rev)
+            : await doc.reparseTextAsync();
+        if (_disposed) return;
+        if (status == ts.TreeSitterReparseStatus.ok) {
+          _hasTree = true;
+        }
+        if (_textBehind) {
+          // Hand the edits made during the first parse to the document; the
+          // next pass reparses them incrementally.
+          _textBehind = false;
+          final change = doc.setText(_text);
+          _textBytes += change.newEndByte - change.oldEndByte;
+        }
+        if (status == ts.TreeSitterReparseStatus.cancelled ||
+            rev != _revision ||
+            _dropTreeWhenIdle) {
+          // The text moved on while parsing, so this tree's changed ranges no
+          // longer line up with `_spans`; the next pass re-highlights. A
+          // cancelled parse left the edited tree in place, so that pass is
+          // still incremental.
+          _spansComplete = false;
+          if (largeFile && status == ts.TreeSitterReparseStatus.ok) {
+            // Likewise for the cached regions.
+            _regionSpans.clear();
+          }
+          return;
+        }
+        if (status != ts.TreeSitterReparseStatus.ok) {
+          throw StateError('ts_doc_reparse failed: ${status.name}');
         }
 
-        final query = _query;
-        if (query == null || query.trim().isEmpty) {
+        if (!_hasQuery) {
           _spans = const [];
+          _spansComplete = false;
+        } else if (largeFile) {
+          // Regions the reparse did not touch were already shifted past the
+          // edits.
+          _dropChangedRegions(doc.changedRanges());
+          _highlightViewportRegions(doc);
+          _spansComplete = false;
+        } else if (_spansComplete) {
+          // Only re-highlight what changed; `_applyChangeToSpans` already
+          // shifted everything else.
+          final ranges = doc.changedRanges();
+          var spans = _spans;
+          for (var i = 0; i + 1 < ranges.length; i += 2) {
+            final highlighted = doc.highlightSpans(
+              null,
+              start: ranges[i],
+              end: ranges[i + 1],
+            );
+            spans = _replaceSpansInRange(
+              spans,
+              ranges[i],
+              ranges[i + 1],
+              _nativeToSpans(highlighted),
+            );
+          }
+          _spans = spans;
+        } else if (_lineStarts.length <= _viewportQueryMinLines) {
+          _spans = _nativeToSpans(doc.highlightSpans(null));
+          _spansComplete = true;
         } else {
-          final captures = doc.queryCaptures(query);
-          _spans = _capturesToSpans(_text, captures);
+          final rows = _takeViewportRows();
+          final highlighted = doc.highlightSpansInRows(
+            null,
+            startRow: rows.start,
+            endRow: rows.end,
+          );
+          _spans = _replaceSpansInRange(
+            _spans,
+            _lineStartUtf16(rows.start),
+            _lineStartUtf16(rows.end),
+            _nativeToSpans(highlighted),
+          );
+          _spansComplete = false;
+          _scheduleRemainderQuery(rev, rows, onUpdated);
         }
         if (_disposed || rev != _revision) return;
-        stats.value = const _TreeSitterHighlightStats(
+        stats.value = _TreeSitterHighlightStats(
           _TreeSitterHighlightState.idle,
+          reason: largeFile ? 'large file' : null,
+          doc: doc.stats,
         );
         WidgetsBinding.instance.addPostFrameCallback((_) => onUpdated());
       } catch (e, st) {
         if (_disposed || rev != _revision) return;
         _spans = const [];
+        _spansComplete = false;
         final details = '$e\n\n$st';
         debugPrint(details);
         stats.value = _TreeSitterHighlightStats(
@@ -785,21 +1035,332 @@ class _TreeSitterHighlighter {
           reason: details,
         );
         WidgetsBinding.instance.addPostFrameCallback((_) => onUpdated());
+      } finally {
+        _running = false;
+        if (_dropTreeWhenIdle && !_disposed) {
+          _dropTree();
+        }
+        // If more edits came in while we were running, schedule another pass.
+        if (_needsRun && !_postFrameScheduled && !_disposed) {
+          _postFrameScheduled = true;
+          WidgetsBinding.instance.addPostFrameCallback((_) {
+            _postFrameScheduled = false;
+            if (_disposed || !enabled.value) return;
+            if (_needsRun) {
+              schedule(_text, onUpdated: onUpdated);
+            }
+          });
+        }
       }
-      // If more edits came in while we were running, schedule another pass.
-      if (_needsRun && !_postFrameScheduled) {
-        _postFrameScheduled = true;
-        WidgetsBinding.instance.addPostFrameCallback((_) {
-          _postFrameScheduled = false;
-          if (_disposed || !enabled.value) return;
-          if (_needsRun) {
-            schedule(_text, onUpdated: onUpdated);
-          }
-        });
+    });
+  }
+
+  /// The change from `_text` to [text], found by comparing them whole.
+  _TextChange _editFromTexts(String text) {
+    final (start, oldEnd, newEnd) = _changedRangeUtf16(_text, text);
+    final startRow = _rowAtUtf16(start);
+    return (
+      start: start,
+      oldEnd: oldEnd,
+      newEnd: newEnd,
+      startRow: startRow,
+      oldEndRow: _lineStarts.length,
+      rowStarts: _lineStartsUtf16ForText(text).sublist(startRow + 1),
+    );
+  }
+
+  /// The change from [previous] to [current], whose text is [text], found
+  /// from the rows their selections touch, as an edit at the selection only
+  /// changes those: they are compared after checking that the rows around
+  /// them are the same. Returns null when the change reaches further (e.g.
+  /// a programmatic edit) or the lengths don't add up; the texts must then
+  /// be compared whole.
+  _TextChange? _editFromValues(
+    CodeLineEditingValue previous,
+    CodeLineEditingValue current,
+    String text,
+  ) {
+    final oldLines = previous.codeLines;
+    final newLines = current.codeLines;
+    if (oldLines.length != _lineStarts.length) return null;
+    final rowDelta = newLines.length - oldLines.length;
+    final oldSelection = previous.selection;
+    final newSelection = current.selection;
+    final startRow = oldSelection.startIndex < newSelection.startIndex
+        ? oldSelection.startIndex
+        : newSelection.startIndex;
+    final oldLastRow = oldSelection.endIndex > newSelection.endIndex - rowDelta
+        ? oldSelection.endIndex
+        : newSelection.endIndex - rowDelta;
+    final oldEndRow = oldLastRow + 1;
+    final newEndRow = oldEndRow + rowDelta;
+    if (startRow < 0 ||
+        oldEndRow > oldLines.length ||
+        newEndRow > newLines.length ||
+        newEndRow <= startRow) {
+      return null;
+    }
+    if (startRow > 0 &&
+        oldLines[startRow - 1].text != newLines[startRow - 1].text) {
+      return null;
+    }
+    if (oldEndRow < oldLines.length &&
+        oldLines[oldEndRow].text != newLines[newEndRow].text) {
+      return null;
+    }
+
+    // Rows [startRow, oldEndRow) became [startRow, newEndRow).
+    final start = _lineStarts[startRow];
+    final oldEnd = _lineStartUtf16(oldEndRow);
+    final rowStarts = <int>[];
+    var newEnd = start;
+    for (var row = startRow; row < newEndRow; row++) {
+      if (row > startRow) rowStarts.add(newEnd);
+      newEnd += newLines[row].text.length;
+      if (row + 1 < newLines.length) newEnd++;
+    }
+    if (text.length - newEnd != _text.length - oldEnd) return null;
+    final (from, oldTo, newTo) = _changedRangeUtf16(
+      _text.substring(start, oldEnd),
+      text.substring(start, newEnd),
+    );
+    return (
+      start: start + from,
+      oldEnd: start + oldTo,
+      newEnd: start + newTo,
+      startRow: startRow,
+      oldEndRow: oldEndRow,
+      rowStarts: rowStarts,
+    );
+  }
+
+  /// Sends [edit] to the document and moves everything cached past it: line
+  /// starts, the spans on screen and, in large-file mode, the regions.
+  void _applyEdit(String text, _TextChange edit) {
+    final rowDelta =
+        edit.rowStarts.length - (edit.oldEndRow - edit.startRow - 1);
+    // IMPORTANT: `replaceText` applies `ts_tree_edit` immediately, so the
+    // native document stays in sync even if we debounce/cancel reparses. Only
+    // the changed slice is sent; the document keeps the rest of the text.
+    final doc = _doc;
+    if (doc != null && _running && !_hasTree) {
+      // The first parse is still running; see [_hasTree].
+      _textBehind = true;
+    } else if (doc != null &&
+        (edit.start != edit.oldEnd || edit.start != edit.newEnd)) {
+      final change = doc.replaceText(
+        edit.start,
+        edit.oldEnd,
+        text.substring(edit.start, edit.newEnd),
+      );
+      _textBytes += change.newEndByte - change.oldEndByte;
+      _applyChangeToSpans(change);
+      _applyChangeToRegions(change, edit.startRow, rowDelta);
+    }
+
+    final delta = text.length - _text.length;
+    _lineStarts.replaceRange(edit.startRow + 1, edit.oldEndRow, edit.rowStarts);
+    for (
+      var row = edit.startRow + 1 + edit.rowStarts.length;
+      row < _lineStarts.length;
+      row++
+    ) {
+      _lineStarts[row] += delta;
+    }
+  }
+
+  /// The row of `_text` that UTF-16 [offset] is on.
+  int _rowAtUtf16(int offset) {
+    var lo = 0;
+    var hi = _lineStarts.length - 1;
+    while (lo < hi) {
+      final mid = (lo + hi + 1) >> 1;
+      if (_lineStarts[mid] <= offset) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    return lo;
+  }
+
+  /// Parses a large file [_largeFileParseSlice] at a time, so a cancel or a
+  /// newer revision takes effect between slices. Each slice resumes where the
+  /// previous one stopped. Newer revisions do not stop the first parse.
+  Future<ts.TreeSitterReparseStatus> _reparseInSlices(
+    ts.TreeSitterDocument doc,
+    int rev,
+  ) async {
+    while (true) {
+      final status = await doc.reparseTextAsync(timeout: _largeFileParseSlice);
+      if (status != ts.TreeSitterReparseStatus.timedOut ||
+          _disposed ||
+          _dropTreeWhenIdle ||
+          (_hasTree && rev != _revision)) {
+        return status;
+      }
+    }
+  }
+
+  /// Large-file mode: makes [_spans] the highlights of the regions around the
+  /// viewport, querying only the ones not in [_regionSpans].
+  void _highlightViewportRegions(ts.TreeSitterDocument doc) {
+    final rows = _takeViewportRows();
+    final lineCount = _lineStarts.length;
+    final firstRegion = rows.start ~/ _regionLines;
+    final lastRegion = (rows.end - 1).clamp(0, lineCount) ~/ _regionLines;
+    final spans = <_Span>[];
+    for (var region = firstRegion; region <= lastRegion; region++) {
+      final startRow = region * _regionLines;
+      final endRow = (startRow + _regionLines).clamp(0, lineCount);
+      // Re-inserting moves the region to the most recently viewed end.
+      final cached =
+          _regionSpans.remove(region) ??
+          _replaceSpansInRange(
+            const [],
+            _lineStartUtf16(startRow),
+            _lineStartUtf16(endRow),
+            _nativeToSpans(
+              doc.highlightSpansInRows(
+                null,
+                startRow: startRow,
+                endRow: endRow,
+              ),
+            ),
+          );
+      _regionSpans[region] = cached;
+      spans.addAll(cached);
+    }
+    while (_regionSpans.length > _maxCachedRegions) {
+      _regionSpans.remove(_regionSpans.keys.first);
+    }
+    _spans = spans;
+    _spansFirstRow = firstRegion * _regionLines;
+    _spansEndRow = ((lastRegion + 1) * _regionLines).clamp(0, lineCount);
+  }
+
+  /// Large-file mode: keeps the cached regions above [startRow], where an
+  /// edit starts, as they are. The later ones are shifted past [change] when
+  /// no rows were added or removed ([rowDelta] is 0), and otherwise dropped:
+  /// their rows no longer line up with the region boundaries.
+  void _applyChangeToRegions(
+    ts.TreeSitterTextEdit change,
+    int startRow,
+    int rowDelta,
+  ) {
+    final firstChanged = startRow ~/ _regionLines;
+    for (final region in _regionSpans.keys.toList()) {
+      if (region < firstChanged) continue;
+      if (rowDelta != 0) {
+        _regionSpans.remove(region);
+      } else {
+        _regionSpans[region] = _shiftSpans(_regionSpans[region]!, change);
+      }
+    }
+  }
+
+  /// Large-file mode: drops the cached regions that intersect [ranges], the
+  /// (start, end) pairs a reparse changed.
+  void _dropChangedRegions(List<int> ranges) {
+    _regionSpans.removeWhere((region, _) {
+      final start = _lineStartUtf16(region * _regionLines);
+      final end = _lineStartUtf16((region + 1) * _regionLines);
+      for (var i = 0; i + 1 < ranges.length; i += 2) {
+        if (ranges[i] < end && ranges[i + 1] > start) return true;
+      }
+      return false;
+    });
+  }
+
+  /// Large-file mode: highlights the regions scrolled into view since the
+  /// last pass, on the next frame.
+  void _scheduleRegionQuery() {
+    if (_regionQueryScheduled) return;
+    _regionQueryScheduled = true;
+    WidgetsBinding.instance.addPostFrameCallback((_) {
+      _regionQueryScheduled = false;
+      if (_disposed || !enabled.value || _running || _needsRun) return;
+      final doc = _doc;
+      final onUpdated = _onUpdated;
+      if (onUpdated == null || !_hasQuery) return;
+      if (doc == null) {
+        // The tree was dropped; scrolling brings it back.
+        schedule(_text, onUpdated: onUpdated);
+        return;
+      }
+      if (doc.isReparsing) return;
+      try {
+        _highlightViewportRegions(doc);
+      } catch (e, st) {
+        debugPrint('$e\n\n$st');
+        return;
+      }
+      onUpdated();
+    });
+  }
+
+  /// Highlights the lines outside [viewport] after the viewport itself was
+  /// highlighted, unless another edit arrived in the meantime.
+  void _scheduleRemainderQuery(
+    int rev,
+    ({int start, int end}) viewport,
+    VoidCallback onUpdated,
+  ) {
+    Timer.run(() {
+      if (_disposed || !enabled.value || rev != _revision) return;
+      final doc = _doc;
+      if (doc == null || !_hasQuery || doc.isReparsing) return;
+      try {
+        var spans = _spans;
+        final lineCount = _lineStarts.length;
+        for (final rows in [
+          (start: 0, end: viewport.start),
+          (start: viewport.end, end: lineCount),
+        ]) {
+          if (rows.end <= rows.start) continue;
+          final highlighted = doc.highlightSpansInRows(
+            null,
+            startRow: rows.start,
+            endRow: rows.end,
+          );
+          spans = _replaceSpansInRange(
+            spans,
+            _lineStartUtf16(rows.start),
+            _lineStartUtf16(rows.end),
+            _nativeToSpans(highlighted),
+          );
+        }
+        _spans = spans;
+        _spansComplete = true;
+      } catch (e, st) {
+        debugPrint('$e\n\n$st');
+        return;
       }
+      onUpdated();
     });
   }
 
+  /// The rows painted since the last highlight pass, widened by
+  /// [_viewportMarginLines]. Falls back to the previous viewport when nothing
+  /// was painted in between.
+  ({int start, int end}) _takeViewportRows() {
+    final first = _builtFirstLine ?? _viewportFirstLine;
+    final last = _builtLastLine ?? _viewportLastLine;
+    _builtFirstLine = null;
+    _builtLastLine = null;
+    _viewportFirstLine = first;
+    _viewportLastLine = last;
+
+    final lineCount = _lineStarts.length;
+    return (
+      start: (first - _viewportMarginLines).clamp(0, lineCount),
+      end: (last + 1 + _viewportMarginLines).clamp(0, lineCount),
+    );
+  }
+
+  int _lineStartUtf16(int row) =>
+      row < _lineStarts.length ? _lineStarts[row] : _text.length;
+
   TextSpan buildLineSpan({
     required int lineIndex,
     required String lineText,
@@ -807,7 +1368,20 @@ class _TreeSitterHighlighter {
     required TextSpan baseSpan,
   }) {
     if (!enabled.value) return baseSpan;
+    // The editor only builds visible lines, so this tracks the viewport.
+    final builtFirst = _builtFirstLine;
+    final builtLast = _builtLastLine;
+    if (builtFirst == null || lineIndex < builtFirst) {
+      _builtFirstLine = lineIndex;
+    }
+    if (builtLast == null || lineIndex > builtLast) {
+      _builtLastLine = lineIndex;
+    }
     if (lineIndex < 0 || lineIndex >= _lineStarts.length) return baseSpan;
+    if (_largeFile &&
+        (lineIndex < _spansFirstRow || lineIndex >= _spansEndRow)) {
+      _scheduleRegionQuery();
+    }
 
     final lineStart = _lineStarts[lineIndex];
     final lineEnd = (lineIndex + 1 < _lineStarts.length)
@@ -889,142 +1463,82 @@ class _TreeSitterHighlighter {
     return out;
   }
 
-  List<_Span> _capturesToSpans(
-    String text,
-    List<ts.TreeSitterCapture> captures,
-  ) {
-    if (captures.isEmpty) return const [];
-    final byteToUtf16 = _buildByteToUtf16Map(text);
-
-    int mapByte(int b) {
-      if (b <= 0) return 0;
-      if (b >= byteToUtf16.last.$1) return byteToUtf16.last.$2;
-      var lo = 0, hi = byteToUtf16.length - 1;
-      while (lo <= hi) {
-        final mid = (lo + hi) >> 1;
-        final v = byteToUtf16[mid].$1;
-        if (v == b) return byteToUtf16[mid].$2;
-        if (v < b) {
-          lo = mid + 1;
-        } else {
-          hi = mid - 1;
-        }
-      }
-      return byteToUtf16[hi.clamp(0, byteToUtf16.length - 1)].$2;
-    }
-
-    final ranked = <_RankedSpan>[];
-    for (final cap in captures) {
-      final style = _captureStyle(cap.name);
-      if (style == null) continue;
-      final start = mapByte(cap.startByte);
-      final end = mapByte(cap.endByte);
-      if (end <= start) continue;
-      ranked.add(_RankedSpan(start, end, style.color, style.priority));
-    }
-
-    ranked.sort((a, b) {
-      final p = b.priority.compareTo(a.priority);
-      if (p != 0) return p;
-      final s = a.startUtf16.compareTo(b.startUtf16);
-      if (s != 0) return s;
-      return b.endUtf16.compareTo(a.endUtf16);
-    });
-
+  /// Converts natively resolved spans (sorted, non-overlapping, UTF-16
+  /// offsets) into [_Span]s.
+  List<_Span> _nativeToSpans(ts.TreeSitterHighlightSpans spans) {
     final out = <_Span>[];
-    for (final span in ranked) {
-      _insertNonOverlappingSorted(out, span);
+    for (var i = 0; i < spans.length; i++) {
+      final start = spans.start(i);
+      final end = spans.end(i);
+      if (end <= start) continue;
+      out.add(_Span(start, end, _captureStyleColors[spans.styleId(i)]));
     }
     return out;
   }
 
-  void _insertNonOverlappingSorted(List<_Span> out, _RankedSpan span) {
-    var start = span.startUtf16;
-    final end = span.endUtf16;
-    if (end <= start) return;
-
-    // `out` is always sorted by start and non-overlapping.
-    int lowerBound(int pos) {
-      var lo = 0;
-      var hi = out.length;
-      while (lo < hi) {
-        final mid = (lo + hi) >> 1;
-        if (out[mid].endUtf16 <= pos) {
-          lo = mid + 1;
-        } else {
-          hi = mid;
-        }
-      }
-      return lo;
-    }
+  void _applyChangeToSpans(ts.TreeSitterTextEdit change) {
+    if (_spans.isEmpty) return;
+    _spans = _shiftSpans(_spans, change);
+  }
+}
 
-    int lowerBoundByStart(int pos) {
-      var lo = 0;
-      var hi = out.length;
-      while (lo < hi) {
-        final mid = (lo + hi) >> 1;
-        if (out[mid].startUtf16 < pos) {
-          lo = mid + 1;
-        } else {
-          hi = mid;
-        }
-      }
-      return lo;
+/// [spans] after [change]: the ones it touches are dropped and the ones past
+/// it are moved by its length difference.
+List<_Span> _shiftSpans(List<_Span> spans, ts.TreeSitterTextEdit change) {
+  final delta = change.newEndUtf16 - change.oldEndUtf16;
+  final changedStart = change.startUtf16;
+  final changedOldEnd = change.oldEndUtf16;
+
+  final updated = <_Span>[];
+  for (final s in spans) {
+    final intersects =
+        s.startUtf16 < changedOldEnd && s.endUtf16 > changedStart;
+    if (intersects) continue;
+
+    if (s.startUtf16 >= changedOldEnd) {
+      updated.add(_Span(s.startUtf16 + delta, s.endUtf16 + delta, s.color));
+    } else {
+      updated.add(s);
     }
+  }
+  return updated;
+}
 
-    final insertAt = lowerBound(start);
-    var i = insertAt;
-    var cursor = start;
-    final pieces = <_Span>[];
-
-    while (i < out.length) {
-      final existing = out[i];
-      if (existing.startUtf16 >= end) break;
-
-      if (existing.startUtf16 > cursor) {
-        pieces.add(
-          _Span(cursor, existing.startUtf16.clamp(cursor, end), span.color),
-        );
-      }
-
-      if (existing.endUtf16 > cursor) {
-        cursor = existing.endUtf16;
-      }
-      if (cursor >= end) break;
-      i++;
+/// Replaces the part of [spans] inside [start, end) with [replacement], which
+/// is clipped to that range. Spans straddling the boundaries are split.
+List<_Span> _replaceSpansInRange(
+  List<_Span> spans,
+  int start,
+  int end,
+  List<_Span> replacement,
+) {
+  final out = <_Span>[];
+  var inserted = false;
+  void insertReplacement() {
+    if (inserted) return;
+    inserted = true;
+    for (final s in replacement) {
+      final a = s.startUtf16 < start ? start : s.startUtf16;
+      final b = s.endUtf16 > end ? end : s.endUtf16;
+      if (b > a) out.add(_Span(a, b, s.color));
     }
+  }
 
-    if (cursor < end) {
-      pieces.add(_Span(cursor, end, span.color));
+  for (final s in spans) {
+    if (s.endUtf16 <= start) {
+      out.add(s);
+      continue;
     }
-
-    if (pieces.isEmpty) return;
-    // Insert each piece at its sorted position to preserve ordering.
-    for (final piece in pieces) {
-      out.insert(lowerBoundByStart(piece.startUtf16), piece);
+    if (s.startUtf16 < start) {
+      out.add(_Span(s.startUtf16, start, s.color));
     }
-  }
-
-  void _applyChangeToSpans(_TextChange change) {
-    if (_spans.isEmpty) return;
-    final delta = change.newEndUtf16 - change.oldEndUtf16;
-    final changedStart = change.startUtf16;
-    final changedOldEnd = change.oldEndUtf16;
-
-    final updated = <_Span>[];
-    for (final s in _spans) {
-      final intersects =
-          s.startUtf16 < changedOldEnd && s.endUtf16 > changedStart;
-      if (intersects) continue;
-
-      if (s.startUtf16 >= changedOldEnd) {
-        updated.add(_Span(s.startUtf16 + delta, s.endUtf16 + delta, s.color));
-      } else {
-        updated.add(s);
-      }
+    if (s.endUtf16 > end) {
+      insertReplacement();
+      out.add(s.startUtf16 < end ? _Span(end, s.endUtf16, s.color) : s);
     }
-    _spans = updated;
   }
+  insertReplacement();
+  return out;
 }
 
 CodeHighlightTheme _reHighlightTheme(_FileLanguage language) {
@@ -1059,133 +1573,66 @@ class _CaptureStyle {
   const _CaptureStyle(this.priority, this.color);
 }
 
-_CaptureStyle? _captureStyle(String name) {
-  final group = name.split('.').first;
-  switch (group) {
-    case 'comment':
-      return const _CaptureStyle(90, 0xFF6A9955);
-    case 'string':
-      return const _CaptureStyle(80, 0xFFCE9178);
-    case 'number':
-      return const _CaptureStyle(70, 0xFFB5CEA8);
-    case 'keyword':
-      return const _CaptureStyle(60, 0xFF569CD6);
-    case 'type':
-      return const _CaptureStyle(55, 0xFF4EC9B0);
-    case 'function':
-      return const _CaptureStyle(50, 0xFFDCDCAA);
-    case 'constant':
-    case 'boolean':
-    case 'constructor':
-      return const _CaptureStyle(45, 0xFF569CD6);
-    case 'operator':
-    case 'punctuation':
-    case 'delimiter':
-      return const _CaptureStyle(40, 0xFFD4D4D4);
-    case 'variable':
-    case 'property':
-    case 'attribute':
-    case 'identifier':
-      return const _CaptureStyle(30, 0xFF9CDCFE);
-    default:
-      return null;
-  }
-}
-
-List<(int, int)> _buildByteToUtf16Map(String text) {
-  final pairs = <(int, int)>[];
-  var byte = 0;
-  var utf16 = 0;
-  pairs.add((0, 0));
-  for (final rune in text.runes) {
-    byte += _utf8Len(rune);
-    utf16 += rune > 0xFFFF ? 2 : 1;
-    pairs.add((byte, utf16));
-  }
-  return pairs;
-}
-
-int _utf8Len(int rune) {
-  if (rune <= 0x7F) return 1;
-  if (rune <= 0x7FF) return 2;
-  if (rune <= 0xFFFF) return 3;
-  return 4;
-}
-
-class _Span {
-  final int startUtf16;
-  final int endUtf16;
-  final int color;
-  const _Span(this.startUtf16, this.endUtf16, this.color);
-}
-
-class _RankedSpan extends _Span {
-  final int priority;
-  const _RankedSpan(
-    super.startUtf16,
-    super.endUtf16,
-    super.color,
-    this.priority,
-  );
-}
-
-class _TextChange {
-  final int startUtf16;
-  final int oldEndUtf16;
-  final int newEndUtf16;
-  final int startByte;
-  final int oldEndByte;
-  final int newEndByte;
-  final int startRow;
-  final int startCol;
-  final int oldEndRow;
-  final int oldEndCol;
-  final int newEndRow;
-  final int newEndCol;
-
-  const _TextChange({
-    required this.startUtf16,
-    required this.oldEndUtf16,
-    required this.newEndUtf16,
-    required this.startByte,
-    required this.oldEndByte,
-    required this.newEndByte,
-    required this.startRow,
-    required this.startCol,
-    required this.oldEndRow,
-    required this.oldEndCol,
-    required this.newEndRow,
-    required this.newEndCol,
-  });
-}
-
-_TextChange _computeChange(String oldText, String newText) {
-  if (oldText == newText) {
-    return const _TextChange(
-      startUtf16: 0,
-      oldEndUtf16: 0,
-      newEndUtf16: 0,
-      startByte: 0,
-      oldEndByte: 0,
-      newEndByte: 0,
-      startRow: 0,
-      startCol: 0,
-      oldEndRow: 0,
-      oldEndCol: 0,
-      newEndRow: 0,
-      newEndCol: 0,
-    );
-  }
-
-  var start = 0;
-  final minLen = oldText.length < newText.length
+/// Highlight styles by capture-name group; `keyword` also covers
+/// `keyword.control` and friends.
+const _captureStyles = <String, _CaptureStyle>{
+  'comment': _CaptureStyle(90, 0xFF6A9955),
+  'string': _CaptureStyle(80, 0xFFCE9178),
+  'number': _CaptureStyle(70, 0xFFB5CEA8),
+  'keyword': _CaptureStyle(60, 0xFF569CD6),
+  'type': _CaptureStyle(55, 0xFF4EC9B0),
+  'function': _CaptureStyle(50, 0xFFDCDCAA),
+  'constant': _CaptureStyle(45, 0xFF569CD6),
+  'boolean': _CaptureStyle(45, 0xFF569CD6),
+  'constructor': _CaptureStyle(45, 0xFF569CD6),
+  'operator': _CaptureStyle(40, 0xFFD4D4D4),
+  'punctuation': _CaptureStyle(40, 0xFFD4D4D4),
+  'delimiter': _CaptureStyle(40, 0xFFD4D4D4),
+  'variable': _CaptureStyle(30, 0xFF9CDCFE),
+  'property': _CaptureStyle(30, 0xFF9CDCFE),
+  'attribute': _CaptureStyle(30, 0xFF9CDCFE),
+  'identifier': _CaptureStyle(30, 0xFF9CDCFE),
+};
+
+/// [_captureStyles] as a native style table; the style id indexes
+/// [_captureStyleColors].
+final Map<String, ts.TreeSitterHighlightStyle> _nativeCaptureStyles = {
+  for (final (i, entry) in _captureStyles.entries.indexed)
+    entry.key: ts.TreeSitterHighlightStyle(
+      priority: entry.value.priority,
+      styleId: i,
+    ),
+};
+
+final List<int> _captureStyleColors = [
+  for (final style in _captureStyles.values) style.color,
+];
+
+/// A change of the highlighted text: UTF-16 range `[start, oldEnd)` of the
+/// old text became `[start, newEnd)`. The line starts of rows
+/// `(startRow, oldEndRow)` are replaced by [rowStarts], and those of the
+/// later rows move by the length difference.
+typedef _TextChange = ({
+  int start,
+  int oldEnd,
+  int newEnd,
+  int startRow,
+  int oldEndRow,
+  List<int> rowStarts,
+});
+
+/// The UTF-16 range `[start, oldEnd)` of [oldText] that was replaced by
+/// `[start, newEnd)` of [newText], widened so it never splits a surrogate
+/// pair. Only compares code units; nothing is encoded or copied.
+(int, int, int) _changedRangeUtf16(String oldText, String newText) {
+  final minLength = oldText.length < newText.length
       ? oldText.length
       : newText.length;
-  while (start < minLen &&
+  var start = 0;
+  while (start < minLength &&
       oldText.codeUnitAt(start) == newText.codeUnitAt(start)) {
     start++;
   }
-
   var oldEnd = oldText.length;
   var newEnd = newText.length;
   while (oldEnd > start &&
@@ -1194,53 +1641,25 @@ _TextChange _computeChange(String oldText, String newText) {
     oldEnd--;
     newEnd--;
   }
-
-  final startByte = _utf8LenOfSlice(oldText, 0, start);
-  final oldEndByte = startByte + _utf8LenOfSlice(oldText, start, oldEnd);
-  final newEndByte = startByte + _utf8LenOfSlice(newText, start, newEnd);
-
-  final (sr, sc) = _pointAtUtf16(oldText, start);
-  final (oer, oec) = _pointAtUtf16(oldText, oldEnd);
-  final (ner, nec) = _pointAtUtf16(newText, newEnd);
-
-  return _TextChange(
-    startUtf16: start,
-    oldEndUtf16: oldEnd,
-    newEndUtf16: newEnd,
-    startByte: startByte,
-    oldEndByte: oldEndByte,
-    newEndByte: newEndByte,
-    startRow: sr,
-    startCol: sc,
-    oldEndRow: oer,
-    oldEndCol: oec,
-    newEndRow: ner,
-    newEndCol: nec,
-  );
-}
-
-(int, int) _pointAtUtf16(String text, int utf16Index) {
-  utf16Index = utf16Index.clamp(0, text.length);
-  var row = 0;
-  var lastLineStart = 0;
-  for (var i = 0; i < utf16Index; i++) {
-    if (text.codeUnitAt(i) == 0x0A) {
-      row++;
-      lastLineStart = i + 1;
-    }
+  if (start > 0 && _isHighSurrogate(oldText.codeUnitAt(start - 1))) {
+    start--;
   }
-  final colBytes = _utf8LenOfSlice(text, lastLineStart, utf16Index);
-  return (row, colBytes);
+  if (oldEnd < oldText.length && _isLowSurrogate(oldText.codeUnitAt(oldEnd))) {
+    oldEnd++;
+    newEnd++;
+  }
+  return (start, oldEnd, newEnd);
 }
 
-int _utf8LenOfSlice(String text, int start, int end) {
-  start = start.clamp(0, text.length);
-  end = end.clamp(start, text.length);
-  var bytes = 0;
-  for (final rune in text.substring(start, end).runes) {
-    bytes += _utf8Len(rune);
-  }
-  return bytes;
+bool _isHighSurrogate(int unit) => unit >= 0xD800 && unit <= 0xDBFF;
+
+bool _isLowSurrogate(int unit) => unit >= 0xDC00 && unit <= 0xDFFF;
+
+class _Span {
+  final int startUtf16;
+  final int endUtf16;
+  final int color;
+  const _Span(this.startUtf16, this.endUtf16, this.color);
 }
 
 const _seedC = r'''
@@ -168,6 +168,50 @@ Future<String?> _copyHeader({
   );
 }
 
+/// Writes `ts_builtin_queries.h`, the bundled highlight queries as C byte
+/// arrays that src/flutter_build_hooks_ffi_example.c compiles in. A missing
+/// query is embedded empty, which makes selecting it fail at run time.
+Future<void> _writeBuiltinQueries({
+  required Logger logger,
+  required Uri packageRoot,
+  required Directory destinationDirectory,
+  required BuildOutputBuilder output,
+}) async {
+  final header = StringBuffer(
+    '// Generated by hook/build.dart from queries/. Do not edit.\n',
+  );
+  for (final language in const ['c', 'javascript', 'dart']) {
+    final query = packageRoot.resolve('queries/$language/highlights.scm');
+    final file = File.fromUri(query);
+    final bytes = <int>[];
+    if (file.existsSync()) {
+      bytes.addAll(await file.readAsBytes());
+      output.addDependency(query);
+    } else {
+      logger.warning('Missing query file: ${file.path}');
+    }
+    // A byte list rather than a string literal: MSVC limits the length of
+    // string literals.
+    header.write('static const char ts_builtin_query_${language}_highlights[] = {');
+    for (var i = 0; i < bytes.length; i++) {
+      header.write(i % 16 == 0 ? '\n  ' : ' ');
+      header.write('0x${bytes[i].toRadixString(16).padLeft(2, '0')},');
+    }
+    header.write('\n  0x00\n};\n');
+  }
+
+  destinationDirectory.createSync(recursive: true);
+  final destination = File(
+    destinationDirectory.uri.resolve('ts_builtin_queries.h').toFilePath(),
+  );
+  final contents = header.toString();
+  // Leave an unchanged header alone so the library is not rebuilt for it.
+  if (!destination.existsSync() ||
+      await destination.readAsString() != contents) {
+    await destination.writeAsString(contents);
+  }
+}
+
 Future<void> main(List<String> args) async {
   await build(args, (input, output) async {
     hierarchicalLoggingEnabled = true;
@@ -301,6 +345,13 @@ Future<void> main(List<String> args) async {
         path,
     ];
 
+    await _writeBuiltinQueries(
+      logger: logger,
+      packageRoot: input.packageRoot,
+      destinationDirectory: stagedGrammarDir,
+      output: output,
+    );
+
     final cbuilder = CBuilder.library(
       name: packageName,
       assetName: '${packageName}_bindings_generated.dart',
@@ -314,6 +365,11 @@ Future<void> main(List<String> args) async {
         treeSitterSrc.path,
         stagedGrammarDir.path,
       ],
+      // Worker threads (batch calls, async reparse). Older glibc keeps them
+      // out of libc.
+      libraries: [
+        if (input.config.code.targetOS == OS.linux) 'pthread',
+      ],
     );
 
     await cbuilder.run(input: input, output: output, logger: logger);
@@ -1,6 +1,8 @@
 import 'dart:async';
+import 'dart:convert';
 import 'dart:ffi' as ffi;
 import 'dart:isolate';
+import 'dart:typed_data';
 
 import 'package:ffi/ffi.dart';
 
@@ -112,6 +114,89 @@ Future<SendPort> _helperIsolateSendPort = () async {
 
 enum TreeSitterLanguage { c, javascript, dart }
 
+/// The unit of the offsets a [TreeSitterDocument] reports and accepts.
+enum TreeSitterOffsetEncoding {
+  /// UTF-8 bytes, tree-sitter's native unit.
+  utf8(bindings.TS_OFFSET_ENCODING_UTF8),
+
+  /// UTF-16 code units, i.e. Dart [String] indices.
+  utf16(bindings.TS_OFFSET_ENCODING_UTF16);
+
+  final int nativeValue;
+
+  const TreeSitterOffsetEncoding(this.nativeValue);
+}
+
+/// Queries built into the native library for every [TreeSitterLanguage]; see
+/// [TreeSitterDocument.selectQuery].
+enum TreeSitterQueryKind {
+  /// The package's `queries/<language>/highlights.scm`.
+  highlights(bindings.TS_QUERY_KIND_HIGHLIGHTS);
+
+  final int nativeValue;
+
+  const TreeSitterQueryKind(this.nativeValue);
+}
+
+/// Outcome of [TreeSitterDocument.reparseWithBudget] and the asynchronous
+/// reparses.
+enum TreeSitterReparseStatus {
+  failed(bindings.TS_REPARSE_FAILED),
+  ok(bindings.TS_REPARSE_OK),
+
+  /// Stopped by [TreeSitterDocument.cancelReparse].
+  cancelled(bindings.TS_REPARSE_CANCELLED),
+
+  /// Ran out of its time budget.
+  timedOut(bindings.TS_REPARSE_TIMED_OUT);
+
+  final int nativeValue;
+
+  const TreeSitterReparseStatus(this.nativeValue);
+
+  static TreeSitterReparseStatus fromNative(int value) => values.firstWhere(
+    (status) => status.nativeValue == value,
+    orElse: () => failed,
+  );
+}
+
+/// The edit between two texts, as found by [TreeSitterDocument.setText] or
+/// made by [TreeSitterDocument.replaceText].
+///
+/// Byte offsets and points (with byte columns) are what tree-sitter expects;
+/// the UTF-16 offsets index the Dart strings.
+class TreeSitterTextEdit {
+  final int startByte;
+  final int oldEndByte;
+  final int newEndByte;
+  final int startRow;
+  final int startCol;
+  final int oldEndRow;
+  final int oldEndCol;
+  final int newEndRow;
+  final int newEndCol;
+  final int startUtf16;
+  final int oldEndUtf16;
+  final int newEndUtf16;
+
+  const TreeSitterTextEdit({
+    required this.startByte,
+    required this.oldEndByte,
+    required this.newEndByte,
+    required this.startRow,
+    required this.startCol,
+    required this.oldEndRow,
+    required this.oldEndCol,
+    required this.newEndRow,
+    required this.newEndCol,
+    required this.startUtf16,
+    required this.oldEndUtf16,
+    required this.newEndUtf16,
+  });
+
+  bool get isEmpty => startByte == oldEndByte && startByte == newEndByte;
+}
+
 class TreeSitterToken {
   final int startByte;
   final int endByte;
@@ -126,6 +211,46 @@ class TreeSitterToken {
   });
 }
 
+/// Leaf tokens in the packed binary layout returned by `ts_tokens_packed`.
+///
+/// [records] is a flat view of `(startByte, endByte, symbol, named)` records
+/// that points straight at native memory; it is released when the list is
+/// garbage collected. [symbolNames] is the language's shared table from
+/// [treeSitterSymbolNames], so token types cost no allocation.
+class TreeSitterPackedTokens {
+  static const int recordWords = 4;
+
+  final Uint32List records;
+  final List<String> symbolNames;
+
+  const TreeSitterPackedTokens(this.records, this.symbolNames);
+
+  int get length => records.length ~/ recordWords;
+
+  int startByte(int index) => records[index * recordWords];
+
+  int endByte(int index) => records[index * recordWords + 1];
+
+  int symbol(int index) => records[index * recordWords + 2];
+
+  bool named(int index) => records[index * recordWords + 3] != 0;
+
+  String type(int index) => symbolNames[symbol(index)];
+
+  /// The non-empty tokens as [TreeSitterToken]s, as [parseTokens] returns
+  /// them.
+  List<TreeSitterToken> toTokens() => [
+    for (var i = 0; i < length; i++)
+      if (endByte(i) > startByte(i))
+        TreeSitterToken(
+          startByte: startByte(i),
+          endByte: endByte(i),
+          named: named(i),
+          type: type(i),
+        ),
+  ];
+}
+
 class TreeSitterCapture {
   final int startByte;
   final int endByte;
@@ -138,6 +263,168 @@ class TreeSitterCapture {
   });
 }
 
+/// Query captures in the packed binary layout returned by
+/// `ts_query_captures_packed`.
+///
+/// [records] is a flat view of `(startByte, endByte, captureId)` triples that
+/// points straight at native memory; it is released when the list is garbage
+/// collected. [captureNames] maps a capture id to its name.
+///
+/// Offsets are UTF-8 bytes, or UTF-16 code units for a [TreeSitterDocument]
+/// using [TreeSitterOffsetEncoding.utf16].
+class TreeSitterPackedCaptures {
+  static const int recordWords = 3;
+
+  final Uint32List records;
+  final List<String> captureNames;
+
+  const TreeSitterPackedCaptures(this.records, this.captureNames);
+
+  int get length => records.length ~/ recordWords;
+
+  int startByte(int index) => records[index * recordWords];
+
+  int endByte(int index) => records[index * recordWords + 1];
+
+  int captureId(int index) => records[index * recordWords + 2];
+
+  String name(int index) => captureNames[captureId(index)];
+}
+
+/// The highlighting delta of one reparse, see [TreeSitterDocument.queryDelta].
+class TreeSitterCaptureDelta {
+  /// Flat `(startByte, endByte)` pairs of the ranges that changed, sorted and
+  /// non-overlapping.
+  final Uint32List changedRanges;
+
+  /// Every capture intersecting one of [changedRanges].
+  final TreeSitterPackedCaptures captures;
+
+  const TreeSitterCaptureDelta(this.changedRanges, this.captures);
+
+  int get rangeCount => changedRanges.length ~/ 2;
+
+  int rangeStartByte(int index) => changedRanges[index * 2];
+
+  int rangeEndByte(int index) => changedRanges[index * 2 + 1];
+}
+
+/// How captures with a given name are highlighted, see
+/// [TreeSitterDocument.setHighlightStyles].
+class TreeSitterHighlightStyle {
+  /// Where captures overlap, the one with the higher priority is shown.
+  final int priority;
+
+  /// Caller-defined id reported in [TreeSitterHighlightSpans].
+  final int styleId;
+
+  const TreeSitterHighlightStyle({
+    required this.priority,
+    required this.styleId,
+  });
+}
+
+/// Sorted, non-overlapping highlight spans resolved natively, see
+/// [TreeSitterDocument.highlightSpans].
+class TreeSitterHighlightSpans {
+  static const int recordWords = 3;
+
+  /// Flat `(start, end, styleId)` triples, with offsets in the document's
+  /// [TreeSitterDocument.offsetEncoding].
+  final Uint32List records;
+
+  const TreeSitterHighlightSpans(this.records);
+
+  int get length => records.length ~/ recordWords;
+
+  int start(int index) => records[index * recordWords];
+
+  int end(int index) => records[index * recordWords + 1];
+
+  int styleId(int index) => records[index * recordWords + 2];
+}
+
+/// What a [TreeSitterDocument] has recently done, see
+/// [TreeSitterDocument.stats]. Rolling values average roughly the last eight
+/// samples.
+class TreeSitterDocumentStats {
+  /// Completed reparses; halted ones are not counted.
+  final int parseCount;
+  final Duration lastParse;
+  final Duration rollingParse;
+
+  /// Packed capture queries and highlight span requests.
+  final int queryCount;
+  final Duration lastQuery;
+  final Duration rollingQuery;
+
+  /// Time spent turning captures into the returned records, on top of the
+  /// query time.
+  final Duration lastSerialize;
+  final Duration rollingSerialize;
+
+  /// Nodes in the current tree. Those touching a range the last reparse
+  /// changed count as [recreatedNodes], the rest as [reusedNodes].
+  final int nodeCount;
+  final int reusedNodes;
+  final int recreatedNodes;
+  final int sourceBytes;
+
+  /// As [TreeSitterDocument.memoryUsage].
+  final int memoryBytes;
+
+  const TreeSitterDocumentStats({
+    required this.parseCount,
+    required this.lastParse,
+    required this.rollingParse,
+    required this.queryCount,
+    required this.lastQuery,
+    required this.rollingQuery,
+    required this.lastSerialize,
+    required this.rollingSerialize,
+    required this.nodeCount,
+    required this.reusedNodes,
+    required this.recreatedNodes,
+    required this.sourceBytes,
+    required this.memoryBytes,
+  });
+
+  /// Share of the current tree reused from the previous one, from 0 to 1.
+  double get reuseRatio => nodeCount == 0 ? 0 : reusedNodes / nodeCount;
+}
+
+/// `ts_free` as a native finalizer, so typed-data views over native results
+/// can release their memory when garbage collected.
+final ffi.Pointer<ffi.NativeFinalizerFunction> _tsFreeFinalizer =
+    ffi.Native.addressOf<ffi.NativeFinalizerFunction>(bindings.ts_free);
+
+Uint32List _adoptUint32Records(
+  ffi.Pointer<ffi.Uint32> recordsPtr,
+  int recordCount,
+  int recordWords,
+) {
+  if (recordsPtr == ffi.nullptr) {
+    return Uint32List(0);
+  }
+  if (recordCount == 0) {
+    bindings.ts_free(recordsPtr.cast());
+    return Uint32List(0);
+  }
+  return recordsPtr.asTypedList(
+    recordCount * recordWords,
+    finalizer: _tsFreeFinalizer,
+  );
+}
+
+List<String> _takeNewlineDelimited(ffi.Pointer<ffi.Char> namesPtr) {
+  if (namesPtr == ffi.nullptr) {
+    return const [];
+  }
+  final names = namesPtr.cast<Utf8>().toDartString();
+  bindings.ts_free(namesPtr.cast());
+  return names.isEmpty ? const [] : names.split('\n');
+}
+
 /// Parses [source] with tree-sitter and returns an s-expression representation.
 ///
 /// Returns an empty string if parsing fails.
@@ -163,46 +450,118 @@ Future<String> parseSExpressionAsync(
   required TreeSitterLanguage language,
 }) => Isolate.run(() => parseSExpression(source, language: language));
 
+final Map<TreeSitterLanguage, List<String>> _symbolNames = {};
+
+/// The node type names of [language], indexed by the symbol ids of
+/// [TreeSitterPackedTokens]. Fetched from native code once per isolate.
+List<String> treeSitterSymbolNames(TreeSitterLanguage language) =>
+    _symbolNames[language] ??= _fetchSymbolNames(language);
+
+List<String> _fetchSymbolNames(TreeSitterLanguage language) {
+  final countPtr = malloc<ffi.Uint32>();
+  final lengthPtr = malloc<ffi.Uint32>();
+  final namesPtr = bindings.ts_language_symbol_names(
+    language.index,
+    countPtr,
+    lengthPtr,
+  );
+  final count = countPtr.value;
+  final length = lengthPtr.value;
+  malloc.free(countPtr);
+  malloc.free(lengthPtr);
+  if (namesPtr == ffi.nullptr) {
+    return const [];
+  }
+
+  final bytes = namesPtr.cast<ffi.Uint8>().asTypedList(length);
+  final names = <String>[];
+  var start = 0;
+  for (var i = 0; i < length && names.length < count; i++) {
+    if (bytes[i] != 0) continue;
+    names.add(utf8.decode(Uint8List.sublistView(bytes, start, i)));
+    start = i + 1;
+  }
+  bindings.ts_free(namesPtr.cast());
+  return List.unmodifiable(names);
+}
+
+/// Native memory not charged to any [TreeSitterDocument], in bytes:
+/// [sharedBytes] is live (pooled parsers, cached queries, results Dart has
+/// not released yet) and [pooledBytes] is freed but kept for reuse.
+({int sharedBytes, int pooledBytes}) treeSitterMemoryUsage() {
+  final sharedPtr = malloc<ffi.Uint64>();
+  final pooledPtr = malloc<ffi.Uint64>();
+  bindings.ts_memory_usage(sharedPtr, pooledPtr);
+  final usage = (sharedBytes: sharedPtr.value, pooledBytes: pooledPtr.value);
+  malloc.free(sharedPtr);
+  malloc.free(pooledPtr);
+  return usage;
+}
+
+/// Hands the freed native blocks kept for reuse back to the system, e.g.
+/// after closing large documents.
+void treeSitterTrimMemory() => bindings.ts_memory_trim();
+
+/// Compiles the built-in queries (see [TreeSitterDocument.selectQuery]) of
+/// every language and pre-creates [parsersPerLanguage] pooled parsers on a
+/// background native thread. Call it at startup so the first highlight of a
+/// file does not include query compilation.
+///
+/// Completes with false if a query or parser could not be created; what did
+/// succeed is still kept. Calling it again only creates what is missing.
+Future<bool> treeSitterWarmUp({int parsersPerLanguage = 2}) {
+  final completer = Completer<bool>();
+  late final ffi.NativeCallable<bindings.TsWarmUpCallbackFunction> callback;
+  callback = ffi.NativeCallable<bindings.TsWarmUpCallbackFunction>.listener((
+    bool ok,
+  ) {
+    callback.close();
+    completer.complete(ok);
+  });
+  if (!bindings.ts_warm_up(parsersPerLanguage, callback.nativeFunction)) {
+    callback.close();
+    return Future.value(false);
+  }
+  return completer.future;
+}
+
 List<TreeSitterToken> parseTokens(
   String source, {
   required TreeSitterLanguage language,
+}) => parseTokensPacked(source, language: language).toTokens();
+
+Future<List<TreeSitterToken>> parseTokensAsync(
+  String source, {
+  required TreeSitterLanguage language,
+}) => Isolate.run(() => parseTokens(source, language: language));
+
+/// Like [parseTokens], but returns packed records that Dart reads directly
+/// instead of one object per token.
+TreeSitterPackedTokens parseTokensPacked(
+  String source, {
+  required TreeSitterLanguage language,
 }) {
   final sourcePtr = source.toNativeUtf8();
-  final resultPtr = bindings.ts_tokens(
+  final countPtr = malloc<ffi.Uint32>();
+  final resultPtr = bindings.ts_tokens_packed(
     sourcePtr.cast<ffi.Char>(),
     language.index,
+    countPtr,
   );
+  final count = countPtr.value;
   malloc.free(sourcePtr);
+  malloc.free(countPtr);
 
-  if (resultPtr == ffi.nullptr) {
-    return const [];
-  }
-
-  final raw = resultPtr.cast<Utf8>().toDartString();
-  bindings.ts_free(resultPtr.cast());
-
-  final tokens = <TreeSitterToken>[];
-  for (final line in raw.split('\n')) {
-    if (line.isEmpty) continue;
-    final parts = line.split('\t');
-    if (parts.length < 4) continue;
-    final start = int.tryParse(parts[0]);
-    final end = int.tryParse(parts[1]);
-    final named = parts[2] == '1';
-    final type = parts.sublist(3).join('\t');
-    if (start == null || end == null) continue;
-    if (end <= start) continue;
-    tokens.add(
-      TreeSitterToken(startByte: start, endByte: end, named: named, type: type),
-    );
-  }
-  return tokens;
+  return TreeSitterPackedTokens(
+    _adoptUint32Records(resultPtr, count, TreeSitterPackedTokens.recordWords),
+    treeSitterSymbolNames(language),
+  );
 }
 
-Future<List<TreeSitterToken>> parseTokensAsync(
+Future<TreeSitterPackedTokens> parseTokensPackedAsync(
   String source, {
   required TreeSitterLanguage language,
-}) => Isolate.run(() => parseTokens(source, language: language));
+}) => Isolate.run(() => parseTokensPacked(source, language: language));
 
 List<TreeSitterCapture> parseQueryCaptures(
   String source, {
@@ -256,10 +615,381 @@ Future<List<TreeSitterCapture>> parseQueryCapturesAsync(
   () => parseQueryCaptures(source, language: language, query: query),
 );
 
+/// Like [parseQueryCaptures], but returns packed records that Dart reads
+/// directly instead of parsing text.
+TreeSitterPackedCaptures parseQueryCapturesPacked(
+  String source, {
+  required TreeSitterLanguage language,
+  required String query,
+}) {
+  final sourcePtr = source.toNativeUtf8();
+  final queryPtr = query.toNativeUtf8();
+  final countPtr = malloc<ffi.Uint32>();
+  final namesPtr = malloc<ffi.Pointer<ffi.Char>>();
+  final resultPtr = bindings.ts_query_captures_packed(
+    sourcePtr.cast<ffi.Char>(),
+    language.index,
+    queryPtr.cast<ffi.Char>(),
+    countPtr,
+    namesPtr,
+  );
+  final count = countPtr.value;
+  final names = _takeNewlineDelimited(namesPtr.value);
+  malloc.free(sourcePtr);
+  malloc.free(queryPtr);
+  malloc.free(countPtr);
+  malloc.free(namesPtr);
+
+  return TreeSitterPackedCaptures(
+    _adoptUint32Records(resultPtr, count, TreeSitterPackedCaptures.recordWords),
+    names,
+  );
+}
+
+Future<TreeSitterPackedCaptures> parseQueryCapturesPackedAsync(
+  String source, {
+  required TreeSitterLanguage language,
+  required String query,
+}) => Isolate.run(
+  () => parseQueryCapturesPacked(source, language: language, query: query),
+);
+
+/// Shared state of [TreeSitterTokenStream] and [TreeSitterCaptureStream]:
+/// the native stream and the one batch buffer it fills.
+class _NativeResultStream {
+  final int batchSize;
+  final int recordWords;
+  ffi.Pointer<ffi.Void> _stream;
+  final ffi.Pointer<ffi.Uint32> _buffer;
+
+  _NativeResultStream(this._stream, this.batchSize, this.recordWords)
+    : _buffer = malloc<ffi.Uint32>(batchSize * recordWords);
+
+  Uint32List next() {
+    if (_stream == ffi.nullptr) {
+      return Uint32List(0);
+    }
+    final count = bindings.ts_stream_next_batch(_stream, _buffer, batchSize);
+    return _buffer.asTypedList(count * recordWords);
+  }
+
+  void dispose() {
+    if (_stream == ffi.nullptr) {
+      return;
+    }
+    bindings.ts_stream_delete(_stream);
+    _stream = ffi.nullptr;
+    malloc.free(_buffer);
+  }
+}
+
+/// Like [parseTokensPacked], but hands the tokens out [batchSize] at a time
+/// so memory stays bounded however large [source] is.
+///
+/// Each batch returned by [nextBatch] views a buffer that the next call
+/// overwrites; copy what must outlive it. Call [dispose] when done, whether
+/// or not the stream was drained.
+class TreeSitterTokenStream {
+  final TreeSitterLanguage language;
+  final _NativeResultStream _results;
+
+  TreeSitterTokenStream._(this.language, this._results);
+
+  factory TreeSitterTokenStream(
+    String source, {
+    required TreeSitterLanguage language,
+    int batchSize = 4096,
+  }) {
+    RangeError.checkValueInInterval(batchSize, 1, 1 << 24, 'batchSize');
+    final sourcePtr = source.toNativeUtf8();
+    final stream = bindings.ts_stream_tokens_new(
+      sourcePtr.cast<ffi.Char>(),
+      sourcePtr.length,
+      language.index,
+    );
+    malloc.free(sourcePtr);
+    if (stream == ffi.nullptr) {
+      throw StateError('ts_stream_tokens_new failed');
+    }
+    return TreeSitterTokenStream._(
+      language,
+      _NativeResultStream(
+        stream,
+        batchSize,
+        TreeSitterPackedTokens.recordWords,
+      ),
+    );
+  }
+
+  /// The next batch of tokens, empty once the stream is exhausted.
+  TreeSitterPackedTokens nextBatch() =>
+      TreeSitterPackedTokens(_results.next(), treeSitterSymbolNames(language));
+
+  void dispose() => _results.dispose();
+}
+
+/// Like [parseQueryCapturesPacked], but hands the captures out [batchSize] at
+/// a time so memory stays bounded however large [source] is.
+///
+/// Captures come in the order tree-sitter reports them, by start byte; unlike
+/// [parseQueryCapturesPacked], ties are not reordered longest first. Each
+/// batch returned by [nextBatch] views a buffer that the next call
+/// overwrites. Call [dispose] when done.
+class TreeSitterCaptureStream {
+  final List<String> captureNames;
+  final _NativeResultStream _results;
+
+  TreeSitterCaptureStream._(this.captureNames, this._results);
+
+  factory TreeSitterCaptureStream(
+    String source, {
+    required TreeSitterLanguage language,
+    required String query,
+    int batchSize = 4096,
+  }) {
+    RangeError.checkValueInInterval(batchSize, 1, 1 << 24, 'batchSize');
+    final sourcePtr = source.toNativeUtf8();
+    final queryPtr = query.toNativeUtf8();
+    final namesPtr = malloc<ffi.Pointer<ffi.Char>>();
+    namesPtr.value = ffi.nullptr;
+    final stream = bindings.ts_stream_captures_new(
+      sourcePtr.cast<ffi.Char>(),
+      sourcePtr.length,
+      language.index,
+      queryPtr.cast<ffi.Char>(),
+      namesPtr,
+    );
+    final names = _takeNewlineDelimited(namesPtr.value);
+    malloc.free(sourcePtr);
+    malloc.free(queryPtr);
+    malloc.free(namesPtr);
+    if (stream == ffi.nullptr) {
+      throw StateError('ts_stream_captures_new failed');
+    }
+    return TreeSitterCaptureStream._(
+      names,
+      _NativeResultStream(
+        stream,
+        batchSize,
+        TreeSitterPackedCaptures.recordWords,
+      ),
+    );
+  }
+
+  /// The next batch of captures, empty once the stream is exhausted.
+  TreeSitterPackedCaptures nextBatch() =>
+      TreeSitterPackedCaptures(_results.next(), captureNames);
+
+  void dispose() => _results.dispose();
+}
+
+/// A source text for the batch entry points.
+class TreeSitterSource {
+  final String text;
+  final TreeSitterLanguage language;
+
+  const TreeSitterSource(this.text, {required this.language});
+}
+
+/// The UTF-8 bytes of a batch, copied into one native buffer.
+class _NativeBatch {
+  final int length;
+  final ffi.Pointer<ffi.Uint8> _bytes;
+  final ffi.Pointer<ffi.Pointer<ffi.Char>> sources;
+  final ffi.Pointer<ffi.Uint32> lengths;
+  final ffi.Pointer<ffi.Int32> languages;
+
+  _NativeBatch._(
+    this.length,
+    this._bytes,
+    this.sources,
+    this.lengths,
+    this.languages,
+  );
+
+  factory _NativeBatch(List<TreeSitterSource> items) {
+    final encoded = [for (final item in items) utf8.encode(item.text)];
+    var total = 0;
+    for (final bytes in encoded) {
+      total += bytes.length;
+    }
+
+    final count = items.length;
+    final bytesPtr = malloc<ffi.Uint8>(total == 0 ? 1 : total);
+    final sources = malloc<ffi.Pointer<ffi.Char>>(count == 0 ? 1 : count);
+    final lengths = malloc<ffi.Uint32>(count == 0 ? 1 : count);
+    final languages = malloc<ffi.Int32>(count == 0 ? 1 : count);
+    final view = bytesPtr.asTypedList(total == 0 ? 1 : total);
+    var offset = 0;
+    for (var i = 0; i < count; i++) {
+      final bytes = encoded[i];
+      view.setAll(offset, bytes);
+      sources[i] = (bytesPtr + offset).cast();
+      lengths[i] = bytes.length;
+      languages[i] = items[i].language.index;
+      offset += bytes.length;
+    }
+    return _NativeBatch._(count, bytesPtr, sources, lengths, languages);
+  }
+
+  void free() {
+    malloc.free(_bytes);
+    malloc.free(sources);
+    malloc.free(lengths);
+    malloc.free(languages);
+  }
+}
+
+/// Tokenizes every source in [sources] with one native call, spread over
+/// [threads] native threads (one per core by default).
+///
+/// This blocks until the whole batch is done; use [parseTokensBatchAsync] from
+/// a UI isolate.
+List<List<TreeSitterToken>> parseTokensBatch(
+  List<TreeSitterSource> sources, {
+  int threads = 0,
+}) => [
+  for (final tokens in parseTokensPackedBatch(sources, threads: threads))
+    tokens.toTokens(),
+];
+
+/// Like [parseTokensBatch], but returns packed records.
+List<TreeSitterPackedTokens> parseTokensPackedBatch(
+  List<TreeSitterSource> sources, {
+  int threads = 0,
+}) {
+  final batch = _NativeBatch(sources);
+  final slots = batch.length == 0 ? 1 : batch.length;
+  final results = malloc<ffi.Pointer<ffi.Uint32>>(slots);
+  final counts = malloc<ffi.Uint32>(slots);
+  bindings.ts_batch_tokens_packed(
+    batch.sources,
+    batch.lengths,
+    batch.languages,
+    batch.length,
+    threads,
+    results,
+    counts,
+  );
+  batch.free();
+
+  final tokens = [
+    for (var i = 0; i < sources.length; i++)
+      TreeSitterPackedTokens(
+        _adoptUint32Records(
+          results[i],
+          counts[i],
+          TreeSitterPackedTokens.recordWords,
+        ),
+        treeSitterSymbolNames(sources[i].language),
+      ),
+  ];
+  malloc.free(results);
+  malloc.free(counts);
+  return tokens;
+}
+
+Future<List<List<TreeSitterToken>>> parseTokensBatchAsync(
+  List<TreeSitterSource> sources, {
+  int threads = 0,
+}) => Isolate.run(() => parseTokensBatch(sources, threads: threads));
+
+/// Runs the query for each source's language from [queries] over every source
+/// in [sources] with one native call, spread over [threads] native threads
+/// (one per core by default). Sources whose language has no query get an
+/// empty result.
+///
+/// This blocks until the whole batch is done; use
+/// [parseQueryCapturesBatchAsync] from a UI isolate.
+List<TreeSitterPackedCaptures> parseQueryCapturesBatch(
+  List<TreeSitterSource> sources, {
+  required Map<TreeSitterLanguage, String> queries,
+  int threads = 0,
+}) {
+  final queryPtrs = {
+    for (final entry in queries.entries)
+      entry.key: entry.value.toNativeUtf8().cast<ffi.Char>(),
+  };
+  final batch = _NativeBatch(sources);
+  final slots = batch.length == 0 ? 1 : batch.length;
+  final queryArray = malloc<ffi.Pointer<ffi.Char>>(slots);
+  for (var i = 0; i < sources.length; i++) {
+    queryArray[i] = queryPtrs[sources[i].language] ?? ffi.nullptr;
+  }
+  final results = malloc<ffi.Pointer<ffi.Uint32>>(slots);
+  final counts = malloc<ffi.Uint32>(slots);
+  final names = malloc<ffi.Pointer<ffi.Char>>(slots);
+  bindings.ts_batch_query_captures_packed(
+    batch.sources,
+    batch.lengths,
+    batch.languages,
+    queryArray,
+    batch.length,
+    threads,
+    results,
+    counts,
+    names,
+  );
+  batch.free();
+  malloc.free(queryArray);
+  for (final ptr in queryPtrs.values) {
+    malloc.free(ptr);
+  }
+
+  final captures = [
+    for (var i = 0; i < sources.length; i++)
+      TreeSitterPackedCaptures(
+        _adoptUint32Records(
+          results[i],
+          counts[i],
+          TreeSitterPackedCaptures.recordWords,
+        ),
+        _takeNewlineDelimited(names[i]),
+      ),
+  ];
+  malloc.free(results);
+  malloc.free(counts);
+  malloc.free(names);
+  return captures;
+}
+
+Future<List<TreeSitterPackedCaptures>> parseQueryCapturesBatchAsync(
+  List<TreeSitterSource> sources, {
+  required Map<TreeSitterLanguage, String> queries,
+  int threads = 0,
+}) => Isolate.run(
+  () => parseQueryCapturesBatch(sources, queries: queries, threads: threads),
+);
+
+/// What a finished asynchronous reparse handed back; see
+/// [TreeSitterDocument.reparseAsync].
+typedef _AsyncReparseResult = ({
+  TreeSitterReparseStatus status,
+  Uint32List records,
+  List<String> names,
+});
+
 class TreeSitterDocument {
   final TreeSitterLanguage language;
   final ffi.Pointer<ffi.Void> _doc;
 
+  /// The query (its text, or a [TreeSitterQueryKind]) whose capture names
+  /// are in [_packedCaptureNames].
+  Object? _packedQuery;
+  List<String> _packedCaptureNames = const [];
+  TreeSitterQueryKind? _selectedQuery;
+  TreeSitterOffsetEncoding _offsetEncoding = TreeSitterOffsetEncoding.utf8;
+
+  /// Completion port of the native worker thread, created by the first
+  /// asynchronous reparse.
+  ffi.NativeCallable<bindings.TsDocReparseCallbackFunction>? _reparseDone;
+  Completer<_AsyncReparseResult>? _pendingReparse;
+  int _pendingReparseId = 0;
+  final List<void Function()> _deferredEdits = [];
+
+  /// The workspace that opened this document, if any.
+  TreeSitterWorkspace? _workspace;
+
   TreeSitterDocument._(this.language, this._doc);
 
   factory TreeSitterDocument.create({required TreeSitterLanguage language}) {
@@ -271,16 +1001,438 @@ class TreeSitterDocument {
   }
 
   void dispose() {
+    _workspace?._documents.remove(this);
+    _workspace = null;
+    // Waits for a running asynchronous reparse before the port is closed.
     bindings.ts_doc_delete(_doc);
+    _reparseDone?.close();
+    _reparseDone = null;
+    _deferredEdits.clear();
+    final pending = _pendingReparse;
+    _pendingReparse = null;
+    pending?.complete((
+      status: TreeSitterReparseStatus.failed,
+      records: Uint32List(0),
+      names: const [],
+    ));
+  }
+
+  /// Makes every successful reparse publish an immutable
+  /// [TreeSitterSnapshot], and publishes the current tree right away. A
+  /// snapshot shares the source with the document; later edits copy only the
+  /// chunks of text they change, so typing stays cheap in a large file.
+  void enableSnapshots() {
+    _checkIdle();
+    if (!bindings.ts_doc_enable_snapshots(_doc)) {
+      throw StateError('ts_doc_enable_snapshots failed');
+    }
+  }
+
+  /// The latest snapshot published by a reparse (see [enableSnapshots]), or
+  /// null if there is none yet. Safe to call while an asynchronous reparse
+  /// runs. The caller owns it and must [TreeSitterSnapshot.dispose] it.
+  TreeSitterSnapshot? snapshot() {
+    final snapshot = bindings.ts_doc_snapshot(_doc);
+    return snapshot == ffi.nullptr ? null : TreeSitterSnapshot._(snapshot);
+  }
+
+  /// Whether an asynchronous reparse is in flight. Until it completes only
+  /// [edit] and [cancelReparse] may be called; the edits are applied once the
+  /// document is idle.
+  bool get isReparsing => _pendingReparse != null;
+
+  /// Native bytes held by this document: parser, trees, tracked text and
+  /// compiled query. Results already returned to Dart are not included. Safe
+  /// to read while an asynchronous reparse is running.
+  int get memoryUsage => bindings.ts_doc_memory_usage(_doc);
+
+  /// Timings and tree shape of the recent parses and queries. Safe to read
+  /// while an asynchronous reparse is running.
+  TreeSitterDocumentStats get stats {
+    final statsPtr = malloc<bindings.TsDocStats>();
+    bindings.ts_doc_stats(_doc, statsPtr);
+    final native = statsPtr.ref;
+    final stats = TreeSitterDocumentStats(
+      parseCount: native.parse_count,
+      lastParse: Duration(microseconds: native.last_parse_micros),
+      rollingParse: Duration(microseconds: native.rolling_parse_micros),
+      queryCount: native.query_count,
+      lastQuery: Duration(microseconds: native.last_query_micros),
+      rollingQuery: Duration(microseconds: native.rolling_query_micros),
+      lastSerialize: Duration(microseconds: native.last_serialize_micros),
+      rollingSerialize: Duration(microseconds: native.rolling_serialize_micros),
+      nodeCount: native.node_count,
+      reusedNodes: native.reused_nodes,
+      recreatedNodes: native.recreated_nodes,
+      sourceBytes: native.source_bytes,
+      memoryBytes: native.memory_bytes,
+    );
+    malloc.free(statsPtr);
+    return stats;
+  }
+
+  void _checkIdle() {
+    if (_pendingReparse != null) {
+      throw StateError('TreeSitterDocument is reparsing asynchronously');
+    }
   }
 
   bool reparse(String source) {
+    _checkIdle();
     final sourcePtr = source.toNativeUtf8();
     final ok = bindings.ts_doc_reparse(_doc, sourcePtr.cast<ffi.Char>()) != 0;
     malloc.free(sourcePtr);
     return ok;
   }
 
+  /// Like [reparse], but stops after [timeout] or once [cancelReparse] is
+  /// called from another isolate.
+  ///
+  /// A stopped parse keeps the previous (edited) tree, so the next reparse is
+  /// still incremental, and reparsing the same [source] picks up where this
+  /// one stopped.
+  TreeSitterReparseStatus reparseWithBudget(String source, {Duration? timeout}) =>
+      _reparseWithBudget(source, timeout);
+
+  /// [reparseWithBudget] of the text passed to [setText].
+  TreeSitterReparseStatus reparseText({Duration? timeout}) =>
+      _reparseWithBudget(null, timeout);
+
+  TreeSitterReparseStatus _reparseWithBudget(String? source, Duration? timeout) {
+    _checkIdle();
+    final sourcePtr = source?.toNativeUtf8() ?? ffi.nullptr;
+    final status = bindings.ts_doc_reparse_with_budget(
+      _doc,
+      sourcePtr.cast<ffi.Char>(),
+      timeout?.inMicroseconds ?? 0,
+    );
+    if (sourcePtr != ffi.nullptr) {
+      malloc.free(sourcePtr);
+    }
+    return TreeSitterReparseStatus.fromNative(status);
+  }
+
+  /// Makes [text] the document's text and applies the edit from the previous
+  /// one (initially empty) to the tree, as [edit] would. Parse it with
+  /// [reparseText] or [reparseTextAsync].
+  ///
+  /// The edit is found natively, with no full scans of either text in Dart.
+  /// When the caller already knows what changed, [replaceText] avoids
+  /// copying the whole text across.
+  TreeSitterTextEdit setText(String text) {
+    final textPtr = text.toNativeUtf8();
+    final editPtr = malloc<ffi.Uint32>(bindings.TS_TEXT_EDIT_WORDS);
+    final ok = bindings.ts_doc_set_text(
+      _doc,
+      textPtr.cast<ffi.Char>(),
+      textPtr.length,
+      editPtr,
+    );
+    malloc.free(textPtr);
+    return _takeTextEdit(ok, editPtr, 'ts_doc_set_text');
+  }
+
+  /// Replaces [start, end) of the document's text with [replacement] and
+  /// applies the edit to the tree, as [setText] does. Offsets are in
+  /// [offsetEncoding] units.
+  ///
+  /// Only [replacement] is copied to native code; the document keeps its
+  /// text in chunks of up to 16 KiB, so typing costs about the same in a
+  /// large file as in a small one.
+  TreeSitterTextEdit replaceText(int start, int end, String replacement) {
+    final replacementPtr = replacement.toNativeUtf8();
+    final editPtr = malloc<ffi.Uint32>(bindings.TS_TEXT_EDIT_WORDS);
+    final ok = bindings.ts_doc_replace_text(
+      _doc,
+      start,
+      end,
+      replacementPtr.cast<ffi.Char>(),
+      replacementPtr.length,
+      editPtr,
+    );
+    malloc.free(replacementPtr);
+    return _takeTextEdit(ok, editPtr, 'ts_doc_replace_text');
+  }
+
+  /// The document's text in [start, end), in [offsetEncoding] units.
+  String textRange(int start, int end) {
+    final lengthPtr = malloc<ffi.Uint32>();
+    final resultPtr = bindings.ts_doc_text_range(_doc, start, end, lengthPtr);
+    final length = lengthPtr.value;
+    malloc.free(lengthPtr);
+    if (resultPtr == ffi.nullptr) {
+      throw StateError('ts_doc_text_range failed');
+    }
+    final text = resultPtr.cast<Utf8>().toDartString(length: length);
+    bindings.ts_free(resultPtr.cast());
+    return text;
+  }
+
+  /// Makes the file at [path] the document's text without reading it into
+  /// Dart: it is memory-mapped natively, and [reparseText] /
+  /// [reparseTextAsync] parse it in place, from scratch. Read the parts that
+  /// are shown with [textRange]; edit with [replaceText].
+  ///
+  /// Returns false if the file can't be mapped.
+  bool openFile(String path) {
+    _checkIdle();
+    final pathPtr = path.toNativeUtf8();
+    final ok = bindings.ts_doc_open_file(_doc, pathPtr.cast<ffi.Char>());
+    malloc.free(pathPtr);
+    return ok;
+  }
+
+  /// Frees the TS_TEXT_EDIT_WORDS [words] written by [function] and applies
+  /// the edit they describe to the tree.
+  TreeSitterTextEdit _takeTextEdit(
+    bool ok,
+    ffi.Pointer<ffi.Uint32> words,
+    String function,
+  ) {
+    if (!ok) {
+      malloc.free(words);
+      throw StateError('$function failed');
+    }
+    final change = TreeSitterTextEdit(
+      startByte: words[0],
+      oldEndByte: words[1],
+      newEndByte: words[2],
+      startRow: words[3],
+      startCol: words[4],
+      oldEndRow: words[5],
+      oldEndCol: words[6],
+      newEndRow: words[7],
+      newEndCol: words[8],
+      startUtf16: words[9],
+      oldEndUtf16: words[10],
+      newEndUtf16: words[11],
+    );
+    malloc.free(words);
+    if (!change.isEmpty) {
+      edit(
+        startByte: change.startByte,
+        oldEndByte: change.oldEndByte,
+        newEndByte: change.newEndByte,
+        startRow: change.startRow,
+        startCol: change.startCol,
+        oldEndRow: change.oldEndRow,
+        oldEndCol: change.oldEndCol,
+        newEndRow: change.newEndRow,
+        newEndCol: change.newEndCol,
+      );
+    }
+    return change;
+  }
+
+  /// Stops the pending asynchronous reparse (or one running on another
+  /// isolate), e.g. because its revision is already stale. It then completes
+  /// with [TreeSitterReparseStatus.cancelled]. Later reparses are not
+  /// affected.
+  void cancelReparse() => bindings.ts_doc_cancel_reparse(_doc);
+
+  /// Like [reparseWithBudget], but parses on a native thread owned by the
+  /// document, so the calling isolate never blocks on tree-sitter. Requests
+  /// are served one at a time in call order.
+  Future<TreeSitterReparseStatus> reparseAsync(
+    String source, {
+    Duration? timeout,
+  }) async => (await _reparseAsync(
+    source,
+    null,
+    bindings.TS_ASYNC_RESULT_NONE,
+    timeout,
+  )).status;
+
+  /// [reparseAsync] of the text passed to [setText].
+  Future<TreeSitterReparseStatus> reparseTextAsync({Duration? timeout}) async =>
+      (await _reparseAsync(
+        null,
+        null,
+        bindings.TS_ASYNC_RESULT_NONE,
+        timeout,
+      )).status;
+
+  /// [reparseAsync] followed by [highlightSpans] of the whole document on the
+  /// same native thread. Returns null if the reparse did not finish.
+  Future<TreeSitterHighlightSpans?> reparseAndHighlightAsync(
+    String source,
+    String? query, {
+    Duration? timeout,
+  }) async {
+    final result = await _reparseAsync(
+      source,
+      query,
+      bindings.TS_ASYNC_RESULT_HIGHLIGHT_SPANS,
+      timeout,
+    );
+    return result.status == TreeSitterReparseStatus.ok
+        ? TreeSitterHighlightSpans(result.records)
+        : null;
+  }
+
+  /// [reparseAsync] followed by [queryCapturesPacked] on the same native
+  /// thread. Returns null if the reparse did not finish.
+  Future<TreeSitterPackedCaptures?> reparseAndQueryAsync(
+    String source,
+    String? query, {
+    Duration? timeout,
+  }) async {
+    final result = await _reparseAsync(
+      source,
+      query,
+      bindings.TS_ASYNC_RESULT_CAPTURES,
+      timeout,
+    );
+    if (result.status != TreeSitterReparseStatus.ok) return null;
+    final key = query ?? _selectedQuery;
+    if (result.names.isNotEmpty) {
+      _packedQuery = key;
+      _packedCaptureNames = result.names;
+    }
+    return TreeSitterPackedCaptures(
+      result.records,
+      key == _packedQuery ? _packedCaptureNames : result.names,
+    );
+  }
+
+  Future<_AsyncReparseResult> _reparseAsync(
+    String? source,
+    String? query,
+    int resultKind,
+    Duration? timeout,
+  ) async {
+    while (_pendingReparse != null) {
+      await _pendingReparse!.future;
+    }
+
+    final callback = _reparseDone ??=
+        ffi.NativeCallable<bindings.TsDocReparseCallbackFunction>.listener(
+          _onReparseDone,
+        );
+    final requestId = ++_pendingReparseId;
+    final sourcePtr = source?.toNativeUtf8() ?? ffi.nullptr;
+    final queryPtr = query == null ? ffi.nullptr : query.toNativeUtf8();
+    final started = bindings.ts_doc_reparse_async(
+      _doc,
+      sourcePtr.cast<ffi.Char>(),
+      sourcePtr == ffi.nullptr ? 0 : sourcePtr.length,
+      queryPtr.cast<ffi.Char>(),
+      resultKind,
+      timeout?.inMicroseconds ?? 0,
+      requestId,
+      callback.nativeFunction,
+    );
+    if (sourcePtr != ffi.nullptr) {
+      malloc.free(sourcePtr);
+    }
+    if (queryPtr != ffi.nullptr) {
+      malloc.free(queryPtr);
+    }
+    if (!started) {
+      return (
+        status: TreeSitterReparseStatus.failed,
+        records: Uint32List(0),
+        names: const <String>[],
+      );
+    }
+
+    final completer = Completer<_AsyncReparseResult>();
+    _pendingReparse = completer;
+    return completer.future;
+  }
+
+  /// Activates this document in [workspace] (see
+  /// [TreeSitterWorkspace.activate]). A restore parse completes through the
+  /// same port as [reparseAsync], and edits made meanwhile are deferred the
+  /// same way.
+  Future<bool> _activate(ffi.Pointer<ffi.Void> workspace) async {
+    while (_pendingReparse != null) {
+      await _pendingReparse!.future;
+    }
+
+    final callback = _reparseDone ??=
+        ffi.NativeCallable<bindings.TsDocReparseCallbackFunction>.listener(
+          _onReparseDone,
+        );
+    final requestId = ++_pendingReparseId;
+    if (!bindings.ts_workspace_activate(
+      workspace,
+      _doc,
+      requestId,
+      callback.nativeFunction,
+    )) {
+      return false;
+    }
+
+    final completer = Completer<_AsyncReparseResult>();
+    _pendingReparse = completer;
+    final result = await completer.future;
+    return result.status == TreeSitterReparseStatus.ok;
+  }
+
+  void _onReparseDone(ffi.Pointer<ffi.Void> doc, int requestId, int status) {
+    final pending = _pendingReparse;
+    if (pending == null || requestId != _pendingReparseId) return;
+
+    final countPtr = malloc<ffi.Uint32>();
+    final namesPtr = malloc<ffi.Pointer<ffi.Char>>();
+    final recordsPtr = bindings.ts_doc_take_async_result(
+      _doc,
+      requestId,
+      countPtr,
+      namesPtr,
+    );
+    final count = countPtr.value;
+    final names = _takeNewlineDelimited(namesPtr.value);
+    malloc.free(countPtr);
+    malloc.free(namesPtr);
+
+    _pendingReparse = null;
+    for (final edit in _deferredEdits) {
+      edit();
+    }
+    _deferredEdits.clear();
+
+    // Packed captures and highlight spans both use three-word records.
+    pending.complete((
+      status: TreeSitterReparseStatus.fromNative(status),
+      records: _adoptUint32Records(
+        recordsPtr,
+        count,
+        TreeSitterPackedCaptures.recordWords,
+      ),
+      names: names,
+    ));
+  }
+
+  /// The unit of every offset this document reports or accepts in packed
+  /// captures, changed ranges, highlight spans and range queries.
+  ///
+  /// With [TreeSitterOffsetEncoding.utf16] results index straight into the
+  /// Dart string passed to [reparse]; the mapping is kept natively. [edit]
+  /// and [queryCaptures] always use UTF-8 bytes.
+  TreeSitterOffsetEncoding get offsetEncoding => _offsetEncoding;
+
+  set offsetEncoding(TreeSitterOffsetEncoding value) {
+    _checkIdle();
+    bindings.ts_doc_set_offset_encoding(_doc, value.nativeValue);
+    _offsetEncoding = value;
+  }
+
+  /// Converts a UTF-8 byte offset into the last parsed source to a UTF-16
+  /// offset.
+  int byteToUtf16(int byteOffset) {
+    _checkIdle();
+    return bindings.ts_doc_byte_to_utf16(_doc, byteOffset);
+  }
+
+  /// Converts a UTF-16 offset into the last parsed source to a UTF-8 byte
+  /// offset.
+  int utf16ToByte(int utf16Offset) {
+    _checkIdle();
+    return bindings.ts_doc_utf16_to_byte(_doc, utf16Offset);
+  }
+
   void edit({
     required int startByte,
     required int oldEndByte,
@@ -292,6 +1444,22 @@ class TreeSitterDocument {
     required int newEndRow,
     required int newEndCol,
   }) {
+    if (_pendingReparse != null) {
+      _deferredEdits.add(
+        () => edit(
+          startByte: startByte,
+          oldEndByte: oldEndByte,
+          newEndByte: newEndByte,
+          startRow: startRow,
+          startCol: startCol,
+          oldEndRow: oldEndRow,
+          oldEndCol: oldEndCol,
+          newEndRow: newEndRow,
+          newEndCol: newEndCol,
+        ),
+      );
+      return;
+    }
     bindings.ts_doc_edit(
       _doc,
       startByte,
@@ -306,13 +1474,31 @@ class TreeSitterDocument {
     );
   }
 
-  List<TreeSitterCapture> queryCaptures(String query) {
-    final queryPtr = query.toNativeUtf8();
+  /// Makes the built-in [kind] query of this document's language the one
+  /// run when the query methods are passed a null query. The built-in queries
+  /// are compiled once per process, by their first use or by
+  /// [treeSitterWarmUp], and shared by all documents, so no query text
+  /// crosses FFI or is compared per call.
+  void selectQuery(TreeSitterQueryKind kind) {
+    _checkIdle();
+    if (!bindings.ts_doc_select_query(_doc, kind.nativeValue)) {
+      throw StateError('ts_doc_select_query failed');
+    }
+    _selectedQuery = kind;
+  }
+
+  /// Captures of [query] on the current tree, or of the [selectQuery] query
+  /// when [query] is null.
+  List<TreeSitterCapture> queryCaptures(String? query) {
+    _checkIdle();
+    final queryPtr = query?.toNativeUtf8() ?? ffi.nullptr;
     final resultPtr = bindings.ts_doc_query_captures(
       _doc,
       queryPtr.cast<ffi.Char>(),
     );
-    malloc.free(queryPtr);
+    if (queryPtr != ffi.nullptr) {
+      malloc.free(queryPtr);
+    }
 
     if (resultPtr == ffi.nullptr) {
       return const [];
@@ -342,4 +1528,397 @@ class TreeSitterDocument {
 
     return captures;
   }
+
+  /// Packed-record variant of [queryCaptures].
+  ///
+  /// The capture-name table is only fetched from native code when [query]
+  /// differs from the previous packed call.
+  TreeSitterPackedCaptures queryCapturesPacked(String? query) => _queryPacked(
+    query,
+    (queryPtr, countPtr, namesPtr) => bindings.ts_doc_query_captures_packed(
+      _doc,
+      queryPtr,
+      countPtr,
+      namesPtr,
+    ),
+  );
+
+  /// Like [queryCapturesPacked], but only returns captures intersecting
+  /// [startByte, endByte), given in [offsetEncoding] units.
+  TreeSitterPackedCaptures queryCapturesInByteRange(
+    String? query, {
+    required int startByte,
+    required int endByte,
+  }) => _queryPacked(
+    query,
+    (queryPtr, countPtr, namesPtr) => bindings.ts_doc_query_captures_byte_range(
+      _doc,
+      queryPtr,
+      startByte,
+      endByte,
+      countPtr,
+      namesPtr,
+    ),
+  );
+
+  /// Like [queryCapturesPacked], but only returns captures intersecting the
+  /// lines [startRow, endRow), e.g. the visible part of an editor.
+  TreeSitterPackedCaptures queryCapturesInRows(
+    String? query, {
+    required int startRow,
+    required int endRow,
+  }) => _queryPacked(
+    query,
+    (queryPtr, countPtr, namesPtr) => bindings.ts_doc_query_captures_row_range(
+      _doc,
+      queryPtr,
+      startRow,
+      endRow,
+      countPtr,
+      namesPtr,
+    ),
+  );
+
+  /// Flat `(startByte, endByte)` pairs of the ranges that changed with the
+  /// last [reparse], sorted and non-overlapping.
+  Uint32List changedRanges() {
+    _checkIdle();
+    final countPtr = malloc<ffi.Uint32>();
+    final rangesPtr = bindings.ts_doc_changed_ranges(_doc, countPtr);
+    final rangeCount = countPtr.value;
+    malloc.free(countPtr);
+    return _adoptUint32Records(rangesPtr, rangeCount, 2);
+  }
+
+  /// Returns what changed with the last [reparse]: the changed byte ranges
+  /// and the captures of [query] inside them.
+  ///
+  /// Replacing the highlights inside [TreeSitterCaptureDelta.changedRanges]
+  /// (after shifting the rest for the edit) makes them match a full
+  /// [queryCapturesPacked], at a cost proportional to the edit.
+  TreeSitterCaptureDelta queryDelta(String? query) {
+    final ranges = changedRanges();
+    final captures = _queryPacked(
+      query,
+      (queryPtr, countPtr, namesPtr) => bindings.ts_doc_query_captures_changed(
+        _doc,
+        queryPtr,
+        countPtr,
+        namesPtr,
+      ),
+    );
+    return TreeSitterCaptureDelta(ranges, captures);
+  }
+
+  /// Sets the capture-name table used by [highlightSpans].
+  ///
+  /// A capture uses the longest key that equals its name or is a
+  /// dot-separated prefix of it, so `'keyword'` also styles
+  /// `'keyword.control'`. Captures without an entry are not highlighted.
+  void setHighlightStyles(Map<String, TreeSitterHighlightStyle> styles) {
+    _checkIdle();
+    final entries = styles.entries.toList();
+    final namesPtr = entries.map((e) => e.key).join('\n').toNativeUtf8();
+    final prioritiesPtr = malloc<ffi.Uint32>(entries.isEmpty ? 1 : entries.length);
+    final styleIdsPtr = malloc<ffi.Uint32>(entries.isEmpty ? 1 : entries.length);
+    for (var i = 0; i < entries.length; i++) {
+      prioritiesPtr[i] = entries[i].value.priority;
+      styleIdsPtr[i] = entries[i].value.styleId;
+    }
+    final ok = bindings.ts_doc_set_highlight_styles(
+      _doc,
+      namesPtr.cast<ffi.Char>(),
+      prioritiesPtr,
+      styleIdsPtr,
+      entries.length,
+    );
+    malloc.free(namesPtr);
+    malloc.free(prioritiesPtr);
+    malloc.free(styleIdsPtr);
+    if (!ok) {
+      throw StateError('ts_doc_set_highlight_styles failed');
+    }
+  }
+
+  /// Runs [query] and resolves its captures into sorted, non-overlapping
+  /// spans using the table from [setHighlightStyles]: the higher priority
+  /// wins where captures overlap, and adjacent spans with the same style are
+  /// merged.
+  ///
+  /// Only captures intersecting [start, end) (in [offsetEncoding] units) are
+  /// considered; spans may extend past that range.
+  TreeSitterHighlightSpans highlightSpans(
+    String? query, {
+    int start = 0,
+    int end = 0xFFFFFFFF,
+  }) => _highlightSpans(
+    query,
+    (queryPtr, countPtr) => bindings.ts_doc_highlight_spans(
+      _doc,
+      queryPtr,
+      start,
+      end,
+      countPtr,
+    ),
+  );
+
+  /// Like [highlightSpans], for the lines [startRow, endRow).
+  TreeSitterHighlightSpans highlightSpansInRows(
+    String? query, {
+    required int startRow,
+    required int endRow,
+  }) => _highlightSpans(
+    query,
+    (queryPtr, countPtr) => bindings.ts_doc_highlight_spans_rows(
+      _doc,
+      queryPtr,
+      startRow,
+      endRow,
+      countPtr,
+    ),
+  );
+
+  TreeSitterHighlightSpans _highlightSpans(
+    String? query,
+    ffi.Pointer<ffi.Uint32> Function(
+      ffi.Pointer<ffi.Char> queryPtr,
+      ffi.Pointer<ffi.Uint32> countPtr,
+    )
+    run,
+  ) {
+    _checkIdle();
+    final queryPtr = query?.toNativeUtf8() ?? ffi.nullptr;
+    final countPtr = malloc<ffi.Uint32>();
+    final resultPtr = run(queryPtr.cast<ffi.Char>(), countPtr);
+    final count = countPtr.value;
+    if (queryPtr != ffi.nullptr) {
+      malloc.free(queryPtr);
+    }
+    malloc.free(countPtr);
+    return TreeSitterHighlightSpans(
+      _adoptUint32Records(
+        resultPtr,
+        count,
+        TreeSitterHighlightSpans.recordWords,
+      ),
+    );
+  }
+
+  TreeSitterPackedCaptures _queryPacked(
+    String? query,
+    ffi.Pointer<ffi.Uint32> Function(
+      ffi.Pointer<ffi.Char> queryPtr,
+      ffi.Pointer<ffi.Uint32> countPtr,
+      ffi.Pointer<ffi.Pointer<ffi.Char>> namesPtr,
+    )
+    run,
+  ) {
+    _checkIdle();
+    final key = query ?? _selectedQuery;
+    final needNames = key != _packedQuery;
+    final queryPtr = query?.toNativeUtf8() ?? ffi.nullptr;
+    final countPtr = malloc<ffi.Uint32>();
+    final namesPtr = needNames
+        ? malloc<ffi.Pointer<ffi.Char>>()
+        : ffi.nullptr;
+    final resultPtr = run(queryPtr.cast<ffi.Char>(), countPtr, namesPtr);
+    final count = countPtr.value;
+    if (queryPtr != ffi.nullptr) {
+      malloc.free(queryPtr);
+    }
+    malloc.free(countPtr);
+    if (needNames) {
+      final names = _takeNewlineDelimited(namesPtr.value);
+      malloc.free(namesPtr);
+      if (names.isNotEmpty) {
+        _packedQuery = key;
+        _packedCaptureNames = names;
+      }
+    }
+
+    return TreeSitterPackedCaptures(
+      _adoptUint32Records(
+        resultPtr,
+        count,
+        TreeSitterPackedCaptures.recordWords,
+      ),
+      _packedCaptureNames,
+    );
+  }
+}
+
+/// An immutable revision of a [TreeSitterDocument]: its tree and source as of
+/// one reparse. Queries on a snapshot take no lock on the document, so other
+/// isolates can highlight, outline or fold a consistent revision while the
+/// document keeps being edited and reparsed. They still briefly share the
+/// query cache and the allocator's pool with other threads.
+///
+/// To use a snapshot on another isolate, send its [address] and adopt it
+/// there with [TreeSitterSnapshot.retain] before disposing the original.
+class TreeSitterSnapshot {
+  final ffi.Pointer<ffi.Void> _snapshot;
+
+  TreeSitterSnapshot._(this._snapshot);
+
+  /// Takes a new reference to the snapshot at [address], as sent by another
+  /// isolate that still holds its own.
+  factory TreeSitterSnapshot.retain(int address) {
+    final snapshot = ffi.Pointer<ffi.Void>.fromAddress(address);
+    bindings.ts_snapshot_retain(snapshot);
+    return TreeSitterSnapshot._(snapshot);
+  }
+
+  int get address => _snapshot.address;
+
+  /// Successful reparses of the document before this snapshot; later
+  /// snapshots have higher revisions.
+  int get revision => bindings.ts_snapshot_revision(_snapshot);
+
+  /// Packed captures of [query] intersecting the lines [startRow, endRow),
+  /// or of the document's [TreeSitterDocument.selectQuery] query when
+  /// [query] is null. Offsets are in the document's offset encoding as of the
+  /// snapshot.
+  TreeSitterPackedCaptures queryCaptures(
+    String? query, {
+    int startRow = 0,
+    int endRow = 0xFFFFFFFF,
+  }) {
+    final queryPtr = query?.toNativeUtf8() ?? ffi.nullptr;
+    final countPtr = malloc<ffi.Uint32>();
+    final namesPtr = malloc<ffi.Pointer<ffi.Char>>();
+    final resultPtr = bindings.ts_snapshot_query_captures(
+      _snapshot,
+      queryPtr.cast<ffi.Char>(),
+      startRow,
+      endRow,
+      countPtr,
+      namesPtr,
+    );
+    final count = countPtr.value;
+    final names = _takeNewlineDelimited(namesPtr.value);
+    if (queryPtr != ffi.nullptr) {
+      malloc.free(queryPtr);
+    }
+    malloc.free(countPtr);
+    malloc.free(namesPtr);
+    return TreeSitterPackedCaptures(
+      _adoptUint32Records(
+        resultPtr,
+        count,
+        TreeSitterPackedCaptures.recordWords,
+      ),
+      names,
+    );
+  }
+
+  void dispose() => bindings.ts_snapshot_release(_snapshot);
+}
+
+/// Counters of a [TreeSitterWorkspace].
+class TreeSitterWorkspaceStats {
+  final int documentCount;
+
+  /// Documents that have a tree, or have not been parsed yet.
+  final int residentCount;
+
+  /// Native bytes held by all documents, evicted ones included.
+  final int memoryBytes;
+  final int memoryBudgetBytes;
+
+  /// Documents evicted, and evicted documents whose parse was started by
+  /// [TreeSitterWorkspace.activate].
+  final int evictions;
+  final int restores;
+
+  const TreeSitterWorkspaceStats({
+    required this.documentCount,
+    required this.residentCount,
+    required this.memoryBytes,
+    required this.memoryBudgetBytes,
+    required this.evictions,
+    required this.restores,
+  });
+}
+
+/// Owns the documents of an editor session, e.g. one per tab, and keeps
+/// their native memory under a budget.
+///
+/// [activate] a document whenever it is shown. When the documents exceed the
+/// budget, the least recently activated ones drop their tree and parser and
+/// keep only their text; activating one parses it again, so memory does not
+/// grow with the number of tabs opened. Text queries of the documents are
+/// shared through a process-wide cache of recently used queries.
+class TreeSitterWorkspace {
+  static const int defaultMemoryBudgetBytes = 128 * 1024 * 1024;
+
+  final ffi.Pointer<ffi.Void> _workspace;
+  final Set<TreeSitterDocument> _documents = {};
+
+  TreeSitterWorkspace._(this._workspace);
+
+  factory TreeSitterWorkspace({
+    int memoryBudgetBytes = defaultMemoryBudgetBytes,
+  }) {
+    final workspace = bindings.ts_workspace_new(memoryBudgetBytes);
+    if (workspace == ffi.nullptr) {
+      throw StateError('ts_workspace_new returned nullptr');
+    }
+    return TreeSitterWorkspace._(workspace);
+  }
+
+  /// Creates a document owned by this workspace, as the most recently
+  /// activated one. [TreeSitterDocument.dispose] closes it.
+  TreeSitterDocument open({required TreeSitterLanguage language}) {
+    final doc = bindings.ts_workspace_open(_workspace, language.index);
+    if (doc == ffi.nullptr) {
+      throw StateError('ts_workspace_open failed');
+    }
+    final document = TreeSitterDocument._(language, doc).._workspace = this;
+    _documents.add(document);
+    return document;
+  }
+
+  /// Marks [document] as the most recently used one and evicts other
+  /// documents down to the budget. If [document] was evicted it is parsed
+  /// again on its native worker thread, and the future completes once it has
+  /// its tree back; until then it is busy as during
+  /// [TreeSitterDocument.reparseAsync].
+  ///
+  /// An evicted document edited since its eviction is not parsed here; its
+  /// next reparse is a full parse. Completes with false if parsing it again
+  /// failed.
+  Future<bool> activate(TreeSitterDocument document) {
+    if (document._workspace != this) {
+      throw ArgumentError.value(document, 'document', 'not open in this workspace');
+    }
+    return document._activate(_workspace);
+  }
+
+  /// Changes the budget, evicting documents to meet it.
+  set memoryBudgetBytes(int bytes) =>
+      bindings.ts_workspace_set_memory_budget(_workspace, bytes);
+
+  TreeSitterWorkspaceStats get stats {
+    final statsPtr = malloc<bindings.TsWorkspaceStats>();
+    bindings.ts_workspace_stats(_workspace, statsPtr);
+    final native = statsPtr.ref;
+    final stats = TreeSitterWorkspaceStats(
+      documentCount: native.document_count,
+      residentCount: native.resident_count,
+      memoryBytes: native.memory_bytes,
+      memoryBudgetBytes: native.memory_budget_bytes,
+      evictions: native.evictions,
+      restores: native.restores,
+    );
+    malloc.free(statsPtr);
+    return stats;
+  }
+
+  /// Disposes every document still open, then the workspace.
+  void dispose() {
+    for (final document in _documents.toList()) {
+      document.dispose();
+    }
+    bindings.ts_workspace_delete(_workspace);
+  }
 }
@@ -48,6 +48,47 @@ external ffi.Pointer<ffi.Char> ts_tokens(
   int language,
 );
 
+/// Returns the tokens of [ts_tokens] as packed binary records instead of text:
+/// an array of `*out_count` records, four uint32 words each:
+/// <start_byte> <end_byte> <symbol> <named:0|1>
+/// in document order. `symbol` indexes the table of
+/// [ts_language_symbol_names], which callers only need to fetch once per
+/// language.
+///
+/// The returned array is heap-allocated; release it by calling [ts_free].
+/// Returns NULL (and sets `*out_count` to 0) on failure or for an empty tree.
+@ffi.Native<
+  ffi.Pointer<ffi.Uint32> Function(
+    ffi.Pointer<ffi.Char>,
+    ffi.Int32,
+    ffi.Pointer<ffi.Uint32>,
+  )
+>()
+external ffi.Pointer<ffi.Uint32> ts_tokens_packed(
+  ffi.Pointer<ffi.Char> utf8_source,
+  int language,
+  ffi.Pointer<ffi.Uint32> out_count,
+);
+
+/// Returns the node type name of every symbol of [language], indexed by symbol
+/// id, as `*out_count` NUL-terminated strings laid end to end (`*out_length`
+/// bytes in all). Names are NUL- rather than newline-separated because some
+/// anonymous tokens are a literal newline.
+///
+/// The returned buffer is heap-allocated; release it by calling [ts_free].
+@ffi.Native<
+  ffi.Pointer<ffi.Char> Function(
+    ffi.Int32,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Uint32>,
+  )
+>()
+external ffi.Pointer<ffi.Char> ts_language_symbol_names(
+  int language,
+  ffi.Pointer<ffi.Uint32> out_count,
+  ffi.Pointer<ffi.Uint32> out_length,
+);
+
 /// Runs a tree-sitter query and returns newline-delimited captures.
 ///
 /// Each line is:
@@ -67,10 +108,210 @@ external ffi.Pointer<ffi.Char> ts_query_captures(
   ffi.Pointer<ffi.Char> utf8_query,
 );
 
+/// Runs a tree-sitter query and returns captures as packed binary records
+/// instead of text.
+///
+/// The result is an array of `*out_count` records, three uint32 words each:
+/// <start_byte> <end_byte> <capture_id>
+/// sorted by start byte (longest capture first on ties). `capture_id` indexes
+/// the query's capture-name table.
+///
+/// If [out_capture_names] is non-NULL it receives the capture-name table as a
+/// newline-delimited string, one name per capture id; release it with
+/// [ts_free]. Callers only need to fetch it once per query.
+///
+/// The returned array is heap-allocated; release it by calling [ts_free].
+/// Returns NULL (and sets `*out_count` to 0) on failure or if nothing matched.
+@ffi.Native<
+  ffi.Pointer<ffi.Uint32> Function(
+    ffi.Pointer<ffi.Char>,
+    ffi.Int32,
+    ffi.Pointer<ffi.Char>,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+  )
+>()
+external ffi.Pointer<ffi.Uint32> ts_query_captures_packed(
+  ffi.Pointer<ffi.Char> utf8_source,
+  int language,
+  ffi.Pointer<ffi.Char> utf8_query,
+  ffi.Pointer<ffi.Uint32> out_count,
+  ffi.Pointer<ffi.Pointer<ffi.Char>> out_capture_names,
+);
+
+/// Batch variants of [ts_tokens], [ts_tokens_packed] and
+/// [ts_query_captures_packed]: item `i` is `utf8_sources[i]` in language
+/// `languages[i]`, `lengths[i]` bytes long (or NUL-terminated when [lengths]
+/// is NULL). Items are spread over [thread_count] native threads, or one per
+/// core when [thread_count] <= 0, and the call returns once every item is
+/// done. Run it off the UI isolate.
+///
+/// Item `i`'s result goes to `out_results[i]` (NULL on failure). The packed
+/// variants also write its record count to `out_counts[i]` and the capture
+/// variant, if [out_capture_names] is non-NULL, its capture-name table to
+/// `out_capture_names[i]`. Release every non-NULL entry with [ts_free].
+@ffi.Native<
+  ffi.Void Function(
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Int32>,
+    ffi.Uint32,
+    ffi.Int32,
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+  )
+>()
+external void ts_batch_tokens(
+  ffi.Pointer<ffi.Pointer<ffi.Char>> utf8_sources,
+  ffi.Pointer<ffi.Uint32> lengths,
+  ffi.Pointer<ffi.Int32> languages,
+  int item_count,
+  int thread_count,
+  ffi.Pointer<ffi.Pointer<ffi.Char>> out_results,
+);
+
+@ffi.Native<
+  ffi.Void Function(
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Int32>,
+    ffi.Uint32,
+    ffi.Int32,
+    ffi.Pointer<ffi.Pointer<ffi.Uint32>>,
+    ffi.Pointer<ffi.Uint32>,
+  )
+>()
+external void ts_batch_tokens_packed(
+  ffi.Pointer<ffi.Pointer<ffi.Char>> utf8_sources,
+  ffi.Pointer<ffi.Uint32> lengths,
+  ffi.Pointer<ffi.Int32> languages,
+  int item_count,
+  int thread_count,
+  ffi.Pointer<ffi.Pointer<ffi.Uint32>> out_results,
+  ffi.Pointer<ffi.Uint32> out_counts,
+);
+
+/// `utf8_queries[i]` is the query run on item `i`. Items sharing a query may
+/// share the pointer; it is compiled once per language either way.
+@ffi.Native<
+  ffi.Void Function(
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Int32>,
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+    ffi.Uint32,
+    ffi.Int32,
+    ffi.Pointer<ffi.Pointer<ffi.Uint32>>,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+  )
+>()
+external void ts_batch_query_captures_packed(
+  ffi.Pointer<ffi.Pointer<ffi.Char>> utf8_sources,
+  ffi.Pointer<ffi.Uint32> lengths,
+  ffi.Pointer<ffi.Int32> languages,
+  ffi.Pointer<ffi.Pointer<ffi.Char>> utf8_queries,
+  int item_count,
+  int thread_count,
+  ffi.Pointer<ffi.Pointer<ffi.Uint32>> out_results,
+  ffi.Pointer<ffi.Uint32> out_counts,
+  ffi.Pointer<ffi.Pointer<ffi.Char>> out_capture_names,
+);
+
+/// Streaming variants of [ts_tokens_packed] and [ts_query_captures_packed]
+/// for sources whose full result would not fit comfortably in memory. The
+/// source is parsed when the stream is created and need not outlive the call;
+/// records are then pulled in caller-sized batches with
+/// [ts_stream_next_batch], so only the tree and one batch are held at a time.
+///
+/// Token streams yield the four-word records of [ts_tokens_packed] in the
+/// same order. Capture streams yield the three-word records of
+/// [ts_query_captures_packed] in the order the query cursor reports them
+/// (by start byte), without the longest-first tie-break, since that would
+/// need the whole result. [out_capture_names] is as in
+/// [ts_query_captures_packed].
+///
+/// Returns NULL on failure. Release the stream with [ts_stream_delete].
+@ffi.Native<
+  ffi.Pointer<ffi.Void> Function(ffi.Pointer<ffi.Char>, ffi.Uint32, ffi.Int32)
+>()
+external ffi.Pointer<ffi.Void> ts_stream_tokens_new(
+  ffi.Pointer<ffi.Char> utf8_source,
+  int length,
+  int language,
+);
+
+@ffi.Native<
+  ffi.Pointer<ffi.Void> Function(
+    ffi.Pointer<ffi.Char>,
+    ffi.Uint32,
+    ffi.Int32,
+    ffi.Pointer<ffi.Char>,
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+  )
+>()
+external ffi.Pointer<ffi.Void> ts_stream_captures_new(
+  ffi.Pointer<ffi.Char> utf8_source,
+  int length,
+  int language,
+  ffi.Pointer<ffi.Char> utf8_query,
+  ffi.Pointer<ffi.Pointer<ffi.Char>> out_capture_names,
+);
+
+/// Writes up to [max_records] records to [out_records], which must hold
+/// `max_records` times the stream's record size in uint32 words, and returns
+/// how many were written. Returns 0 once the stream is exhausted.
+@ffi.Native<
+  ffi.Uint32 Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Uint32,
+  )
+>()
+external int ts_stream_next_batch(
+  ffi.Pointer<ffi.Void> stream,
+  ffi.Pointer<ffi.Uint32> out_records,
+  int max_records,
+);
+
+/// Releases a stream created by [ts_stream_tokens_new] or
+/// [ts_stream_captures_new]. Safe to call before it is exhausted.
+@ffi.Native<ffi.Void Function(ffi.Pointer<ffi.Void>)>()
+external void ts_stream_delete(ffi.Pointer<ffi.Void> stream);
+
 /// Frees memory returned by this library (e.g. [ts_parse_sexp]).
 @ffi.Native<ffi.Void Function(ffi.Pointer<ffi.Void>)>()
 external void ts_free(ffi.Pointer<ffi.Void> ptr);
 
+/// Every allocation of the library and of tree-sitter goes through a tracked
+/// allocator. [out_shared_bytes] receives the bytes not charged to any
+/// document (pooled parsers, cached queries, results not yet released with
+/// [ts_free]) and [out_pooled_bytes] the freed small blocks kept for reuse.
+/// Either may be NULL. Each thread tallies its shared bytes and keeps up to
+/// 16 KiB of freed blocks per size class before handing them over in a batch,
+/// so both figures can lag behind other threads by that much.
+@ffi.Native<
+  ffi.Void Function(ffi.Pointer<ffi.Uint64>, ffi.Pointer<ffi.Uint64>)
+>()
+external void ts_memory_usage(
+  ffi.Pointer<ffi.Uint64> out_shared_bytes,
+  ffi.Pointer<ffi.Uint64> out_pooled_bytes,
+);
+
+/// Returns the freed blocks kept for reuse, by the shared pools and by the
+/// calling thread, to the system allocator.
+@ffi.Native<ffi.Void Function()>()
+external void ts_memory_trim();
+
+/// Compiles the built-in queries of every language (see [ts_doc_select_query])
+/// and puts [parsers_per_language] parsers (at most the pool size) in the
+/// parser pool, on a new background thread. From Dart, pass a
+/// NativeCallable.listener as [on_complete] (or NULL) to learn when it is done.
+///
+/// Returns false if the thread could not be started; [on_complete] is then
+/// never called.
+@ffi.Native<ffi.Bool Function(ffi.Uint32, TsWarmUpCallback)>()
+external bool ts_warm_up(int parsers_per_language, TsWarmUpCallback on_complete);
+
 /// --- tree-sitter incremental document API -----------------------------------
 @ffi.Native<ffi.Pointer<ffi.Void> Function(ffi.Int32)>()
 external ffi.Pointer<ffi.Void> ts_doc_new(int language);
@@ -105,9 +346,181 @@ external void ts_doc_edit(
   int newEndCol,
 );
 
+/// Replaces the text the document tracks with [utf8_text] ([length] bytes) and
+/// writes the edit between the two to [out_edit] as TS_TEXT_EDIT_WORDS words:
+/// <start_byte> <old_end_byte> <new_end_byte>
+/// <start_row> <start_col> <old_end_row> <old_end_col>
+/// <new_end_row> <new_end_col>
+/// <start_utf16> <old_end_utf16> <new_end_utf16>
+/// The first nine are the arguments of [ts_doc_edit]; columns are in bytes.
+/// Finding the edit compares the texts a word at a time; rows come from a line
+/// index updated in place rather than from rescanning the text.
+///
+/// The syntax tree is not touched: pass the edit to [ts_doc_edit], then reparse
+/// with a NULL source to parse the tracked text. May be called while
+/// [ts_doc_reparse_async] is pending. Returns false on allocation failure.
+@ffi.Native<
+  ffi.Bool Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Char>,
+    ffi.Uint32,
+    ffi.Pointer<ffi.Uint32>,
+  )
+>()
+external bool ts_doc_set_text(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Char> utf8_text,
+  int length,
+  ffi.Pointer<ffi.Uint32> out_edit,
+);
+
+/// Replaces [start, end) of the tracked text with [utf8_replacement] ([length]
+/// bytes) and writes the edit to [out_edit] as [ts_doc_set_text] does.
+/// [start] and [end] are in the document's offset encoding and are moved to
+/// code point boundaries. The text is kept in chunks of up to 16 KiB, so only
+/// the replacement crosses the FFI boundary and an edit rewrites the chunks it
+/// touches rather than the document.
+@ffi.Native<
+  ffi.Bool Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Uint32,
+    ffi.Uint32,
+    ffi.Pointer<ffi.Char>,
+    ffi.Uint32,
+    ffi.Pointer<ffi.Uint32>,
+  )
+>()
+external bool ts_doc_replace_text(
+  ffi.Pointer<ffi.Void> doc,
+  int start,
+  int end,
+  ffi.Pointer<ffi.Char> utf8_replacement,
+  int length,
+  ffi.Pointer<ffi.Uint32> out_edit,
+);
+
+/// Copies [start, end) of the tracked text (offsets in the document's offset
+/// encoding) into a NUL-terminated UTF-8 string of [out_length] bytes. Free it
+/// with [ts_free].
+@ffi.Native<
+  ffi.Pointer<ffi.Char> Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Uint32,
+    ffi.Uint32,
+    ffi.Pointer<ffi.Uint32>,
+  )
+>()
+external ffi.Pointer<ffi.Char> ts_doc_text_range(
+  ffi.Pointer<ffi.Void> doc,
+  int start,
+  int end,
+  ffi.Pointer<ffi.Uint32> out_length,
+);
+
+/// Maps the file at [utf8_path] read-only and makes it the tracked text,
+/// dropping the current tree so the next reparse with a NULL source parses the
+/// file from scratch. Parsing reads the mapping in place; an edit copies only
+/// the chunks of it that it changes, and the file is unmapped once no revision
+/// of the text reads it. The file must not be truncated while it is mapped.
+///
+/// Returns false if the file can't be mapped or is 4 GB or larger. Must not be
+/// called while [ts_doc_reparse_async] is pending.
+@ffi.Native<ffi.Bool Function(ffi.Pointer<ffi.Void>, ffi.Pointer<ffi.Char>)>()
+external bool ts_doc_open_file(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Char> utf8_path,
+);
+
 @ffi.Native<ffi.Uint8 Function(ffi.Pointer<ffi.Void>, ffi.Pointer<ffi.Char>)>()
 external int ts_doc_reparse(ffi.Pointer<ffi.Void> doc, ffi.Pointer<ffi.Char> utf8Source);
 
+/// Like [ts_doc_reparse], but parses the tracked text (see [ts_doc_set_text])
+/// in place when [utf8_source] is NULL, and gives up after [timeout_micros] (0 = no limit) or
+/// once [ts_doc_cancel_reparse] is called, returning TS_REPARSE_TIMED_OUT or
+/// TS_REPARSE_CANCELLED. The document keeps its previous (edited) tree, so
+/// the next reparse is still incremental; reparsing the same source resumes
+/// where the halted parse stopped, unless the tracked text changed or
+/// [ts_doc_edit] was called in between.
+@ffi.Native<
+  ffi.Int32 Function(ffi.Pointer<ffi.Void>, ffi.Pointer<ffi.Char>, ffi.Uint64)
+>()
+external int ts_doc_reparse_with_budget(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Char> utf8_source,
+  int timeout_micros,
+);
+
+/// Asks the reparse running on [doc] (or the pending [ts_doc_reparse_async]
+/// request) to stop. Safe to call from any thread. Has no effect on reparses
+/// requested later.
+@ffi.Native<ffi.Void Function(ffi.Pointer<ffi.Void>)>()
+external void ts_doc_cancel_reparse(ffi.Pointer<ffi.Void> doc);
+
+/// Starts [ts_doc_reparse_with_budget] of [utf8_source] ([length] bytes, copied
+/// before returning; NULL for the tracked text) on a background thread owned by
+/// the document, optionally followed by [utf8_query] producing [result_kind]:
+/// TS_ASYNC_RESULT_CAPTURES        - as [ts_doc_query_captures_packed]
+/// TS_ASYNC_RESULT_HIGHLIGHT_SPANS - as [ts_doc_highlight_spans] over the
+/// whole document
+/// [on_complete] then receives [request_id]; fetch the result with
+/// [ts_doc_take_async_result].
+///
+/// Only one request runs at a time: returns false if one is still pending (or
+/// on failure). Until [on_complete] runs, only [ts_doc_set_text],
+/// [ts_doc_replace_text], [ts_doc_cancel_reparse], [ts_doc_take_async_result]
+/// and [ts_doc_delete] may be called on the document. [ts_doc_delete] waits for a
+/// running request to finish first.
+@ffi.Native<
+  ffi.Bool Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Char>,
+    ffi.Uint32,
+    ffi.Pointer<ffi.Char>,
+    ffi.Int32,
+    ffi.Uint64,
+    ffi.Int64,
+    TsDocReparseCallback,
+  )
+>()
+external bool ts_doc_reparse_async(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Char> utf8_source,
+  int length,
+  ffi.Pointer<ffi.Char> utf8_query,
+  int result_kind,
+  int timeout_micros,
+  int request_id,
+  TsDocReparseCallback on_complete,
+);
+
+/// Hands over the result of the finished [ts_doc_reparse_async] with
+/// [request_id]: `*out_count` records (and, for captures, the capture-name
+/// table in [out_capture_names] if non-NULL). Returns NULL if there is none or
+/// it was already taken.
+///
+/// Returned array is heap-allocated; free with ts_free.
+@ffi.Native<
+  ffi.Pointer<ffi.Uint32> Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Int64,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+  )
+>()
+external ffi.Pointer<ffi.Uint32> ts_doc_take_async_result(
+  ffi.Pointer<ffi.Void> doc,
+  int request_id,
+  ffi.Pointer<ffi.Uint32> out_count,
+  ffi.Pointer<ffi.Pointer<ffi.Char>> out_capture_names,
+);
+
+/// Selects the built-in query of [kind] (a TS_QUERY_KIND_* value) for the
+/// document's language. The query functions below then run it when passed a
+/// NULL [utf8_query]. It is compiled by its first use or by [ts_warm_up].
+/// Returns false for an unknown [kind].
+@ffi.Native<ffi.Bool Function(ffi.Pointer<ffi.Void>, ffi.Int32)>()
+external bool ts_doc_select_query(ffi.Pointer<ffi.Void> doc, int kind);
+
 @ffi.Native<
   ffi.Pointer<ffi.Char> Function(ffi.Pointer<ffi.Void>, ffi.Pointer<ffi.Char>)
 >()
@@ -115,3 +528,448 @@ external ffi.Pointer<ffi.Char> ts_doc_query_captures(
   ffi.Pointer<ffi.Void> doc,
   ffi.Pointer<ffi.Char> utf8Query,
 );
+
+/// Packed-record variant of [ts_doc_query_captures]. See
+/// [ts_query_captures_packed] for the record layout and [out_capture_names].
+///
+/// Returned array is heap-allocated; free with ts_free.
+@ffi.Native<
+  ffi.Pointer<ffi.Uint32> Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Char>,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+  )
+>()
+external ffi.Pointer<ffi.Uint32> ts_doc_query_captures_packed(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Char> utf8_query,
+  ffi.Pointer<ffi.Uint32> out_count,
+  ffi.Pointer<ffi.Pointer<ffi.Char>> out_capture_names,
+);
+
+/// Like [ts_doc_query_captures_packed], but only returns captures that
+/// intersect the byte range [start_byte, end_byte). Use this to highlight the
+/// visible part of a large document first.
+///
+/// Returned array is heap-allocated; free with ts_free.
+@ffi.Native<
+  ffi.Pointer<ffi.Uint32> Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Char>,
+    ffi.Uint32,
+    ffi.Uint32,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+  )
+>()
+external ffi.Pointer<ffi.Uint32> ts_doc_query_captures_byte_range(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Char> utf8_query,
+  int start_byte,
+  int end_byte,
+  ffi.Pointer<ffi.Uint32> out_count,
+  ffi.Pointer<ffi.Pointer<ffi.Char>> out_capture_names,
+);
+
+/// Like [ts_doc_query_captures_byte_range], but the range is given as rows:
+/// captures intersecting lines [start_row, end_row) are returned.
+///
+/// Returned array is heap-allocated; free with ts_free.
+@ffi.Native<
+  ffi.Pointer<ffi.Uint32> Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Char>,
+    ffi.Uint32,
+    ffi.Uint32,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+  )
+>()
+external ffi.Pointer<ffi.Uint32> ts_doc_query_captures_row_range(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Char> utf8_query,
+  int start_row,
+  int end_row,
+  ffi.Pointer<ffi.Uint32> out_count,
+  ffi.Pointer<ffi.Pointer<ffi.Char>> out_capture_names,
+);
+
+/// Returns the byte ranges that changed with the last successful
+/// [ts_doc_reparse], as `*out_count` pairs of uint32 words:
+/// <start_byte> <end_byte>
+/// sorted and non-overlapping. This is the union of the ranges whose syntax
+/// tree changed and the text touched by [ts_doc_edit] since the reparse
+/// before it (widened by one byte on each side). After the first parse the
+/// whole document is one range.
+///
+/// Returned array is heap-allocated; free with ts_free. Returns NULL if
+/// nothing changed.
+@ffi.Native<
+  ffi.Pointer<ffi.Uint32> Function(ffi.Pointer<ffi.Void>, ffi.Pointer<ffi.Uint32>)
+>()
+external ffi.Pointer<ffi.Uint32> ts_doc_changed_ranges(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Uint32> out_count,
+);
+
+/// Returns the packed captures (see [ts_query_captures_packed]) intersecting
+/// [ts_doc_changed_ranges]. Replacing the highlights inside those ranges with
+/// these captures brings a highlighter up to date with the last reparse.
+///
+/// Returned array is heap-allocated; free with ts_free.
+@ffi.Native<
+  ffi.Pointer<ffi.Uint32> Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Char>,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+  )
+>()
+external ffi.Pointer<ffi.Uint32> ts_doc_query_captures_changed(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Char> utf8_query,
+  ffi.Pointer<ffi.Uint32> out_count,
+  ffi.Pointer<ffi.Pointer<ffi.Char>> out_capture_names,
+);
+
+/// Sets the highlight table used by [ts_doc_highlight_spans]: entry i maps the
+/// capture name on line i of the newline-delimited [utf8_names] to
+/// ([priorities][i], [style_ids][i]). A capture uses the longest entry that
+/// equals its name or is a dot-separated prefix of it, so "keyword" also
+/// styles "keyword.control". Captures without an entry are not highlighted.
+///
+/// Call once per document; [count] == 0 clears the table. Returns false on
+/// allocation failure.
+@ffi.Native<
+  ffi.Bool Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Char>,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Uint32,
+  )
+>()
+external bool ts_doc_set_highlight_styles(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Char> utf8_names,
+  ffi.Pointer<ffi.Uint32> priorities,
+  ffi.Pointer<ffi.Uint32> style_ids,
+  int count,
+);
+
+/// Resolves the captures of [utf8_query] intersecting [start_byte, end_byte)
+/// into highlight spans, as `*out_count` records of three uint32 words:
+/// <start_byte> <end_byte> <style_id>
+/// Spans are sorted, non-overlapping and adjacent spans with the same style
+/// are merged. Where captures overlap, the higher priority wins, then the
+/// earlier start, then the longer capture. Spans may extend past the range.
+///
+/// Pass 0 and UINT32_MAX to highlight the whole document.
+///
+/// Returned array is heap-allocated; free with ts_free.
+@ffi.Native<
+  ffi.Pointer<ffi.Uint32> Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Char>,
+    ffi.Uint32,
+    ffi.Uint32,
+    ffi.Pointer<ffi.Uint32>,
+  )
+>()
+external ffi.Pointer<ffi.Uint32> ts_doc_highlight_spans(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Char> utf8_query,
+  int start_byte,
+  int end_byte,
+  ffi.Pointer<ffi.Uint32> out_count,
+);
+
+/// Like [ts_doc_highlight_spans], for the lines [start_row, end_row).
+///
+/// Returned array is heap-allocated; free with ts_free.
+@ffi.Native<
+  ffi.Pointer<ffi.Uint32> Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Char>,
+    ffi.Uint32,
+    ffi.Uint32,
+    ffi.Pointer<ffi.Uint32>,
+  )
+>()
+external ffi.Pointer<ffi.Uint32> ts_doc_highlight_spans_rows(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<ffi.Char> utf8_query,
+  int start_row,
+  int end_row,
+  ffi.Pointer<ffi.Uint32> out_count,
+);
+
+/// Selects the unit of the offsets a document reports and accepts: packed
+/// captures, changed ranges, highlight spans and the byte-range arguments of
+/// the range queries. UTF-16 code units match Dart string indices, so callers
+/// need no byte/UTF-16 table of their own. [ts_doc_edit] and the text-based
+/// [ts_doc_query_captures] always use UTF-8 bytes.
+///
+/// Returns false for an unknown [encoding].
+@ffi.Native<ffi.Bool Function(ffi.Pointer<ffi.Void>, ffi.Int32)>()
+external bool ts_doc_set_offset_encoding(ffi.Pointer<ffi.Void> doc, int encoding);
+
+/// Converts a UTF-8 byte offset into the source of the last successful
+/// [ts_doc_reparse] to a UTF-16 offset. Offsets past the end are clamped.
+@ffi.Native<ffi.Uint32 Function(ffi.Pointer<ffi.Void>, ffi.Uint32)>()
+external int ts_doc_byte_to_utf16(ffi.Pointer<ffi.Void> doc, int byte_offset);
+
+/// Converts a UTF-16 offset into the source of the last successful
+/// [ts_doc_reparse] to a UTF-8 byte offset. An offset inside a surrogate pair
+/// maps to the end of that code point.
+@ffi.Native<ffi.Uint32 Function(ffi.Pointer<ffi.Void>, ffi.Uint32)>()
+external int ts_doc_utf16_to_byte(ffi.Pointer<ffi.Void> doc, int utf16_offset);
+
+/// Bytes currently charged to [doc]: its parser, trees, source copies,
+/// tracked text, line index, query and highlight tables, rounded up to the
+/// allocator's size classes. Results returned to the caller are charged to the
+/// shared account instead (see [ts_memory_usage]). Safe to call from any
+/// thread while the document is alive.
+@ffi.Native<ffi.Uint64 Function(ffi.Pointer<ffi.Void>)>()
+external int ts_doc_memory_usage(ffi.Pointer<ffi.Void> doc);
+
+/// Counters of a document's recent work, see [ts_doc_stats]. Times are in
+/// microseconds; the rolling ones average roughly the last eight samples.
+final class TsDocStats extends ffi.Struct {
+  /// Completed reparses. Halted (timed out or cancelled) ones don't count.
+  @ffi.Uint64()
+  external int parse_count;
+
+  @ffi.Uint64()
+  external int last_parse_micros;
+
+  @ffi.Uint64()
+  external int rolling_parse_micros;
+
+  /// Packed capture queries and highlight span requests.
+  @ffi.Uint64()
+  external int query_count;
+
+  @ffi.Uint64()
+  external int last_query_micros;
+
+  @ffi.Uint64()
+  external int rolling_query_micros;
+
+  /// Time spent turning captures into the returned records; not part of the
+  /// query times.
+  @ffi.Uint64()
+  external int last_serialize_micros;
+
+  @ffi.Uint64()
+  external int rolling_serialize_micros;
+
+  /// Shape of the current tree. Nodes touching a range the last reparse
+  /// changed count as recreated, the rest as reused from the previous tree.
+  @ffi.Uint64()
+  external int node_count;
+
+  @ffi.Uint64()
+  external int reused_nodes;
+
+  @ffi.Uint64()
+  external int recreated_nodes;
+
+  @ffi.Uint64()
+  external int source_bytes;
+
+  /// As [ts_doc_memory_usage].
+  @ffi.Uint64()
+  external int memory_bytes;
+}
+
+/// Copies the counters of [doc] to [out_stats]. Safe to call from any thread,
+/// including while an asynchronous reparse runs. Returns false on NULL
+/// arguments.
+@ffi.Native<ffi.Bool Function(ffi.Pointer<ffi.Void>, ffi.Pointer<TsDocStats>)>()
+external bool ts_doc_stats(
+  ffi.Pointer<ffi.Void> doc,
+  ffi.Pointer<TsDocStats> out_stats,
+);
+
+/// --- document snapshots ------------------------------------------------------
+///
+/// Makes every successful reparse of [doc] publish an immutable snapshot of
+/// the new tree, and publishes the current one (if any) right away. Must be
+/// called while no [ts_doc_reparse_async] is pending. Returns false on a NULL
+/// [doc].
+@ffi.Native<ffi.Bool Function(ffi.Pointer<ffi.Void>)>()
+external bool ts_doc_enable_snapshots(ffi.Pointer<ffi.Void> doc);
+
+/// Retains the latest published snapshot of [doc] and returns it, or NULL if
+/// none was published yet. Safe to call from any thread. Release it with
+/// [ts_snapshot_release].
+@ffi.Native<ffi.Pointer<ffi.Void> Function(ffi.Pointer<ffi.Void>)>()
+external ffi.Pointer<ffi.Void> ts_doc_snapshot(ffi.Pointer<ffi.Void> doc);
+
+/// Adds a reference to [snapshot], e.g. before handing it to another thread.
+@ffi.Native<ffi.Void Function(ffi.Pointer<ffi.Void>)>()
+external void ts_snapshot_retain(ffi.Pointer<ffi.Void> snapshot);
+
+/// Drops a reference to [snapshot]; the last one frees it.
+@ffi.Native<ffi.Void Function(ffi.Pointer<ffi.Void>)>()
+external void ts_snapshot_release(ffi.Pointer<ffi.Void> snapshot);
+
+/// Number of successful reparses of the document before [snapshot] was
+/// published. -1 for NULL.
+@ffi.Native<ffi.Int64 Function(ffi.Pointer<ffi.Void>)>()
+external int ts_snapshot_revision(ffi.Pointer<ffi.Void> snapshot);
+
+/// Packed captures of [utf8_query] on [snapshot] intersecting lines
+/// [start_row, end_row). A NULL [utf8_query] runs the built-in query the
+/// document had selected. Takes no lock on the document.
+///
+/// Returned array is heap-allocated; free with ts_free.
+@ffi.Native<
+  ffi.Pointer<ffi.Uint32> Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Char>,
+    ffi.Uint32,
+    ffi.Uint32,
+    ffi.Pointer<ffi.Uint32>,
+    ffi.Pointer<ffi.Pointer<ffi.Char>>,
+  )
+>()
+external ffi.Pointer<ffi.Uint32> ts_snapshot_query_captures(
+  ffi.Pointer<ffi.Void> snapshot,
+  ffi.Pointer<ffi.Char> utf8_query,
+  int start_row,
+  int end_row,
+  ffi.Pointer<ffi.Uint32> out_count,
+  ffi.Pointer<ffi.Pointer<ffi.Char>> out_capture_names,
+);
+
+/// --- workspaces --------------------------------------------------------------
+///
+/// Creates a workspace: a set of documents whose combined memory is kept under
+/// [memory_budget_bytes] by evicting the trees and parsers of the least
+/// recently activated ones. Returns NULL on failure; free with
+/// [ts_workspace_delete].
+@ffi.Native<ffi.Pointer<ffi.Void> Function(ffi.Uint64)>()
+external ffi.Pointer<ffi.Void> ts_workspace_new(int memory_budget_bytes);
+
+/// Deletes [workspace] and every document still open in it.
+@ffi.Native<ffi.Void Function(ffi.Pointer<ffi.Void>)>()
+external void ts_workspace_delete(ffi.Pointer<ffi.Void> workspace);
+
+/// Creates a document owned by [workspace], as the most recently activated
+/// one. [ts_doc_delete] closes it. Returns NULL on failure.
+@ffi.Native<ffi.Pointer<ffi.Void> Function(ffi.Pointer<ffi.Void>, ffi.Int32)>()
+external ffi.Pointer<ffi.Void> ts_workspace_open(
+  ffi.Pointer<ffi.Void> workspace,
+  int language,
+);
+
+/// Marks [doc] as the most recently activated document of [workspace], then
+/// evicts others until the workspace fits its budget. An evicted [doc] is
+/// parsed again on its worker thread; [on_complete] receives [request_id] once
+/// it has its tree back, or right away when nothing had to be parsed. Returns
+/// false, without calling [on_complete], if [doc] is not open in [workspace]
+/// or its worker thread could not start.
+@ffi.Native<
+  ffi.Bool Function(
+    ffi.Pointer<ffi.Void>,
+    ffi.Pointer<ffi.Void>,
+    ffi.Int64,
+    TsDocReparseCallback,
+  )
+>()
+external bool ts_workspace_activate(
+  ffi.Pointer<ffi.Void> workspace,
+  ffi.Pointer<ffi.Void> doc,
+  int request_id,
+  TsDocReparseCallback on_complete,
+);
+
+/// Changes the budget of [workspace] and evicts documents to meet it.
+@ffi.Native<ffi.Void Function(ffi.Pointer<ffi.Void>, ffi.Uint64)>()
+external void ts_workspace_set_memory_budget(
+  ffi.Pointer<ffi.Void> workspace,
+  int memory_budget_bytes,
+);
+
+/// Counters of a workspace, see [ts_workspace_stats].
+final class TsWorkspaceStats extends ffi.Struct {
+  @ffi.Uint32()
+  external int document_count;
+
+  /// Documents that have a tree, or have not been parsed yet.
+  @ffi.Uint32()
+  external int resident_count;
+
+  /// Bytes charged to all documents, evicted ones included.
+  @ffi.Uint64()
+  external int memory_bytes;
+
+  @ffi.Uint64()
+  external int memory_budget_bytes;
+
+  /// Documents evicted, and evicted documents whose parse was started by an
+  /// activation.
+  @ffi.Uint64()
+  external int evictions;
+
+  @ffi.Uint64()
+  external int restores;
+}
+
+/// Copies the counters of [workspace] to [out_stats]. Returns false on NULL
+/// arguments.
+@ffi.Native<
+  ffi.Bool Function(ffi.Pointer<ffi.Void>, ffi.Pointer<TsWorkspaceStats>)
+>()
+external bool ts_workspace_stats(
+  ffi.Pointer<ffi.Void> workspace,
+  ffi.Pointer<TsWorkspaceStats> out_stats,
+);
+
+const int TS_OFFSET_ENCODING_UTF8 = 0;
+
+const int TS_OFFSET_ENCODING_UTF16 = 1;
+
+const int TS_TEXT_EDIT_WORDS = 12;
+
+const int TS_REPARSE_FAILED = 0;
+
+const int TS_REPARSE_OK = 1;
+
+const int TS_REPARSE_CANCELLED = 2;
+
+const int TS_REPARSE_TIMED_OUT = 3;
+
+const int TS_ASYNC_RESULT_NONE = 0;
+
+const int TS_ASYNC_RESULT_CAPTURES = 1;
+
+const int TS_ASYNC_RESULT_HIGHLIGHT_SPANS = 2;
+
+const int TS_QUERY_KIND_HIGHLIGHTS = 0;
+
+/// Called on the document's worker thread once an asynchronous reparse is done
+/// and the document is idle again. From Dart, pass a NativeCallable.listener so
+/// completion is posted to the isolate that made the request.
+///
+/// [status] is one of the TS_REPARSE_* values.
+typedef TsDocReparseCallback =
+    ffi.Pointer<ffi.NativeFunction<TsDocReparseCallbackFunction>>;
+typedef TsDocReparseCallbackFunction =
+    ffi.Void Function(
+      ffi.Pointer<ffi.Void> doc,
+      ffi.Int64 request_id,
+      ffi.Int32 status,
+    );
+typedef DartTsDocReparseCallbackFunction =
+    void Function(ffi.Pointer<ffi.Void> doc, int request_id, int status);
+
+/// Called on the warm-up thread once [ts_warm_up] is done. [ok] is false if a
+/// built-in query could not be compiled or a parser could not be created.
+typedef TsWarmUpCallback =
+    ffi.Pointer<ffi.NativeFunction<TsWarmUpCallbackFunction>>;
+typedef TsWarmUpCallbackFunction = ffi.Void Function(ffi.Bool ok);
+typedef DartTsWarmUpCallbackFunction = void Function(bool ok);
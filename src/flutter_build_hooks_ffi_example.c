@@ -1,21 +1,350 @@
 #include "flutter_build_hooks_ffi_example.h"
 
 #include <string.h>
+#include <time.h>
+
+#if !_WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include <tree_sitter/api.h>
 
+// The bundled highlights.scm files as byte arrays, generated by
+// hook/build.dart (and benchmark/native/CMakeLists.txt).
+#include "ts_builtin_queries.h"
+
 extern const TSLanguage *tree_sitter_c(void);
 extern const TSLanguage *tree_sitter_javascript(void);
 extern const TSLanguage *tree_sitter_dart(void);
 
+#define LANGUAGE_COUNT 3
+
+// Built-in queries per language (see TS_QUERY_KIND_* in the header).
+#define QUERY_KIND_COUNT 1
+
+// Idle parsers kept per language by the parser pool.
+#define PARSER_POOL_CAPACITY 8
+
+// Compiled queries kept by the process-wide query cache. Callers hold a
+// reference while they use one; the least recently used entry nobody holds
+// is evicted when a new query needs room.
+#define QUERY_CACHE_CAPACITY 32
+
+// Upper bound on the worker threads of one batch call.
+#define BATCH_MAX_THREADS 64
+
+// Limits of the #match? regex engine: group nesting, counted repetition and
+// program size accepted by the compiler. A query with a regex beyond them
+// fails to compile.
+#define REGEX_MAX_NESTING 32
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_MAX_PROGRAM 4096
+
+// Pooled size classes of the tracked allocator: blocks of
+// MEMORY_SMALLEST_CLASS << i bytes, header included, with up to
+// MEMORY_POOL_CLASS_BYTES of free blocks kept per class in the shared pool
+// and MEMORY_THREAD_CLASS_BYTES per class in each thread's cache.
+#define MEMORY_SIZE_CLASS_COUNT 8
+#define MEMORY_SMALLEST_CLASS 32u
+#define MEMORY_LARGEST_CLASS (MEMORY_SMALLEST_CLASS << (MEMORY_SIZE_CLASS_COUNT - 1))
+#define MEMORY_POOL_CLASS_BYTES (256u * 1024u)
+#define MEMORY_THREAD_CLASS_BYTES (16u * 1024u)
+
+// Bytes a thread charges to the shared account before adding them to its
+// counter.
+#define MEMORY_SHARED_FLUSH_BYTES (64 * 1024)
+
+// Longest chunk of a document's text. Revisions share chunks, so an edit to
+// text a snapshot or a pending reparse still reads copies only the chunks it
+// touches.
+#define TEXT_CHUNK_BYTES (16u * 1024u)
+
+// How many parse progress callbacks pass between clock reads while a time
+// budget is set.
+#define PARSE_CLOCK_CHECK_INTERVAL 16
+
+#if _WIN32
+typedef volatile LONG TsAtomicFlag;
+#define ts_atomic_flag_set(flag, value) InterlockedExchange(flag, value)
+#define ts_atomic_flag_get(flag) InterlockedCompareExchange(flag, 0, 0)
+#else
+typedef volatile int32_t TsAtomicFlag;
+#define ts_atomic_flag_set(flag, value) __atomic_store_n(flag, value, __ATOMIC_RELEASE)
+#define ts_atomic_flag_get(flag) __atomic_load_n(flag, __ATOMIC_ACQUIRE)
+#endif
+
+#if _WIN32
+typedef volatile LONG64 TsAtomicCounter;
+#define ts_atomic_counter_add(counter, delta) InterlockedExchangeAdd64(counter, delta)
+#define ts_atomic_counter_get(counter) InterlockedCompareExchange64(counter, 0, 0)
+#define TS_THREAD_LOCAL __declspec(thread)
+#else
+typedef volatile int64_t TsAtomicCounter;
+#define ts_atomic_counter_add(counter, delta) __atomic_fetch_add(counter, delta, __ATOMIC_ACQ_REL)
+#define ts_atomic_counter_get(counter) __atomic_load_n(counter, __ATOMIC_ACQUIRE)
+#define TS_THREAD_LOCAL __thread
+#endif
+
+// A pointer written once, from NULL, and read without a lock afterwards.
+#if _WIN32
+typedef PVOID volatile TsAtomicPointer;
+#define ts_atomic_pointer_get(pointer) InterlockedCompareExchangePointer(pointer, NULL, NULL)
+#define ts_atomic_pointer_publish(pointer, value) \
+  (InterlockedCompareExchangePointer(pointer, value, NULL) == NULL)
+#else
+typedef void *volatile TsAtomicPointer;
+#define ts_atomic_pointer_get(pointer) __atomic_load_n(pointer, __ATOMIC_ACQUIRE)
+#define ts_atomic_pointer_publish(pointer, value) __sync_bool_compare_and_swap(pointer, NULL, value)
+#endif
+
+#if _WIN32
+typedef SRWLOCK TsMutex;
+#define TS_MUTEX_INITIALIZER SRWLOCK_INIT
+#define ts_mutex_init(mutex) InitializeSRWLock(mutex)
+#define ts_mutex_destroy(mutex) ((void)(mutex))
+#define ts_mutex_lock(mutex) AcquireSRWLockExclusive(mutex)
+#define ts_mutex_unlock(mutex) ReleaseSRWLockExclusive(mutex)
+typedef CONDITION_VARIABLE TsCond;
+#define ts_cond_init(cond) InitializeConditionVariable(cond)
+#define ts_cond_destroy(cond) ((void)(cond))
+#define ts_cond_wait(cond, mutex) SleepConditionVariableSRW(cond, mutex, INFINITE, 0)
+#define ts_cond_signal(cond) WakeConditionVariable(cond)
+#else
+typedef pthread_mutex_t TsMutex;
+#define TS_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define ts_mutex_init(mutex) pthread_mutex_init(mutex, NULL)
+#define ts_mutex_destroy(mutex) pthread_mutex_destroy(mutex)
+#define ts_mutex_lock(mutex) pthread_mutex_lock(mutex)
+#define ts_mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+typedef pthread_cond_t TsCond;
+#define ts_cond_init(cond) pthread_cond_init(cond, NULL)
+#define ts_cond_destroy(cond) pthread_cond_destroy(cond)
+#define ts_cond_wait(cond, mutex) pthread_cond_wait(cond, mutex)
+#define ts_cond_signal(cond) pthread_cond_signal(cond)
+#endif
+
+// Bytes charged to a document, or to the library as a whole. [balance] is
+// the live bytes plus MEMORY_ACCOUNT_OWNER_BIAS while the owner holds the
+// account, so blocks may outlive their document: whichever release brings it
+// to zero frees the account.
+typedef struct TsMemoryAccount {
+  TsAtomicCounter balance;
+} TsMemoryAccount;
+
+// Read-only view of a whole file. [data] is NULL when nothing is mapped and
+// points at "" for an empty file.
+typedef struct TsFileMapping {
+  const char *data;
+  uint32_t length;
+} TsFileMapping;
+
+// A file mapped by ts_doc_open_file, unmapped when the last chunk reading it
+// is freed.
+typedef struct TsMappedFile {
+  TsAtomicCounter refs;
+  TsFileMapping mapping;
+} TsMappedFile;
+
+// Up to TEXT_CHUNK_BYTES of a TsTextBuffer, split on a code point boundary
+// where the text allows. [data] is [storage], or a slice of [file] that is
+// never written. A chunk is edited in place only while one buffer holds it;
+// once a later revision shares it, an edit copies it. Once [indexed], the
+// line starts are the (byte, UTF-16) offsets, from the start of the chunk, of
+// the lines following each '\n' in it.
+typedef struct TsTextChunk {
+  TsAtomicCounter refs;
+  const char *data;
+  uint32_t length;
+  uint32_t capacity;
+  TsMappedFile *file;
+  bool indexed;
+  uint32_t utf16_length;
+  uint32_t line_count;
+  uint32_t line_capacity;
+  uint32_t *line_starts;
+  char storage[];
+} TsTextChunk;
+
+// A chunk of a TsTextBuffer and where it starts: in bytes, in UTF-16 code
+// units and in rows (the number of '\n' before it).
+typedef struct TsTextChunkRef {
+  TsTextChunk *chunk;
+  uint32_t byte;
+  uint32_t utf16;
+  uint32_t row;
+} TsTextChunkRef;
+
+// Source text handed to the parser and the predicates: [length] contiguous
+// bytes at [data], or the [chunk_count] chunks of a TsTextBuffer when
+// [chunks] is set, so the tracked text is parsed without joining it first.
+typedef struct TsSourceText {
+  const char *data;
+  uint32_t length;
+  const TsTextChunkRef *chunks;
+  uint32_t chunk_count;
+} TsSourceText;
+
+// Text a document parses and maps offsets in: the text edited by
+// ts_doc_set_text / ts_doc_replace_text, a file mapped by ts_doc_open_file,
+// or a copy of a source passed to a reparse. A reparse on the worker thread
+// and snapshots hold a reference to the revision they read; an edit to a
+// buffer held by anyone else first copies its list of chunks, then copies
+// each shared chunk it changes.
+typedef struct TsTextBuffer {
+  TsAtomicCounter refs;
+  TsTextChunkRef *chunks;
+  uint32_t chunk_count;
+  uint32_t chunk_capacity;
+  uint32_t length;
+  uint32_t utf16_length;
+  uint32_t row_count;
+  // Unset for a reparse source that is not indexed yet, or could not be,
+  // whose offsets are then reported as UTF-8 bytes. Only the byte offsets of
+  // [chunks] are kept up to date until it is set.
+  bool indexed;
+} TsTextBuffer;
+
+// Background thread of a document, started by its first
+// ts_doc_reparse_async. It runs one request at a time; [busy] stays set from
+// the request until its completion callback has been invoked.
+typedef struct TsDocWorker {
+  TsMutex mutex;
+  TsCond cond;
+#if _WIN32
+  HANDLE thread;
+#else
+  pthread_t thread;
+#endif
+  bool stopping;
+  bool busy;
+  bool has_job;
+  // Text to parse, and whether it is (a revision of) the tracked text rather
+  // than a copy of the caller's source, with the document's text generation
+  // when it was queued. [job_restore] marks the parse ts_workspace_activate
+  // queues for an evicted document.
+  TsTextBuffer *job_text;
+  bool job_tracked;
+  uint64_t job_generation;
+  bool job_restore;
+  char *job_query;
+  int32_t job_result_kind;
+  int64_t job_id;
+  uint64_t job_timeout_micros;
+  TsDocReparseCallback job_callback;
+  // Output of the last finished request, until ts_doc_take_async_result.
+  int64_t result_id;
+  uint32_t *result;
+  uint32_t result_count;
+  char *result_capture_names;
+} TsDocWorker;
+
+// Compiled text predicates of a query (see query_match_passes).
+typedef struct TsQueryPredicates TsQueryPredicates;
+
+// Immutable revision of a document (see ts_doc_enable_snapshots).
+typedef struct TsDocSnapshot TsDocSnapshot;
+
+// Documents sharing a memory budget (see ts_workspace_new).
+typedef struct TsWorkspace TsWorkspace;
+
+// Query held by the shared query cache (see query_cache_acquire).
+typedef struct QueryCacheEntry QueryCacheEntry;
+
 typedef struct TsDoc {
+  // Charged with the document's own state: parser, trees, text, query and
+  // highlight tables. Results handed to the caller are not included.
+  TsMemoryAccount *memory;
   TSParser *parser;
   const TSLanguage *language;
+  int32_t language_id;
   TSTree *tree;
+  // Source [tree] was parsed from when that was not the tracked text, else
+  // NULL. [job_source] is set while the worker thread queries the revision it
+  // has just parsed, which later edits may have replaced. See ts_doc_source.
+  TsTextBuffer *source;
+  TsTextBuffer *job_source;
+  int32_t offset_encoding;
   TSQuery *query;
   char *query_source;
+  // Text predicates of [query], or NULL when it has none.
+  TsQueryPredicates *query_predicates;
+  // Set when [query] is the built-in query of kind [builtin_query_kind],
+  // which the document does not own. -1 until ts_doc_select_query.
+  bool query_builtin;
+  int32_t builtin_query_kind;
+  // The shared query cache entry [query] and [query_predicates] belong to, as
+  // text queries of workspace documents do, while the document holds a
+  // reference to it; NULL otherwise. [query_source] is still the document's
+  // own copy.
+  QueryCacheEntry *query_entry;
+  // Latest snapshot published by a reparse, once ts_doc_enable_snapshots was
+  // called. [snapshot_mutex] only guards swapping and retaining it; readers
+  // of a retained snapshot take no lock.
+  bool snapshots_enabled;
+  int64_t revision;
+  TsMutex snapshot_mutex;
+  TsDocSnapshot *snapshot;
+  // Workspace that opened the document, or NULL. While [evicted] is set the
+  // workspace has dropped the tree and parser; its text is kept so that
+  // ts_workspace_activate can rebuild the tree, unless an edit arrived in the
+  // meantime ([edited_while_evicted]) and only a reparse can. [evicted] is
+  // cleared by the worker thread that rebuilds the tree, while the workspace
+  // may be reading it.
+  TsWorkspace *workspace;
+  TsAtomicFlag evicted;
+  bool edited_while_evicted;
+  // Byte range touched by ts_doc_edit since the last reparse, in new-text
+  // coordinates. Only meaningful while [has_pending_edit] is set.
+  bool has_pending_edit;
+  uint32_t pending_edit_start;
+  uint32_t pending_edit_end;
+  // (start_byte, end_byte) pairs that differ between the last two trees.
+  uint32_t *changed_ranges;
+  uint32_t changed_range_count;
+  // Capture-name → (priority, style id) table set by
+  // ts_doc_set_highlight_styles, and its resolution for the capture ids of
+  // [query] (-1 for unstyled captures), rebuilt whenever the query changes.
+  char **style_names;
+  uint32_t *style_priorities;
+  uint32_t *style_ids;
+  uint32_t style_count;
+  int32_t *capture_styles;
+  // Text tracked by ts_doc_set_text / ts_doc_replace_text / ts_doc_open_file,
+  // or NULL before the first of them. Only the caller's thread replaces it;
+  // a pending reparse holds its own reference.
+  TsTextBuffer *text;
+  TsDocWorker *worker;
+  // Timings and tree shape of recent parses and queries, read by
+  // ts_doc_stats from any thread while the worker may be updating them.
+  TsMutex stats_mutex;
+  TsDocStats stats;
+  // Set by ts_doc_cancel_reparse from any thread; cleared when a reparse is
+  // requested.
+  TsAtomicFlag cancel_requested;
+  // Bumped by every change to the tracked text and every ts_doc_edit, on the
+  // caller's thread while the worker may be reading it.
+  TsAtomicCounter text_generation;
+  // A halted parse leaves its progress in the parser, and tree-sitter resumes
+  // it on the next parse of the same input: one of the same kind, length and
+  // [text_generation]. Anything else resets the parser.
+  bool parse_halted;
+  bool halted_tracked;
+  uint32_t halted_length;
+  uint64_t halted_generation;
 } TsDoc;
 
+// Restricts a capture query to part of the tree. Rows are used when
+// [use_points] is set, bytes otherwise.
+typedef struct TsCaptureRange {
+  bool use_points;
+  uint32_t start_byte;
+  uint32_t end_byte;
+  TSPoint start_point;
+  TSPoint end_point;
+} TsCaptureRange;
+
 static bool buffer_ensure(char **buffer, size_t *capacity, size_t needed);
 static bool buffer_append(
   char **buffer,
@@ -24,6 +353,79 @@ static bool buffer_append(
   const char *data,
   size_t data_length
 );
+static uint32_t *query_captures_packed(
+  const TSQuery *query,
+  const TsQueryPredicates *predicates,
+  const TsSourceText *source,
+  TSNode root,
+  const TsCaptureRange *ranges,
+  uint32_t range_count,
+  uint32_t *out_count
+);
+static char *query_capture_names(const TSQuery *query);
+static int32_t ts_doc_reparse_source(
+  TsDoc *doc,
+  TsTextBuffer *text,
+  bool tracked,
+  uint64_t generation,
+  uint64_t timeout_micros
+);
+static int32_t ts_doc_restore(TsDoc *doc, TsTextBuffer *text);
+static void ts_doc_stop_worker(TsDoc *doc);
+static void ts_doc_publish_snapshot(TsDoc *doc, TsTextBuffer *text);
+static void snapshot_release(TsDocSnapshot *snapshot);
+static void workspace_forget(TsWorkspace *workspace, TsDoc *doc);
+static TsSourceText ts_doc_tracked_text(const TsDoc *doc);
+static bool ts_doc_ensure_text(TsDoc *doc);
+static TsSourceText text_buffer_view(const TsTextBuffer *buffer);
+static TsTextBuffer *text_buffer_copy(const char *data, uint32_t length, bool index_lines);
+static TsTextBuffer *text_buffer_retain(TsTextBuffer *buffer);
+static void text_buffer_release(TsTextBuffer *buffer);
+static const TsTextChunkRef *text_buffer_anchor(
+  const TsTextBuffer *buffer,
+  uint32_t offset,
+  bool utf16_offset,
+  uint32_t *out_byte,
+  uint32_t *out_utf16
+);
+static const char *source_text_run(
+  const TsSourceText *text,
+  uint32_t offset,
+  uint32_t *out_start,
+  uint32_t *out_length
+);
+static void source_text_copy(const TsSourceText *text, uint32_t start, uint32_t end, char *out);
+static uint8_t source_text_byte_at(const TsSourceText *text, uint32_t offset);
+static bool is_utf8_continuation(uint8_t byte);
+static void file_mapping_close(TsFileMapping *mapping);
+static void ts_doc_clear_query(TsDoc *doc);
+static TSQuery* ts_doc_get_or_compile_query(TsDoc *doc, const char *utf8_query);
+static char *tokens_for_source(const char *source, uint32_t length, int32_t language);
+static uint32_t *tokens_packed_for_source(
+  const char *source,
+  uint32_t length,
+  int32_t language,
+  uint32_t *out_count
+);
+static bool tree_cursor_advance(TSTreeCursor *cursor);
+static bool tree_cursor_skip_subtree(TSTreeCursor *cursor);
+static uint64_t monotonic_micros(void);
+static uint32_t *captures_packed_for_source(
+  const char *source,
+  uint32_t length,
+  int32_t language,
+  const char *utf8_query,
+  uint32_t *out_count,
+  char **out_capture_names
+);
+static uint32_t *resolve_highlight_spans(
+  const uint32_t *records,
+  uint32_t record_count,
+  const int32_t *capture_styles,
+  const uint32_t *style_priorities,
+  const uint32_t *style_ids,
+  uint32_t *out_count
+);
 
 // A very short-lived native function.
 //
@@ -66,325 +468,5803 @@ static const TSLanguage *language_from_id(int32_t language_id) {
   }
 }
 
-FFI_PLUGIN_EXPORT void* ts_doc_new(int32_t language) {
-  const TSLanguage *ts_language = language_from_id(language);
-  if (ts_language == NULL) {
-    return NULL;
-  }
+// --- memory accounting -------------------------------------------------------
+//
+// Every allocation of this library, and of tree-sitter through
+// ts_set_allocator, goes through memory_alloc and friends. A block starts
+// with a header naming the account it is charged to: the document whose
+// export allocated it (see memory_scope_enter), or the shared account for
+// everything else. Blocks up to MEMORY_LARGEST_CLASS bytes are rounded up to
+// a power-of-two size class and recycled through per-class free lists, so
+// repeated reparses stop churning the system allocator for tree nodes.
+//
+// Each thread keeps its own free lists and its own tally of shared-account
+// bytes, and only trades them with the shared pools and counter in batches,
+// so parsing and querying on many threads at once contends on no lock and no
+// shared cache line per allocation.
 
-  TSParser *parser = ts_parser_new();
-  if (parser == NULL) {
-    return NULL;
+#define MEMORY_ACCOUNT_OWNER_BIAS ((int64_t)1 << 62)
+
+typedef union TsMemoryHeader {
+  struct {
+    TsMemoryAccount *account;
+    size_t size;
+  } info;
+  // Links a pooled block; only valid while the block is free.
+  union TsMemoryHeader *next_free;
+  // Keeps the payload aligned like the system allocator's.
+  double align_double;
+  uint64_t align_uint64;
+} TsMemoryHeader;
+
+typedef struct TsMemoryPool {
+  TsMutex mutex;
+  TsMemoryHeader *free_list;
+  uint32_t free_count;
+} TsMemoryPool;
+
+static TsMemoryPool memory_pools[MEMORY_SIZE_CLASS_COUNT] = {
+  { TS_MUTEX_INITIALIZER, NULL, 0 },
+  { TS_MUTEX_INITIALIZER, NULL, 0 },
+  { TS_MUTEX_INITIALIZER, NULL, 0 },
+  { TS_MUTEX_INITIALIZER, NULL, 0 },
+  { TS_MUTEX_INITIALIZER, NULL, 0 },
+  { TS_MUTEX_INITIALIZER, NULL, 0 },
+  { TS_MUTEX_INITIALIZER, NULL, 0 },
+  { TS_MUTEX_INITIALIZER, NULL, 0 },
+};
+
+// Free blocks and shared-account bytes held back by one thread, handed over
+// when the thread exits. [registered] is set once the exit hook is armed.
+typedef struct TsMemoryThreadCache {
+  TsMemoryHeader *free_list[MEMORY_SIZE_CLASS_COUNT];
+  uint32_t free_count[MEMORY_SIZE_CLASS_COUNT];
+  int64_t shared_bytes;
+  bool registered;
+} TsMemoryThreadCache;
+
+static TS_THREAD_LOCAL TsMemoryThreadCache memory_thread_cache;
+
+// Runs memory_thread_cache_flush on exiting threads that allocated.
+#if _WIN32
+static DWORD memory_thread_exit_key = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t memory_thread_exit_key;
+static bool memory_thread_exit_key_created;
+#endif
+
+// Never released; its balance is the bytes flushed by threads.
+static TsMemoryAccount memory_shared_account = { 0 };
+
+// Account charged by allocations on this thread; NULL means the shared one.
+static TS_THREAD_LOCAL TsMemoryAccount *memory_current_account;
+
+// Returns the size class whose blocks fit [size] payload bytes, or
+// MEMORY_SIZE_CLASS_COUNT when the block is too large to pool.
+static uint32_t memory_size_class(size_t size) {
+  if (size > MEMORY_LARGEST_CLASS - sizeof(TsMemoryHeader)) {
+    return MEMORY_SIZE_CLASS_COUNT;
   }
-  if (!ts_parser_set_language(parser, ts_language)) {
-    ts_parser_delete(parser);
-    return NULL;
+  const size_t block_bytes = size + sizeof(TsMemoryHeader);
+  uint32_t size_class = 0;
+  while (((size_t)MEMORY_SMALLEST_CLASS << size_class) < block_bytes) {
+    size_class++;
   }
+  return size_class;
+}
 
-  TsDoc *doc = (TsDoc *)calloc(1, sizeof(TsDoc));
-  if (doc == NULL) {
-    ts_parser_delete(parser);
-    return NULL;
+// Bytes a block of [size] payload bytes occupies, header included.
+static size_t memory_block_bytes(size_t size) {
+  const uint32_t size_class = memory_size_class(size);
+  return size_class < MEMORY_SIZE_CLASS_COUNT
+    ? (size_t)MEMORY_SMALLEST_CLASS << size_class
+    : size + sizeof(TsMemoryHeader);
+}
+
+// Free blocks of [size_class] a thread cache holds before returning half of
+// them to the shared pool, and the most the shared pool keeps.
+static uint32_t memory_thread_class_limit(uint32_t size_class) {
+  return (MEMORY_THREAD_CLASS_BYTES >> size_class) / MEMORY_SMALLEST_CLASS;
+}
+
+static uint32_t memory_pool_class_limit(uint32_t size_class) {
+  return (MEMORY_POOL_CLASS_BYTES >> size_class) / MEMORY_SMALLEST_CLASS;
+}
+
+// Arms the exit hook of the calling thread, once.
+static void memory_thread_cache_register(TsMemoryThreadCache *cache) {
+  cache->registered = true;
+#if _WIN32
+  if (memory_thread_exit_key != FLS_OUT_OF_INDEXES) {
+    FlsSetValue(memory_thread_exit_key, cache);
   }
-  doc->parser = parser;
-  doc->language = ts_language;
-  doc->tree = NULL;
-  doc->query = NULL;
-  doc->query_source = NULL;
-  return (void *)doc;
+#else
+  if (memory_thread_exit_key_created) {
+    pthread_setspecific(memory_thread_exit_key, cache);
+  }
+#endif
 }
 
-FFI_PLUGIN_EXPORT void ts_doc_delete(void* doc_ptr) {
-  if (doc_ptr == NULL) {
+// Moves up to [count] blocks of [size_class] from [cache] to the shared
+// pool, freeing those it has no room for.
+static void memory_thread_cache_drain(
+  TsMemoryThreadCache *cache,
+  uint32_t size_class,
+  uint32_t count
+) {
+  TsMemoryHeader *first = cache->free_list[size_class];
+  if (first == NULL || count == 0) {
     return;
   }
-  TsDoc *doc = (TsDoc *)doc_ptr;
-  if (doc->query != NULL) {
-    ts_query_delete(doc->query);
+  TsMemoryHeader *last = first;
+  uint32_t taken = 1;
+  while (taken < count && last->next_free != NULL) {
+    last = last->next_free;
+    taken++;
   }
-  if (doc->query_source != NULL) {
-    free(doc->query_source);
+  cache->free_list[size_class] = last->next_free;
+  cache->free_count[size_class] -= taken;
+  last->next_free = NULL;
+
+  TsMemoryPool *pool = &memory_pools[size_class];
+  const uint32_t limit = memory_pool_class_limit(size_class);
+  ts_mutex_lock(&pool->mutex);
+  while (first != NULL && pool->free_count < limit) {
+    TsMemoryHeader *next = first->next_free;
+    first->next_free = pool->free_list;
+    pool->free_list = first;
+    pool->free_count++;
+    first = next;
   }
-  if (doc->tree != NULL) {
-    ts_tree_delete(doc->tree);
+  ts_mutex_unlock(&pool->mutex);
+  while (first != NULL) {
+    TsMemoryHeader *next = first->next_free;
+    free(first);
+    first = next;
   }
-  if (doc->parser != NULL) {
-    ts_parser_delete(doc->parser);
+}
+
+// Moves up to half a thread cache's worth of blocks of [size_class] from the
+// shared pool to [cache].
+static void memory_thread_cache_refill(TsMemoryThreadCache *cache, uint32_t size_class) {
+  TsMemoryPool *pool = &memory_pools[size_class];
+  uint32_t wanted = memory_thread_class_limit(size_class) / 2;
+  ts_mutex_lock(&pool->mutex);
+  while (wanted > 0 && pool->free_list != NULL) {
+    TsMemoryHeader *block = pool->free_list;
+    pool->free_list = block->next_free;
+    pool->free_count--;
+    block->next_free = cache->free_list[size_class];
+    cache->free_list[size_class] = block;
+    cache->free_count[size_class]++;
+    wanted--;
   }
-  free(doc);
+  ts_mutex_unlock(&pool->mutex);
 }
 
-FFI_PLUGIN_EXPORT void ts_doc_edit(
-  void* doc_ptr,
-  uint32_t start_byte,
-  uint32_t old_end_byte,
-  uint32_t new_end_byte,
-  uint32_t start_row,
-  uint32_t start_col,
-  uint32_t old_end_row,
-  uint32_t old_end_col,
-  uint32_t new_end_row,
-  uint32_t new_end_col
-) {
-  if (doc_ptr == NULL) {
+static void memory_flush_shared_bytes(TsMemoryThreadCache *cache) {
+  if (cache->shared_bytes != 0) {
+    ts_atomic_counter_add(&memory_shared_account.balance, cache->shared_bytes);
+    cache->shared_bytes = 0;
+  }
+}
+
+// Hands everything [cache] holds back: its blocks to the shared pools and its
+// bytes to the shared account.
+static void memory_thread_cache_flush(TsMemoryThreadCache *cache) {
+  for (uint32_t i = 0; i < MEMORY_SIZE_CLASS_COUNT; i++) {
+    memory_thread_cache_drain(cache, i, cache->free_count[i]);
+  }
+  memory_flush_shared_bytes(cache);
+  // A later allocation on this thread arms the hook again.
+  cache->registered = false;
+}
+
+#if _WIN32
+static void NTAPI memory_thread_exit(void *cache) {
+#else
+static void memory_thread_exit(void *cache) {
+#endif
+  if (cache != NULL) {
+    memory_thread_cache_flush((TsMemoryThreadCache *)cache);
+  }
+}
+
+static TsMemoryAccount *memory_account_new(void) {
+  TsMemoryAccount *account = (TsMemoryAccount *)calloc(1, sizeof(TsMemoryAccount));
+  if (account != NULL) {
+    account->balance = MEMORY_ACCOUNT_OWNER_BIAS;
+  }
+  return account;
+}
+
+// Drops the owner's hold on [account]. The account is freed once nothing
+// charged to it is still live.
+static void memory_account_release(TsMemoryAccount *account) {
+  if (account == NULL || account == &memory_shared_account) {
     return;
   }
-  TsDoc *doc = (TsDoc *)doc_ptr;
-  if (doc->tree == NULL) {
+  if (ts_atomic_counter_add(&account->balance, -MEMORY_ACCOUNT_OWNER_BIAS) ==
+      MEMORY_ACCOUNT_OWNER_BIAS) {
+    free(account);
+  }
+}
+
+// Adds [bytes] (negative when freeing) to [account], freeing it if that was
+// the last block of an account its owner has released. The shared account is
+// charged through the calling thread's tally.
+static void memory_account_charge(TsMemoryAccount *account, int64_t bytes) {
+  if (account == &memory_shared_account) {
+    TsMemoryThreadCache *cache = &memory_thread_cache;
+    cache->shared_bytes += bytes;
+    if (cache->shared_bytes >= MEMORY_SHARED_FLUSH_BYTES ||
+        cache->shared_bytes <= -MEMORY_SHARED_FLUSH_BYTES) {
+      memory_flush_shared_bytes(cache);
+    }
     return;
   }
-  TSInputEdit edit;
-  edit.start_byte = start_byte;
-  edit.old_end_byte = old_end_byte;
-  edit.new_end_byte = new_end_byte;
-  edit.start_point = (TSPoint){ start_row, start_col };
-  edit.old_end_point = (TSPoint){ old_end_row, old_end_col };
-  edit.new_end_point = (TSPoint){ new_end_row, new_end_col };
-  ts_tree_edit(doc->tree, &edit);
+  if (ts_atomic_counter_add(&account->balance, bytes) == -bytes) {
+    free(account);
+  }
 }
 
-FFI_PLUGIN_EXPORT bool ts_doc_reparse(void* doc_ptr, const char* utf8_source) {
-  if (doc_ptr == NULL || utf8_source == NULL) {
-    return false;
+// Bytes live in [account], which its owner still holds.
+static int64_t memory_account_live_bytes(TsMemoryAccount *account) {
+  const int64_t balance = ts_atomic_counter_get(&account->balance);
+  return account == &memory_shared_account
+    ? balance
+    : balance - MEMORY_ACCOUNT_OWNER_BIAS;
+}
+
+// Charges allocations on this thread to [account] (the shared account when
+// NULL) until memory_scope_leave. Returns the account to restore.
+static TsMemoryAccount *memory_scope_enter(TsMemoryAccount *account) {
+  TsMemoryAccount *previous = memory_current_account;
+  memory_current_account = account;
+  return previous;
+}
+
+static void memory_scope_leave(TsMemoryAccount *previous) {
+  memory_current_account = previous;
+}
+
+static void *memory_alloc(size_t size) {
+  TsMemoryAccount *account = memory_current_account != NULL
+    ? memory_current_account
+    : &memory_shared_account;
+  TsMemoryThreadCache *cache = &memory_thread_cache;
+  if (!cache->registered) {
+    memory_thread_cache_register(cache);
   }
-  TsDoc *doc = (TsDoc *)doc_ptr;
-  const uint32_t length = (uint32_t)strlen(utf8_source);
-  TSTree *new_tree = ts_parser_parse_string(doc->parser, doc->tree, utf8_source, length);
-  if (new_tree == NULL) {
-    return false;
+  const uint32_t size_class = memory_size_class(size);
+  TsMemoryHeader *header = NULL;
+  if (size_class < MEMORY_SIZE_CLASS_COUNT) {
+    if (cache->free_list[size_class] == NULL) {
+      memory_thread_cache_refill(cache, size_class);
+    }
+    header = cache->free_list[size_class];
+    if (header != NULL) {
+      cache->free_list[size_class] = header->next_free;
+      cache->free_count[size_class]--;
+    } else {
+      header = (TsMemoryHeader *)malloc((size_t)MEMORY_SMALLEST_CLASS << size_class);
+    }
+  } else if (size <= SIZE_MAX - sizeof(TsMemoryHeader)) {
+    header = (TsMemoryHeader *)malloc(size + sizeof(TsMemoryHeader));
   }
-  if (doc->tree != NULL) {
-    ts_tree_delete(doc->tree);
+  if (header == NULL) {
+    return NULL;
   }
-  doc->tree = new_tree;
-  return true;
+  header->info.account = account;
+  header->info.size = size;
+  memory_account_charge(account, (int64_t)memory_block_bytes(size));
+  return header + 1;
 }
 
-static TSQuery* ts_doc_get_or_compile_query(TsDoc *doc, const char *utf8_query) {
-  if (utf8_query == NULL) {
+static void *memory_calloc(size_t count, size_t size) {
+  if (size != 0 && count > SIZE_MAX / size) {
     return NULL;
   }
-  if (doc->query != NULL && doc->query_source != NULL) {
-    if (strcmp(doc->query_source, utf8_query) == 0) {
-      return doc->query;
-    }
-    ts_query_delete(doc->query);
-    doc->query = NULL;
-    free(doc->query_source);
-    doc->query_source = NULL;
+  void *result = memory_alloc(count * size);
+  if (result != NULL) {
+    memset(result, 0, count * size);
   }
+  return result;
+}
 
-  uint32_t error_offset = 0;
-  TSQueryError error_type = TSQueryErrorNone;
-  const uint32_t query_length = (uint32_t)strlen(utf8_query);
-  TSQuery *query = ts_query_new(
-    doc->language,
-    utf8_query,
-    query_length,
-    &error_offset,
-    &error_type
-  );
-  if (query == NULL) {
-    return NULL;
+static void memory_free(void *ptr) {
+  if (ptr == NULL) {
+    return;
   }
-  char *copy = (char *)malloc((size_t)query_length + 1);
-  if (copy == NULL) {
-    ts_query_delete(query);
-    return NULL;
+  TsMemoryHeader *header = (TsMemoryHeader *)ptr - 1;
+  TsMemoryAccount *account = header->info.account;
+  const size_t size = header->info.size;
+  const uint32_t size_class = memory_size_class(size);
+  if (size_class < MEMORY_SIZE_CLASS_COUNT) {
+    TsMemoryThreadCache *cache = &memory_thread_cache;
+    if (!cache->registered) {
+      memory_thread_cache_register(cache);
+    }
+    header->next_free = cache->free_list[size_class];
+    cache->free_list[size_class] = header;
+    cache->free_count[size_class]++;
+    const uint32_t limit = memory_thread_class_limit(size_class);
+    if (cache->free_count[size_class] > limit) {
+      memory_thread_cache_drain(cache, size_class, limit / 2);
+    }
+  } else {
+    free(header);
   }
-  memcpy(copy, utf8_query, (size_t)query_length);
-  copy[query_length] = '\0';
-  doc->query = query;
-  doc->query_source = copy;
-  return query;
+  memory_account_charge(account, -(int64_t)memory_block_bytes(size));
 }
 
-FFI_PLUGIN_EXPORT char* ts_doc_query_captures(void* doc_ptr, const char* utf8_query) {
-  if (doc_ptr == NULL || utf8_query == NULL) {
-    return NULL;
+// Resizes in place while the block stays in its size class; the block keeps
+// the account it was first charged to.
+static void *memory_realloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return memory_alloc(size);
   }
-  TsDoc *doc = (TsDoc *)doc_ptr;
-  if (doc->tree == NULL) {
-    return NULL;
+  TsMemoryHeader *header = (TsMemoryHeader *)ptr - 1;
+  TsMemoryAccount *account = header->info.account;
+  const size_t old_size = header->info.size;
+  const uint32_t old_class = memory_size_class(old_size);
+  const uint32_t new_class = memory_size_class(size);
+  if (old_class == new_class && old_class < MEMORY_SIZE_CLASS_COUNT) {
+    header->info.size = size;
+    return ptr;
   }
-  TSQuery *query = ts_doc_get_or_compile_query(doc, utf8_query);
-  if (query == NULL) {
-    return NULL;
+  if (old_class == MEMORY_SIZE_CLASS_COUNT && new_class == MEMORY_SIZE_CLASS_COUNT) {
+    if (size > SIZE_MAX - sizeof(TsMemoryHeader)) {
+      return NULL;
+    }
+    TsMemoryHeader *resized = (TsMemoryHeader *)realloc(header, size + sizeof(TsMemoryHeader));
+    if (resized == NULL) {
+      return NULL;
+    }
+    resized->info.size = size;
+    memory_account_charge(account, (int64_t)size - (int64_t)old_size);
+    return resized + 1;
   }
 
-  TSQueryCursor *cursor = ts_query_cursor_new();
-  if (cursor == NULL) {
+  TsMemoryAccount *previous = memory_scope_enter(account);
+  void *result = memory_alloc(size);
+  memory_scope_leave(previous);
+  if (result == NULL) {
     return NULL;
   }
+  memcpy(result, ptr, old_size < size ? old_size : size);
+  memory_free(ptr);
+  return result;
+}
 
-  TSNode root = ts_tree_root_node(doc->tree);
-  ts_query_cursor_exec(cursor, query, root);
+// tree-sitter expects its allocator to abort rather than return NULL.
+static void memory_abort(size_t size) {
+  fprintf(stderr, "tree-sitter failed to allocate %zu bytes\n", size);
+  abort();
+}
 
-  char *buffer = NULL;
-  size_t buffer_length = 0;
-  size_t buffer_capacity = 0;
+static void *memory_ts_malloc(size_t size) {
+  void *result = memory_alloc(size);
+  if (result == NULL) {
+    memory_abort(size);
+  }
+  return result;
+}
 
-  TSQueryMatch match;
-  uint32_t capture_index = 0;
-  while (ts_query_cursor_next_capture(cursor, &match, &capture_index)) {
-    const TSQueryCapture capture = match.captures[capture_index];
-    const TSNode node = capture.node;
-    const uint32_t start = ts_node_start_byte(node);
-    const uint32_t end = ts_node_end_byte(node);
+static void *memory_ts_calloc(size_t count, size_t size) {
+  void *result = memory_calloc(count, size);
+  if (result == NULL) {
+    memory_abort(count * size);
+  }
+  return result;
+}
 
-    uint32_t name_length = 0;
-    const char *name = ts_query_capture_name_for_id(
-      query,
-      capture.index,
-      &name_length
-    );
-    if (name == NULL || name_length == 0) {
-      continue;
-    }
+static void *memory_ts_realloc(void *ptr, size_t size) {
+  void *result = memory_realloc(ptr, size);
+  if (result == NULL) {
+    memory_abort(size);
+  }
+  return result;
+}
 
-    char prefix[64];
-    const int prefix_written = snprintf(
-      prefix,
-      sizeof(prefix),
-      "%u\t%u\t",
-      start,
+// Installs the tracked allocator before anything can allocate a tree-sitter
+// object, since blocks must be freed by the allocator that made them.
+#if _WIN32
+static void __cdecl memory_install_allocator(void);
+#pragma section(".CRT$XCU", read)
+__declspec(allocate(".CRT$XCU")) void (__cdecl *ts_memory_install_allocator_entry)(void) =
+  memory_install_allocator;
+static void __cdecl memory_install_allocator(void) {
+#else
+__attribute__((constructor)) static void memory_install_allocator(void) {
+#endif
+#if _WIN32
+  memory_thread_exit_key = FlsAlloc(memory_thread_exit);
+#else
+  memory_thread_exit_key_created =
+    pthread_key_create(&memory_thread_exit_key, memory_thread_exit) == 0;
+#endif
+  ts_set_allocator(memory_ts_malloc, memory_ts_calloc, memory_ts_realloc, memory_free);
+}
+
+FFI_PLUGIN_EXPORT void ts_memory_usage(uint64_t* out_shared_bytes, uint64_t* out_pooled_bytes) {
+  if (out_shared_bytes != NULL) {
+    // Bytes other threads have not flushed yet are not counted.
+    memory_flush_shared_bytes(&memory_thread_cache);
+    const int64_t shared = memory_account_live_bytes(&memory_shared_account);
+    *out_shared_bytes = shared > 0 ? (uint64_t)shared : 0;
+  }
+  if (out_pooled_bytes != NULL) {
+    uint64_t pooled = 0;
+    for (uint32_t i = 0; i < MEMORY_SIZE_CLASS_COUNT; i++) {
+      ts_mutex_lock(&memory_pools[i].mutex);
+      pooled += (uint64_t)memory_pools[i].free_count * (MEMORY_SMALLEST_CLASS << i);
+      ts_mutex_unlock(&memory_pools[i].mutex);
+    }
+    *out_pooled_bytes = pooled;
+  }
+}
+
+FFI_PLUGIN_EXPORT void ts_memory_trim(void) {
+  memory_thread_cache_flush(&memory_thread_cache);
+  for (uint32_t i = 0; i < MEMORY_SIZE_CLASS_COUNT; i++) {
+    ts_mutex_lock(&memory_pools[i].mutex);
+    TsMemoryHeader *block = memory_pools[i].free_list;
+    memory_pools[i].free_list = NULL;
+    memory_pools[i].free_count = 0;
+    ts_mutex_unlock(&memory_pools[i].mutex);
+    while (block != NULL) {
+      TsMemoryHeader *next = block->next_free;
+      free(block);
+      block = next;
+    }
+  }
+}
+
+// --- query predicates --------------------------------------------------------
+//
+// tree-sitter parses predicates such as (#match? @constant "^[A-Z]") but leaves
+// evaluating them to the caller. The text predicates (#eq?, #match?,
+// #any-of? and their not-/any- forms) are compiled once per query, next to
+// the TSQuery, and checked against the captured nodes' bytes in the source
+// while captures are collected; matches that fail are removed from the query
+// cursor. Other predicates (#is?, #is-not?, #set!, ...) do not filter: there
+// is no locals tracking for #is-not? local to consult.
+//
+// #match? regexes are compiled by a small engine covering the syntax
+// highlight queries use: literals, ., [classes] with ranges, \d \w \s (ASCII)
+// and their negations, groups, alternation, ^ $ and the greedy and lazy
+// quantifiers * + ? {n,m}. A query with a regex outside that subset fails to
+// compile, as it would with a syntax error.
+//
+// The pattern is parsed into terms, then compiled into a Thompson NFA program
+// that a Pike VM runs over the text: all threads advance a byte at a time, so
+// a search takes time linear in the text and needs no recursion, whatever the
+// pattern. Only whether a match exists is asked for, so greedy and lazy
+// quantifiers compile alike. Each instruction runs at most once per byte, so
+// checking a capture takes at most (node length + 1) × program size steps and
+// always finishes.
+
+typedef enum TsRegexTermType {
+  REGEX_BYTE,
+  REGEX_ANY,
+  REGEX_CLASS,
+  REGEX_GROUP,
+  REGEX_TEXT_START,
+  REGEX_TEXT_END,
+} TsRegexTermType;
+
+// One element of a sequence, repeated [min, max] times. Groups hold a chain
+// of alternatives, each the first term of a sequence; a sequence ends at a
+// term whose [next] is -1.
+typedef struct TsRegexTerm {
+  uint8_t type;
+  uint8_t byte;
+  bool greedy;
+  uint32_t min;
+  uint32_t max;
+  int32_t next;
+  uint32_t class_index;
+  int32_t first_alternative;
+} TsRegexTerm;
+
+// A byte set over ASCII. Non-ASCII code points match only negated classes.
+typedef struct TsRegexClass {
+  uint8_t ascii[16];
+  bool negated;
+} TsRegexClass;
+
+typedef struct TsRegexAlternative {
+  int32_t first;
+  int32_t next;
+} TsRegexAlternative;
+
+typedef enum TsRegexOpcode {
+  // Consume one byte, then continue with the next instruction.
+  REGEX_OP_BYTE,
+  REGEX_OP_ANY,
+  REGEX_OP_CLASS,
+  REGEX_OP_CONTINUATION,
+  // Continue with the next instruction if the position is at the start (or
+  // end) of the text.
+  REGEX_OP_TEXT_START,
+  REGEX_OP_TEXT_END,
+  // Continue with both [x] and [y].
+  REGEX_OP_SPLIT,
+  // Continue with [x].
+  REGEX_OP_JUMP,
+  REGEX_OP_MATCH,
+} TsRegexOpcode;
+
+typedef struct TsRegexInstruction {
+  uint8_t opcode;
+  uint8_t byte;
+  uint32_t class_index;
+  int32_t x;
+  int32_t y;
+} TsRegexInstruction;
+
+// Term 0 is the group of top-level alternatives. [terms] and [alternatives]
+// only live until the program is compiled from them.
+typedef struct TsRegex {
+  TsRegexTerm *terms;
+  uint32_t term_count;
+  uint32_t term_capacity;
+  TsRegexClass *classes;
+  uint32_t class_count;
+  uint32_t class_capacity;
+  TsRegexAlternative *alternatives;
+  uint32_t alternative_count;
+  uint32_t alternative_capacity;
+  TsRegexInstruction *program;
+  uint32_t program_count;
+  uint32_t program_capacity;
+  // Starts with ^, so only a match at offset 0 needs trying.
+  bool anchored;
+} TsRegex;
+
+// Outcome of a text predicate test. A test that can't allocate the memory it
+// needs is unknown, and the predicate is then treated as unevaluated.
+typedef enum TsTestResult {
+  TEST_FALSE,
+  TEST_TRUE,
+  TEST_UNKNOWN,
+} TsTestResult;
+
+typedef struct TsRegexParser {
+  TsRegex *regex;
+  const char *pattern;
+  uint32_t length;
+  uint32_t pos;
+  uint32_t depth;
+} TsRegexParser;
+
+typedef enum TsTextPredicateKind {
+  TEXT_PREDICATE_EQ,
+  TEXT_PREDICATE_MATCH,
+  TEXT_PREDICATE_ANY_OF,
+} TsTextPredicateKind;
+
+// A string argument; points into the query's string table.
+typedef struct TsPredicateString {
+  const char *value;
+  uint32_t length;
+} TsPredicateString;
+
+// One text predicate on [capture_id]. With several nodes captured under that
+// id, all must pass, or one with [any]. [negated] inverts the test per node.
+// #eq? compares with [other_capture_id]'s text when [compare_capture] is set,
+// and with the first string otherwise; #any-of? with any of its strings.
+typedef struct TsTextPredicate {
+  uint8_t kind;
+  bool negated;
+  bool any;
+  bool compare_capture;
+  uint32_t capture_id;
+  uint32_t other_capture_id;
+  uint32_t first_string;
+  uint32_t string_count;
+  TsRegex *regex;
+} TsTextPredicate;
+
+// The text predicates of a query, grouped by pattern: those of pattern `i`
+// are [pattern_starts[i], pattern_starts[i + 1]).
+struct TsQueryPredicates {
+  uint32_t pattern_count;
+  uint32_t *pattern_starts;
+  TsTextPredicate *predicates;
+  uint32_t predicate_count;
+  uint32_t predicate_capacity;
+  TsPredicateString *strings;
+  uint32_t string_count;
+  uint32_t string_capacity;
+};
+
+// Makes room for one more of the [*count] items of [item_size] bytes.
+static bool array_reserve(void **items, uint32_t *capacity, uint32_t count, size_t item_size) {
+  if (count < *capacity) {
+    return true;
+  }
+  const uint32_t new_capacity = *capacity == 0 ? 8 : *capacity * 2;
+  void *grown = memory_realloc(*items, (size_t)new_capacity * item_size);
+  if (grown == NULL) {
+    return false;
+  }
+  *items = grown;
+  *capacity = new_capacity;
+  return true;
+}
+
+static void regex_delete(TsRegex *regex) {
+  if (regex == NULL) {
+    return;
+  }
+  memory_free(regex->terms);
+  memory_free(regex->classes);
+  memory_free(regex->alternatives);
+  memory_free(regex->program);
+  memory_free(regex);
+}
+
+// Appends a term matching once; returns its index, or -1.
+static int32_t regex_add_term(TsRegex *regex, TsRegexTermType type) {
+  if (!array_reserve((void **)&regex->terms, &regex->term_capacity, regex->term_count, sizeof(TsRegexTerm))) {
+    return -1;
+  }
+  TsRegexTerm *term = &regex->terms[regex->term_count];
+  memset(term, 0, sizeof(*term));
+  term->type = (uint8_t)type;
+  term->greedy = true;
+  term->min = 1;
+  term->max = 1;
+  term->next = -1;
+  term->first_alternative = -1;
+  return (int32_t)regex->term_count++;
+}
+
+static int32_t regex_add_byte(TsRegex *regex, uint8_t byte) {
+  const int32_t term = regex_add_term(regex, REGEX_BYTE);
+  if (term >= 0) {
+    regex->terms[term].byte = byte;
+  }
+  return term;
+}
+
+static int32_t regex_add_class(TsRegex *regex, const TsRegexClass *class_bits) {
+  if (!array_reserve((void **)&regex->classes, &regex->class_capacity, regex->class_count, sizeof(TsRegexClass))) {
+    return -1;
+  }
+  const int32_t term = regex_add_term(regex, REGEX_CLASS);
+  if (term < 0) {
+    return -1;
+  }
+  regex->classes[regex->class_count] = *class_bits;
+  regex->terms[term].class_index = regex->class_count++;
+  return term;
+}
+
+// Appends an alternative starting at term [first] to [group].
+static bool regex_add_alternative(TsRegex *regex, int32_t group, int32_t *last, int32_t first) {
+  if (!array_reserve(
+        (void **)&regex->alternatives,
+        &regex->alternative_capacity,
+        regex->alternative_count,
+        sizeof(TsRegexAlternative))) {
+    return false;
+  }
+  const int32_t index = (int32_t)regex->alternative_count++;
+  regex->alternatives[index].first = first;
+  regex->alternatives[index].next = -1;
+  if (*last < 0) {
+    regex->terms[group].first_alternative = index;
+  } else {
+    regex->alternatives[*last].next = index;
+  }
+  *last = index;
+  return true;
+}
+
+static void regex_class_add_range(TsRegexClass *class_bits, uint8_t low, uint8_t high) {
+  for (uint32_t byte = low; byte <= high; byte++) {
+    class_bits->ascii[byte >> 3] |= (uint8_t)(1u << (byte & 7));
+  }
+}
+
+// The class of \d, \w, \s and their upper-case negations.
+static bool regex_escape_class(uint8_t escape, TsRegexClass *out_class) {
+  memset(out_class, 0, sizeof(*out_class));
+  switch (escape) {
+    case 'd':
+    case 'D':
+      regex_class_add_range(out_class, '0', '9');
+      break;
+    case 'w':
+    case 'W':
+      regex_class_add_range(out_class, '0', '9');
+      regex_class_add_range(out_class, 'A', 'Z');
+      regex_class_add_range(out_class, 'a', 'z');
+      regex_class_add_range(out_class, '_', '_');
+      break;
+    case 's':
+    case 'S':
+      regex_class_add_range(out_class, '\t', '\r');
+      regex_class_add_range(out_class, ' ', ' ');
+      break;
+    default:
+      return false;
+  }
+  out_class->negated = escape == 'D' || escape == 'W' || escape == 'S';
+  return true;
+}
+
+// The byte an escape such as \n or \. stands for, or -1.
+static int32_t regex_escape_byte(uint8_t escape) {
+  switch (escape) {
+    case 'n':
+      return '\n';
+    case 't':
+      return '\t';
+    case 'r':
+      return '\r';
+    case 'f':
+      return '\f';
+    case 'v':
+      return '\v';
+    default:
+      break;
+  }
+  const bool alphanumeric = (escape >= '0' && escape <= '9') ||
+    (escape >= 'A' && escape <= 'Z') || (escape >= 'a' && escape <= 'z');
+  return escape > ' ' && escape < 0x7F && !alphanumeric ? escape : -1;
+}
+
+static bool regex_parse_alternatives(TsRegexParser *parser, int32_t group);
+
+static int32_t regex_parse_class(TsRegexParser *parser) {
+  const char *pattern = parser->pattern;
+  TsRegexClass class_bits;
+  memset(&class_bits, 0, sizeof(class_bits));
+  if (parser->pos < parser->length && pattern[parser->pos] == '^') {
+    class_bits.negated = true;
+    parser->pos++;
+  }
+  // A ']' right after the opening bracket is a literal.
+  for (bool first = true;; first = false) {
+    if (parser->pos >= parser->length) {
+      return -1;
+    }
+    const uint8_t c = (uint8_t)pattern[parser->pos++];
+    if (c == ']' && !first) {
+      break;
+    }
+    int32_t low = c;
+    if (c == '\\') {
+      if (parser->pos >= parser->length) {
+        return -1;
+      }
+      const uint8_t escape = (uint8_t)pattern[parser->pos++];
+      TsRegexClass escaped;
+      if (regex_escape_class(escape, &escaped)) {
+        if (escaped.negated) {
+          return -1;
+        }
+        for (uint32_t i = 0; i < sizeof(escaped.ascii); i++) {
+          class_bits.ascii[i] |= escaped.ascii[i];
+        }
+        continue;
+      }
+      low = regex_escape_byte(escape);
+    }
+    if (low < 0 || low >= 0x80) {
+      return -1;
+    }
+    int32_t high = low;
+    if (parser->pos + 1 < parser->length && pattern[parser->pos] == '-' &&
+        pattern[parser->pos + 1] != ']') {
+      high = (uint8_t)pattern[parser->pos + 1];
+      parser->pos += 2;
+      if (high == '\\') {
+        if (parser->pos >= parser->length) {
+          return -1;
+        }
+        high = regex_escape_byte((uint8_t)pattern[parser->pos++]);
+      }
+      if (high < low || high >= 0x80) {
+        return -1;
+      }
+    }
+    regex_class_add_range(&class_bits, (uint8_t)low, (uint8_t)high);
+  }
+  return regex_add_class(parser->regex, &class_bits);
+}
+
+// A literal non-ASCII code point, starting with [lead]: a group of its bytes,
+// so that a quantifier applies to the whole code point.
+static int32_t regex_parse_code_point(TsRegexParser *parser, uint8_t lead) {
+  const uint32_t extra = lead >= 0xF0 ? 3 : (lead >= 0xE0 ? 2 : (lead >= 0xC0 ? 1 : 0));
+  if (extra == 0 || parser->pos + extra > parser->length) {
+    return -1;
+  }
+  TsRegex *regex = parser->regex;
+  const int32_t group = regex_add_term(regex, REGEX_GROUP);
+  int32_t first = group < 0 ? -1 : regex_add_byte(regex, lead);
+  if (first < 0) {
+    return -1;
+  }
+  int32_t previous = first;
+  for (uint32_t i = 0; i < extra; i++) {
+    const uint8_t byte = (uint8_t)parser->pattern[parser->pos++];
+    const int32_t term = (byte & 0xC0) == 0x80 ? regex_add_byte(regex, byte) : -1;
+    if (term < 0) {
+      return -1;
+    }
+    regex->terms[previous].next = term;
+    previous = term;
+  }
+  int32_t last = -1;
+  return regex_add_alternative(regex, group, &last, first) ? group : -1;
+}
+
+static int32_t regex_parse_atom(TsRegexParser *parser) {
+  TsRegex *regex = parser->regex;
+  const uint8_t c = (uint8_t)parser->pattern[parser->pos++];
+  switch (c) {
+    case '(': {
+      if (parser->pos < parser->length && parser->pattern[parser->pos] == '?') {
+        if (parser->pos + 1 >= parser->length || parser->pattern[parser->pos + 1] != ':') {
+          return -1;
+        }
+        parser->pos += 2;
+      }
+      if (++parser->depth > REGEX_MAX_NESTING) {
+        return -1;
+      }
+      const int32_t group = regex_add_term(regex, REGEX_GROUP);
+      if (group < 0 || !regex_parse_alternatives(parser, group) ||
+          parser->pos >= parser->length || parser->pattern[parser->pos] != ')') {
+        return -1;
+      }
+      parser->pos++;
+      parser->depth--;
+      return group;
+    }
+    case '[':
+      return regex_parse_class(parser);
+    case '.':
+      return regex_add_term(regex, REGEX_ANY);
+    case '^':
+      return regex_add_term(regex, REGEX_TEXT_START);
+    case '$':
+      return regex_add_term(regex, REGEX_TEXT_END);
+    case '\\': {
+      if (parser->pos >= parser->length) {
+        return -1;
+      }
+      const uint8_t escape = (uint8_t)parser->pattern[parser->pos++];
+      TsRegexClass class_bits;
+      if (regex_escape_class(escape, &class_bits)) {
+        return regex_add_class(regex, &class_bits);
+      }
+      const int32_t byte = regex_escape_byte(escape);
+      return byte < 0 ? -1 : regex_add_byte(regex, (uint8_t)byte);
+    }
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+      return -1;
+    default:
+      return c < 0x80 ? regex_add_byte(regex, c) : regex_parse_code_point(parser, c);
+  }
+}
+
+// Reads the decimal number at the parser's position into [*out_value].
+static bool regex_parse_count(TsRegexParser *parser, uint32_t *out_value) {
+  uint32_t value = 0;
+  const uint32_t start = parser->pos;
+  while (parser->pos < parser->length &&
+         parser->pattern[parser->pos] >= '0' && parser->pattern[parser->pos] <= '9') {
+    value = value * 10 + (uint32_t)(parser->pattern[parser->pos++] - '0');
+    if (value > REGEX_MAX_REPEAT) {
+      return false;
+    }
+  }
+  *out_value = value;
+  return parser->pos > start;
+}
+
+static bool regex_parse_quantifier(TsRegexParser *parser, int32_t atom) {
+  if (parser->pos >= parser->length) {
+    return true;
+  }
+  uint32_t min = 1;
+  uint32_t max = 1;
+  switch (parser->pattern[parser->pos]) {
+    case '*':
+      min = 0;
+      max = UINT32_MAX;
+      parser->pos++;
+      break;
+    case '+':
+      max = UINT32_MAX;
+      parser->pos++;
+      break;
+    case '?':
+      min = 0;
+      parser->pos++;
+      break;
+    case '{':
+      parser->pos++;
+      if (!regex_parse_count(parser, &min) || parser->pos >= parser->length) {
+        return false;
+      }
+      max = min;
+      if (parser->pattern[parser->pos] == ',') {
+        parser->pos++;
+        max = UINT32_MAX;
+        if (parser->pos < parser->length && parser->pattern[parser->pos] != '}' &&
+            (!regex_parse_count(parser, &max) || max < min)) {
+          return false;
+        }
+      }
+      if (parser->pos >= parser->length || parser->pattern[parser->pos] != '}') {
+        return false;
+      }
+      parser->pos++;
+      break;
+    default:
+      return true;
+  }
+  TsRegexTerm *term = &parser->regex->terms[atom];
+  if (term->type == REGEX_TEXT_START || term->type == REGEX_TEXT_END) {
+    return false;
+  }
+  term->min = min;
+  term->max = max;
+  if (parser->pos < parser->length && parser->pattern[parser->pos] == '?') {
+    term->greedy = false;
+    parser->pos++;
+  }
+  // Stacked or possessive quantifiers are not supported.
+  return parser->pos >= parser->length || strchr("*+?{", parser->pattern[parser->pos]) == NULL;
+}
+
+// Parses '|'-separated sequences into the alternatives of [group], up to a
+// closing parenthesis or the end of the pattern.
+static bool regex_parse_alternatives(TsRegexParser *parser, int32_t group) {
+  TsRegex *regex = parser->regex;
+  int32_t last_alternative = -1;
+  while (true) {
+    int32_t first = -1;
+    int32_t previous = -1;
+    while (parser->pos < parser->length && parser->pattern[parser->pos] != '|' &&
+           parser->pattern[parser->pos] != ')') {
+      const int32_t atom = regex_parse_atom(parser);
+      if (atom < 0 || !regex_parse_quantifier(parser, atom)) {
+        return false;
+      }
+      if (previous < 0) {
+        first = atom;
+      } else {
+        regex->terms[previous].next = atom;
+      }
+      previous = atom;
+    }
+    if (!regex_add_alternative(regex, group, &last_alternative, first)) {
+      return false;
+    }
+    if (parser->pos >= parser->length || parser->pattern[parser->pos] != '|') {
+      return true;
+    }
+    parser->pos++;
+  }
+}
+
+// Appends an instruction; returns its index, or -1 if the program would
+// exceed REGEX_MAX_PROGRAM or on allocation failure.
+static int32_t regex_emit(TsRegex *regex, TsRegexOpcode opcode) {
+  if (regex->program_count >= REGEX_MAX_PROGRAM ||
+      !array_reserve(
+        (void **)&regex->program,
+        &regex->program_capacity,
+        regex->program_count,
+        sizeof(TsRegexInstruction))) {
+    return -1;
+  }
+  TsRegexInstruction *instruction = &regex->program[regex->program_count];
+  memset(instruction, 0, sizeof(*instruction));
+  instruction->opcode = (uint8_t)opcode;
+  instruction->x = -1;
+  instruction->y = -1;
+  return (int32_t)regex->program_count++;
+}
+
+// Emits the continuation bytes of a UTF-8 sequence whose lead byte was just
+// consumed: a loop of REGEX_OP_CONTINUATION.
+static bool regex_emit_continuations(TsRegex *regex) {
+  const int32_t split = regex_emit(regex, REGEX_OP_SPLIT);
+  if (split < 0 || regex_emit(regex, REGEX_OP_CONTINUATION) < 0) {
+    return false;
+  }
+  const int32_t jump = regex_emit(regex, REGEX_OP_JUMP);
+  if (jump < 0) {
+    return false;
+  }
+  regex->program[split].x = split + 1;
+  regex->program[split].y = jump + 1;
+  regex->program[jump].x = split;
+  return true;
+}
+
+static bool regex_emit_sequence(TsRegex *regex, int32_t first);
+
+// Emits one iteration of [term_index].
+static bool regex_emit_once(TsRegex *regex, int32_t term_index) {
+  const TsRegexTerm term = regex->terms[term_index];
+  int32_t index;
+  switch (term.type) {
+    case REGEX_BYTE:
+      index = regex_emit(regex, REGEX_OP_BYTE);
+      if (index >= 0) {
+        regex->program[index].byte = term.byte;
+      }
+      return index >= 0;
+    case REGEX_ANY:
+      return regex_emit(regex, REGEX_OP_ANY) >= 0 && regex_emit_continuations(regex);
+    case REGEX_CLASS:
+      index = regex_emit(regex, REGEX_OP_CLASS);
+      if (index < 0) {
+        return false;
+      }
+      regex->program[index].class_index = term.class_index;
+      // Only negated classes match non-ASCII code points.
+      return !regex->classes[term.class_index].negated || regex_emit_continuations(regex);
+    case REGEX_TEXT_START:
+      return regex_emit(regex, REGEX_OP_TEXT_START) >= 0;
+    case REGEX_TEXT_END:
+      return regex_emit(regex, REGEX_OP_TEXT_END) >= 0;
+    case REGEX_GROUP: {
+      // SPLIT to each alternative but the last; every alternative but the
+      // last ends with a JUMP past the group. Unpatched jumps are chained
+      // through their [x].
+      int32_t jumps = -1;
+      for (int32_t i = term.first_alternative; i >= 0; i = regex->alternatives[i].next) {
+        const TsRegexAlternative alternative = regex->alternatives[i];
+        if (alternative.next < 0) {
+          if (!regex_emit_sequence(regex, alternative.first)) {
+            return false;
+          }
+          break;
+        }
+        const int32_t split = regex_emit(regex, REGEX_OP_SPLIT);
+        if (split < 0 || !regex_emit_sequence(regex, alternative.first)) {
+          return false;
+        }
+        const int32_t jump = regex_emit(regex, REGEX_OP_JUMP);
+        if (jump < 0) {
+          return false;
+        }
+        regex->program[jump].x = jumps;
+        jumps = jump;
+        regex->program[split].x = split + 1;
+        regex->program[split].y = (int32_t)regex->program_count;
+      }
+      while (jumps >= 0) {
+        const int32_t previous = regex->program[jumps].x;
+        regex->program[jumps].x = (int32_t)regex->program_count;
+        jumps = previous;
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Emits [term_index] with its repetition: [min] copies, then a loop for an
+// unbounded one or [max] - [min] optional copies.
+static bool regex_emit_term(TsRegex *regex, int32_t term_index) {
+  const uint32_t min = regex->terms[term_index].min;
+  const uint32_t max = regex->terms[term_index].max;
+  for (uint32_t i = 0; i < min; i++) {
+    if (!regex_emit_once(regex, term_index)) {
+      return false;
+    }
+  }
+  if (max == UINT32_MAX) {
+    const int32_t split = regex_emit(regex, REGEX_OP_SPLIT);
+    if (split < 0 || !regex_emit_once(regex, term_index)) {
+      return false;
+    }
+    const int32_t jump = regex_emit(regex, REGEX_OP_JUMP);
+    if (jump < 0) {
+      return false;
+    }
+    regex->program[jump].x = split;
+    regex->program[split].x = split + 1;
+    regex->program[split].y = jump + 1;
+    return true;
+  }
+  // Each optional copy may skip to the end; the skips are chained through
+  // their [y] until it is known.
+  int32_t skips = -1;
+  for (uint32_t i = min; i < max; i++) {
+    const int32_t split = regex_emit(regex, REGEX_OP_SPLIT);
+    if (split < 0) {
+      return false;
+    }
+    regex->program[split].x = split + 1;
+    regex->program[split].y = skips;
+    skips = split;
+    if (!regex_emit_once(regex, term_index)) {
+      return false;
+    }
+  }
+  while (skips >= 0) {
+    const int32_t previous = regex->program[skips].y;
+    regex->program[skips].y = (int32_t)regex->program_count;
+    skips = previous;
+  }
+  return true;
+}
+
+// Emits the sequence of terms starting at [first] (-1 for an empty one).
+static bool regex_emit_sequence(TsRegex *regex, int32_t first) {
+  for (int32_t term = first; term >= 0; term = regex->terms[term].next) {
+    if (!regex_emit_term(regex, term)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Compiles [pattern] ([length] bytes). Returns NULL for syntax outside the
+// supported subset, a program over REGEX_MAX_PROGRAM instructions, or on
+// allocation failure.
+static TsRegex *regex_compile(const char *pattern, uint32_t length) {
+  TsRegex *regex = (TsRegex *)memory_calloc(1, sizeof(TsRegex));
+  if (regex == NULL) {
+    return NULL;
+  }
+  TsRegexParser parser = { regex, pattern, length, 0, 0 };
+  const int32_t root = regex_add_term(regex, REGEX_GROUP);
+  if (root != 0 || !regex_parse_alternatives(&parser, root) || parser.pos != length ||
+      !regex_emit_term(regex, root) || regex_emit(regex, REGEX_OP_MATCH) < 0) {
+    regex_delete(regex);
+    return NULL;
+  }
+  const TsRegexAlternative *alternative = &regex->alternatives[regex->terms[0].first_alternative];
+  regex->anchored = alternative->next < 0 && alternative->first >= 0 &&
+    regex->terms[alternative->first].type == REGEX_TEXT_START;
+  memory_free(regex->terms);
+  memory_free(regex->alternatives);
+  regex->terms = NULL;
+  regex->alternatives = NULL;
+  return regex;
+}
+
+// Thread lists of a Pike VM run: the instructions waiting to consume the byte
+// at the current position ([current]) and the next one ([next]). [marks]
+// holds, per instruction, the last position it was added to a list for, so an
+// instruction is added once per position and empty loops terminate.
+typedef struct TsRegexThreads {
+  uint32_t *current;
+  uint32_t current_count;
+  uint32_t *next;
+  uint32_t next_count;
+  uint32_t *marks;
+  uint32_t *stack;
+} TsRegexThreads;
+
+// Adds [pc] and everything reachable from it without consuming a byte at
+// [pos] to the [next] list. Returns true once REGEX_OP_MATCH is reached.
+static bool regex_add_thread(
+  const TsRegex *regex,
+  TsRegexThreads *threads,
+  int32_t pc,
+  uint32_t pos,
+  uint32_t length
+) {
+  uint32_t depth = 0;
+  if (threads->marks[pc] != pos) {
+    threads->marks[pc] = pos;
+    threads->stack[depth++] = (uint32_t)pc;
+  }
+  while (depth > 0) {
+    const uint32_t index = threads->stack[--depth];
+    const TsRegexInstruction *instruction = &regex->program[index];
+    int32_t follow[2] = { -1, -1 };
+    switch (instruction->opcode) {
+      case REGEX_OP_MATCH:
+        return true;
+      case REGEX_OP_JUMP:
+        follow[0] = instruction->x;
+        break;
+      case REGEX_OP_SPLIT:
+        follow[0] = instruction->x;
+        follow[1] = instruction->y;
+        break;
+      case REGEX_OP_TEXT_START:
+        follow[0] = pos == 0 ? (int32_t)index + 1 : -1;
+        break;
+      case REGEX_OP_TEXT_END:
+        follow[0] = pos == length ? (int32_t)index + 1 : -1;
+        break;
+      default:
+        threads->next[threads->next_count++] = index;
+        break;
+    }
+    for (int i = 0; i < 2; i++) {
+      if (follow[i] >= 0 && threads->marks[follow[i]] != pos) {
+        threads->marks[follow[i]] = pos;
+        threads->stack[depth++] = (uint32_t)follow[i];
+      }
+    }
+  }
+  return false;
+}
+
+// Whether the consuming [instruction] accepts [byte]. . and classes start on
+// a code point and leave its continuation bytes to REGEX_OP_CONTINUATION.
+static bool regex_accepts(const TsRegex *regex, const TsRegexInstruction *instruction, uint8_t byte) {
+  switch (instruction->opcode) {
+    case REGEX_OP_BYTE:
+      return byte == instruction->byte;
+    case REGEX_OP_ANY:
+      return byte != '\n' && (byte & 0xC0) != 0x80;
+    case REGEX_OP_CLASS: {
+      const TsRegexClass *class_bits = &regex->classes[instruction->class_index];
+      const bool in_class = byte < 0x80 && (class_bits->ascii[byte >> 3] & (1u << (byte & 7))) != 0;
+      return in_class != class_bits->negated && (byte & 0xC0) != 0x80;
+    }
+    case REGEX_OP_CONTINUATION:
+      return (byte & 0xC0) == 0x80;
+    default:
+      return false;
+  }
+}
+
+// Whether [regex] matches anywhere in [text] ([length] bytes), or
+// TEST_UNKNOWN if its thread lists can't be allocated.
+static TsTestResult regex_search(const TsRegex *regex, const char *text, uint32_t length) {
+  const uint8_t *bytes = (const uint8_t *)text;
+  const uint32_t count = regex->program_count;
+  // Small programs (the usual case) run without allocating.
+  uint32_t local[4 * 64];
+  uint32_t *scratch = count <= 64 ? local : (uint32_t *)memory_alloc((size_t)count * 4 * sizeof(uint32_t));
+  if (scratch == NULL) {
+    return TEST_UNKNOWN;
+  }
+  TsRegexThreads threads = {
+    .current = scratch,
+    .current_count = 0,
+    .next = scratch + count,
+    .next_count = 0,
+    .marks = scratch + (size_t)count * 2,
+    .stack = scratch + (size_t)count * 3,
+  };
+  memset(threads.marks, 0xFF, (size_t)count * sizeof(uint32_t));
+
+  TsTestResult result = TEST_FALSE;
+  for (uint32_t pos = 0; result == TEST_FALSE; pos++) {
+    // [next] holds the threads for [pos]; a new match attempt starts at every
+    // code point unless the regex is anchored.
+    if ((pos == 0 || !regex->anchored) &&
+        (pos == length || (bytes[pos] & 0xC0) != 0x80) &&
+        regex_add_thread(regex, &threads, 0, pos, length)) {
+      result = TEST_TRUE;
+      break;
+    }
+    uint32_t *swap = threads.current;
+    threads.current = threads.next;
+    threads.current_count = threads.next_count;
+    threads.next = swap;
+    threads.next_count = 0;
+    if (pos == length || (threads.current_count == 0 && regex->anchored)) {
+      break;
+    }
+    for (uint32_t i = 0; i < threads.current_count; i++) {
+      const uint32_t pc = threads.current[i];
+      if (regex_accepts(regex, &regex->program[pc], bytes[pos]) &&
+          regex_add_thread(regex, &threads, (int32_t)pc + 1, pos + 1, length)) {
+        result = TEST_TRUE;
+        break;
+      }
+    }
+  }
+  if (scratch != local) {
+    memory_free(scratch);
+  }
+  return result;
+}
+
+static void query_predicates_delete(TsQueryPredicates *predicates) {
+  if (predicates == NULL) {
+    return;
+  }
+  for (uint32_t i = 0; i < predicates->predicate_count; i++) {
+    regex_delete(predicates->predicates[i].regex);
+  }
+  memory_free(predicates->pattern_starts);
+  memory_free(predicates->predicates);
+  memory_free(predicates->strings);
+  memory_free(predicates);
+}
+
+// Adds the predicate spelled by [steps] (its name first, up to the Done step)
+// to [predicates], if it is a text predicate with valid arguments. Returns
+// false on allocation failure or a #match? regex regex_compile rejects.
+static bool query_predicates_add(
+  TsQueryPredicates *predicates,
+  const TSQuery *query,
+  const TSQueryPredicateStep *steps,
+  uint32_t step_count
+) {
+  if (step_count < 3 || steps[0].type != TSQueryPredicateStepTypeString ||
+      steps[1].type != TSQueryPredicateStepTypeCapture) {
+    return true;
+  }
+  uint32_t name_length = 0;
+  const char *name = ts_query_string_value_for_id(query, steps[0].value_id, &name_length);
+  TsTextPredicate predicate;
+  memset(&predicate, 0, sizeof(predicate));
+  predicate.capture_id = steps[1].value_id;
+  if (name_length > 4 && memcmp(name, "not-", 4) == 0) {
+    predicate.negated = true;
+    name += 4;
+    name_length -= 4;
+  }
+  if (name_length == 7 && memcmp(name, "any-of?", 7) == 0) {
+    predicate.kind = TEXT_PREDICATE_ANY_OF;
+  } else {
+    // #any-eq?, #any-not-eq?, #any-match?, #any-not-match?
+    if (!predicate.negated && name_length > 4 && memcmp(name, "any-", 4) == 0) {
+      predicate.any = true;
+      name += 4;
+      name_length -= 4;
+      if (name_length > 4 && memcmp(name, "not-", 4) == 0) {
+        predicate.negated = true;
+        name += 4;
+        name_length -= 4;
+      }
+    }
+    if (name_length == 3 && memcmp(name, "eq?", 3) == 0) {
+      predicate.kind = TEXT_PREDICATE_EQ;
+    } else if (name_length == 6 && memcmp(name, "match?", 6) == 0) {
+      predicate.kind = TEXT_PREDICATE_MATCH;
+    } else {
+      return true;
+    }
+  }
+
+  if (predicate.kind == TEXT_PREDICATE_EQ && step_count == 3 &&
+      steps[2].type == TSQueryPredicateStepTypeCapture) {
+    predicate.compare_capture = true;
+    predicate.other_capture_id = steps[2].value_id;
+  } else {
+    if (predicate.kind != TEXT_PREDICATE_ANY_OF && step_count != 3) {
+      return true;
+    }
+    predicate.first_string = predicates->string_count;
+    for (uint32_t i = 2; i < step_count; i++) {
+      if (steps[i].type != TSQueryPredicateStepTypeString) {
+        predicates->string_count = predicate.first_string;
+        return true;
+      }
+      if (!array_reserve(
+            (void **)&predicates->strings,
+            &predicates->string_capacity,
+            predicates->string_count,
+            sizeof(TsPredicateString))) {
+        return false;
+      }
+      TsPredicateString *string = &predicates->strings[predicates->string_count++];
+      string->value = ts_query_string_value_for_id(query, steps[i].value_id, &string->length);
+      predicate.string_count++;
+    }
+  }
+  if (predicate.kind == TEXT_PREDICATE_MATCH) {
+    const TsPredicateString *pattern = &predicates->strings[predicate.first_string];
+    predicate.regex = regex_compile(pattern->value, pattern->length);
+    if (predicate.regex == NULL) {
+      return false;
+    }
+  }
+
+  if (!array_reserve(
+        (void **)&predicates->predicates,
+        &predicates->predicate_capacity,
+        predicates->predicate_count,
+        sizeof(TsTextPredicate))) {
+    regex_delete(predicate.regex);
+    return false;
+  }
+  predicates->predicates[predicates->predicate_count++] = predicate;
+  return true;
+}
+
+// Compiles the text predicates of [query] into [*out_predicates], which is
+// left NULL when it has none. Returns false on allocation failure or an
+// unsupported #match? regex; the query is then treated as invalid.
+static bool query_predicates_compile(const TSQuery *query, TsQueryPredicates **out_predicates) {
+  *out_predicates = NULL;
+  const uint32_t pattern_count = ts_query_pattern_count(query);
+  TsQueryPredicates *predicates = (TsQueryPredicates *)memory_calloc(1, sizeof(TsQueryPredicates));
+  if (predicates == NULL) {
+    return false;
+  }
+  predicates->pattern_count = pattern_count;
+  predicates->pattern_starts = (uint32_t *)memory_calloc((size_t)pattern_count + 1, sizeof(uint32_t));
+  if (predicates->pattern_starts == NULL) {
+    query_predicates_delete(predicates);
+    return false;
+  }
+  for (uint32_t pattern = 0; pattern < pattern_count; pattern++) {
+    predicates->pattern_starts[pattern] = predicates->predicate_count;
+    uint32_t step_count = 0;
+    const TSQueryPredicateStep *steps = ts_query_predicates_for_pattern(query, pattern, &step_count);
+    uint32_t start = 0;
+    for (uint32_t i = 0; i < step_count; i++) {
+      if (steps[i].type != TSQueryPredicateStepTypeDone) {
+        continue;
+      }
+      if (!query_predicates_add(predicates, query, steps + start, i - start)) {
+        query_predicates_delete(predicates);
+        return false;
+      }
+      start = i + 1;
+    }
+  }
+  predicates->pattern_starts[pattern_count] = predicates->predicate_count;
+  if (predicates->predicate_count == 0) {
+    query_predicates_delete(predicates);
+    return true;
+  }
+  *out_predicates = predicates;
+  return true;
+}
+
+// Bytes [start, end) of [source] as one run: in place, unless they straddle
+// two chunks of a tracked text, in which case they are copied into
+// *[scratch] (which the caller frees). NULL if that copy can't be allocated.
+static const char *source_text_slice(
+  const TsSourceText *source,
+  uint32_t start,
+  uint32_t end,
+  char **scratch
+) {
+  if (start == end) {
+    return "";
+  }
+  uint32_t run_start;
+  uint32_t run_length;
+  const char *run = source_text_run(source, start, &run_start, &run_length);
+  if (end <= run_start + run_length) {
+    return run + (start - run_start);
+  }
+  memory_free(*scratch);
+  *scratch = (char *)memory_alloc(end - start);
+  if (*scratch != NULL) {
+    source_text_copy(source, start, end, *scratch);
+  }
+  return *scratch;
+}
+
+static TsTestResult text_predicate_test(
+  const TsQueryPredicates *predicates,
+  const TsTextPredicate *predicate,
+  const char *text,
+  uint32_t length,
+  const TSQueryMatch *match,
+  const TsSourceText *source
+) {
+  if (predicate->kind == TEXT_PREDICATE_MATCH) {
+    return regex_search(predicate->regex, text, length);
+  }
+  if (predicate->compare_capture) {
+    for (uint16_t i = 0; i < match->capture_count; i++) {
+      if (match->captures[i].index != predicate->other_capture_id) {
+        continue;
+      }
+      const TSNode other = match->captures[i].node;
+      const uint32_t start = ts_node_start_byte(other);
+      const uint32_t end = ts_node_end_byte(other);
+      if (end > source->length || end - start != length) {
+        return TEST_FALSE;
+      }
+      char *scratch = NULL;
+      const char *other_text = source_text_slice(source, start, end, &scratch);
+      const TsTestResult result = other_text == NULL
+        ? TEST_UNKNOWN
+        : (memcmp(other_text, text, length) == 0 ? TEST_TRUE : TEST_FALSE);
+      memory_free(scratch);
+      return result;
+    }
+    return TEST_TRUE;
+  }
+  // #eq? has one string, #any-of? one or more.
+  for (uint32_t i = 0; i < predicate->string_count; i++) {
+    const TsPredicateString *string = &predicates->strings[predicate->first_string + i];
+    if (string->length == length && memcmp(string->value, text, length) == 0) {
+      return TEST_TRUE;
+    }
+  }
+  return TEST_FALSE;
+}
+
+// Whether [match] passes the text predicates of its pattern, testing the
+// captured nodes' text in [source]. Predicates on a capture that did not
+// take part in the match (an optional one) pass, and so do tests whose
+// outcome is unknown (one that ran out of memory), which are treated as
+// unevaluated rather than dropping the capture.
+static bool query_match_passes(
+  const TsQueryPredicates *predicates,
+  const TSQueryMatch *match,
+  const TsSourceText *source
+) {
+  if (predicates == NULL || source == NULL || match->pattern_index >= predicates->pattern_count) {
+    return true;
+  }
+  const uint32_t source_length = source->length;
+  char *scratch = NULL;
+  bool passes = true;
+  const uint32_t end = predicates->pattern_starts[match->pattern_index + 1];
+  for (uint32_t p = predicates->pattern_starts[match->pattern_index]; passes && p < end; p++) {
+    const TsTextPredicate *predicate = &predicates->predicates[p];
+    bool seen = false;
+    bool any_passed = false;
+    bool all_passed = true;
+    for (uint16_t i = 0; i < match->capture_count; i++) {
+      if (match->captures[i].index != predicate->capture_id) {
+        continue;
+      }
+      const TSNode node = match->captures[i].node;
+      const uint32_t start = ts_node_start_byte(node);
+      const uint32_t node_end = ts_node_end_byte(node);
+      if (node_end > source_length || node_end < start) {
+        continue;
+      }
+      const char *text = source_text_slice(source, start, node_end, &scratch);
+      if (text == NULL) {
+        continue;
+      }
+      seen = true;
+      const TsTestResult result = text_predicate_test(
+        predicates,
+        predicate,
+        text,
+        node_end - start,
+        match,
+        source
+      );
+      const bool passed = result == TEST_UNKNOWN || predicate->negated != (result == TEST_TRUE);
+      any_passed = any_passed || passed;
+      all_passed = all_passed && passed;
+    }
+    if (seen && !(predicate->any ? any_passed : all_passed)) {
+      passes = false;
+    }
+  }
+  memory_free(scratch);
+  return passes;
+}
+
+// --- parser pool and query cache ---------------------------------------------
+//
+// The stateless entry points (ts_parse_sexp, ts_tokens, ts_query_captures...)
+// are called from many isolates at once. Instead of creating a parser and
+// compiling the query on every call they borrow a ready parser from a
+// per-language pool and look the query up in a shared cache.
+
+typedef struct ParserPool {
+  TsMutex mutex;
+  TSParser *idle[LANGUAGE_COUNT][PARSER_POOL_CAPACITY];
+  uint32_t idle_count[LANGUAGE_COUNT];
+} ParserPool;
+
+static ParserPool parser_pool = { TS_MUTEX_INITIALIZER, { { NULL } }, { 0 } };
+
+// Returns a parser set up for [language_id], or NULL. Hand it back with
+// parser_pool_release.
+static TSParser *parser_pool_acquire(int32_t language_id) {
+  const TSLanguage *ts_language = language_from_id(language_id);
+  if (ts_language == NULL) {
+    return NULL;
+  }
+
+  TSParser *parser = NULL;
+  ts_mutex_lock(&parser_pool.mutex);
+  if (parser_pool.idle_count[language_id] > 0) {
+    parser = parser_pool.idle[language_id][--parser_pool.idle_count[language_id]];
+  }
+  ts_mutex_unlock(&parser_pool.mutex);
+  if (parser != NULL) {
+    return parser;
+  }
+
+  parser = ts_parser_new();
+  if (parser == NULL) {
+    return NULL;
+  }
+  if (!ts_parser_set_language(parser, ts_language)) {
+    ts_parser_delete(parser);
+    return NULL;
+  }
+  return parser;
+}
+
+static void parser_pool_release(int32_t language_id, TSParser *parser) {
+  if (parser == NULL) {
+    return;
+  }
+  ts_parser_reset(parser);
+  ts_mutex_lock(&parser_pool.mutex);
+  if (parser_pool.idle_count[language_id] < PARSER_POOL_CAPACITY) {
+    parser_pool.idle[language_id][parser_pool.idle_count[language_id]++] = parser;
+    parser = NULL;
+  }
+  ts_mutex_unlock(&parser_pool.mutex);
+  if (parser != NULL) {
+    ts_parser_delete(parser);
+  }
+}
+
+// A compiled query held by the cache. [refs] counts the callers using it
+// and [last_used] orders entries for eviction; both change under the cache
+// mutex.
+struct QueryCacheEntry {
+  int32_t language_id;
+  uint64_t hash;
+  uint32_t length;
+  char *source;
+  TSQuery *query;
+  TsQueryPredicates *predicates;
+  uint32_t refs;
+  uint64_t last_used;
+};
+
+// Up to QUERY_CACHE_CAPACITY entries; when it is full the least recently
+// used entry nobody holds makes room for a new query.
+typedef struct QueryCache {
+  TsMutex mutex;
+  QueryCacheEntry *entries[QUERY_CACHE_CAPACITY];
+  uint32_t count;
+  uint64_t clock;
+} QueryCache;
+
+static QueryCache query_cache = { TS_MUTEX_INITIALIZER, { NULL }, 0, 0 };
+
+static uint64_t fnv1a_hash_update(uint64_t hash, const char *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static uint64_t fnv1a_hash(const char *data, size_t length) {
+  return fnv1a_hash_update(1469598103934665603ULL, data, length);
+}
+
+static void query_cache_entry_delete(QueryCacheEntry *entry) {
+  query_predicates_delete(entry->predicates);
+  ts_query_delete(entry->query);
+  memory_free(entry->source);
+  memory_free(entry);
+}
+
+// Returns the entry for the query, taking a reference to it, or NULL. Must be
+// called with the cache mutex held.
+static QueryCacheEntry *query_cache_find_locked(
+  int32_t language_id,
+  uint64_t hash,
+  const char *source,
+  uint32_t length
+) {
+  for (uint32_t i = 0; i < query_cache.count; i++) {
+    QueryCacheEntry *entry = query_cache.entries[i];
+    if (entry->language_id == language_id && entry->hash == hash &&
+        entry->length == length && memcmp(entry->source, source, length) == 0) {
+      entry->refs++;
+      entry->last_used = ++query_cache.clock;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+// Returns the compiled [utf8_query] for [language_id], compiling it on first
+// use, and sets [*out_predicates] to its text predicates (NULL when it has
+// none). Queries are compiled outside the cache lock so a slow compile does
+// not block other threads. [*out_entry] is set to the cache entry the query
+// belongs to, or to NULL when every entry is in use and the query was not
+// cached; either way the caller releases it with query_cache_release.
+static TSQuery *query_cache_acquire(
+  int32_t language_id,
+  const char *utf8_query,
+  TsQueryPredicates **out_predicates,
+  QueryCacheEntry **out_entry
+) {
+  *out_entry = NULL;
+  *out_predicates = NULL;
+  const TSLanguage *ts_language = language_from_id(language_id);
+  if (ts_language == NULL || utf8_query == NULL) {
+    return NULL;
+  }
+  const uint32_t length = (uint32_t)strlen(utf8_query);
+  const uint64_t hash = fnv1a_hash(utf8_query, length);
+
+  ts_mutex_lock(&query_cache.mutex);
+  QueryCacheEntry *cached = query_cache_find_locked(language_id, hash, utf8_query, length);
+  ts_mutex_unlock(&query_cache.mutex);
+  if (cached != NULL) {
+    *out_entry = cached;
+    *out_predicates = cached->predicates;
+    return cached->query;
+  }
+
+  // Cached queries outlive whichever document asked first.
+  uint32_t error_offset = 0;
+  TSQueryError error_type = TSQueryErrorNone;
+  TsMemoryAccount *previous = memory_scope_enter(NULL);
+  TSQuery *query = ts_query_new(
+    ts_language,
+    utf8_query,
+    length,
+    &error_offset,
+    &error_type
+  );
+  TsQueryPredicates *predicates = NULL;
+  const bool predicates_ok = query != NULL && query_predicates_compile(query, &predicates);
+  QueryCacheEntry *entry = predicates_ok
+    ? (QueryCacheEntry *)memory_calloc(1, sizeof(QueryCacheEntry))
+    : NULL;
+  char *copy = entry != NULL ? (char *)memory_alloc((size_t)length + 1) : NULL;
+  memory_scope_leave(previous);
+  if (!predicates_ok) {
+    if (query != NULL) {
+      ts_query_delete(query);
+    }
+    return NULL;
+  }
+  *out_predicates = predicates;
+  if (copy == NULL) {
+    memory_free(entry);
+    return query;
+  }
+  memcpy(copy, utf8_query, length);
+  copy[length] = '\0';
+  entry->language_id = language_id;
+  entry->hash = hash;
+  entry->length = length;
+  entry->source = copy;
+  entry->query = query;
+  entry->predicates = predicates;
+  entry->refs = 1;
+
+  QueryCacheEntry *evicted = NULL;
+  ts_mutex_lock(&query_cache.mutex);
+  // Another thread may have compiled the same query meanwhile.
+  cached = query_cache_find_locked(language_id, hash, utf8_query, length);
+  if (cached == NULL) {
+    uint32_t slot = query_cache.count;
+    if (slot == QUERY_CACHE_CAPACITY) {
+      for (uint32_t i = 0; i < QUERY_CACHE_CAPACITY; i++) {
+        const QueryCacheEntry *candidate = query_cache.entries[i];
+        if (candidate->refs == 0 && (slot == QUERY_CACHE_CAPACITY ||
+            candidate->last_used < query_cache.entries[slot]->last_used)) {
+          slot = i;
+        }
+      }
+    }
+    if (slot < QUERY_CACHE_CAPACITY) {
+      if (slot == query_cache.count) {
+        query_cache.count++;
+      } else {
+        evicted = query_cache.entries[slot];
+      }
+      entry->last_used = ++query_cache.clock;
+      query_cache.entries[slot] = entry;
+      *out_entry = entry;
+    }
+  }
+  ts_mutex_unlock(&query_cache.mutex);
+
+  if (evicted != NULL) {
+    query_cache_entry_delete(evicted);
+  }
+  if (cached != NULL) {
+    query_cache_entry_delete(entry);
+    *out_entry = cached;
+    *out_predicates = cached->predicates;
+    return cached->query;
+  }
+  if (*out_entry == NULL) {
+    // Every entry is in use: the caller keeps this compile to itself.
+    memory_free(entry->source);
+    memory_free(entry);
+  }
+  return query;
+}
+
+// Releases a query from query_cache_acquire: drops the reference to its cache
+// [entry], or deletes it when it was not cached.
+static void query_cache_release(
+  TSQuery *query,
+  TsQueryPredicates *predicates,
+  QueryCacheEntry *entry
+) {
+  if (entry != NULL) {
+    ts_mutex_lock(&query_cache.mutex);
+    entry->refs--;
+    ts_mutex_unlock(&query_cache.mutex);
+  } else if (query != NULL) {
+    query_predicates_delete(predicates);
+    ts_query_delete(query);
+  }
+}
+
+// The queries embedded by the build hook, compiled on first use. They live
+// until the process exits, so documents share them without reference counts.
+// Each slot is published once and then read without a lock.
+
+typedef struct TsBuiltinQuery {
+  // NULL when the query is empty or does not compile.
+  TSQuery *query;
+  TsQueryPredicates *predicates;
+} TsBuiltinQuery;
+
+static const char *const builtin_query_sources[LANGUAGE_COUNT][QUERY_KIND_COUNT] = {
+  { ts_builtin_query_c_highlights },
+  { ts_builtin_query_javascript_highlights },
+  { ts_builtin_query_dart_highlights },
+};
+
+// Points at a TsBuiltinQuery once the slot's query was compiled.
+static TsAtomicPointer builtin_queries[LANGUAGE_COUNT][QUERY_KIND_COUNT];
+
+// Returns the built-in query of [kind] for [language_id], compiling it on the
+// first call. Returns NULL if it is empty (its file was missing at build
+// time) or does not compile.
+static const TsBuiltinQuery *builtin_query_get(int32_t language_id, int32_t kind) {
+  const TSLanguage *ts_language = language_from_id(language_id);
+  if (ts_language == NULL || kind < 0 || kind >= QUERY_KIND_COUNT) {
+    return NULL;
+  }
+  TsAtomicPointer *slot = &builtin_queries[language_id][kind];
+  const TsBuiltinQuery *entry = (const TsBuiltinQuery *)ts_atomic_pointer_get(slot);
+  if (entry == NULL) {
+    // Threads that race here each compile a copy; the first one published
+    // wins and the others drop theirs.
+    const char *source = builtin_query_sources[language_id][kind];
+    const uint32_t length = (uint32_t)strlen(source);
+    uint32_t error_offset = 0;
+    TSQueryError error_type = TSQueryErrorNone;
+    TsMemoryAccount *previous = memory_scope_enter(NULL);
+    TsBuiltinQuery *compiled = (TsBuiltinQuery *)memory_calloc(1, sizeof(TsBuiltinQuery));
+    TSQuery *query = compiled != NULL && length > 0
+      ? ts_query_new(ts_language, source, length, &error_offset, &error_type)
+      : NULL;
+    TsQueryPredicates *predicates = NULL;
+    if (query != NULL && !query_predicates_compile(query, &predicates)) {
+      ts_query_delete(query);
+      query = NULL;
+    }
+    memory_scope_leave(previous);
+    if (compiled == NULL) {
+      return NULL;
+    }
+    compiled->query = query;
+    compiled->predicates = predicates;
+    if (ts_atomic_pointer_publish(slot, compiled)) {
+      entry = compiled;
+    } else {
+      if (query != NULL) {
+        query_predicates_delete(predicates);
+        ts_query_delete(query);
+      }
+      memory_free(compiled);
+      entry = (const TsBuiltinQuery *)ts_atomic_pointer_get(slot);
+    }
+  }
+  return entry->query != NULL ? entry : NULL;
+}
+
+FFI_PLUGIN_EXPORT bool ts_doc_select_query(void* doc_ptr, int32_t kind) {
+  if (doc_ptr == NULL) {
+    return false;
+  }
+  if (kind < 0 || kind >= QUERY_KIND_COUNT) {
+    return false;
+  }
+  // Compiled by the first query that uses it, unless ts_warm_up got there
+  // first.
+  ((TsDoc *)doc_ptr)->builtin_query_kind = kind;
+  return true;
+}
+
+// Warm-up: compiles every built-in query and fills the parser pool on a
+// detached thread, so the first highlight of a file does not pay for it.
+
+typedef struct TsWarmUp {
+  uint32_t parsers_per_language;
+  TsWarmUpCallback on_complete;
+} TsWarmUp;
+
+static bool warm_up_run(uint32_t parsers_per_language) {
+  bool ok = true;
+  for (int32_t language_id = 0; language_id < LANGUAGE_COUNT; language_id++) {
+    for (int32_t kind = 0; kind < QUERY_KIND_COUNT; kind++) {
+      ok = builtin_query_get(language_id, kind) != NULL && ok;
+    }
+    // Taking the parsers out together makes the pool create the missing ones;
+    // handing them back leaves them idle in the pool.
+    TSParser *parsers[PARSER_POOL_CAPACITY];
+    uint32_t count = 0;
+    while (count < parsers_per_language && count < PARSER_POOL_CAPACITY) {
+      parsers[count] = parser_pool_acquire(language_id);
+      if (parsers[count] == NULL) {
+        ok = false;
+        break;
+      }
+      count++;
+    }
+    while (count > 0) {
+      parser_pool_release(language_id, parsers[--count]);
+    }
+  }
+  return ok;
+}
+
+#if _WIN32
+static DWORD WINAPI warm_up_main(LPVOID arg) {
+#else
+static void *warm_up_main(void *arg) {
+#endif
+  TsWarmUp warm_up = *(TsWarmUp *)arg;
+  memory_free(arg);
+  const bool ok = warm_up_run(warm_up.parsers_per_language);
+  if (warm_up.on_complete != NULL) {
+    warm_up.on_complete(ok);
+  }
+#if _WIN32
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+FFI_PLUGIN_EXPORT bool ts_warm_up(
+  uint32_t parsers_per_language,
+  TsWarmUpCallback on_complete
+) {
+  TsWarmUp *warm_up = (TsWarmUp *)memory_alloc(sizeof(TsWarmUp));
+  if (warm_up == NULL) {
+    return false;
+  }
+  warm_up->parsers_per_language = parsers_per_language;
+  warm_up->on_complete = on_complete;
+#if _WIN32
+  HANDLE thread = CreateThread(NULL, 0, warm_up_main, warm_up, 0, NULL);
+  const bool started = thread != NULL;
+  if (started) {
+    CloseHandle(thread);
+  }
+#else
+  pthread_t thread;
+  const bool started = pthread_create(&thread, NULL, warm_up_main, warm_up) == 0;
+  if (started) {
+    pthread_detach(thread);
+  }
+#endif
+  if (!started) {
+    memory_free(warm_up);
+  }
+  return started;
+}
+
+FFI_PLUGIN_EXPORT void* ts_doc_new(int32_t language) {
+  const TSLanguage *ts_language = language_from_id(language);
+  if (ts_language == NULL) {
+    return NULL;
+  }
+
+  TsMemoryAccount *account = memory_account_new();
+  if (account == NULL) {
+    return NULL;
+  }
+  TsMemoryAccount *previous = memory_scope_enter(account);
+  TSParser *parser = ts_parser_new();
+  const bool language_ok = parser != NULL && ts_parser_set_language(parser, ts_language);
+  TsDoc *doc = language_ok ? (TsDoc *)memory_calloc(1, sizeof(TsDoc)) : NULL;
+  memory_scope_leave(previous);
+  if (doc == NULL) {
+    if (parser != NULL) {
+      ts_parser_delete(parser);
+    }
+    memory_account_release(account);
+    return NULL;
+  }
+  ts_mutex_init(&doc->stats_mutex);
+  ts_mutex_init(&doc->snapshot_mutex);
+  doc->memory = account;
+  doc->parser = parser;
+  doc->language = ts_language;
+  doc->language_id = language;
+  doc->tree = NULL;
+  doc->query = NULL;
+  doc->query_source = NULL;
+  doc->builtin_query_kind = -1;
+  return (void *)doc;
+}
+
+// Creates the parser of a document whose workspace evicted it. Call inside
+// the document's memory scope.
+static bool ts_doc_ensure_parser(TsDoc *doc) {
+  if (doc->parser != NULL) {
+    return true;
+  }
+  TSParser *parser = ts_parser_new();
+  if (parser == NULL) {
+    return false;
+  }
+  if (!ts_parser_set_language(parser, doc->language)) {
+    ts_parser_delete(parser);
+    return false;
+  }
+  doc->parser = parser;
+  return true;
+}
+
+static void ts_doc_clear_highlight_styles(TsDoc *doc) {
+  for (uint32_t i = 0; i < doc->style_count; i++) {
+    memory_free(doc->style_names[i]);
+  }
+  memory_free(doc->style_names);
+  memory_free(doc->style_priorities);
+  memory_free(doc->style_ids);
+  memory_free(doc->capture_styles);
+  doc->style_names = NULL;
+  doc->style_priorities = NULL;
+  doc->style_ids = NULL;
+  doc->style_count = 0;
+  doc->capture_styles = NULL;
+}
+
+// --- asynchronous reparse ----------------------------------------------------
+
+static void ts_doc_run_job(
+  TsDoc *doc,
+  const char *utf8_query,
+  int32_t result_kind,
+  uint32_t **out_result,
+  uint32_t *out_count,
+  char **out_capture_names
+) {
+  switch (result_kind) {
+    case TS_ASYNC_RESULT_CAPTURES:
+      *out_result = ts_doc_query_captures_packed(
+        doc,
+        utf8_query,
+        out_count,
+        out_capture_names
+      );
+      break;
+    case TS_ASYNC_RESULT_HIGHLIGHT_SPANS:
+      *out_result = ts_doc_highlight_spans(doc, utf8_query, 0, UINT32_MAX, out_count);
+      break;
+    default:
+      break;
+  }
+}
+
+static void ts_doc_worker_loop(TsDoc *doc) {
+  TsDocWorker *worker = doc->worker;
+  ts_mutex_lock(&worker->mutex);
+  while (true) {
+    while (!worker->has_job && !worker->stopping) {
+      ts_cond_wait(&worker->cond, &worker->mutex);
+    }
+    if (worker->stopping) {
+      break;
+    }
+    TsTextBuffer *text = worker->job_text;
+    const bool tracked = worker->job_tracked;
+    const uint64_t generation = worker->job_generation;
+    const bool restore = worker->job_restore;
+    char *query = worker->job_query;
+    const int32_t result_kind = worker->job_result_kind;
+    const int64_t id = worker->job_id;
+    const uint64_t timeout_micros = worker->job_timeout_micros;
+    TsDocReparseCallback callback = worker->job_callback;
+    worker->has_job = false;
+    worker->job_text = NULL;
+    worker->job_query = NULL;
+    ts_mutex_unlock(&worker->mutex);
+
+    uint32_t *result = NULL;
+    uint32_t count = 0;
+    char *capture_names = NULL;
+    const int32_t status = restore
+      ? ts_doc_restore(doc, text)
+      : ts_doc_reparse_source(doc, text, tracked, generation, timeout_micros);
+    if (status == TS_REPARSE_OK) {
+      doc->job_source = text;
+      ts_doc_run_job(doc, query, result_kind, &result, &count, &capture_names);
+      doc->job_source = NULL;
+    }
+    text_buffer_release(text);
+    memory_free(query);
+
+    ts_mutex_lock(&worker->mutex);
+    memory_free(worker->result);
+    memory_free(worker->result_capture_names);
+    worker->result_id = id;
+    worker->result = result;
+    worker->result_count = count;
+    worker->result_capture_names = capture_names;
+    worker->busy = false;
+    ts_mutex_unlock(&worker->mutex);
+
+    // The document is idle again before the caller hears about it.
+    if (callback != NULL) {
+      callback((void *)doc, id, status);
+    }
+    ts_mutex_lock(&worker->mutex);
+  }
+  ts_mutex_unlock(&worker->mutex);
+}
+
+#if _WIN32
+static DWORD WINAPI ts_doc_worker_main(LPVOID arg) {
+  ts_doc_worker_loop((TsDoc *)arg);
+  return 0;
+}
+#else
+static void *ts_doc_worker_main(void *arg) {
+  ts_doc_worker_loop((TsDoc *)arg);
+  return NULL;
+}
+#endif
+
+static bool ts_doc_start_worker(TsDoc *doc) {
+  if (doc->worker != NULL) {
+    return true;
+  }
+  TsDocWorker *worker = (TsDocWorker *)memory_calloc(1, sizeof(TsDocWorker));
+  if (worker == NULL) {
+    return false;
+  }
+  ts_mutex_init(&worker->mutex);
+  ts_cond_init(&worker->cond);
+  doc->worker = worker;
+#if _WIN32
+  worker->thread = CreateThread(NULL, 0, ts_doc_worker_main, doc, 0, NULL);
+  const bool started = worker->thread != NULL;
+#else
+  const bool started = pthread_create(&worker->thread, NULL, ts_doc_worker_main, doc) == 0;
+#endif
+  if (!started) {
+    ts_cond_destroy(&worker->cond);
+    ts_mutex_destroy(&worker->mutex);
+    memory_free(worker);
+    doc->worker = NULL;
+    return false;
+  }
+  return true;
+}
+
+// Waits for the running request (if any) and joins the worker thread. A
+// request the thread has not picked up yet is dropped without a callback.
+static void ts_doc_stop_worker(TsDoc *doc) {
+  TsDocWorker *worker = doc->worker;
+  if (worker == NULL) {
+    return;
+  }
+  ts_mutex_lock(&worker->mutex);
+  worker->stopping = true;
+  ts_cond_signal(&worker->cond);
+  ts_mutex_unlock(&worker->mutex);
+#if _WIN32
+  WaitForSingleObject(worker->thread, INFINITE);
+  CloseHandle(worker->thread);
+#else
+  pthread_join(worker->thread, NULL);
+#endif
+  text_buffer_release(worker->job_text);
+  memory_free(worker->job_query);
+  memory_free(worker->result);
+  memory_free(worker->result_capture_names);
+  ts_cond_destroy(&worker->cond);
+  ts_mutex_destroy(&worker->mutex);
+  memory_free(worker);
+  doc->worker = NULL;
+}
+
+FFI_PLUGIN_EXPORT bool ts_doc_reparse_async(
+  void* doc_ptr,
+  const char* utf8_source,
+  uint32_t length,
+  const char* utf8_query,
+  int32_t result_kind,
+  uint64_t timeout_micros,
+  int64_t request_id,
+  TsDocReparseCallback on_complete
+) {
+  if (doc_ptr == NULL) {
+    return false;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  if (!ts_doc_start_worker(doc)) {
+    memory_scope_leave(previous);
+    return false;
+  }
+  TsDocWorker *worker = doc->worker;
+
+  // The worker holds a reference to the tracked text as it is now, and the
+  // next edit gives the document a copy of its own, so the two never race.
+  // A caller's source is copied since it need not outlive the call.
+  TsTextBuffer *text = NULL;
+  char *query = NULL;
+  if (utf8_source != NULL) {
+    text = text_buffer_copy(utf8_source, length, false);
+  } else if (ts_doc_ensure_text(doc)) {
+    text = text_buffer_retain(doc->text);
+  }
+  if (text == NULL) {
+    memory_scope_leave(previous);
+    return false;
+  }
+  if (utf8_query != NULL) {
+    const size_t query_length = strlen(utf8_query);
+    query = (char *)memory_alloc(query_length + 1);
+    if (query == NULL) {
+      text_buffer_release(text);
+      memory_scope_leave(previous);
+      return false;
+    }
+    memcpy(query, utf8_query, query_length + 1);
+  }
+  memory_scope_leave(previous);
+
+  ts_mutex_lock(&worker->mutex);
+  if (worker->busy) {
+    ts_mutex_unlock(&worker->mutex);
+    text_buffer_release(text);
+    memory_free(query);
+    return false;
+  }
+  worker->busy = true;
+  ts_atomic_flag_set(&doc->cancel_requested, 0);
+  worker->has_job = true;
+  worker->job_text = text;
+  worker->job_tracked = utf8_source == NULL;
+  worker->job_generation = (uint64_t)ts_atomic_counter_get(&doc->text_generation);
+  worker->job_restore = false;
+  worker->job_query = query;
+  worker->job_result_kind = result_kind;
+  worker->job_id = request_id;
+  worker->job_timeout_micros = timeout_micros;
+  worker->job_callback = on_complete;
+  ts_cond_signal(&worker->cond);
+  ts_mutex_unlock(&worker->mutex);
+  return true;
+}
+
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_take_async_result(
+  void* doc_ptr,
+  int64_t request_id,
+  uint32_t* out_count,
+  char** out_capture_names
+) {
+  if (out_count != NULL) {
+    *out_count = 0;
+  }
+  if (out_capture_names != NULL) {
+    *out_capture_names = NULL;
+  }
+  if (doc_ptr == NULL || out_count == NULL) {
+    return NULL;
+  }
+  TsDocWorker *worker = ((TsDoc *)doc_ptr)->worker;
+  if (worker == NULL) {
+    return NULL;
+  }
+
+  ts_mutex_lock(&worker->mutex);
+  uint32_t *result = NULL;
+  char *capture_names = NULL;
+  if (worker->result_id == request_id) {
+    result = worker->result;
+    *out_count = worker->result_count;
+    capture_names = worker->result_capture_names;
+    worker->result = NULL;
+    worker->result_count = 0;
+    worker->result_capture_names = NULL;
+  }
+  ts_mutex_unlock(&worker->mutex);
+
+  if (out_capture_names != NULL) {
+    *out_capture_names = capture_names;
+  } else {
+    memory_free(capture_names);
+  }
+  return result;
+}
+
+FFI_PLUGIN_EXPORT void ts_doc_delete(void* doc_ptr) {
+  if (doc_ptr == NULL) {
+    return;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  if (doc->workspace != NULL) {
+    workspace_forget(doc->workspace, doc);
+  }
+  ts_doc_stop_worker(doc);
+  ts_doc_clear_query(doc);
+  // Readers may still hold it; the last of them frees it.
+  snapshot_release(doc->snapshot);
+  ts_mutex_destroy(&doc->snapshot_mutex);
+  if (doc->tree != NULL) {
+    ts_tree_delete(doc->tree);
+  }
+  if (doc->parser != NULL) {
+    ts_parser_delete(doc->parser);
+  }
+  memory_free(doc->changed_ranges);
+  ts_doc_clear_highlight_styles(doc);
+  text_buffer_release(doc->source);
+  text_buffer_release(doc->text);
+  ts_mutex_destroy(&doc->stats_mutex);
+  TsMemoryAccount *account = doc->memory;
+  memory_free(doc);
+  memory_account_release(account);
+}
+
+FFI_PLUGIN_EXPORT void ts_doc_edit(
+  void* doc_ptr,
+  uint32_t start_byte,
+  uint32_t old_end_byte,
+  uint32_t new_end_byte,
+  uint32_t start_row,
+  uint32_t start_col,
+  uint32_t old_end_row,
+  uint32_t old_end_col,
+  uint32_t new_end_row,
+  uint32_t new_end_col
+) {
+  if (doc_ptr == NULL) {
+    return;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  // A halted parse was for the text before this edit.
+  ts_atomic_counter_add(&doc->text_generation, 1);
+  if (doc->tree == NULL) {
+    if (ts_atomic_flag_get(&doc->evicted)) {
+      doc->edited_while_evicted = true;
+    }
+    return;
+  }
+  TSInputEdit edit;
+  edit.start_byte = start_byte;
+  edit.old_end_byte = old_end_byte;
+  edit.new_end_byte = new_end_byte;
+  edit.start_point = (TSPoint){ start_row, start_col };
+  edit.old_end_point = (TSPoint){ old_end_row, old_end_col };
+  edit.new_end_point = (TSPoint){ new_end_row, new_end_col };
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  ts_tree_edit(doc->tree, &edit);
+  memory_scope_leave(previous);
+
+  // Track the union of all edits in new-text coordinates so the next reparse
+  // can report text changes that leave the syntax tree shape unchanged.
+  if (!doc->has_pending_edit) {
+    doc->has_pending_edit = true;
+    doc->pending_edit_start = start_byte;
+    doc->pending_edit_end = new_end_byte;
+    return;
+  }
+  uint32_t pending_end = doc->pending_edit_end;
+  if (pending_end >= old_end_byte) {
+    pending_end = pending_end - old_end_byte + new_end_byte;
+  } else if (pending_end > start_byte) {
+    pending_end = new_end_byte;
+  }
+  if (start_byte < doc->pending_edit_start) {
+    doc->pending_edit_start = start_byte;
+  }
+  doc->pending_edit_end = pending_end > new_end_byte ? pending_end : new_end_byte;
+}
+
+static int compare_byte_ranges(const void *a, const void *b) {
+  const uint32_t *left = (const uint32_t *)a;
+  const uint32_t *right = (const uint32_t *)b;
+  if (left[0] != right[0]) {
+    return left[0] < right[0] ? -1 : 1;
+  }
+  return left[1] < right[1] ? -1 : (left[1] > right[1] ? 1 : 0);
+}
+
+// Records which byte ranges differ between [old_tree] (already edited) and
+// [new_tree], merged with the pending edit range. Without an old tree the
+// whole document counts as changed.
+static void ts_doc_update_changed_ranges(
+  TsDoc *doc,
+  const TSTree *old_tree,
+  const TSTree *new_tree,
+  uint32_t source_length
+) {
+  memory_free(doc->changed_ranges);
+  doc->changed_ranges = NULL;
+  doc->changed_range_count = 0;
+
+  uint32_t tree_range_count = 0;
+  TSRange *tree_ranges = NULL;
+  if (old_tree != NULL) {
+    tree_ranges = ts_tree_get_changed_ranges(old_tree, new_tree, &tree_range_count);
+  }
+
+  const uint32_t capacity = tree_range_count + 1;
+  uint32_t *pairs = (uint32_t *)memory_alloc((size_t)capacity * 2 * sizeof(uint32_t));
+  if (pairs == NULL) {
+    memory_free(tree_ranges);
+    return;
+  }
+  uint32_t count = 0;
+  if (old_tree == NULL) {
+    pairs[0] = 0;
+    pairs[1] = source_length;
+    count = 1;
+  } else {
+    for (uint32_t i = 0; i < tree_range_count; i++) {
+      pairs[count * 2] = tree_ranges[i].start_byte;
+      pairs[count * 2 + 1] = tree_ranges[i].end_byte;
+      count++;
+    }
+    if (doc->has_pending_edit) {
+      // Widen by a byte on each side so tokens that merely touch the edit
+      // (e.g. an identifier being extended) are included.
+      pairs[count * 2] = doc->pending_edit_start > 0 ? doc->pending_edit_start - 1 : 0;
+      pairs[count * 2 + 1] = doc->pending_edit_end + 1;
+      count++;
+    }
+  }
+  memory_free(tree_ranges);
+
+  qsort(pairs, count, 2 * sizeof(uint32_t), compare_byte_ranges);
+  uint32_t merged = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    const uint32_t start = pairs[i * 2];
+    const uint32_t end = pairs[i * 2 + 1] > source_length
+      ? source_length
+      : pairs[i * 2 + 1];
+    if (merged > 0 && start <= pairs[merged * 2 - 1]) {
+      if (end > pairs[merged * 2 - 1]) {
+        pairs[merged * 2 - 1] = end;
+      }
+      continue;
+    }
+    pairs[merged * 2] = start;
+    pairs[merged * 2 + 1] = end;
+    merged++;
+  }
+  if (merged == 0) {
+    memory_free(pairs);
+    return;
+  }
+  doc->changed_ranges = pairs;
+  doc->changed_range_count = merged;
+}
+
+// Returns how many UTF-16 code units the UTF-8 bytes [bytes, bytes + length)
+// encode: every byte that is not a continuation byte starts a code point, and
+// four-byte sequences need a surrogate pair. Eight bytes are classified at a
+// time (SWAR), with a fast path for pure ASCII words.
+static uint32_t utf16_length_of_utf8(const uint8_t *bytes, size_t length) {
+  const uint64_t high_bits = 0x8080808080808080ULL;
+  uint32_t units = 0;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    if ((word & high_bits) == 0) {
+      units += 8;
+      continue;
+    }
+    // Bit 7 of each byte: continuation (10xxxxxx) and 4-byte lead (11110xxx).
+    const uint64_t continuation = word & ~(word << 1) & high_bits;
+    const uint64_t four_byte_lead =
+      word & (word << 1) & (word << 2) & (word << 3) & high_bits;
+    // Each byte of (mask >> 7) is 0 or 1; the multiply sums them into the
+    // top byte.
+    const uint32_t continuation_count =
+      (uint32_t)((((continuation >> 7) * 0x0101010101010101ULL)) >> 56);
+    const uint32_t four_byte_count =
+      (uint32_t)((((four_byte_lead >> 7) * 0x0101010101010101ULL)) >> 56);
+    units += 8 - continuation_count + four_byte_count;
+  }
+  for (; i < length; i++) {
+    const uint8_t byte = bytes[i];
+    if ((byte & 0xC0) != 0x80) {
+      units += byte >= 0xF0 ? 2 : 1;
+    }
+  }
+  return units;
+}
+
+// Text [doc]'s tree describes: the revision the worker thread has just
+// parsed while it queries it, else the source of the last reparse, else the
+// tracked text. NULL when there is none.
+static TsTextBuffer *ts_doc_source(const TsDoc *doc) {
+  if (doc->job_source != NULL) {
+    return doc->job_source;
+  }
+  return doc->source != NULL ? doc->source : doc->text;
+}
+
+// Returns how many UTF-16 code units bytes [start, end) of [text] encode.
+static uint32_t source_text_utf16_length(const TsSourceText *text, uint32_t start, uint32_t end) {
+  uint32_t units = 0;
+  while (start < end) {
+    uint32_t run_start;
+    uint32_t run_length;
+    const char *run = source_text_run(text, start, &run_start, &run_length);
+    const uint32_t run_end = run_start + run_length < end ? run_start + run_length : end;
+    units += utf16_length_of_utf8((const uint8_t *)run + (start - run_start), run_end - start);
+    start = run_end;
+  }
+  return units;
+}
+
+// Last position converted by text_buffer_byte_to_utf16, from which a nearby
+// offset on the same line is reached without scanning from the line start.
+typedef struct TsUtf16Cursor {
+  uint32_t byte;
+  uint32_t utf16;
+} TsUtf16Cursor;
+
+// Maps [byte] in [buffer] to UTF-16 code units: the line index gives the
+// offsets of its line start (or of its chunk, when the line starts in an
+// earlier one), and only the bytes from there (or from [cursor], when it is
+// closer on the same line) are counted. [cursor] may be NULL. Without a line
+// index the offset is returned as is.
+static uint32_t text_buffer_byte_to_utf16(
+  const TsTextBuffer *buffer,
+  uint32_t byte,
+  TsUtf16Cursor *cursor
+) {
+  if (buffer == NULL || !buffer->indexed) {
+    return byte;
+  }
+  if (byte > buffer->length) {
+    byte = buffer->length;
+  }
+  const TsSourceText text = text_buffer_view(buffer);
+  uint32_t line_byte;
+  uint32_t line_utf16;
+  text_buffer_anchor(buffer, byte, false, &line_byte, &line_utf16);
+  uint32_t utf16;
+  if (cursor != NULL && cursor->byte >= line_byte && cursor->byte <= byte) {
+    utf16 = cursor->utf16 + source_text_utf16_length(&text, cursor->byte, byte);
+  } else if (cursor != NULL && cursor->byte > byte && cursor->byte - byte < byte - line_byte) {
+    utf16 = cursor->utf16 - source_text_utf16_length(&text, byte, cursor->byte);
+  } else {
+    utf16 = line_utf16 + source_text_utf16_length(&text, line_byte, byte);
+  }
+  if (cursor != NULL) {
+    cursor->byte = byte;
+    cursor->utf16 = utf16;
+  }
+  return utf16;
+}
+
+// Maps [utf16] code units in [buffer] to a byte offset on a code point
+// boundary; an offset inside a surrogate pair maps to the end of that code
+// point. Without a line index the offset is returned as is.
+static uint32_t text_buffer_utf16_to_byte(const TsTextBuffer *buffer, uint32_t utf16) {
+  if (buffer == NULL || !buffer->indexed) {
+    return utf16;
+  }
+  if (utf16 >= buffer->utf16_length) {
+    return buffer->length;
+  }
+  uint32_t byte;
+  uint32_t units;
+  const TsTextChunkRef *ref = text_buffer_anchor(buffer, utf16, true, &byte, &units);
+  // The chunk holds whole code points and ends past [utf16].
+  const TsTextChunk *chunk = ref->chunk;
+  const uint8_t *bytes = (const uint8_t *)chunk->data;
+  uint32_t i = byte - ref->byte;
+  while (i < chunk->length && units < utf16) {
+    units += bytes[i] >= 0xF0 ? 2 : 1;
+    i++;
+    while (i < chunk->length && is_utf8_continuation(bytes[i])) {
+      i++;
+    }
+  }
+  return ref->byte + i;
+}
+
+// Converts the first two words (start, end) of each [stride]-word record from
+// bytes in [buffer] to UTF-16 code units. Records come mostly sorted by start,
+// so each column keeps a cursor and a line is scanned about once.
+static void text_buffer_encode_offsets(
+  const TsTextBuffer *buffer,
+  uint32_t *records,
+  uint32_t count,
+  uint32_t stride
+) {
+  TsUtf16Cursor cursors[2] = { { 0, 0 }, { 0, 0 } };
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t *record = records + (size_t)i * stride;
+    record[0] = text_buffer_byte_to_utf16(buffer, record[0], &cursors[0]);
+    record[1] = text_buffer_byte_to_utf16(buffer, record[1], &cursors[1]);
+  }
+}
+
+static uint32_t ts_doc_byte_to_utf16_offset(const TsDoc *doc, uint32_t byte) {
+  return text_buffer_byte_to_utf16(ts_doc_source(doc), byte, NULL);
+}
+
+static uint32_t ts_doc_utf16_to_byte_offset(const TsDoc *doc, uint32_t utf16) {
+  return text_buffer_utf16_to_byte(ts_doc_source(doc), utf16);
+}
+
+// Converts the first two words (start, end) of each [stride]-word record from
+// bytes to the document's offset encoding.
+static void ts_doc_encode_offsets(
+  const TsDoc *doc,
+  uint32_t *records,
+  uint32_t count,
+  uint32_t stride
+) {
+  if (doc->offset_encoding != TS_OFFSET_ENCODING_UTF16 || records == NULL) {
+    return;
+  }
+  text_buffer_encode_offsets(ts_doc_source(doc), records, count, stride);
+}
+
+// Returns [range] with byte offsets decoded from the document's encoding.
+static TsCaptureRange ts_doc_decode_range(const TsDoc *doc, const TsCaptureRange *range) {
+  TsCaptureRange decoded = *range;
+  if (!range->use_points && doc->offset_encoding == TS_OFFSET_ENCODING_UTF16) {
+    decoded.start_byte = ts_doc_utf16_to_byte_offset(doc, range->start_byte);
+    decoded.end_byte = ts_doc_utf16_to_byte_offset(doc, range->end_byte);
+  }
+  return decoded;
+}
+
+FFI_PLUGIN_EXPORT bool ts_doc_set_offset_encoding(void* doc_ptr, int32_t encoding) {
+  if (doc_ptr == NULL ||
+      (encoding != TS_OFFSET_ENCODING_UTF8 && encoding != TS_OFFSET_ENCODING_UTF16)) {
+    return false;
+  }
+  ((TsDoc *)doc_ptr)->offset_encoding = encoding;
+  return true;
+}
+
+FFI_PLUGIN_EXPORT uint32_t ts_doc_byte_to_utf16(void* doc_ptr, uint32_t byte_offset) {
+  if (doc_ptr == NULL) {
+    return byte_offset;
+  }
+  return ts_doc_byte_to_utf16_offset((const TsDoc *)doc_ptr, byte_offset);
+}
+
+FFI_PLUGIN_EXPORT uint32_t ts_doc_utf16_to_byte(void* doc_ptr, uint32_t utf16_offset) {
+  if (doc_ptr == NULL) {
+    return utf16_offset;
+  }
+  return ts_doc_utf16_to_byte_offset((const TsDoc *)doc_ptr, utf16_offset);
+}
+
+// --- tracked text --------------------------------------------------------------
+
+static void mapped_file_release(TsMappedFile *file) {
+  if (file == NULL || ts_atomic_counter_add(&file->refs, -1) != 1) {
+    return;
+  }
+  file_mapping_close(&file->mapping);
+  memory_free(file);
+}
+
+// Returns a new, empty chunk with room for [capacity] bytes, or NULL.
+static TsTextChunk *text_chunk_new(uint32_t capacity) {
+  TsTextChunk *chunk = (TsTextChunk *)memory_alloc(sizeof(TsTextChunk) + capacity);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  memset(chunk, 0, sizeof(TsTextChunk));
+  chunk->refs = 1;
+  chunk->data = chunk->storage;
+  chunk->capacity = capacity;
+  return chunk;
+}
+
+// Drops a reference; the last one frees the chunk (and lets go of its file)
+// on whichever thread releases it.
+static void text_chunk_release(TsTextChunk *chunk) {
+  if (chunk == NULL || ts_atomic_counter_add(&chunk->refs, -1) != 1) {
+    return;
+  }
+  memory_free(chunk->line_starts);
+  mapped_file_release(chunk->file);
+  memory_free(chunk);
+}
+
+static uint32_t count_newlines(const char *bytes, uint32_t length) {
+  uint32_t count = 0;
+  for (const char *newline = bytes;
+       length > 0 &&
+       (newline = memchr(newline, '\n', (size_t)(bytes + length - newline))) != NULL;
+       newline++) {
+    count++;
+  }
+  return count;
+}
+
+// Makes room for [count] line starts in [chunk].
+static bool text_chunk_reserve_lines(TsTextChunk *chunk, uint32_t count) {
+  if (count <= chunk->line_capacity) {
+    return true;
+  }
+  const uint32_t capacity = count + count / 4 + 8;
+  uint32_t *starts = (uint32_t *)memory_realloc(
+    chunk->line_starts,
+    (size_t)capacity * 2 * sizeof(uint32_t)
+  );
+  if (starts == NULL) {
+    return false;
+  }
+  chunk->line_starts = starts;
+  chunk->line_capacity = capacity;
+  return true;
+}
+
+// Rebuilds the UTF-16 length and line starts of [chunk] from its bytes. It
+// only fails, leaving the chunk as it was, if the line starts need more room
+// than can be allocated.
+static bool text_chunk_index(TsTextChunk *chunk) {
+  if (!text_chunk_reserve_lines(chunk, count_newlines(chunk->data, chunk->length))) {
+    return false;
+  }
+  const char *end = chunk->data + chunk->length;
+  const char *line = chunk->data;
+  uint32_t line_count = 0;
+  uint32_t utf16 = 0;
+  for (const char *newline;
+       (newline = memchr(line, '\n', (size_t)(end - line))) != NULL;
+       line_count++) {
+    utf16 += utf16_length_of_utf8((const uint8_t *)line, (size_t)(newline + 1 - line));
+    line = newline + 1;
+    chunk->line_starts[line_count * 2] = (uint32_t)(line - chunk->data);
+    chunk->line_starts[line_count * 2 + 1] = utf16;
+  }
+  chunk->utf16_length = utf16 + utf16_length_of_utf8((const uint8_t *)line, (size_t)(end - line));
+  chunk->line_count = line_count;
+  chunk->indexed = true;
+  return true;
+}
+
+// Index of the chunk of [chunks] (of which there are [count], at least one)
+// holding [offset]: the last one starting at or before it. [offset] is in
+// UTF-16 code units if [utf16_offset] is set, else bytes.
+static uint32_t text_chunk_find(
+  const TsTextChunkRef *chunks,
+  uint32_t count,
+  uint32_t offset,
+  bool utf16_offset
+) {
+  uint32_t low = 0;
+  uint32_t high = count;
+  while (high - low > 1) {
+    const uint32_t mid = low + (high - low) / 2;
+    if ((utf16_offset ? chunks[mid].utf16 : chunks[mid].byte) <= offset) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Number of line starts of [chunk] at or before [offset] from its start, in
+// UTF-16 code units if [utf16_offset] is set, else bytes.
+static uint32_t text_chunk_lines_before(
+  const TsTextChunk *chunk,
+  uint32_t offset,
+  bool utf16_offset
+) {
+  uint32_t low = 0;
+  uint32_t high = chunk->line_count;
+  while (low < high) {
+    const uint32_t mid = low + (high - low) / 2;
+    if (chunk->line_starts[mid * 2 + (utf16_offset ? 1 : 0)] <= offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Returns the chunk of the indexed [buffer] holding [offset] (bytes, or UTF-16
+// code units if [utf16_offset] is set) and sets *[out_byte] and *[out_utf16]
+// to the closest point at or before it that the line index knows: the start
+// of its line, or of the chunk when the line starts in an earlier one. NULL,
+// with both set to 0, for an empty buffer.
+static const TsTextChunkRef *text_buffer_anchor(
+  const TsTextBuffer *buffer,
+  uint32_t offset,
+  bool utf16_offset,
+  uint32_t *out_byte,
+  uint32_t *out_utf16
+) {
+  *out_byte = 0;
+  *out_utf16 = 0;
+  if (buffer->chunk_count == 0) {
+    return NULL;
+  }
+  const TsTextChunkRef *ref =
+    &buffer->chunks[text_chunk_find(buffer->chunks, buffer->chunk_count, offset, utf16_offset)];
+  const uint32_t lines = text_chunk_lines_before(
+    ref->chunk,
+    offset - (utf16_offset ? ref->utf16 : ref->byte),
+    utf16_offset
+  );
+  *out_byte = ref->byte + (lines > 0 ? ref->chunk->line_starts[(lines - 1) * 2] : 0);
+  *out_utf16 = ref->utf16 + (lines > 0 ? ref->chunk->line_starts[(lines - 1) * 2 + 1] : 0);
+  return ref;
+}
+
+// Returns the row of the indexed [buffer] holding byte [offset]: the last
+// line starting at or before it.
+static uint32_t text_buffer_find_row(const TsTextBuffer *buffer, uint32_t offset) {
+  if (buffer->chunk_count == 0) {
+    return 0;
+  }
+  const TsTextChunkRef *ref =
+    &buffer->chunks[text_chunk_find(buffer->chunks, buffer->chunk_count, offset, false)];
+  return ref->row + text_chunk_lines_before(ref->chunk, offset - ref->byte, false);
+}
+
+// Byte offset at which [row], one of the rows of the indexed [buffer],
+// starts.
+static uint32_t text_buffer_line_start(const TsTextBuffer *buffer, uint32_t row) {
+  if (row == 0 || buffer->chunk_count == 0) {
+    return 0;
+  }
+  // The '\n' ending the previous row is in the last chunk starting before it.
+  uint32_t low = 0;
+  uint32_t high = buffer->chunk_count;
+  while (high - low > 1) {
+    const uint32_t mid = low + (high - low) / 2;
+    if (buffer->chunks[mid].row < row) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  const TsTextChunkRef *ref = &buffer->chunks[low];
+  return ref->byte + ref->chunk->line_starts[(row - ref->row - 1) * 2];
+}
+
+static uint32_t common_prefix_length(const uint8_t *a, const uint8_t *b, uint32_t length) {
+  uint32_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t left;
+    uint64_t right;
+    memcpy(&left, a + i, sizeof(left));
+    memcpy(&right, b + i, sizeof(right));
+    if (left != right) {
+      break;
+    }
+  }
+  while (i < length && a[i] == b[i]) {
+    i++;
+  }
+  return i;
+}
+
+// Length of the common suffix of a[0, a_length) and b[0, b_length), at most
+// [limit] bytes.
+static uint32_t common_suffix_length(
+  const uint8_t *a,
+  uint32_t a_length,
+  const uint8_t *b,
+  uint32_t b_length,
+  uint32_t limit
+) {
+  uint32_t n = 0;
+  for (; n + 8 <= limit; n += 8) {
+    uint64_t left;
+    uint64_t right;
+    memcpy(&left, a + a_length - n - 8, sizeof(left));
+    memcpy(&right, b + b_length - n - 8, sizeof(right));
+    if (left != right) {
+      break;
+    }
+  }
+  while (n < limit && a[a_length - n - 1] == b[b_length - n - 1]) {
+    n++;
+  }
+  return n;
+}
+
+static bool is_utf8_continuation(uint8_t byte) {
+  return (byte & 0xC0) == 0x80;
+}
+
+// Returns the run of [text] holding byte [offset], which must be below its
+// length: the whole text, or one of its chunks. *[out_start] is set to the
+// offset of the run's first byte and *[out_length] to its length.
+static const char *source_text_run(
+  const TsSourceText *text,
+  uint32_t offset,
+  uint32_t *out_start,
+  uint32_t *out_length
+) {
+  if (text->chunks == NULL) {
+    *out_start = 0;
+    *out_length = text->length;
+    return text->data;
+  }
+  const TsTextChunkRef *ref =
+    &text->chunks[text_chunk_find(text->chunks, text->chunk_count, offset, false)];
+  *out_start = ref->byte;
+  *out_length = ref->chunk->length;
+  return ref->chunk->data;
+}
+
+static uint8_t source_text_byte_at(const TsSourceText *text, uint32_t offset) {
+  uint32_t run_start;
+  uint32_t run_length;
+  return (uint8_t)source_text_run(text, offset, &run_start, &run_length)[offset - run_start];
+}
+
+// Copies bytes [start, end) of [text] to [out].
+static void source_text_copy(const TsSourceText *text, uint32_t start, uint32_t end, char *out) {
+  while (start < end) {
+    uint32_t run_start;
+    uint32_t run_length;
+    const char *run = source_text_run(text, start, &run_start, &run_length);
+    const uint32_t run_end = run_start + run_length < end ? run_start + run_length : end;
+    memcpy(out, run + (start - run_start), run_end - start);
+    out += run_end - start;
+    start = run_end;
+  }
+}
+
+// A run of bytes that new chunks are copied from.
+typedef struct TsTextRun {
+  const char *data;
+  uint32_t length;
+} TsTextRun;
+
+// Byte [position] of [runs] taken as one text; it must be below their
+// total length.
+static uint8_t text_runs_byte_at(const TsTextRun *runs, uint32_t position) {
+  while (position >= runs->length) {
+    position -= runs->length;
+    runs++;
+  }
+  return (uint8_t)runs->data[position];
+}
+
+// Copies [length] bytes from [position] of [runs] taken as one text to [out].
+static void text_runs_copy(const TsTextRun *runs, uint32_t position, uint32_t length, char *out) {
+  for (; length > 0; runs++) {
+    if (position >= runs->length) {
+      position -= runs->length;
+      continue;
+    }
+    const uint32_t n = runs->length - position < length ? runs->length - position : length;
+    memcpy(out, runs->data + position, n);
+    out += n;
+    length -= n;
+    position = 0;
+  }
+}
+
+// Chunk length a text of [total] bytes is split at: chunks of about even
+// length, leaving room for the bytes a split gives up to keep a code point
+// whole.
+static uint32_t text_chunk_target(uint32_t total) {
+  const uint32_t even = TEXT_CHUNK_BYTES - 4;
+  const uint32_t pieces = total / even + (total % even != 0 ? 1 : 0);
+  if (pieces <= 1) {
+    return TEXT_CHUNK_BYTES;
+  }
+  return (uint32_t)(((uint64_t)total + pieces - 1) / pieces);
+}
+
+// Most chunks text_chunk_split cuts [total] bytes into at [target].
+static uint32_t text_chunk_bound(uint32_t total, uint32_t target) {
+  if (total <= TEXT_CHUNK_BYTES) {
+    return total > 0 ? 1 : 0;
+  }
+  return total / (target - 3) + 1;
+}
+
+// Length of the chunk starting at [position] of the [total] bytes of [runs]:
+// all that is left if it fits in one chunk, else [target] bytes less the
+// start of a code point the cut would split.
+static uint32_t text_chunk_split(
+  const TsTextRun *runs,
+  uint32_t position,
+  uint32_t total,
+  uint32_t target
+) {
+  if (total - position <= TEXT_CHUNK_BYTES) {
+    return total - position;
+  }
+  uint32_t length = target;
+  while (length > target - 3 && is_utf8_continuation(text_runs_byte_at(runs, position + length))) {
+    length--;
+  }
+  // Not UTF-8: cut anyway.
+  return is_utf8_continuation(text_runs_byte_at(runs, position + length)) ? target : length;
+}
+
+// Copies the [run_count] runs of [runs], taken as one text, into new chunks,
+// indexed if [index_lines] is set, and returns them in a new array in
+// *[out_chunks] (NULL for an empty text) with their count in *[out_count].
+// The total length must fit in 32 bits. False, with nothing allocated, if
+// memory runs out.
+static bool text_chunks_build(
+  const TsTextRun *runs,
+  uint32_t run_count,
+  bool index_lines,
+  TsTextChunk ***out_chunks,
+  uint32_t *out_count
+) {
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < run_count; i++) {
+    total += runs[i].length;
+  }
+  *out_chunks = NULL;
+  *out_count = 0;
+  if (total == 0) {
+    return true;
+  }
+  const uint32_t target = text_chunk_target(total);
+  TsTextChunk **chunks = (TsTextChunk **)memory_alloc(
+    (size_t)text_chunk_bound(total, target) * sizeof(TsTextChunk *)
+  );
+  if (chunks == NULL) {
+    return false;
+  }
+  uint32_t count = 0;
+  for (uint32_t position = 0; position < total;) {
+    const uint32_t length = text_chunk_split(runs, position, total, target);
+    TsTextChunk *chunk = text_chunk_new(length);
+    if (chunk != NULL) {
+      chunks[count++] = chunk;
+      text_runs_copy(runs, position, length, chunk->storage);
+      chunk->length = length;
+    }
+    if (chunk == NULL || (index_lines && !text_chunk_index(chunk))) {
+      while (count > 0) {
+        text_chunk_release(chunks[--count]);
+      }
+      memory_free(chunks);
+      return false;
+    }
+    position += length;
+  }
+  *out_chunks = chunks;
+  *out_count = count;
+  return true;
+}
+
+// Makes room for [count] chunks in [buffer].
+static bool text_buffer_reserve_chunks(TsTextBuffer *buffer, uint32_t count) {
+  if (count <= buffer->chunk_capacity) {
+    return true;
+  }
+  uint32_t capacity = buffer->chunk_capacity < 8 ? 16 : buffer->chunk_capacity * 2;
+  if (capacity < count) {
+    capacity = count;
+  }
+  TsTextChunkRef *chunks = (TsTextChunkRef *)memory_realloc(
+    buffer->chunks,
+    (size_t)capacity * sizeof(TsTextChunkRef)
+  );
+  if (chunks == NULL) {
+    return false;
+  }
+  buffer->chunks = chunks;
+  buffer->chunk_capacity = capacity;
+  return true;
+}
+
+// Recomputes where chunks [first, chunk_count) of [buffer] start, and its
+// totals, from the chunks before them.
+static void text_buffer_update_offsets(TsTextBuffer *buffer, uint32_t first) {
+  uint32_t byte = 0;
+  uint32_t utf16 = 0;
+  uint32_t row = 0;
+  if (first > 0) {
+    const TsTextChunkRef *previous = &buffer->chunks[first - 1];
+    byte = previous->byte + previous->chunk->length;
+    utf16 = previous->utf16 + previous->chunk->utf16_length;
+    row = previous->row + previous->chunk->line_count;
+  }
+  for (uint32_t i = first; i < buffer->chunk_count; i++) {
+    TsTextChunkRef *ref = &buffer->chunks[i];
+    ref->byte = byte;
+    ref->utf16 = utf16;
+    ref->row = row;
+    byte += ref->chunk->length;
+    utf16 += ref->chunk->utf16_length;
+    row += ref->chunk->line_count;
+  }
+  buffer->length = byte;
+  buffer->utf16_length = utf16;
+  buffer->row_count = row + 1;
+}
+
+static TsSourceText text_buffer_view(const TsTextBuffer *buffer) {
+  if (buffer == NULL || buffer->chunk_count == 0) {
+    return (TsSourceText){ "", 0, NULL, 0 };
+  }
+  return (TsSourceText){ NULL, buffer->length, buffer->chunks, buffer->chunk_count };
+}
+
+static TsTextBuffer *text_buffer_retain(TsTextBuffer *buffer) {
+  ts_atomic_counter_add(&buffer->refs, 1);
+  return buffer;
+}
+
+// Drops a reference; the last one releases the buffer's chunks (freeing, or
+// unmapping, those no other revision holds) on whichever thread lets go of
+// it.
+static void text_buffer_release(TsTextBuffer *buffer) {
+  if (buffer == NULL || ts_atomic_counter_add(&buffer->refs, -1) != 1) {
+    return;
+  }
+  for (uint32_t i = 0; i < buffer->chunk_count; i++) {
+    text_chunk_release(buffer->chunks[i].chunk);
+  }
+  memory_free(buffer->chunks);
+  memory_free(buffer);
+}
+
+// Indexes the lines of the chunks of [buffer] that are not indexed yet. On
+// failure the buffer stays unindexed.
+static bool text_buffer_index_lines(TsTextBuffer *buffer) {
+  for (uint32_t i = 0; i < buffer->chunk_count; i++) {
+    TsTextChunk *chunk = buffer->chunks[i].chunk;
+    if (!chunk->indexed && !text_chunk_index(chunk)) {
+      return false;
+    }
+  }
+  text_buffer_update_offsets(buffer, 0);
+  buffer->indexed = true;
+  return true;
+}
+
+// Returns a new buffer holding a copy of [length] bytes at [data], with its
+// line index if [index_lines] is set (otherwise the caller indexes it later,
+// possibly on another thread). NULL on allocation failure.
+static TsTextBuffer *text_buffer_copy(const char *data, uint32_t length, bool index_lines) {
+  TsTextBuffer *buffer = (TsTextBuffer *)memory_calloc(1, sizeof(TsTextBuffer));
+  if (buffer == NULL) {
+    return NULL;
+  }
+  buffer->refs = 1;
+  const TsTextRun run = { data, length };
+  TsTextChunk **chunks;
+  uint32_t count;
+  if (!text_chunks_build(&run, 1, index_lines, &chunks, &count) ||
+      !text_buffer_reserve_chunks(buffer, count)) {
+    for (uint32_t i = 0; chunks != NULL && i < count; i++) {
+      text_chunk_release(chunks[i]);
+    }
+    memory_free(chunks);
+    memory_free(buffer);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    buffer->chunks[i].chunk = chunks[i];
+  }
+  memory_free(chunks);
+  buffer->chunk_count = count;
+  buffer->indexed = index_lines;
+  text_buffer_update_offsets(buffer, 0);
+  return buffer;
+}
+
+// Returns a private copy of [buffer] to edit. Only the list of chunks is
+// copied; the chunks themselves are shared until an edit touches them.
+static TsTextBuffer *text_buffer_clone(const TsTextBuffer *buffer) {
+  TsTextBuffer *clone = (TsTextBuffer *)memory_calloc(1, sizeof(TsTextBuffer));
+  if (clone == NULL) {
+    return NULL;
+  }
+  clone->refs = 1;
+  if (!text_buffer_reserve_chunks(clone, buffer->chunk_count)) {
+    memory_free(clone);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < buffer->chunk_count; i++) {
+    clone->chunks[i] = buffer->chunks[i];
+    ts_atomic_counter_add(&clone->chunks[i].chunk->refs, 1);
+  }
+  clone->chunk_count = buffer->chunk_count;
+  clone->length = buffer->length;
+  clone->utf16_length = buffer->utf16_length;
+  clone->row_count = buffer->row_count;
+  clone->indexed = buffer->indexed;
+  return clone;
+}
+
+static TsSourceText ts_doc_tracked_text(const TsDoc *doc) {
+  return text_buffer_view(doc->text);
+}
+
+// Replaces bytes [start, end) of [ref]'s indexed chunk, which only this
+// buffer holds and which still fits in a chunk afterwards, with [inserted],
+// growing the chunk if needed. Line starts before the edit are kept and those
+// after it shifted, so only the edited line is counted. Nothing changes if it
+// fails.
+static bool text_chunk_splice(
+  TsTextChunkRef *ref,
+  uint32_t start,
+  uint32_t end,
+  const char *inserted,
+  uint32_t inserted_length
+) {
+  TsTextChunk *chunk = ref->chunk;
+  const uint32_t length = chunk->length - (end - start) + inserted_length;
+  const uint32_t kept_lines = text_chunk_lines_before(chunk, start, false);
+  const uint32_t removed_end = text_chunk_lines_before(chunk, end, false);
+  const uint32_t inserted_lines = count_newlines(inserted, inserted_length);
+  const uint32_t line_count = chunk->line_count - (removed_end - kept_lines) + inserted_lines;
+  if (!text_chunk_reserve_lines(chunk, line_count)) {
+    return false;
+  }
+  if (length > chunk->capacity) {
+    uint32_t capacity = length + length / 4 + 64;
+    if (capacity > TEXT_CHUNK_BYTES) {
+      capacity = TEXT_CHUNK_BYTES;
+    }
+    TsTextChunk *grown = (TsTextChunk *)memory_realloc(chunk, sizeof(TsTextChunk) + capacity);
+    if (grown == NULL) {
+      return false;
+    }
+    grown->data = grown->storage;
+    grown->capacity = capacity;
+    ref->chunk = chunk = grown;
+  }
+
+  uint32_t *starts = chunk->line_starts;
+  const uint32_t line_byte = kept_lines > 0 ? starts[(kept_lines - 1) * 2] : 0;
+  const uint32_t line_utf16 = kept_lines > 0 ? starts[(kept_lines - 1) * 2 + 1] : 0;
+  const uint32_t start_utf16 = line_utf16 +
+    utf16_length_of_utf8((const uint8_t *)chunk->data + line_byte, start - line_byte);
+  const uint32_t removed_utf16 =
+    utf16_length_of_utf8((const uint8_t *)chunk->data + start, end - start);
+  const uint32_t inserted_utf16 = utf16_length_of_utf8((const uint8_t *)inserted, inserted_length);
+
+  memmove(chunk->storage + start + inserted_length, chunk->storage + end, chunk->length - end);
+  if (inserted_length > 0) {
+    memcpy(chunk->storage + start, inserted, inserted_length);
+  }
+
+  // Line starts after the removed bytes move by the change in length; those
+  // inside them give way to the ones of [inserted].
+  const uint32_t later_lines = chunk->line_count - removed_end;
+  const uint32_t first_later = kept_lines + inserted_lines;
+  if (later_lines > 0) {
+    memmove(
+      starts + (size_t)first_later * 2,
+      starts + (size_t)removed_end * 2,
+      (size_t)later_lines * 2 * sizeof(uint32_t)
+    );
+  }
+  for (uint32_t i = first_later; i < first_later + later_lines; i++) {
+    starts[i * 2] = starts[i * 2] - (end - start) + inserted_length;
+    starts[i * 2 + 1] = starts[i * 2 + 1] - removed_utf16 + inserted_utf16;
+  }
+  uint32_t row = kept_lines;
+  uint32_t utf16 = start_utf16;
+  const char *line = inserted;
+  for (const char *newline;
+       row < first_later &&
+       (newline = memchr(line, '\n', (size_t)(inserted + inserted_length - line))) != NULL;
+       row++) {
+    utf16 += utf16_length_of_utf8((const uint8_t *)line, (size_t)(newline + 1 - line));
+    line = newline + 1;
+    starts[row * 2] = start + (uint32_t)(line - inserted);
+    starts[row * 2 + 1] = utf16;
+  }
+  chunk->length = length;
+  chunk->utf16_length = chunk->utf16_length - removed_utf16 + inserted_utf16;
+  chunk->line_count = line_count;
+  return true;
+}
+
+// Replaces bytes [start, end) of the indexed, unshared [buffer] with
+// [inserted]. A chunk that only this buffer holds is edited in place while
+// the result fits in it; otherwise the chunks the edit touches are replaced
+// by new ones, and whoever still reads the old ones is undisturbed. Nothing
+// changes if it fails.
+static bool text_buffer_splice(
+  TsTextBuffer *buffer,
+  uint32_t start,
+  uint32_t end,
+  const char *inserted,
+  uint32_t inserted_length
+) {
+  uint32_t first = 0;
+  uint32_t last = 0;
+  TsTextRun runs[3];
+  uint32_t run_count = 0;
+  if (buffer->chunk_count > 0) {
+    // An insertion between two chunks goes at the end of the first.
+    const uint32_t count = buffer->chunk_count;
+    first = start > 0 ? text_chunk_find(buffer->chunks, count, start - 1, false) : 0;
+    last = end > start ? text_chunk_find(buffer->chunks, count, end - 1, false) : first;
+    TsTextChunkRef *head = &buffer->chunks[first];
+    const TsTextChunkRef *tail = &buffer->chunks[last];
+    const TsTextChunk *chunk = head->chunk;
+    const uint32_t length = chunk->length - (end - start) + inserted_length;
+    if (first == last &&
+        chunk->file == NULL &&
+        ts_atomic_counter_get(&chunk->refs) == 1 &&
+        length > 0 &&
+        length <= TEXT_CHUNK_BYTES) {
+      const uint32_t offset = head->byte;
+      if (!text_chunk_splice(head, start - offset, end - offset, inserted, inserted_length)) {
+        return false;
+      }
+      text_buffer_update_offsets(buffer, first);
+      return true;
+    }
+    runs[run_count++] = (TsTextRun){ head->chunk->data, start - head->byte };
+    runs[run_count++] = (TsTextRun){ inserted, inserted_length };
+    runs[run_count++] = (TsTextRun){
+      tail->chunk->data + (end - tail->byte),
+      tail->byte + tail->chunk->length - end,
+    };
+  } else {
+    runs[run_count++] = (TsTextRun){ inserted, inserted_length };
+  }
+
+  const uint32_t replaced = buffer->chunk_count > 0 ? last - first + 1 : 0;
+  TsTextChunk **chunks;
+  uint32_t count;
+  if (!text_chunks_build(runs, run_count, true, &chunks, &count)) {
+    return false;
+  }
+  if (!text_buffer_reserve_chunks(buffer, buffer->chunk_count - replaced + count)) {
+    for (uint32_t i = 0; i < count; i++) {
+      text_chunk_release(chunks[i]);
+    }
+    memory_free(chunks);
+    return false;
+  }
+  for (uint32_t i = first; i < first + replaced; i++) {
+    text_chunk_release(buffer->chunks[i].chunk);
+  }
+  memmove(
+    buffer->chunks + first + count,
+    buffer->chunks + first + replaced,
+    (size_t)(buffer->chunk_count - first - replaced) * sizeof(TsTextChunkRef)
+  );
+  for (uint32_t i = 0; i < count; i++) {
+    buffer->chunks[first + i].chunk = chunks[i];
+  }
+  memory_free(chunks);
+  buffer->chunk_count = buffer->chunk_count - replaced + count;
+  text_buffer_update_offsets(buffer, first);
+  return true;
+}
+
+// Creates the empty tracked text if there is none yet.
+static bool ts_doc_ensure_text(TsDoc *doc) {
+  if (doc->text == NULL) {
+    doc->text = text_buffer_copy("", 0, true);
+  }
+  return doc->text != NULL;
+}
+
+// Readies the tracked text for an edit. A revision still held by a pending
+// reparse or a snapshot is first replaced by a copy of its chunk list, which
+// keeps sharing the chunks the edit leaves alone.
+static bool ts_doc_prepare_text(TsDoc *doc) {
+  if (!ts_doc_ensure_text(doc)) {
+    return false;
+  }
+  if (ts_atomic_counter_get(&doc->text->refs) == 1) {
+    return true;
+  }
+  TsTextBuffer *copy = text_buffer_clone(doc->text);
+  if (copy == NULL) {
+    return false;
+  }
+  text_buffer_release(doc->text);
+  doc->text = copy;
+  return true;
+}
+
+// Replaces bytes [start, old_end) of the tracked text, both on code point
+// boundaries, with [inserted], updates the line index and writes the
+// TS_TEXT_EDIT_WORDS words of the edit to [out_edit]. Nothing changes if it
+// fails.
+static bool ts_doc_splice_text(
+  TsDoc *doc,
+  uint32_t start,
+  uint32_t old_end,
+  const uint8_t *inserted,
+  uint32_t inserted_length,
+  uint32_t *out_edit
+) {
+  TsTextBuffer *text = doc->text;
+  const uint32_t removed_length = old_end - start;
+  if ((uint64_t)text->length - removed_length + inserted_length > UINT32_MAX) {
+    return false;
+  }
+
+  const uint32_t start_row = text_buffer_find_row(text, start);
+  const uint32_t line_byte = text_buffer_line_start(text, start_row);
+  const uint32_t start_col = start - line_byte;
+  const uint32_t start_utf16 = text_buffer_byte_to_utf16(text, start, NULL);
+
+  const uint32_t old_end_row = text_buffer_find_row(text, old_end);
+  const uint32_t old_end_col = old_end - text_buffer_line_start(text, old_end_row);
+
+  const uint32_t removed_utf16 = text_buffer_byte_to_utf16(text, old_end, NULL) - start_utf16;
+  const uint32_t inserted_utf16 = utf16_length_of_utf8(inserted, inserted_length);
+  const uint32_t new_end = start + inserted_length;
+
+  uint32_t new_end_row = start_row;
+  uint32_t new_end_line_byte = line_byte;
+  for (const uint8_t *newline = inserted;
+       inserted_length > 0 &&
+       (newline = memchr(newline, '\n', (size_t)(inserted + inserted_length - newline))) != NULL;
+       newline++) {
+    new_end_row++;
+    new_end_line_byte = start + (uint32_t)(newline + 1 - inserted);
+  }
+
+  if (!text_buffer_splice(text, start, old_end, (const char *)inserted, inserted_length)) {
+    return false;
+  }
+  if (removed_length > 0 || inserted_length > 0) {
+    ts_atomic_counter_add(&doc->text_generation, 1);
+  }
+
+  out_edit[0] = start;
+  out_edit[1] = old_end;
+  out_edit[2] = new_end;
+  out_edit[3] = start_row;
+  out_edit[4] = start_col;
+  out_edit[5] = old_end_row;
+  out_edit[6] = old_end_col;
+  out_edit[7] = new_end_row;
+  out_edit[8] = new_end - new_end_line_byte;
+  out_edit[9] = start_utf16;
+  out_edit[10] = start_utf16 + removed_utf16;
+  out_edit[11] = start_utf16 + inserted_utf16;
+  return true;
+}
+
+FFI_PLUGIN_EXPORT bool ts_doc_set_text(
+  void* doc_ptr,
+  const char* utf8_text,
+  uint32_t length,
+  uint32_t* out_edit
+) {
+  if (doc_ptr == NULL || (utf8_text == NULL && length > 0) || out_edit == NULL) {
+    return false;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  if (!ts_doc_prepare_text(doc)) {
+    memory_scope_leave(previous);
+    return false;
+  }
+  // Diff chunk by chunk against the new text.
+  const TsSourceText old_text = ts_doc_tracked_text(doc);
+  const uint8_t *new_text = utf8_text != NULL ? (const uint8_t *)utf8_text : (const uint8_t *)"";
+  const uint32_t old_length = old_text.length;
+  const uint32_t min_length = old_length < length ? old_length : length;
+
+  uint32_t start = 0;
+  while (start < min_length) {
+    uint32_t run_start;
+    uint32_t run_length;
+    const char *run = source_text_run(&old_text, start, &run_start, &run_length);
+    const uint32_t run_end = run_start + run_length;
+    const uint32_t limit = (run_end < min_length ? run_end : min_length) - start;
+    const uint32_t same = common_prefix_length(
+      (const uint8_t *)run + (start - run_start),
+      new_text + start,
+      limit
+    );
+    start += same;
+    if (same < limit) {
+      break;
+    }
+  }
+  uint32_t suffix = 0;
+  while (suffix < min_length - start) {
+    uint32_t run_start;
+    uint32_t run_length;
+    const char *run = source_text_run(&old_text, old_length - suffix - 1, &run_start, &run_length);
+    const uint32_t available = old_length - suffix - run_start;
+    const uint32_t limit =
+      available < min_length - start - suffix ? available : min_length - start - suffix;
+    const uint32_t same = common_suffix_length(
+      (const uint8_t *)run,
+      available,
+      new_text,
+      length - suffix,
+      limit
+    );
+    suffix += same;
+    if (same < limit) {
+      break;
+    }
+  }
+  uint32_t old_end = old_length - suffix;
+  uint32_t new_end = length - suffix;
+  // Keep the edit on code point boundaries so UTF-16 offsets are exact.
+  while (start > 0 &&
+         ((start < old_length && is_utf8_continuation(source_text_byte_at(&old_text, start))) ||
+          (start < length && is_utf8_continuation(new_text[start])))) {
+    start--;
+  }
+  while (old_end < old_length && is_utf8_continuation(source_text_byte_at(&old_text, old_end))) {
+    old_end++;
+    new_end++;
+  }
+  const bool ok = ts_doc_splice_text(
+    doc,
+    start,
+    old_end,
+    new_text + start,
+    new_end - start,
+    out_edit
+  );
+  memory_scope_leave(previous);
+  return ok;
+}
+
+// Converts [offset], in the document's offset encoding, to a byte offset of
+// the tracked text on a code point boundary.
+static uint32_t ts_doc_text_offset_to_byte(const TsDoc *doc, uint32_t offset) {
+  const TsSourceText text = ts_doc_tracked_text(doc);
+  const uint32_t length = text.length;
+  if (doc->offset_encoding != TS_OFFSET_ENCODING_UTF16) {
+    uint32_t byte = offset < length ? offset : length;
+    while (byte > 0 && byte < length && is_utf8_continuation(source_text_byte_at(&text, byte))) {
+      byte--;
+    }
+    return byte;
+  }
+  return doc->text != NULL ? text_buffer_utf16_to_byte(doc->text, offset) : 0;
+}
+
+FFI_PLUGIN_EXPORT bool ts_doc_replace_text(
+  void* doc_ptr,
+  uint32_t start,
+  uint32_t end,
+  const char* utf8_replacement,
+  uint32_t length,
+  uint32_t* out_edit
+) {
+  if (doc_ptr == NULL || start > end || (utf8_replacement == NULL && length > 0) ||
+      out_edit == NULL) {
+    return false;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  const bool ok = ts_doc_prepare_text(doc) && ts_doc_splice_text(
+    doc,
+    ts_doc_text_offset_to_byte(doc, start),
+    ts_doc_text_offset_to_byte(doc, end),
+    (const uint8_t *)utf8_replacement,
+    length,
+    out_edit
+  );
+  memory_scope_leave(previous);
+  return ok;
+}
+
+FFI_PLUGIN_EXPORT char* ts_doc_text_range(
+  void* doc_ptr,
+  uint32_t start,
+  uint32_t end,
+  uint32_t* out_length
+) {
+  if (doc_ptr == NULL || out_length == NULL) {
+    return NULL;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  const TsSourceText text = ts_doc_tracked_text(doc);
+  const uint32_t start_byte = ts_doc_text_offset_to_byte(doc, start);
+  uint32_t end_byte = ts_doc_text_offset_to_byte(doc, end);
+  if (end_byte < start_byte) {
+    end_byte = start_byte;
+  }
+  char *out = (char *)memory_alloc((size_t)(end_byte - start_byte) + 1);
+  if (out == NULL) {
+    return NULL;
+  }
+  source_text_copy(&text, start_byte, end_byte, out);
+  out[end_byte - start_byte] = '\0';
+  *out_length = end_byte - start_byte;
+  return out;
+}
+
+// --- memory-mapped files -------------------------------------------------------
+
+static bool file_mapping_open(const char *utf8_path, TsFileMapping *out) {
+#if _WIN32
+  const int wide_length = MultiByteToWideChar(CP_UTF8, 0, utf8_path, -1, NULL, 0);
+  if (wide_length <= 0) {
+    return false;
+  }
+  wchar_t *wide_path = (wchar_t *)memory_alloc((size_t)wide_length * sizeof(wchar_t));
+  if (wide_path == NULL) {
+    return false;
+  }
+  MultiByteToWideChar(CP_UTF8, 0, utf8_path, -1, wide_path, wide_length);
+  HANDLE file = CreateFileW(
+    wide_path,
+    GENERIC_READ,
+    FILE_SHARE_READ,
+    NULL,
+    OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL,
+    NULL
+  );
+  memory_free(wide_path);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart >= UINT32_MAX) {
+    CloseHandle(file);
+    return false;
+  }
+  const char *data = "";
+  if (size.QuadPart > 0) {
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+      CloseHandle(file);
+      return false;
+    }
+    // The view keeps the mapping object alive.
+    data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (data == NULL) {
+      CloseHandle(file);
+      return false;
+    }
+  }
+  CloseHandle(file);
+  out->data = data;
+  out->length = (uint32_t)size.QuadPart;
+  return true;
+#else
+  const int fd = open(utf8_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) ||
+      (uint64_t)info.st_size >= UINT32_MAX) {
+    close(fd);
+    return false;
+  }
+  const char *data = "";
+  if (info.st_size > 0) {
+    void *view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (view == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    data = (const char *)view;
+  }
+  close(fd);
+  out->data = data;
+  out->length = (uint32_t)info.st_size;
+  return true;
+#endif
+}
+
+static void file_mapping_close(TsFileMapping *mapping) {
+  if (mapping->data != NULL && mapping->length > 0) {
+#if _WIN32
+    UnmapViewOfFile(mapping->data);
+#else
+    munmap((void *)mapping->data, mapping->length);
+#endif
+  }
+  mapping->data = NULL;
+  mapping->length = 0;
+}
+
+// Returns an indexed buffer whose chunks read [mapping] in place, and unmap
+// it once the last of them is freed. NULL, with the file unmapped, if memory
+// runs out.
+static TsTextBuffer *text_buffer_map(TsFileMapping mapping) {
+  TsMappedFile *file = (TsMappedFile *)memory_alloc(sizeof(TsMappedFile));
+  TsTextBuffer *buffer = (TsTextBuffer *)memory_calloc(1, sizeof(TsTextBuffer));
+  if (file == NULL || buffer == NULL) {
+    memory_free(file);
+    memory_free(buffer);
+    file_mapping_close(&mapping);
+    return NULL;
+  }
+  file->refs = 1;
+  file->mapping = mapping;
+  buffer->refs = 1;
+  const TsTextRun run = { mapping.data, mapping.length };
+  const uint32_t target = text_chunk_target(mapping.length);
+  bool ok = text_buffer_reserve_chunks(buffer, text_chunk_bound(mapping.length, target));
+  for (uint32_t position = 0; ok && position < mapping.length;) {
+    const uint32_t length = text_chunk_split(&run, position, mapping.length, target);
+    TsTextChunk *chunk = text_chunk_new(0);
+    ok = chunk != NULL;
+    if (ok) {
+      chunk->data = mapping.data + position;
+      chunk->length = length;
+      chunk->file = file;
+      ts_atomic_counter_add(&file->refs, 1);
+      buffer->chunks[buffer->chunk_count++].chunk = chunk;
+      ok = text_chunk_index(chunk);
+    }
+    position += length;
+  }
+  mapped_file_release(file);
+  if (!ok) {
+    text_buffer_release(buffer);
+    return NULL;
+  }
+  text_buffer_update_offsets(buffer, 0);
+  buffer->indexed = true;
+  return buffer;
+}
+
+FFI_PLUGIN_EXPORT bool ts_doc_open_file(void* doc_ptr, const char* utf8_path) {
+  if (doc_ptr == NULL || utf8_path == NULL) {
+    return false;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  TsFileMapping mapping;
+  if (!file_mapping_open(utf8_path, &mapping)) {
+    return false;
+  }
+
+  // Parsing reads the mapping in place; the line index is built straight
+  // from it. Failure leaves the document as it was.
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  TsTextBuffer *text = text_buffer_map(mapping);
+  memory_scope_leave(previous);
+  if (text == NULL) {
+    return false;
+  }
+
+  // The old tree belongs to unrelated text: parse the file from scratch.
+  if (doc->tree != NULL) {
+    ts_tree_delete(doc->tree);
+    doc->tree = NULL;
+  }
+  if (doc->parser != NULL) {
+    ts_parser_reset(doc->parser);
+  }
+  doc->parse_halted = false;
+  doc->has_pending_edit = false;
+  ts_atomic_counter_add(&doc->text_generation, 1);
+  text_buffer_release(doc->source);
+  doc->source = NULL;
+  text_buffer_release(doc->text);
+  doc->text = text;
+  return true;
+}
+
+// Parses a copy of [utf8_source], which the document keeps as the source of
+// its tree.
+static int32_t ts_doc_reparse_copy(TsDoc *doc, const char *utf8_source, uint64_t timeout_micros) {
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  TsTextBuffer *text = text_buffer_copy(utf8_source, (uint32_t)strlen(utf8_source), false);
+  memory_scope_leave(previous);
+  if (text == NULL) {
+    return TS_REPARSE_FAILED;
+  }
+  const int32_t status = ts_doc_reparse_source(
+    doc,
+    text,
+    false,
+    (uint64_t)ts_atomic_counter_get(&doc->text_generation),
+    timeout_micros
+  );
+  text_buffer_release(text);
+  return status;
+}
+
+FFI_PLUGIN_EXPORT bool ts_doc_reparse(void* doc_ptr, const char* utf8_source) {
+  if (doc_ptr == NULL || utf8_source == NULL) {
+    return false;
+  }
+  ts_atomic_flag_set(&((TsDoc *)doc_ptr)->cancel_requested, 0);
+  return ts_doc_reparse_copy((TsDoc *)doc_ptr, utf8_source, 0) == TS_REPARSE_OK;
+}
+
+FFI_PLUGIN_EXPORT int32_t ts_doc_reparse_with_budget(
+  void* doc_ptr,
+  const char* utf8_source,
+  uint64_t timeout_micros
+) {
+  if (doc_ptr == NULL) {
+    return TS_REPARSE_FAILED;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  // A cancel aimed at an earlier reparse must not stop this one.
+  ts_atomic_flag_set(&doc->cancel_requested, 0);
+  if (utf8_source != NULL) {
+    return ts_doc_reparse_copy(doc, utf8_source, timeout_micros);
+  }
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  const bool has_text = ts_doc_ensure_text(doc);
+  memory_scope_leave(previous);
+  if (!has_text) {
+    return TS_REPARSE_FAILED;
+  }
+  return ts_doc_reparse_source(
+    doc,
+    doc->text,
+    true,
+    (uint64_t)ts_atomic_counter_get(&doc->text_generation),
+    timeout_micros
+  );
+}
+
+FFI_PLUGIN_EXPORT void ts_doc_cancel_reparse(void* doc_ptr) {
+  if (doc_ptr == NULL) {
+    return;
+  }
+  ts_atomic_flag_set(&((TsDoc *)doc_ptr)->cancel_requested, 1);
+}
+
+FFI_PLUGIN_EXPORT bool ts_doc_stats(void* doc_ptr, TsDocStats* out_stats) {
+  if (doc_ptr == NULL || out_stats == NULL) {
+    return false;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  ts_mutex_lock(&doc->stats_mutex);
+  *out_stats = doc->stats;
+  ts_mutex_unlock(&doc->stats_mutex);
+  out_stats->memory_bytes = (uint64_t)memory_account_live_bytes(doc->memory);
+  return true;
+}
+
+FFI_PLUGIN_EXPORT uint64_t ts_doc_memory_usage(void* doc_ptr) {
+  if (doc_ptr == NULL) {
+    return 0;
+  }
+  return (uint64_t)memory_account_live_bytes(((TsDoc *)doc_ptr)->memory);
+}
+
+static uint64_t monotonic_micros(void) {
+#if _WIN32
+  static LARGE_INTEGER frequency;
+  if (frequency.QuadPart == 0) {
+    QueryPerformanceFrequency(&frequency);
+  }
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000u +
+    (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000u / (uint64_t)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000u + (uint64_t)now.tv_nsec / 1000u;
+#endif
+}
+
+// TSInput reader over a TsSourceText: hands out the rest of whichever chunk
+// [byte_index] falls in.
+static const char *source_text_read(
+  void *payload,
+  uint32_t byte_index,
+  TSPoint position,
+  uint32_t *bytes_read
+) {
+  const TsSourceText *text = (const TsSourceText *)payload;
+  (void)position;
+  if (byte_index >= text->length) {
+    *bytes_read = 0;
+    return "";
+  }
+  uint32_t run_start;
+  uint32_t run_length;
+  const char *run = source_text_run(text, byte_index, &run_start, &run_length);
+  *bytes_read = run_start + run_length - byte_index;
+  return run + (byte_index - run_start);
+}
+
+typedef struct TsParseProgress {
+  TsDoc *doc;
+  uint64_t deadline;
+  uint32_t calls;
+  int32_t halt_status;
+} TsParseProgress;
+
+static bool parse_progress_callback(TSParseState *state) {
+  TsParseProgress *progress = (TsParseProgress *)state->payload;
+  if (ts_atomic_flag_get(&progress->doc->cancel_requested)) {
+    progress->halt_status = TS_REPARSE_CANCELLED;
+    return true;
+  }
+  if (progress->deadline != 0 &&
+      ++progress->calls % PARSE_CLOCK_CHECK_INTERVAL == 0 &&
+      monotonic_micros() >= progress->deadline) {
+    progress->halt_status = TS_REPARSE_TIMED_OUT;
+    return true;
+  }
+  return false;
+}
+
+// Exponential moving average over roughly the last eight samples.
+static uint64_t rolling_average(uint64_t average, uint64_t sample, uint64_t count) {
+  if (count <= 1) {
+    return sample;
+  }
+  return sample >= average
+    ? average + (sample - average) / 8
+    : average - (average - sample) / 8;
+}
+
+// Counts the nodes of [tree] touching one of the sorted (start, end) byte
+// [ranges]. Subtrees outside every range are skipped and subtrees inside one
+// are counted without being walked.
+static uint64_t tree_count_nodes_in_ranges(
+  const TSTree *tree,
+  const uint32_t *ranges,
+  uint32_t range_count
+) {
+  if (range_count == 0) {
+    return 0;
+  }
+  TSTreeCursor cursor = ts_tree_cursor_new(ts_tree_root_node(tree));
+  uint64_t count = 0;
+  bool more = true;
+  while (more) {
+    const TSNode node = ts_tree_cursor_current_node(&cursor);
+    const uint32_t start = ts_node_start_byte(node);
+    const uint32_t end = ts_node_end_byte(node);
+    bool touches = false;
+    bool inside = false;
+    for (uint32_t i = 0; i < range_count && ranges[i * 2] <= end; i++) {
+      if (ranges[i * 2 + 1] >= start) {
+        touches = true;
+        inside = ranges[i * 2] <= start && end <= ranges[i * 2 + 1];
+        break;
+      }
+    }
+    if (inside) {
+      count += ts_node_descendant_count(node);
+      more = tree_cursor_skip_subtree(&cursor);
+    } else if (touches) {
+      count++;
+      more = tree_cursor_advance(&cursor);
+    } else {
+      more = tree_cursor_skip_subtree(&cursor);
+    }
+  }
+  ts_tree_cursor_delete(&cursor);
+  return count;
+}
+
+static void ts_doc_record_parse(TsDoc *doc, uint64_t micros, uint32_t source_length) {
+  // Nodes touching a changed range were rebuilt; the rest were reused from
+  // the previous tree. A first parse rebuilds everything.
+  const uint64_t node_count = ts_node_descendant_count(ts_tree_root_node(doc->tree));
+  uint64_t recreated = tree_count_nodes_in_ranges(
+    doc->tree,
+    doc->changed_ranges,
+    doc->changed_range_count
+  );
+  if (recreated > node_count) {
+    recreated = node_count;
+  }
+
+  ts_mutex_lock(&doc->stats_mutex);
+  TsDocStats *stats = &doc->stats;
+  stats->parse_count++;
+  stats->last_parse_micros = micros;
+  stats->rolling_parse_micros = rolling_average(
+    stats->rolling_parse_micros,
+    micros,
+    stats->parse_count
+  );
+  stats->node_count = node_count;
+  stats->recreated_nodes = recreated;
+  stats->reused_nodes = node_count - recreated;
+  stats->source_bytes = source_length;
+  ts_mutex_unlock(&doc->stats_mutex);
+}
+
+// [query_micros] covers compiling (if needed) and running the query,
+// [serialize_micros] turning its captures into the result handed back.
+static void ts_doc_record_query(TsDoc *doc, uint64_t query_micros, uint64_t serialize_micros) {
+  ts_mutex_lock(&doc->stats_mutex);
+  TsDocStats *stats = &doc->stats;
+  stats->query_count++;
+  stats->last_query_micros = query_micros;
+  stats->rolling_query_micros = rolling_average(
+    stats->rolling_query_micros,
+    query_micros,
+    stats->query_count
+  );
+  stats->last_serialize_micros = serialize_micros;
+  stats->rolling_serialize_micros = rolling_average(
+    stats->rolling_serialize_micros,
+    serialize_micros,
+    stats->query_count
+  );
+  ts_mutex_unlock(&doc->stats_mutex);
+}
+
+// Parses [text] and makes it the source of the document's tree: the tracked
+// text if [tracked] is set, else a reparse source, which the document then
+// keeps a reference to. [generation] is the document's text generation when
+// [text] was taken. Reading the text is all that happens to it; a tracked
+// revision is neither copied nor rescanned.
+static int32_t ts_doc_reparse_source(
+  TsDoc *doc,
+  TsTextBuffer *text,
+  bool tracked,
+  uint64_t generation,
+  uint64_t timeout_micros
+) {
+  const TsSourceText view = text_buffer_view(text);
+  const uint32_t length = view.length;
+  if (doc->parse_halted && (doc->halted_tracked != tracked ||
+                            doc->halted_length != length ||
+                            doc->halted_generation != generation)) {
+    ts_parser_reset(doc->parser);
+  }
+  doc->parse_halted = false;
+
+  TSInput input = {
+    .payload = (void *)&view,
+    .read = source_text_read,
+    .encoding = TSInputEncodingUTF8,
+    .decode = NULL,
+  };
+  TsParseProgress progress = {
+    .doc = doc,
+    .deadline = timeout_micros != 0 ? monotonic_micros() + timeout_micros : 0,
+    .calls = 0,
+    .halt_status = TS_REPARSE_FAILED,
+  };
+  TSParseOptions options = {
+    .payload = &progress,
+    .progress_callback = parse_progress_callback,
+  };
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  if (!ts_doc_ensure_parser(doc)) {
+    memory_scope_leave(previous);
+    return TS_REPARSE_FAILED;
+  }
+  const uint64_t parse_start = monotonic_micros();
+  TSTree *new_tree = ts_parser_parse_with_options(doc->parser, doc->tree, input, options);
+  const uint64_t parse_micros = monotonic_micros() - parse_start;
+  if (new_tree == NULL) {
+    memory_scope_leave(previous);
+    if (progress.halt_status != TS_REPARSE_FAILED) {
+      // doc->tree (with every edit applied) is untouched, so the next
+      // reparse is still incremental.
+      doc->parse_halted = true;
+      doc->halted_tracked = tracked;
+      doc->halted_length = length;
+      doc->halted_generation = generation;
+    }
+    return progress.halt_status;
+  }
+  ts_doc_update_changed_ranges(doc, doc->tree, new_tree, length);
+  doc->has_pending_edit = false;
+  if (doc->tree != NULL) {
+    ts_tree_delete(doc->tree);
+  }
+  doc->tree = new_tree;
+  if (!tracked && !text->indexed) {
+    // Without a line index offsets can only be reported as UTF-8 bytes.
+    text_buffer_index_lines(text);
+  }
+  TsTextBuffer *old_source = doc->source;
+  doc->source = tracked ? NULL : text_buffer_retain(text);
+  text_buffer_release(old_source);
+  ts_atomic_flag_set(&doc->evicted, 0);
+  doc->edited_while_evicted = false;
+  doc->revision++;
+  if (doc->snapshots_enabled) {
+    ts_doc_publish_snapshot(doc, text);
+  }
+  memory_scope_leave(previous);
+  ts_doc_record_parse(doc, parse_micros, length);
+  return TS_REPARSE_OK;
+}
+
+// Drops the document's current query, and the capture styles resolved for it.
+static void ts_doc_clear_query(TsDoc *doc) {
+  if (!doc->query_builtin) {
+    query_cache_release(doc->query, doc->query_predicates, doc->query_entry);
+    memory_free(doc->query_source);
+  }
+  doc->query = NULL;
+  doc->query_source = NULL;
+  doc->query_predicates = NULL;
+  doc->query_builtin = false;
+  doc->query_entry = NULL;
+  memory_free(doc->capture_styles);
+  doc->capture_styles = NULL;
+}
+
+// Returns the compiled [utf8_query], or the query selected with
+// ts_doc_select_query when [utf8_query] is NULL.
+static TSQuery* ts_doc_get_or_compile_query(TsDoc *doc, const char *utf8_query) {
+  if (utf8_query == NULL) {
+    if (doc->builtin_query_kind < 0) {
+      return NULL;
+    }
+    const TsBuiltinQuery *builtin = builtin_query_get(doc->language_id, doc->builtin_query_kind);
+    if (builtin == NULL) {
+      return NULL;
+    }
+    if (doc->query_builtin && doc->query == builtin->query) {
+      return doc->query;
+    }
+    ts_doc_clear_query(doc);
+    doc->query = builtin->query;
+    doc->query_predicates = builtin->predicates;
+    doc->query_builtin = true;
+    return doc->query;
+  }
+  if (doc->query != NULL) {
+    if (doc->query_source != NULL && strcmp(doc->query_source, utf8_query) == 0) {
+      return doc->query;
+    }
+    ts_doc_clear_query(doc);
+  }
+
+  const uint32_t query_length = (uint32_t)strlen(utf8_query);
+  if (doc->workspace != NULL) {
+    // Documents of a workspace share one compiled query per text.
+    TsQueryPredicates *predicates = NULL;
+    QueryCacheEntry *entry = NULL;
+    TSQuery *query = query_cache_acquire(doc->language_id, utf8_query, &predicates, &entry);
+    if (query == NULL) {
+      return NULL;
+    }
+    TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+    char *copy = (char *)memory_alloc((size_t)query_length + 1);
+    memory_scope_leave(previous);
+    if (copy == NULL) {
+      query_cache_release(query, predicates, entry);
+      return NULL;
+    }
+    memcpy(copy, utf8_query, (size_t)query_length);
+    copy[query_length] = '\0';
+    doc->query = query;
+    doc->query_source = copy;
+    doc->query_predicates = predicates;
+    doc->query_entry = entry;
+    return query;
+  }
+
+  uint32_t error_offset = 0;
+  TSQueryError error_type = TSQueryErrorNone;
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  TSQuery *query = ts_query_new(
+    doc->language,
+    utf8_query,
+    query_length,
+    &error_offset,
+    &error_type
+  );
+  char *copy = query != NULL ? (char *)memory_alloc((size_t)query_length + 1) : NULL;
+  TsQueryPredicates *predicates = NULL;
+  const bool predicates_ok = copy != NULL && query_predicates_compile(query, &predicates);
+  memory_scope_leave(previous);
+  if (!predicates_ok) {
+    memory_free(copy);
+    if (query != NULL) {
+      ts_query_delete(query);
+    }
+    return NULL;
+  }
+  memcpy(copy, utf8_query, (size_t)query_length);
+  copy[query_length] = '\0';
+  doc->query = query;
+  doc->query_source = copy;
+  doc->query_predicates = predicates;
+  return query;
+}
+
+FFI_PLUGIN_EXPORT char* ts_doc_query_captures(void* doc_ptr, const char* utf8_query) {
+  if (doc_ptr == NULL) {
+    return NULL;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  if (doc->tree == NULL) {
+    return NULL;
+  }
+  TSQuery *query = ts_doc_get_or_compile_query(doc, utf8_query);
+  if (query == NULL) {
+    return NULL;
+  }
+  const TsQueryPredicates *predicates = doc->query_predicates;
+  const TsSourceText source = text_buffer_view(ts_doc_source(doc));
+
+  TSQueryCursor *cursor = ts_query_cursor_new();
+  if (cursor == NULL) {
+    return NULL;
+  }
+
+  TSNode root = ts_tree_root_node(doc->tree);
+  ts_query_cursor_exec(cursor, query, root);
+
+  char *buffer = NULL;
+  size_t buffer_length = 0;
+  size_t buffer_capacity = 0;
+
+  TSQueryMatch match;
+  uint32_t capture_index = 0;
+  while (ts_query_cursor_next_capture(cursor, &match, &capture_index)) {
+    if (!query_match_passes(predicates, &match, &source)) {
+      ts_query_cursor_remove_match(cursor, match.id);
+      continue;
+    }
+    const TSQueryCapture capture = match.captures[capture_index];
+    const TSNode node = capture.node;
+    const uint32_t start = ts_node_start_byte(node);
+    const uint32_t end = ts_node_end_byte(node);
+
+    uint32_t name_length = 0;
+    const char *name = ts_query_capture_name_for_id(
+      query,
+      capture.index,
+      &name_length
+    );
+    if (name == NULL || name_length == 0) {
+      continue;
+    }
+
+    char prefix[64];
+    const int prefix_written = snprintf(
+      prefix,
+      sizeof(prefix),
+      "%u\t%u\t",
+      start,
       end
     );
-    if (prefix_written <= 0) {
+    if (prefix_written <= 0) {
+      continue;
+    }
+
+    if (!buffer_append(
+          &buffer,
+          &buffer_length,
+          &buffer_capacity,
+          prefix,
+          (size_t)prefix_written)) {
+      memory_free(buffer);
+      ts_query_cursor_delete(cursor);
+      return NULL;
+    }
+
+    if (!buffer_append(
+          &buffer,
+          &buffer_length,
+          &buffer_capacity,
+          name,
+          (size_t)name_length)) {
+      memory_free(buffer);
+      ts_query_cursor_delete(cursor);
+      return NULL;
+    }
+
+    if (!buffer_append(&buffer, &buffer_length, &buffer_capacity, "\n", 1)) {
+      memory_free(buffer);
+      ts_query_cursor_delete(cursor);
+      return NULL;
+    }
+  }
+
+  ts_query_cursor_delete(cursor);
+  return buffer;
+}
+
+static uint32_t *ts_doc_query_captures_packed_in(
+  void *doc_ptr,
+  const char *utf8_query,
+  const TsCaptureRange *range,
+  uint32_t *out_count,
+  char **out_capture_names
+) {
+  if (out_count != NULL) {
+    *out_count = 0;
+  }
+  if (out_capture_names != NULL) {
+    *out_capture_names = NULL;
+  }
+  if (doc_ptr == NULL || out_count == NULL) {
+    return NULL;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  if (doc->tree == NULL) {
+    return NULL;
+  }
+  const uint64_t query_start = monotonic_micros();
+  TSQuery *query = ts_doc_get_or_compile_query(doc, utf8_query);
+  if (query == NULL) {
+    return NULL;
+  }
+  TsCaptureRange decoded;
+  if (range != NULL) {
+    decoded = ts_doc_decode_range(doc, range);
+  }
+  const TsSourceText source = text_buffer_view(ts_doc_source(doc));
+  uint32_t *records = query_captures_packed(
+    query,
+    doc->query_predicates,
+    &source,
+    ts_tree_root_node(doc->tree),
+    range == NULL ? NULL : &decoded,
+    range == NULL ? 0 : 1,
+    out_count
+  );
+  const uint64_t serialize_start = monotonic_micros();
+  if (out_capture_names != NULL) {
+    *out_capture_names = query_capture_names(query);
+  }
+  ts_doc_encode_offsets(doc, records, *out_count, 3);
+  ts_doc_record_query(
+    doc,
+    serialize_start - query_start,
+    monotonic_micros() - serialize_start
+  );
+  return records;
+}
+
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_query_captures_packed(
+  void* doc_ptr,
+  const char* utf8_query,
+  uint32_t* out_count,
+  char** out_capture_names
+) {
+  return ts_doc_query_captures_packed_in(
+    doc_ptr,
+    utf8_query,
+    NULL,
+    out_count,
+    out_capture_names
+  );
+}
+
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_query_captures_byte_range(
+  void* doc_ptr,
+  const char* utf8_query,
+  uint32_t start_byte,
+  uint32_t end_byte,
+  uint32_t* out_count,
+  char** out_capture_names
+) {
+  TsCaptureRange range;
+  memset(&range, 0, sizeof(range));
+  range.start_byte = start_byte;
+  range.end_byte = end_byte;
+  return ts_doc_query_captures_packed_in(
+    doc_ptr,
+    utf8_query,
+    &range,
+    out_count,
+    out_capture_names
+  );
+}
+
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_query_captures_row_range(
+  void* doc_ptr,
+  const char* utf8_query,
+  uint32_t start_row,
+  uint32_t end_row,
+  uint32_t* out_count,
+  char** out_capture_names
+) {
+  TsCaptureRange range;
+  memset(&range, 0, sizeof(range));
+  range.use_points = true;
+  range.start_point = (TSPoint){ start_row, 0 };
+  range.end_point = (TSPoint){ end_row, 0 };
+  return ts_doc_query_captures_packed_in(
+    doc_ptr,
+    utf8_query,
+    &range,
+    out_count,
+    out_capture_names
+  );
+}
+
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_changed_ranges(
+  void* doc_ptr,
+  uint32_t* out_count
+) {
+  if (out_count != NULL) {
+    *out_count = 0;
+  }
+  if (doc_ptr == NULL || out_count == NULL) {
+    return NULL;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  if (doc->changed_range_count == 0) {
+    return NULL;
+  }
+  const size_t size = (size_t)doc->changed_range_count * 2 * sizeof(uint32_t);
+  uint32_t *copy = (uint32_t *)memory_alloc(size);
+  if (copy == NULL) {
+    return NULL;
+  }
+  memcpy(copy, doc->changed_ranges, size);
+  *out_count = doc->changed_range_count;
+  ts_doc_encode_offsets(doc, copy, *out_count, 2);
+  return copy;
+}
+
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_query_captures_changed(
+  void* doc_ptr,
+  const char* utf8_query,
+  uint32_t* out_count,
+  char** out_capture_names
+) {
+  if (out_count != NULL) {
+    *out_count = 0;
+  }
+  if (out_capture_names != NULL) {
+    *out_capture_names = NULL;
+  }
+  if (doc_ptr == NULL || out_count == NULL) {
+    return NULL;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  if (doc->tree == NULL) {
+    return NULL;
+  }
+  TSQuery *query = ts_doc_get_or_compile_query(doc, utf8_query);
+  if (query == NULL) {
+    return NULL;
+  }
+  if (out_capture_names != NULL) {
+    *out_capture_names = query_capture_names(query);
+  }
+  if (doc->changed_range_count == 0) {
+    return NULL;
+  }
+
+  TsCaptureRange *ranges = (TsCaptureRange *)memory_calloc(
+    doc->changed_range_count,
+    sizeof(TsCaptureRange)
+  );
+  if (ranges == NULL) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < doc->changed_range_count; i++) {
+    ranges[i].start_byte = doc->changed_ranges[i * 2];
+    ranges[i].end_byte = doc->changed_ranges[i * 2 + 1];
+  }
+  const TsSourceText source = text_buffer_view(ts_doc_source(doc));
+  uint32_t *records = query_captures_packed(
+    query,
+    doc->query_predicates,
+    &source,
+    ts_tree_root_node(doc->tree),
+    ranges,
+    doc->changed_range_count,
+    out_count
+  );
+  memory_free(ranges);
+  ts_doc_encode_offsets(doc, records, *out_count, 3);
+  return records;
+}
+
+FFI_PLUGIN_EXPORT bool ts_doc_set_highlight_styles(
+  void* doc_ptr,
+  const char* utf8_names,
+  const uint32_t* priorities,
+  const uint32_t* style_ids,
+  uint32_t count
+) {
+  if (doc_ptr == NULL || (count > 0 &&
+      (utf8_names == NULL || priorities == NULL || style_ids == NULL))) {
+    return false;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  ts_doc_clear_highlight_styles(doc);
+  if (count == 0) {
+    return true;
+  }
+
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  doc->style_names = (char **)memory_calloc(count, sizeof(char *));
+  doc->style_priorities = (uint32_t *)memory_alloc((size_t)count * sizeof(uint32_t));
+  doc->style_ids = (uint32_t *)memory_alloc((size_t)count * sizeof(uint32_t));
+  if (doc->style_names == NULL || doc->style_priorities == NULL ||
+      doc->style_ids == NULL) {
+    ts_doc_clear_highlight_styles(doc);
+    memory_scope_leave(previous);
+    return false;
+  }
+  doc->style_count = count;
+  memcpy(doc->style_priorities, priorities, (size_t)count * sizeof(uint32_t));
+  memcpy(doc->style_ids, style_ids, (size_t)count * sizeof(uint32_t));
+
+  const char *cursor = utf8_names;
+  for (uint32_t i = 0; i < count; i++) {
+    const char *line_end = strchr(cursor, '\n');
+    const size_t length = line_end == NULL ? strlen(cursor) : (size_t)(line_end - cursor);
+    char *name = (char *)memory_alloc(length + 1);
+    if (name == NULL) {
+      ts_doc_clear_highlight_styles(doc);
+      memory_scope_leave(previous);
+      return false;
+    }
+    memcpy(name, cursor, length);
+    name[length] = '\0';
+    doc->style_names[i] = name;
+    if (line_end == NULL) {
+      // Fewer names than [count]: the remaining entries match nothing.
+      for (uint32_t j = i + 1; j < count; j++) {
+        doc->style_names[j] = (char *)memory_calloc(1, 1);
+        if (doc->style_names[j] == NULL) {
+          ts_doc_clear_highlight_styles(doc);
+          memory_scope_leave(previous);
+          return false;
+        }
+      }
+      break;
+    }
+    cursor = line_end + 1;
+  }
+  memory_scope_leave(previous);
+  return true;
+}
+
+// Maps every capture id of [query] to an index into the document's style
+// table. A capture name matches the longest entry that equals it or is a
+// dot-separated prefix of it ("keyword" styles "keyword.control").
+static const int32_t *ts_doc_capture_styles(TsDoc *doc, const TSQuery *query) {
+  if (doc->capture_styles != NULL) {
+    return doc->capture_styles;
+  }
+  const uint32_t capture_count = ts_query_capture_count(query);
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  int32_t *styles = (int32_t *)memory_alloc(
+    (size_t)(capture_count == 0 ? 1 : capture_count) * sizeof(int32_t)
+  );
+  memory_scope_leave(previous);
+  if (styles == NULL) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < capture_count; i++) {
+    uint32_t name_length = 0;
+    const char *name = ts_query_capture_name_for_id(query, i, &name_length);
+    int32_t best = -1;
+    size_t best_length = 0;
+    for (uint32_t s = 0; name != NULL && s < doc->style_count; s++) {
+      const char *style_name = doc->style_names[s];
+      const size_t style_length = strlen(style_name);
+      if (style_length == 0 || style_length > name_length ||
+          memcmp(style_name, name, style_length) != 0) {
+        continue;
+      }
+      if (style_length < name_length && name[style_length] != '.') {
+        continue;
+      }
+      if (best < 0 || style_length > best_length) {
+        best = (int32_t)s;
+        best_length = style_length;
+      }
+    }
+    styles[i] = best;
+  }
+  doc->capture_styles = styles;
+  return styles;
+}
+
+static uint32_t *ts_doc_highlight_spans_in(
+  void *doc_ptr,
+  const char *utf8_query,
+  const TsCaptureRange *range,
+  uint32_t *out_count
+) {
+  if (out_count != NULL) {
+    *out_count = 0;
+  }
+  if (doc_ptr == NULL || out_count == NULL) {
+    return NULL;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  if (doc->tree == NULL || doc->style_count == 0) {
+    return NULL;
+  }
+  const uint64_t query_start = monotonic_micros();
+  TSQuery *query = ts_doc_get_or_compile_query(doc, utf8_query);
+  if (query == NULL) {
+    return NULL;
+  }
+  const int32_t *capture_styles = ts_doc_capture_styles(doc, query);
+  if (capture_styles == NULL) {
+    return NULL;
+  }
+
+  const TsCaptureRange decoded = ts_doc_decode_range(doc, range);
+  const TsSourceText source = text_buffer_view(ts_doc_source(doc));
+  uint32_t record_count = 0;
+  uint32_t *records = query_captures_packed(
+    query,
+    doc->query_predicates,
+    &source,
+    ts_tree_root_node(doc->tree),
+    &decoded,
+    1,
+    &record_count
+  );
+  if (records == NULL) {
+    return NULL;
+  }
+  const uint64_t serialize_start = monotonic_micros();
+  uint32_t *spans = resolve_highlight_spans(
+    records,
+    record_count,
+    capture_styles,
+    doc->style_priorities,
+    doc->style_ids,
+    out_count
+  );
+  memory_free(records);
+  ts_doc_encode_offsets(doc, spans, *out_count, 3);
+  ts_doc_record_query(
+    doc,
+    serialize_start - query_start,
+    monotonic_micros() - serialize_start
+  );
+  return spans;
+}
+
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_highlight_spans(
+  void* doc_ptr,
+  const char* utf8_query,
+  uint32_t start_byte,
+  uint32_t end_byte,
+  uint32_t* out_count
+) {
+  TsCaptureRange range;
+  memset(&range, 0, sizeof(range));
+  range.start_byte = start_byte;
+  range.end_byte = end_byte;
+  return ts_doc_highlight_spans_in(doc_ptr, utf8_query, &range, out_count);
+}
+
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_highlight_spans_rows(
+  void* doc_ptr,
+  const char* utf8_query,
+  uint32_t start_row,
+  uint32_t end_row,
+  uint32_t* out_count
+) {
+  TsCaptureRange range;
+  memset(&range, 0, sizeof(range));
+  range.use_points = true;
+  range.start_point = (TSPoint){ start_row, 0 };
+  range.end_point = (TSPoint){ end_row, 0 };
+  return ts_doc_highlight_spans_in(doc_ptr, utf8_query, &range, out_count);
+}
+
+FFI_PLUGIN_EXPORT char* ts_parse_sexp(const char* utf8_source, int32_t language) {
+  if (utf8_source == NULL) {
+    return NULL;
+  }
+
+  TSParser *parser = parser_pool_acquire(language);
+  if (parser == NULL) {
+    return NULL;
+  }
+
+  const uint32_t length = (uint32_t)strlen(utf8_source);
+  TSTree *tree = ts_parser_parse_string(parser, NULL, utf8_source, length);
+  parser_pool_release(language, parser);
+  if (tree == NULL) {
+    return NULL;
+  }
+
+  TSNode root = ts_tree_root_node(tree);
+  char *result = ts_node_string(root);
+
+  ts_tree_delete(tree);
+
+  return result;
+}
+
+// --- document snapshots ------------------------------------------------------
+//
+// Once enabled, every successful reparse publishes the new tree as an
+// immutable, reference-counted snapshot: a copy of the tree (cheap, its
+// nodes are shared) and a reference to the text buffer it was parsed from,
+// line index included. The buffer is shared with the document rather than
+// copied; the document's next edit copies it first (see
+// ts_doc_prepare_text), so a snapshot's source never changes under a reader.
+// Any thread may retain the latest snapshot and query it while the document
+// is edited and reparsed; the next reparse publishes a new one and drops the
+// document's reference to the old, which is freed by its last reader.
+
+struct TsDocSnapshot {
+  TsAtomicCounter refs;
+  int64_t revision;
+  int32_t language_id;
+  int32_t builtin_query_kind;
+  int32_t offset_encoding;
+  TSTree *tree;
+  TsTextBuffer *source;
+};
+
+static void snapshot_release(TsDocSnapshot *snapshot) {
+  if (snapshot == NULL || ts_atomic_counter_add(&snapshot->refs, -1) != 1) {
+    return;
+  }
+  ts_tree_delete(snapshot->tree);
+  text_buffer_release(snapshot->source);
+  memory_free(snapshot);
+}
+
+// Runs on the thread that reparsed, inside the document's memory scope, with
+// the [text] the tree was parsed from, which the snapshot retains. On
+// allocation failure the previous snapshot stays published.
+static void ts_doc_publish_snapshot(TsDoc *doc, TsTextBuffer *text) {
+  if (doc->tree == NULL) {
+    return;
+  }
+  TsDocSnapshot *snapshot = (TsDocSnapshot *)memory_calloc(1, sizeof(TsDocSnapshot));
+  if (snapshot == NULL) {
+    return;
+  }
+  snapshot->source = text != NULL ? text_buffer_retain(text) : NULL;
+  snapshot->refs = 1;
+  snapshot->revision = doc->revision;
+  snapshot->language_id = doc->language_id;
+  snapshot->builtin_query_kind = doc->builtin_query_kind;
+  snapshot->offset_encoding = doc->offset_encoding;
+  snapshot->tree = ts_tree_copy(doc->tree);
+
+  ts_mutex_lock(&doc->snapshot_mutex);
+  TsDocSnapshot *previous = doc->snapshot;
+  doc->snapshot = snapshot;
+  ts_mutex_unlock(&doc->snapshot_mutex);
+  snapshot_release(previous);
+}
+
+FFI_PLUGIN_EXPORT bool ts_doc_enable_snapshots(void* doc_ptr) {
+  if (doc_ptr == NULL) {
+    return false;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  if (!doc->snapshots_enabled) {
+    doc->snapshots_enabled = true;
+    TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+    ts_doc_publish_snapshot(doc, ts_doc_source(doc));
+    memory_scope_leave(previous);
+  }
+  return true;
+}
+
+FFI_PLUGIN_EXPORT void* ts_doc_snapshot(void* doc_ptr) {
+  if (doc_ptr == NULL) {
+    return NULL;
+  }
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  ts_mutex_lock(&doc->snapshot_mutex);
+  TsDocSnapshot *snapshot = doc->snapshot;
+  if (snapshot != NULL) {
+    ts_atomic_counter_add(&snapshot->refs, 1);
+  }
+  ts_mutex_unlock(&doc->snapshot_mutex);
+  return (void *)snapshot;
+}
+
+FFI_PLUGIN_EXPORT void ts_snapshot_retain(void* snapshot_ptr) {
+  if (snapshot_ptr != NULL) {
+    ts_atomic_counter_add(&((TsDocSnapshot *)snapshot_ptr)->refs, 1);
+  }
+}
+
+FFI_PLUGIN_EXPORT void ts_snapshot_release(void* snapshot_ptr) {
+  snapshot_release((TsDocSnapshot *)snapshot_ptr);
+}
+
+FFI_PLUGIN_EXPORT int64_t ts_snapshot_revision(void* snapshot_ptr) {
+  return snapshot_ptr != NULL ? ((const TsDocSnapshot *)snapshot_ptr)->revision : -1;
+}
+
+FFI_PLUGIN_EXPORT uint32_t* ts_snapshot_query_captures(
+  void* snapshot_ptr,
+  const char* utf8_query,
+  uint32_t start_row,
+  uint32_t end_row,
+  uint32_t* out_count,
+  char** out_capture_names
+) {
+  if (out_count != NULL) {
+    *out_count = 0;
+  }
+  if (out_capture_names != NULL) {
+    *out_capture_names = NULL;
+  }
+  if (snapshot_ptr == NULL || out_count == NULL) {
+    return NULL;
+  }
+  const TsDocSnapshot *snapshot = (const TsDocSnapshot *)snapshot_ptr;
+
+  // Text queries come from the shared cache, built-in ones from their table;
+  // both are safe to use from any thread.
+  TSQuery *query = NULL;
+  TsQueryPredicates *predicates = NULL;
+  QueryCacheEntry *query_entry = NULL;
+  if (utf8_query != NULL) {
+    query = query_cache_acquire(snapshot->language_id, utf8_query, &predicates, &query_entry);
+  } else {
+    const TsBuiltinQuery *builtin = builtin_query_get(
+      snapshot->language_id,
+      snapshot->builtin_query_kind
+    );
+    if (builtin != NULL) {
+      query = builtin->query;
+      predicates = builtin->predicates;
+    }
+  }
+  if (query == NULL) {
+    return NULL;
+  }
+
+  // Tree-sitter trees must not be shared between threads, so every reader
+  // works on its own copy.
+  TSTree *tree = ts_tree_copy(snapshot->tree);
+  TsCaptureRange range;
+  memset(&range, 0, sizeof(range));
+  range.use_points = true;
+  range.start_point = (TSPoint){ start_row, 0 };
+  range.end_point = (TSPoint){ end_row, 0 };
+  const TsSourceText source = text_buffer_view(snapshot->source);
+  uint32_t *records = query_captures_packed(
+    query,
+    predicates,
+    &source,
+    ts_tree_root_node(tree),
+    &range,
+    1,
+    out_count
+  );
+  ts_tree_delete(tree);
+  if (out_capture_names != NULL) {
+    *out_capture_names = query_capture_names(query);
+  }
+  query_cache_release(query, predicates, query_entry);
+
+  if (snapshot->offset_encoding == TS_OFFSET_ENCODING_UTF16 && records != NULL) {
+    text_buffer_encode_offsets(snapshot->source, records, *out_count, 3);
+  }
+  return records;
+}
+
+// --- workspaces --------------------------------------------------------------
+//
+// A workspace owns the documents of an editor session and keeps the memory
+// they are charged with under a budget. Documents are ordered by their last
+// ts_workspace_activate; when the resident ones exceed the budget the least
+// recently activated lose their tree, parser and private query, keeping only
+// one copy of the text. Activating an evicted document parses that text again
+// on the document's worker thread, so the cost of a tab that is not looked at
+// is its text, not its tree, and switching to it does not block the caller.
+
+struct TsWorkspace {
+  TsMutex mutex;
+  uint64_t memory_budget;
+  // Open documents, least recently activated first.
+  TsDoc **docs;
+  uint32_t doc_count;
+  uint32_t doc_capacity;
+  uint64_t evictions;
+  uint64_t restores;
+};
+
+static uint64_t ts_doc_live_bytes(const TsDoc *doc) {
+  return (uint64_t)memory_account_live_bytes(doc->memory);
+}
+
+// Returns the index of [doc] in [workspace], or doc_count. Call with the
+// workspace locked.
+static uint32_t workspace_find_locked(const TsWorkspace *workspace, const TsDoc *doc) {
+  uint32_t i = 0;
+  while (i < workspace->doc_count && workspace->docs[i] != doc) {
+    i++;
+  }
+  return i;
+}
+
+// Removes [doc] from [workspace]; called by ts_doc_delete.
+static void workspace_forget(TsWorkspace *workspace, TsDoc *doc) {
+  ts_mutex_lock(&workspace->mutex);
+  const uint32_t i = workspace_find_locked(workspace, doc);
+  if (i < workspace->doc_count) {
+    memmove(
+      workspace->docs + i,
+      workspace->docs + i + 1,
+      (size_t)(workspace->doc_count - i - 1) * sizeof(TsDoc *)
+    );
+    workspace->doc_count--;
+  }
+  ts_mutex_unlock(&workspace->mutex);
+  doc->workspace = NULL;
+}
+
+// Drops the tree, parser and per-tree state of [doc], keeping only the text
+// ts_doc_start_restore parses again. Skipped while an asynchronous reparse is
+// queued or running, and for documents that have no text to restore from.
+static bool ts_doc_evict(TsDoc *doc) {
+  TsDocWorker *worker = doc->worker;
+  if (worker != NULL) {
+    // Held until the end so the worker cannot pick up a job meanwhile.
+    ts_mutex_lock(&worker->mutex);
+    if (worker->busy || worker->has_job) {
+      ts_mutex_unlock(&worker->mutex);
+      return false;
+    }
+  }
+  bool evicted = false;
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  TsTextBuffer *source = doc->source;
+  if (source != NULL && !source->indexed) {
+    text_buffer_index_lines(source);
+  }
+  if (doc->tree != NULL && ts_doc_source(doc) != NULL &&
+      (source == NULL || source->indexed)) {
+    // The source of an explicit reparse replaces the tracked text rather than
+    // being kept beside it, so the restore parses the text the tree came from.
+    if (source != NULL) {
+      text_buffer_release(doc->text);
+      doc->text = source;
+      doc->source = NULL;
+    }
+    ts_tree_delete(doc->tree);
+    doc->tree = NULL;
+    ts_parser_delete(doc->parser);
+    doc->parser = NULL;
+    doc->parse_halted = false;
+    doc->has_pending_edit = false;
+    memory_free(doc->changed_ranges);
+    doc->changed_ranges = NULL;
+    doc->changed_range_count = 0;
+    // Built-in and cached queries are shared; only a private one is freed.
+    if (!doc->query_builtin && doc->query_entry == NULL) {
+      ts_doc_clear_query(doc);
+    }
+    ts_mutex_lock(&doc->snapshot_mutex);
+    TsDocSnapshot *snapshot = doc->snapshot;
+    doc->snapshot = NULL;
+    ts_mutex_unlock(&doc->snapshot_mutex);
+    snapshot_release(snapshot);
+    ts_atomic_flag_set(&doc->evicted, 1);
+    doc->edited_while_evicted = false;
+    evicted = true;
+  }
+  memory_scope_leave(previous);
+  if (worker != NULL) {
+    ts_mutex_unlock(&worker->mutex);
+  }
+  return evicted;
+}
+
+// Queues the parse of an evicted document's text on its worker thread, which
+// then calls [on_complete] as ts_doc_reparse_async does; sets [*out_queued]
+// if it did. Nothing is queued for a document that is not evicted, was
+// edited since (its next reparse is a full one), or has a reparse pending
+// that rebuilds the tree anyway. Returns false if the worker could not start.
+static bool ts_doc_start_restore(
+  TsDoc *doc,
+  int64_t request_id,
+  TsDocReparseCallback on_complete,
+  bool *out_queued
+) {
+  *out_queued = false;
+  if (!ts_atomic_flag_get(&doc->evicted) || doc->edited_while_evicted) {
+    return true;
+  }
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  const bool started = ts_doc_start_worker(doc);
+  memory_scope_leave(previous);
+  if (!started) {
+    return false;
+  }
+  TsDocWorker *worker = doc->worker;
+  ts_mutex_lock(&worker->mutex);
+  if (!worker->busy) {
+    worker->busy = true;
+    ts_atomic_flag_set(&doc->cancel_requested, 0);
+    worker->has_job = true;
+    // Edits while the parse runs go to a copy, as for a tracked reparse.
+    worker->job_text = text_buffer_retain(doc->text);
+    worker->job_tracked = true;
+    worker->job_generation = (uint64_t)ts_atomic_counter_get(&doc->text_generation);
+    worker->job_restore = true;
+    worker->job_query = NULL;
+    worker->job_result_kind = TS_ASYNC_RESULT_NONE;
+    worker->job_id = request_id;
+    worker->job_timeout_micros = 0;
+    worker->job_callback = on_complete;
+    ts_cond_signal(&worker->cond);
+    *out_queued = true;
+  }
+  ts_mutex_unlock(&worker->mutex);
+  return true;
+}
+
+// Runs on the worker thread: parses [text], the kept text of an evicted
+// document, from scratch. The new tree matches the evicted one, so no changed
+// ranges are reported and the revision is unchanged.
+static int32_t ts_doc_restore(TsDoc *doc, TsTextBuffer *text) {
+  TsSourceText view = text_buffer_view(text);
+  TSInput input = {
+    .payload = (void *)&view,
+    .read = source_text_read,
+    .encoding = TSInputEncodingUTF8,
+    .decode = NULL,
+  };
+  TsMemoryAccount *previous = memory_scope_enter(doc->memory);
+  TSTree *tree = ts_doc_ensure_parser(doc)
+    ? ts_parser_parse(doc->parser, NULL, input)
+    : NULL;
+  if (tree != NULL) {
+    doc->tree = tree;
+    ts_atomic_flag_set(&doc->evicted, 0);
+    if (doc->snapshots_enabled) {
+      ts_doc_publish_snapshot(doc, text);
+    }
+  }
+  memory_scope_leave(previous);
+  return tree != NULL ? TS_REPARSE_OK : TS_REPARSE_FAILED;
+}
+
+// Evicts the least recently activated documents until the workspace fits its
+// budget. The most recently activated document is always kept. Call with the
+// workspace locked.
+static void workspace_trim_locked(TsWorkspace *workspace) {
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < workspace->doc_count; i++) {
+    total += ts_doc_live_bytes(workspace->docs[i]);
+  }
+  for (uint32_t i = 0; i + 1 < workspace->doc_count && total > workspace->memory_budget; i++) {
+    TsDoc *doc = workspace->docs[i];
+    const uint64_t before = ts_doc_live_bytes(doc);
+    if (!ts_doc_evict(doc)) {
       continue;
     }
+    const uint64_t after = ts_doc_live_bytes(doc);
+    total -= before > after ? before - after : 0;
+    workspace->evictions++;
+  }
+}
 
-    if (!buffer_append(
-          &buffer,
-          &buffer_length,
-          &buffer_capacity,
-          prefix,
-          (size_t)prefix_written)) {
-      free(buffer);
-      ts_query_cursor_delete(cursor);
-      return NULL;
+FFI_PLUGIN_EXPORT void* ts_workspace_new(uint64_t memory_budget_bytes) {
+  TsWorkspace *workspace = (TsWorkspace *)memory_calloc(1, sizeof(TsWorkspace));
+  if (workspace == NULL) {
+    return NULL;
+  }
+  ts_mutex_init(&workspace->mutex);
+  workspace->memory_budget = memory_budget_bytes;
+  return (void *)workspace;
+}
+
+FFI_PLUGIN_EXPORT void ts_workspace_delete(void* workspace_ptr) {
+  if (workspace_ptr == NULL) {
+    return;
+  }
+  TsWorkspace *workspace = (TsWorkspace *)workspace_ptr;
+  // Detached first, so ts_doc_delete does not look for them in the list.
+  for (uint32_t i = 0; i < workspace->doc_count; i++) {
+    workspace->docs[i]->workspace = NULL;
+    ts_doc_delete(workspace->docs[i]);
+  }
+  memory_free(workspace->docs);
+  ts_mutex_destroy(&workspace->mutex);
+  memory_free(workspace);
+}
+
+FFI_PLUGIN_EXPORT void* ts_workspace_open(void* workspace_ptr, int32_t language) {
+  if (workspace_ptr == NULL) {
+    return NULL;
+  }
+  TsWorkspace *workspace = (TsWorkspace *)workspace_ptr;
+  TsDoc *doc = (TsDoc *)ts_doc_new(language);
+  if (doc == NULL) {
+    return NULL;
+  }
+  ts_mutex_lock(&workspace->mutex);
+  const bool added = array_reserve(
+    (void **)&workspace->docs,
+    &workspace->doc_capacity,
+    workspace->doc_count,
+    sizeof(TsDoc *)
+  );
+  if (added) {
+    workspace->docs[workspace->doc_count++] = doc;
+    doc->workspace = workspace;
+  }
+  ts_mutex_unlock(&workspace->mutex);
+  if (!added) {
+    ts_doc_delete(doc);
+    return NULL;
+  }
+  return (void *)doc;
+}
+
+FFI_PLUGIN_EXPORT bool ts_workspace_activate(
+  void* workspace_ptr,
+  void* doc_ptr,
+  int64_t request_id,
+  TsDocReparseCallback on_complete
+) {
+  if (workspace_ptr == NULL || doc_ptr == NULL) {
+    return false;
+  }
+  TsWorkspace *workspace = (TsWorkspace *)workspace_ptr;
+  TsDoc *doc = (TsDoc *)doc_ptr;
+  ts_mutex_lock(&workspace->mutex);
+  const uint32_t i = workspace_find_locked(workspace, doc);
+  if (i == workspace->doc_count) {
+    ts_mutex_unlock(&workspace->mutex);
+    return false;
+  }
+  memmove(
+    workspace->docs + i,
+    workspace->docs + i + 1,
+    (size_t)(workspace->doc_count - i - 1) * sizeof(TsDoc *)
+  );
+  workspace->docs[workspace->doc_count - 1] = doc;
+  // Only queued here: the parse runs on the document's worker thread, not
+  // under the workspace lock.
+  bool queued = false;
+  const bool ok = ts_doc_start_restore(doc, request_id, on_complete, &queued);
+  if (queued) {
+    workspace->restores++;
+  }
+  workspace_trim_locked(workspace);
+  ts_mutex_unlock(&workspace->mutex);
+  if (ok && !queued && on_complete != NULL) {
+    on_complete(doc_ptr, request_id, TS_REPARSE_OK);
+  }
+  return ok;
+}
+
+FFI_PLUGIN_EXPORT void ts_workspace_set_memory_budget(
+  void* workspace_ptr,
+  uint64_t memory_budget_bytes
+) {
+  if (workspace_ptr == NULL) {
+    return;
+  }
+  TsWorkspace *workspace = (TsWorkspace *)workspace_ptr;
+  ts_mutex_lock(&workspace->mutex);
+  workspace->memory_budget = memory_budget_bytes;
+  workspace_trim_locked(workspace);
+  ts_mutex_unlock(&workspace->mutex);
+}
+
+FFI_PLUGIN_EXPORT bool ts_workspace_stats(void* workspace_ptr, TsWorkspaceStats* out_stats) {
+  if (workspace_ptr == NULL || out_stats == NULL) {
+    return false;
+  }
+  TsWorkspace *workspace = (TsWorkspace *)workspace_ptr;
+  memset(out_stats, 0, sizeof(*out_stats));
+  ts_mutex_lock(&workspace->mutex);
+  out_stats->document_count = workspace->doc_count;
+  for (uint32_t i = 0; i < workspace->doc_count; i++) {
+    const TsDoc *doc = workspace->docs[i];
+    if (!ts_atomic_flag_get(&doc->evicted)) {
+      out_stats->resident_count++;
     }
+    out_stats->memory_bytes += ts_doc_live_bytes(doc);
+  }
+  out_stats->memory_budget_bytes = workspace->memory_budget;
+  out_stats->evictions = workspace->evictions;
+  out_stats->restores = workspace->restores;
+  ts_mutex_unlock(&workspace->mutex);
+  return true;
+}
 
-    if (!buffer_append(
-          &buffer,
-          &buffer_length,
-          &buffer_capacity,
-          name,
-          (size_t)name_length)) {
-      free(buffer);
-      ts_query_cursor_delete(cursor);
-      return NULL;
+// --- batch entry points ------------------------------------------------------
+//
+// A batch is split across worker threads that pull the next unprocessed item
+// under a lock. The calling thread works too, so a batch of one item (or a
+// single-core machine) spawns no threads at all.
+
+typedef struct TsBatch {
+  TsMutex mutex;
+  uint32_t next_item;
+  uint32_t item_count;
+  const char *const *sources;
+  const uint32_t *lengths;
+  const int32_t *languages;
+  // NULL for a token batch, which is packed when [out_counts] is set.
+  const char *const *queries;
+  void **out_results;
+  uint32_t *out_counts;
+  char **out_capture_names;
+} TsBatch;
+
+static void batch_run_item(TsBatch *batch, uint32_t i) {
+  const char *source = batch->sources[i];
+  if (source == NULL) {
+    return;
+  }
+  const uint32_t length =
+    batch->lengths != NULL ? batch->lengths[i] : (uint32_t)strlen(source);
+  if (batch->queries == NULL) {
+    batch->out_results[i] = batch->out_counts != NULL
+      ? (void *)tokens_packed_for_source(source, length, batch->languages[i], &batch->out_counts[i])
+      : (void *)tokens_for_source(source, length, batch->languages[i]);
+    return;
+  }
+  if (batch->queries[i] == NULL) {
+    return;
+  }
+  batch->out_results[i] = captures_packed_for_source(
+    source,
+    length,
+    batch->languages[i],
+    batch->queries[i],
+    &batch->out_counts[i],
+    batch->out_capture_names != NULL ? &batch->out_capture_names[i] : NULL
+  );
+}
+
+static void batch_work(TsBatch *batch) {
+  while (true) {
+    ts_mutex_lock(&batch->mutex);
+    const uint32_t i = batch->next_item;
+    if (i < batch->item_count) {
+      batch->next_item++;
     }
+    ts_mutex_unlock(&batch->mutex);
+    if (i >= batch->item_count) {
+      return;
+    }
+    batch_run_item(batch, i);
+  }
+}
 
-    if (!buffer_append(&buffer, &buffer_length, &buffer_capacity, "\n", 1)) {
-      free(buffer);
-      ts_query_cursor_delete(cursor);
-      return NULL;
+#if _WIN32
+static DWORD WINAPI batch_thread_main(LPVOID arg) {
+  batch_work((TsBatch *)arg);
+  return 0;
+}
+#else
+static void *batch_thread_main(void *arg) {
+  batch_work((TsBatch *)arg);
+  return NULL;
+}
+#endif
+
+static uint32_t batch_thread_count(int32_t requested, uint32_t item_count) {
+  long threads = requested;
+  if (threads <= 0) {
+#if _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    threads = (long)info.dwNumberOfProcessors;
+#else
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (threads > BATCH_MAX_THREADS) {
+    threads = BATCH_MAX_THREADS;
+  }
+  if ((uint32_t)threads > item_count) {
+    threads = (long)item_count;
+  }
+  return (uint32_t)threads;
+}
+
+static void batch_run(TsBatch *batch, int32_t thread_count) {
+  const uint32_t threads = batch_thread_count(thread_count, batch->item_count);
+  if (threads == 0) {
+    return;
+  }
+  ts_mutex_init(&batch->mutex);
+  batch->next_item = 0;
+
+#if _WIN32
+  HANDLE handles[BATCH_MAX_THREADS];
+#else
+  pthread_t handles[BATCH_MAX_THREADS];
+#endif
+  uint32_t started = 0;
+  for (uint32_t t = 1; t < threads; t++) {
+#if _WIN32
+    handles[started] = CreateThread(NULL, 0, batch_thread_main, batch, 0, NULL);
+    if (handles[started] == NULL) {
+      break;
     }
+#else
+    if (pthread_create(&handles[started], NULL, batch_thread_main, batch) != 0) {
+      break;
+    }
+#endif
+    started++;
   }
 
-  ts_query_cursor_delete(cursor);
-  return buffer;
+  // If a thread failed to start, the remaining ones (and this thread) simply
+  // take more items.
+  batch_work(batch);
+
+  for (uint32_t t = 0; t < started; t++) {
+#if _WIN32
+    WaitForSingleObject(handles[t], INFINITE);
+    CloseHandle(handles[t]);
+#else
+    pthread_join(handles[t], NULL);
+#endif
+  }
+  ts_mutex_destroy(&batch->mutex);
 }
 
-FFI_PLUGIN_EXPORT char* ts_parse_sexp(const char* utf8_source, int32_t language) {
-  if (utf8_source == NULL) {
-    return NULL;
+FFI_PLUGIN_EXPORT void ts_batch_tokens(
+  const char* const* utf8_sources,
+  const uint32_t* lengths,
+  const int32_t* languages,
+  uint32_t item_count,
+  int32_t thread_count,
+  char** out_results
+) {
+  if (out_results == NULL) {
+    return;
+  }
+  memset(out_results, 0, sizeof(char *) * item_count);
+  if (utf8_sources == NULL || languages == NULL) {
+    return;
   }
 
-  const TSLanguage *ts_language = language_from_id(language);
-  if (ts_language == NULL) {
-    return NULL;
+  TsBatch batch = {
+    .item_count = item_count,
+    .sources = utf8_sources,
+    .lengths = lengths,
+    .languages = languages,
+    .out_results = (void **)out_results,
+  };
+  batch_run(&batch, thread_count);
+}
+
+FFI_PLUGIN_EXPORT void ts_batch_tokens_packed(
+  const char* const* utf8_sources,
+  const uint32_t* lengths,
+  const int32_t* languages,
+  uint32_t item_count,
+  int32_t thread_count,
+  uint32_t** out_results,
+  uint32_t* out_counts
+) {
+  if (out_results == NULL || out_counts == NULL) {
+    return;
+  }
+  memset(out_results, 0, sizeof(uint32_t *) * item_count);
+  memset(out_counts, 0, sizeof(uint32_t) * item_count);
+  if (utf8_sources == NULL || languages == NULL) {
+    return;
   }
 
-  TSParser *parser = ts_parser_new();
-  if (parser == NULL) {
-    return NULL;
+  TsBatch batch = {
+    .item_count = item_count,
+    .sources = utf8_sources,
+    .lengths = lengths,
+    .languages = languages,
+    .out_results = (void **)out_results,
+    .out_counts = out_counts,
+  };
+  batch_run(&batch, thread_count);
+}
+
+FFI_PLUGIN_EXPORT void ts_batch_query_captures_packed(
+  const char* const* utf8_sources,
+  const uint32_t* lengths,
+  const int32_t* languages,
+  const char* const* utf8_queries,
+  uint32_t item_count,
+  int32_t thread_count,
+  uint32_t** out_results,
+  uint32_t* out_counts,
+  char** out_capture_names
+) {
+  if (out_results == NULL || out_counts == NULL) {
+    return;
+  }
+  memset(out_results, 0, sizeof(uint32_t *) * item_count);
+  memset(out_counts, 0, sizeof(uint32_t) * item_count);
+  if (out_capture_names != NULL) {
+    memset(out_capture_names, 0, sizeof(char *) * item_count);
+  }
+  if (utf8_sources == NULL || languages == NULL || utf8_queries == NULL) {
+    return;
   }
 
-  if (!ts_parser_set_language(parser, ts_language)) {
-    ts_parser_delete(parser);
+  TsBatch batch = {
+    .item_count = item_count,
+    .sources = utf8_sources,
+    .lengths = lengths,
+    .languages = languages,
+    .queries = utf8_queries,
+    .out_results = (void **)out_results,
+    .out_counts = out_counts,
+    .out_capture_names = out_capture_names,
+  };
+  batch_run(&batch, thread_count);
+}
+
+FFI_PLUGIN_EXPORT void ts_free(void* ptr) {
+  memory_free(ptr);
+}
+
+static bool buffer_ensure(char **buffer, size_t *capacity, size_t needed) {
+  if (needed <= *capacity) {
+    return true;
+  }
+  size_t new_capacity = *capacity == 0 ? 4096 : *capacity;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+  char *new_buffer = (char *)memory_realloc(*buffer, new_capacity);
+  if (new_buffer == NULL) {
+    return false;
+  }
+  *buffer = new_buffer;
+  *capacity = new_capacity;
+  return true;
+}
+
+static bool buffer_append(
+  char **buffer,
+  size_t *length,
+  size_t *capacity,
+  const char *data,
+  size_t data_length
+) {
+  const size_t needed = *length + data_length + 1;
+  if (!buffer_ensure(buffer, capacity, needed)) {
+    return false;
+  }
+  memcpy(*buffer + *length, data, data_length);
+  *length += data_length;
+  (*buffer)[*length] = '\0';
+  return true;
+}
+
+static int compare_capture_records(const void *a, const void *b) {
+  const uint32_t *left = (const uint32_t *)a;
+  const uint32_t *right = (const uint32_t *)b;
+  if (left[0] != right[0]) {
+    return left[0] < right[0] ? -1 : 1;
+  }
+  if (left[1] != right[1]) {
+    return left[1] > right[1] ? -1 : 1;
+  }
+  return left[2] < right[2] ? -1 : (left[2] > right[2] ? 1 : 0);
+}
+
+// Collects (start_byte, end_byte, capture_id) records for every capture of
+// [query] under [root] whose match passes [predicates] on [source], sorted the
+// same way the Dart layer sorts text results.
+// When [range_count] is non-zero only captures intersecting one of [ranges]
+// are returned; captures spanning several ranges are reported once.
+static uint32_t *query_captures_packed(
+  const TSQuery *query,
+  const TsQueryPredicates *predicates,
+  const TsSourceText *source,
+  TSNode root,
+  const TsCaptureRange *ranges,
+  uint32_t range_count,
+  uint32_t *out_count
+) {
+  *out_count = 0;
+  TSQueryCursor *cursor = ts_query_cursor_new();
+  if (cursor == NULL) {
     return NULL;
   }
 
-  const uint32_t length = (uint32_t)strlen(utf8_source);
-  TSTree *tree = ts_parser_parse_string(parser, NULL, utf8_source, length);
-  if (tree == NULL) {
-    ts_parser_delete(parser);
+  uint32_t *records = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+
+  const uint32_t passes = range_count == 0 ? 1 : range_count;
+  for (uint32_t pass = 0; pass < passes; pass++) {
+    if (range_count > 0) {
+      const TsCaptureRange *range = &ranges[pass];
+      const bool range_ok = range->use_points
+        ? ts_query_cursor_set_point_range(cursor, range->start_point, range->end_point)
+        : ts_query_cursor_set_byte_range(cursor, range->start_byte, range->end_byte);
+      if (!range_ok) {
+        memory_free(records);
+        ts_query_cursor_delete(cursor);
+        return NULL;
+      }
+    }
+    ts_query_cursor_exec(cursor, query, root);
+
+    TSQueryMatch match;
+    uint32_t capture_index = 0;
+    while (ts_query_cursor_next_capture(cursor, &match, &capture_index)) {
+      if (!query_match_passes(predicates, &match, source)) {
+        ts_query_cursor_remove_match(cursor, match.id);
+        continue;
+      }
+      const TSQueryCapture capture = match.captures[capture_index];
+      const uint32_t start = ts_node_start_byte(capture.node);
+      const uint32_t end = ts_node_end_byte(capture.node);
+      if (end <= start) {
+        continue;
+      }
+
+      if (count == capacity) {
+        const size_t new_capacity = capacity == 0 ? 1024 : capacity * 2;
+        uint32_t *new_records = (uint32_t *)memory_realloc(
+          records,
+          new_capacity * 3 * sizeof(uint32_t)
+        );
+        if (new_records == NULL) {
+          memory_free(records);
+          ts_query_cursor_delete(cursor);
+          return NULL;
+        }
+        records = new_records;
+        capacity = new_capacity;
+      }
+      uint32_t *record = records + count * 3;
+      record[0] = start;
+      record[1] = end;
+      record[2] = capture.index;
+      count++;
+    }
+  }
+  ts_query_cursor_delete(cursor);
+
+  if (count > 1) {
+    qsort(records, count, 3 * sizeof(uint32_t), compare_capture_records);
+  }
+  if (range_count > 1 && count > 1) {
+    size_t unique = 1;
+    for (size_t i = 1; i < count; i++) {
+      if (memcmp(records + i * 3, records + (unique - 1) * 3, 3 * sizeof(uint32_t)) != 0) {
+        memmove(records + unique * 3, records + i * 3, 3 * sizeof(uint32_t));
+        unique++;
+      }
+    }
+    count = unique;
+  }
+  *out_count = (uint32_t)count;
+  return records;
+}
+
+// Returns the capture names of [query], newline-delimited and indexed by
+// capture id. Heap-allocated; free with ts_free.
+static char *query_capture_names(const TSQuery *query) {
+  char *buffer = NULL;
+  size_t buffer_length = 0;
+  size_t buffer_capacity = 0;
+  if (!buffer_ensure(&buffer, &buffer_capacity, 1)) {
     return NULL;
   }
+  buffer[0] = '\0';
 
-  TSNode root = ts_tree_root_node(tree);
-  char *result = ts_node_string(root);
-
-  ts_tree_delete(tree);
-  ts_parser_delete(parser);
-
-  return result;
+  const uint32_t capture_count = ts_query_capture_count(query);
+  for (uint32_t i = 0; i < capture_count; i++) {
+    uint32_t name_length = 0;
+    const char *name = ts_query_capture_name_for_id(query, i, &name_length);
+    if (i > 0 && !buffer_append(&buffer, &buffer_length, &buffer_capacity, "\n", 1)) {
+      memory_free(buffer);
+      return NULL;
+    }
+    if (name != NULL &&
+        !buffer_append(&buffer, &buffer_length, &buffer_capacity, name, name_length)) {
+      memory_free(buffer);
+      return NULL;
+    }
+  }
+  return buffer;
 }
 
-FFI_PLUGIN_EXPORT void ts_free(void* ptr) {
-  free(ptr);
-}
+// Heap entry for resolve_highlight_spans: an active capture and the style it
+// resolved to.
+typedef struct HighlightCandidate {
+  uint32_t start;
+  uint32_t end;
+  uint32_t priority;
+  uint32_t style_id;
+  uint32_t order;
+} HighlightCandidate;
 
-static bool buffer_ensure(char **buffer, size_t *capacity, size_t needed) {
-  if (needed <= *capacity) {
-    return true;
+// True if [a] beats [b]: higher priority, then earlier start, then longer,
+// then earlier in query order.
+static bool highlight_candidate_wins(
+  const HighlightCandidate *a,
+  const HighlightCandidate *b
+) {
+  if (a->priority != b->priority) {
+    return a->priority > b->priority;
   }
-  size_t new_capacity = *capacity == 0 ? 4096 : *capacity;
-  while (new_capacity < needed) {
-    new_capacity *= 2;
+  if (a->start != b->start) {
+    return a->start < b->start;
   }
-  char *new_buffer = (char *)realloc(*buffer, new_capacity);
-  if (new_buffer == NULL) {
-    return false;
+  if (a->end != b->end) {
+    return a->end > b->end;
   }
-  *buffer = new_buffer;
-  *capacity = new_capacity;
-  return true;
+  return a->order < b->order;
 }
 
-static bool buffer_append(
-  char **buffer,
-  size_t *length,
-  size_t *capacity,
-  const char *data,
-  size_t data_length
+static void highlight_heap_push(
+  HighlightCandidate *heap,
+  uint32_t *size,
+  HighlightCandidate candidate
 ) {
-  const size_t needed = *length + data_length + 1;
-  if (!buffer_ensure(buffer, capacity, needed)) {
-    return false;
+  uint32_t i = (*size)++;
+  while (i > 0) {
+    const uint32_t parent = (i - 1) / 2;
+    if (!highlight_candidate_wins(&candidate, &heap[parent])) {
+      break;
+    }
+    heap[i] = heap[parent];
+    i = parent;
   }
-  memcpy(*buffer + *length, data, data_length);
-  *length += data_length;
-  (*buffer)[*length] = '\0';
-  return true;
+  heap[i] = candidate;
 }
 
-FFI_PLUGIN_EXPORT char* ts_tokens(const char* utf8_source, int32_t language) {
-  if (utf8_source == NULL) {
+static void highlight_heap_pop(HighlightCandidate *heap, uint32_t *size) {
+  const HighlightCandidate last = heap[--(*size)];
+  uint32_t i = 0;
+  while (true) {
+    const uint32_t left = i * 2 + 1;
+    if (left >= *size) {
+      break;
+    }
+    uint32_t best = left;
+    if (left + 1 < *size && highlight_candidate_wins(&heap[left + 1], &heap[left])) {
+      best = left + 1;
+    }
+    if (!highlight_candidate_wins(&heap[best], &last)) {
+      break;
+    }
+    heap[i] = heap[best];
+    i = best;
+  }
+  if (*size > 0) {
+    heap[i] = last;
+  }
+}
+
+// Flattens capture [records] (sorted by start) into sorted, non-overlapping
+// (start, end, style_id) spans. Where captures overlap the winner of
+// highlight_candidate_wins is shown; adjacent spans with the same style are
+// coalesced. Captures whose style index is negative are ignored.
+static uint32_t *resolve_highlight_spans(
+  const uint32_t *records,
+  uint32_t record_count,
+  const int32_t *capture_styles,
+  const uint32_t *style_priorities,
+  const uint32_t *style_ids,
+  uint32_t *out_count
+) {
+  *out_count = 0;
+  if (record_count == 0) {
+    return NULL;
+  }
+  HighlightCandidate *heap = (HighlightCandidate *)memory_alloc(
+    (size_t)record_count * sizeof(HighlightCandidate)
+  );
+  // Each capture adds at most two boundaries, so spans never exceed
+  // 2 * record_count.
+  uint32_t *spans = (uint32_t *)memory_alloc((size_t)record_count * 2 * 3 * sizeof(uint32_t));
+  if (heap == NULL || spans == NULL) {
+    memory_free(heap);
+    memory_free(spans);
     return NULL;
   }
 
-  const TSLanguage *ts_language = language_from_id(language);
-  if (ts_language == NULL) {
+  uint32_t heap_size = 0;
+  uint32_t span_count = 0;
+  uint32_t next = 0;
+  uint32_t position = 0;
+  while (next < record_count || heap_size > 0) {
+    // Drop candidates that ended before the current position.
+    while (heap_size > 0 && heap[0].end <= position) {
+      highlight_heap_pop(heap, &heap_size);
+    }
+    if (heap_size == 0) {
+      if (next >= record_count) {
+        break;
+      }
+      if (records[next * 3] > position) {
+        position = records[next * 3];
+      }
+    }
+    // Activate every capture starting at or before the current position.
+    while (next < record_count && records[next * 3] <= position) {
+      const uint32_t *record = records + next * 3;
+      const int32_t style = capture_styles[record[2]];
+      if (style >= 0 && record[1] > position) {
+        HighlightCandidate candidate;
+        candidate.start = record[0];
+        candidate.end = record[1];
+        candidate.priority = style_priorities[style];
+        candidate.style_id = style_ids[style];
+        candidate.order = next;
+        highlight_heap_push(heap, &heap_size, candidate);
+      }
+      next++;
+    }
+    if (heap_size == 0) {
+      continue;
+    }
+
+    const HighlightCandidate *winner = &heap[0];
+    uint32_t segment_end = winner->end;
+    if (next < record_count && records[next * 3] < segment_end) {
+      segment_end = records[next * 3];
+    }
+    if (span_count > 0) {
+      uint32_t *last = spans + (span_count - 1) * 3;
+      if (last[1] == position && last[2] == winner->style_id) {
+        last[1] = segment_end;
+        position = segment_end;
+        continue;
+      }
+    }
+    uint32_t *span = spans + span_count * 3;
+    span[0] = position;
+    span[1] = segment_end;
+    span[2] = winner->style_id;
+    span_count++;
+    position = segment_end;
+  }
+
+  memory_free(heap);
+  if (span_count == 0) {
+    memory_free(spans);
     return NULL;
   }
+  *out_count = span_count;
+  return spans;
+}
 
-  TSParser *parser = ts_parser_new();
-  if (parser == NULL) {
+FFI_PLUGIN_EXPORT char* ts_tokens(const char* utf8_source, int32_t language) {
+  if (utf8_source == NULL) {
     return NULL;
   }
+  return tokens_for_source(utf8_source, (uint32_t)strlen(utf8_source), language);
+}
 
-  if (!ts_parser_set_language(parser, ts_language)) {
-    ts_parser_delete(parser);
+static char *tokens_for_source(const char *source, uint32_t length, int32_t language) {
+  TSParser *parser = parser_pool_acquire(language);
+  if (parser == NULL) {
     return NULL;
   }
 
-  const uint32_t length = (uint32_t)strlen(utf8_source);
-  TSTree *tree = ts_parser_parse_string(parser, NULL, utf8_source, length);
+  TSTree *tree = ts_parser_parse_string(parser, NULL, source, length);
+  parser_pool_release(language, parser);
   if (tree == NULL) {
-    ts_parser_delete(parser);
     return NULL;
   }
 
@@ -416,28 +6296,25 @@ FFI_PLUGIN_EXPORT char* ts_tokens(const char* utf8_source, int32_t language) {
         type
       );
       if (written < 0) {
-        free(buffer);
+        memory_free(buffer);
         ts_tree_cursor_delete(&cursor);
         ts_tree_delete(tree);
-        ts_parser_delete(parser);
         return NULL;
       }
       if ((size_t)written < sizeof(line)) {
         if (!buffer_append(&buffer, &buffer_length, &buffer_capacity, line, (size_t)written)) {
-          free(buffer);
+          memory_free(buffer);
           ts_tree_cursor_delete(&cursor);
           ts_tree_delete(tree);
-          ts_parser_delete(parser);
           return NULL;
         }
       } else {
         // Fallback for unusually long type names.
-        char *dynamic_line = (char *)malloc((size_t)written + 1);
+        char *dynamic_line = (char *)memory_alloc((size_t)written + 1);
         if (dynamic_line == NULL) {
-          free(buffer);
+          memory_free(buffer);
           ts_tree_cursor_delete(&cursor);
           ts_tree_delete(tree);
-          ts_parser_delete(parser);
           return NULL;
         }
         snprintf(
@@ -456,12 +6333,11 @@ FFI_PLUGIN_EXPORT char* ts_tokens(const char* utf8_source, int32_t language) {
           dynamic_line,
           (size_t)written
         );
-        free(dynamic_line);
+        memory_free(dynamic_line);
         if (!ok) {
-          free(buffer);
+          memory_free(buffer);
           ts_tree_cursor_delete(&cursor);
           ts_tree_delete(tree);
-          ts_parser_delete(parser);
           return NULL;
         }
       }
@@ -478,7 +6354,6 @@ FFI_PLUGIN_EXPORT char* ts_tokens(const char* utf8_source, int32_t language) {
       if (!ts_tree_cursor_goto_parent(&cursor)) {
         ts_tree_cursor_delete(&cursor);
         ts_tree_delete(tree);
-        ts_parser_delete(parser);
         return buffer;
       }
       if (ts_tree_cursor_goto_next_sibling(&cursor)) {
@@ -488,63 +6363,167 @@ FFI_PLUGIN_EXPORT char* ts_tokens(const char* utf8_source, int32_t language) {
   }
 }
 
-FFI_PLUGIN_EXPORT char* ts_query_captures(
+FFI_PLUGIN_EXPORT uint32_t* ts_tokens_packed(
   const char* utf8_source,
   int32_t language,
-  const char* utf8_query
+  uint32_t* out_count
 ) {
-  if (utf8_source == NULL || utf8_query == NULL) {
+  if (out_count == NULL) {
     return NULL;
   }
-
-  const TSLanguage *ts_language = language_from_id(language);
-  if (ts_language == NULL) {
+  *out_count = 0;
+  if (utf8_source == NULL) {
     return NULL;
   }
+  return tokens_packed_for_source(
+    utf8_source,
+    (uint32_t)strlen(utf8_source),
+    language,
+    out_count
+  );
+}
 
-  TSParser *parser = ts_parser_new();
+static uint32_t *tokens_packed_for_source(
+  const char *source,
+  uint32_t length,
+  int32_t language,
+  uint32_t *out_count
+) {
+  *out_count = 0;
+  TSParser *parser = parser_pool_acquire(language);
   if (parser == NULL) {
     return NULL;
   }
+  TSTree *tree = ts_parser_parse_string(parser, NULL, source, length);
+  parser_pool_release(language, parser);
+  if (tree == NULL) {
+    return NULL;
+  }
 
-  if (!ts_parser_set_language(parser, ts_language)) {
-    ts_parser_delete(parser);
+  TSTreeCursor cursor = ts_tree_cursor_new(ts_tree_root_node(tree));
+  uint32_t *records = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  do {
+    TSNode node = ts_tree_cursor_current_node(&cursor);
+    if (ts_node_child_count(node) == 0) {
+      if (count == capacity) {
+        const size_t new_capacity = capacity == 0 ? 1024 : capacity * 2;
+        uint32_t *new_records = (uint32_t *)memory_realloc(
+          records,
+          new_capacity * 4 * sizeof(uint32_t)
+        );
+        if (new_records == NULL) {
+          memory_free(records);
+          ts_tree_cursor_delete(&cursor);
+          ts_tree_delete(tree);
+          return NULL;
+        }
+        records = new_records;
+        capacity = new_capacity;
+      }
+      uint32_t *record = records + count * 4;
+      record[0] = ts_node_start_byte(node);
+      record[1] = ts_node_end_byte(node);
+      record[2] = ts_node_symbol(node);
+      record[3] = ts_node_is_named(node) ? 1 : 0;
+      count++;
+    }
+  } while (tree_cursor_advance(&cursor));
+  ts_tree_cursor_delete(&cursor);
+  ts_tree_delete(tree);
+  *out_count = (uint32_t)count;
+  return records;
+}
+
+// Moves [cursor] to the next node in pre-order. Returns false, leaving the
+// cursor at the root, once the whole tree has been visited.
+static bool tree_cursor_advance(TSTreeCursor *cursor) {
+  return ts_tree_cursor_goto_first_child(cursor) || tree_cursor_skip_subtree(cursor);
+}
+
+// Like tree_cursor_advance, but without visiting the current node's children.
+static bool tree_cursor_skip_subtree(TSTreeCursor *cursor) {
+  do {
+    if (ts_tree_cursor_goto_next_sibling(cursor)) {
+      return true;
+    }
+  } while (ts_tree_cursor_goto_parent(cursor));
+  return false;
+}
+
+FFI_PLUGIN_EXPORT char* ts_language_symbol_names(
+  int32_t language,
+  uint32_t* out_count,
+  uint32_t* out_length
+) {
+  const TSLanguage *ts_language = language_from_id(language);
+  if (ts_language == NULL || out_count == NULL || out_length == NULL) {
     return NULL;
   }
+  const uint32_t symbol_count = ts_language_symbol_count(ts_language);
+  size_t length = 0;
+  for (uint32_t i = 0; i < symbol_count; i++) {
+    const char *name = ts_language_symbol_name(ts_language, (TSSymbol)i);
+    length += (name != NULL ? strlen(name) : 0) + 1;
+  }
+  char *names = (char *)memory_alloc(length > 0 ? length : 1);
+  if (names == NULL) {
+    return NULL;
+  }
+  char *cursor = names;
+  for (uint32_t i = 0; i < symbol_count; i++) {
+    const char *name = ts_language_symbol_name(ts_language, (TSSymbol)i);
+    const size_t name_length = name != NULL ? strlen(name) : 0;
+    memcpy(cursor, name != NULL ? name : "", name_length);
+    cursor[name_length] = '\0';
+    cursor += name_length + 1;
+  }
+  *out_count = symbol_count;
+  *out_length = (uint32_t)length;
+  return names;
+}
 
-  const uint32_t source_length = (uint32_t)strlen(utf8_source);
-  TSTree *tree = ts_parser_parse_string(parser, NULL, utf8_source, source_length);
-  if (tree == NULL) {
-    ts_parser_delete(parser);
+FFI_PLUGIN_EXPORT char* ts_query_captures(
+  const char* utf8_source,
+  int32_t language,
+  const char* utf8_query
+) {
+  if (utf8_source == NULL || utf8_query == NULL) {
     return NULL;
   }
 
-  uint32_t error_offset = 0;
-  TSQueryError error_type = TSQueryErrorNone;
-  const uint32_t query_length = (uint32_t)strlen(utf8_query);
-  TSQuery *query = ts_query_new(
-    ts_language,
-    utf8_query,
-    query_length,
-    &error_offset,
-    &error_type
-  );
+  QueryCacheEntry *query_entry = NULL;
+  TsQueryPredicates *predicates = NULL;
+  TSQuery *query = query_cache_acquire(language, utf8_query, &predicates, &query_entry);
   if (query == NULL) {
-    ts_tree_delete(tree);
-    ts_parser_delete(parser);
+    return NULL;
+  }
+
+  TSParser *parser = parser_pool_acquire(language);
+  if (parser == NULL) {
+    query_cache_release(query, predicates, query_entry);
+    return NULL;
+  }
+
+  const uint32_t source_length = (uint32_t)strlen(utf8_source);
+  TSTree *tree = ts_parser_parse_string(parser, NULL, utf8_source, source_length);
+  parser_pool_release(language, parser);
+  if (tree == NULL) {
+    query_cache_release(query, predicates, query_entry);
     return NULL;
   }
 
   TSQueryCursor *cursor = ts_query_cursor_new();
   if (cursor == NULL) {
-    ts_query_delete(query);
+    query_cache_release(query, predicates, query_entry);
     ts_tree_delete(tree);
-    ts_parser_delete(parser);
     return NULL;
   }
 
   TSNode root = ts_tree_root_node(tree);
   ts_query_cursor_exec(cursor, query, root);
+  const TsSourceText source = { utf8_source, source_length, NULL, 0 };
 
   char *buffer = NULL;
   size_t buffer_length = 0;
@@ -553,6 +6532,10 @@ FFI_PLUGIN_EXPORT char* ts_query_captures(
   TSQueryMatch match;
   uint32_t capture_index = 0;
   while (ts_query_cursor_next_capture(cursor, &match, &capture_index)) {
+    if (!query_match_passes(predicates, &match, &source)) {
+      ts_query_cursor_remove_match(cursor, match.id);
+      continue;
+    }
     const TSQueryCapture capture = match.captures[capture_index];
     const TSNode node = capture.node;
     const uint32_t start = ts_node_start_byte(node);
@@ -586,11 +6569,10 @@ FFI_PLUGIN_EXPORT char* ts_query_captures(
           &buffer_capacity,
           prefix,
           (size_t)prefix_written)) {
-      free(buffer);
+      memory_free(buffer);
       ts_query_cursor_delete(cursor);
-      ts_query_delete(query);
+      query_cache_release(query, predicates, query_entry);
       ts_tree_delete(tree);
-      ts_parser_delete(parser);
       return NULL;
     }
 
@@ -600,27 +6582,273 @@ FFI_PLUGIN_EXPORT char* ts_query_captures(
           &buffer_capacity,
           name,
           (size_t)name_length)) {
-      free(buffer);
+      memory_free(buffer);
       ts_query_cursor_delete(cursor);
-      ts_query_delete(query);
+      query_cache_release(query, predicates, query_entry);
       ts_tree_delete(tree);
-      ts_parser_delete(parser);
       return NULL;
     }
 
     if (!buffer_append(&buffer, &buffer_length, &buffer_capacity, "\n", 1)) {
-      free(buffer);
+      memory_free(buffer);
       ts_query_cursor_delete(cursor);
-      ts_query_delete(query);
+      query_cache_release(query, predicates, query_entry);
       ts_tree_delete(tree);
-      ts_parser_delete(parser);
       return NULL;
     }
   }
 
   ts_query_cursor_delete(cursor);
-  ts_query_delete(query);
+  query_cache_release(query, predicates, query_entry);
   ts_tree_delete(tree);
-  ts_parser_delete(parser);
   return buffer;
 }
+
+FFI_PLUGIN_EXPORT uint32_t* ts_query_captures_packed(
+  const char* utf8_source,
+  int32_t language,
+  const char* utf8_query,
+  uint32_t* out_count,
+  char** out_capture_names
+) {
+  if (out_count != NULL) {
+    *out_count = 0;
+  }
+  if (out_capture_names != NULL) {
+    *out_capture_names = NULL;
+  }
+  if (utf8_source == NULL || utf8_query == NULL || out_count == NULL) {
+    return NULL;
+  }
+  return captures_packed_for_source(
+    utf8_source,
+    (uint32_t)strlen(utf8_source),
+    language,
+    utf8_query,
+    out_count,
+    out_capture_names
+  );
+}
+
+static uint32_t *captures_packed_for_source(
+  const char *source,
+  uint32_t length,
+  int32_t language,
+  const char *utf8_query,
+  uint32_t *out_count,
+  char **out_capture_names
+) {
+  QueryCacheEntry *query_entry = NULL;
+  TsQueryPredicates *predicates = NULL;
+  TSQuery *query = query_cache_acquire(language, utf8_query, &predicates, &query_entry);
+  if (query == NULL) {
+    return NULL;
+  }
+
+  TSParser *parser = parser_pool_acquire(language);
+  if (parser == NULL) {
+    query_cache_release(query, predicates, query_entry);
+    return NULL;
+  }
+
+  TSTree *tree = ts_parser_parse_string(parser, NULL, source, length);
+  parser_pool_release(language, parser);
+  if (tree == NULL) {
+    query_cache_release(query, predicates, query_entry);
+    return NULL;
+  }
+
+  if (out_capture_names != NULL) {
+    *out_capture_names = query_capture_names(query);
+  }
+  const TsSourceText text = { source, length, NULL, 0 };
+  uint32_t *records = query_captures_packed(
+    query,
+    predicates,
+    &text,
+    ts_tree_root_node(tree),
+    NULL,
+    0,
+    out_count
+  );
+
+  query_cache_release(query, predicates, query_entry);
+  ts_tree_delete(tree);
+  return records;
+}
+
+// --- streaming results --------------------------------------------------------
+
+// A parsed source whose tokens or captures are handed out a batch at a time
+// by ts_stream_next_batch, so no result buffer grows with the source.
+typedef struct TsResultStream {
+  TSTree *tree;
+  bool done;
+  // Token streams walk [tree_cursor]; capture streams run [query].
+  TSTreeCursor tree_cursor;
+  TSQuery *query;
+  TsQueryPredicates *predicates;
+  QueryCacheEntry *query_entry;
+  TSQueryCursor *query_cursor;
+  // Copy of the source the predicates test, when [predicates] is set.
+  char *source;
+  uint32_t source_length;
+} TsResultStream;
+
+static TsResultStream *result_stream_new(
+  const char *utf8_source,
+  uint32_t length,
+  int32_t language
+) {
+  if (utf8_source == NULL) {
+    return NULL;
+  }
+  TsResultStream *stream = (TsResultStream *)memory_calloc(1, sizeof(TsResultStream));
+  if (stream == NULL) {
+    return NULL;
+  }
+  TSParser *parser = parser_pool_acquire(language);
+  if (parser == NULL) {
+    memory_free(stream);
+    return NULL;
+  }
+  stream->tree = ts_parser_parse_string(parser, NULL, utf8_source, length);
+  parser_pool_release(language, parser);
+  if (stream->tree == NULL) {
+    memory_free(stream);
+    return NULL;
+  }
+  return stream;
+}
+
+FFI_PLUGIN_EXPORT void* ts_stream_tokens_new(
+  const char* utf8_source,
+  uint32_t length,
+  int32_t language
+) {
+  TsResultStream *stream = result_stream_new(utf8_source, length, language);
+  if (stream == NULL) {
+    return NULL;
+  }
+  stream->tree_cursor = ts_tree_cursor_new(ts_tree_root_node(stream->tree));
+  return (void *)stream;
+}
+
+FFI_PLUGIN_EXPORT void* ts_stream_captures_new(
+  const char* utf8_source,
+  uint32_t length,
+  int32_t language,
+  const char* utf8_query,
+  char** out_capture_names
+) {
+  QueryCacheEntry *query_entry = NULL;
+  TsQueryPredicates *predicates = NULL;
+  TSQuery *query = query_cache_acquire(language, utf8_query, &predicates, &query_entry);
+  if (query == NULL) {
+    return NULL;
+  }
+  TSQueryCursor *query_cursor = ts_query_cursor_new();
+  if (query_cursor == NULL) {
+    query_cache_release(query, predicates, query_entry);
+    return NULL;
+  }
+  TsResultStream *stream = result_stream_new(utf8_source, length, language);
+  if (stream == NULL) {
+    ts_query_cursor_delete(query_cursor);
+    query_cache_release(query, predicates, query_entry);
+    return NULL;
+  }
+  if (predicates != NULL) {
+    stream->source = (char *)memory_alloc(length > 0 ? length : 1);
+    if (stream->source == NULL) {
+      ts_tree_delete(stream->tree);
+      memory_free(stream);
+      ts_query_cursor_delete(query_cursor);
+      query_cache_release(query, predicates, query_entry);
+      return NULL;
+    }
+    memcpy(stream->source, utf8_source, length);
+    stream->source_length = length;
+  }
+  stream->query = query;
+  stream->predicates = predicates;
+  stream->query_entry = query_entry;
+  stream->query_cursor = query_cursor;
+  ts_query_cursor_exec(query_cursor, query, ts_tree_root_node(stream->tree));
+  if (out_capture_names != NULL) {
+    *out_capture_names = query_capture_names(query);
+  }
+  return (void *)stream;
+}
+
+FFI_PLUGIN_EXPORT uint32_t ts_stream_next_batch(
+  void* stream_ptr,
+  uint32_t* out_records,
+  uint32_t max_records
+) {
+  TsResultStream *stream = (TsResultStream *)stream_ptr;
+  if (stream == NULL || out_records == NULL || stream->done) {
+    return 0;
+  }
+  uint32_t count = 0;
+  if (stream->query_cursor != NULL) {
+    TSQueryMatch match;
+    uint32_t capture_index = 0;
+    while (count < max_records) {
+      if (!ts_query_cursor_next_capture(stream->query_cursor, &match, &capture_index)) {
+        stream->done = true;
+        break;
+      }
+      const TsSourceText source = { stream->source, stream->source_length, NULL, 0 };
+      if (!query_match_passes(stream->predicates, &match, &source)) {
+        ts_query_cursor_remove_match(stream->query_cursor, match.id);
+        continue;
+      }
+      const TSQueryCapture capture = match.captures[capture_index];
+      const uint32_t start = ts_node_start_byte(capture.node);
+      const uint32_t end = ts_node_end_byte(capture.node);
+      if (end <= start) {
+        continue;
+      }
+      uint32_t *record = out_records + (size_t)count * 3;
+      record[0] = start;
+      record[1] = end;
+      record[2] = capture.index;
+      count++;
+    }
+    return count;
+  }
+
+  while (count < max_records) {
+    TSNode node = ts_tree_cursor_current_node(&stream->tree_cursor);
+    if (ts_node_child_count(node) == 0) {
+      uint32_t *record = out_records + (size_t)count * 4;
+      record[0] = ts_node_start_byte(node);
+      record[1] = ts_node_end_byte(node);
+      record[2] = ts_node_symbol(node);
+      record[3] = ts_node_is_named(node) ? 1 : 0;
+      count++;
+    }
+    if (!tree_cursor_advance(&stream->tree_cursor)) {
+      stream->done = true;
+      break;
+    }
+  }
+  return count;
+}
+
+FFI_PLUGIN_EXPORT void ts_stream_delete(void* stream_ptr) {
+  TsResultStream *stream = (TsResultStream *)stream_ptr;
+  if (stream == NULL) {
+    return;
+  }
+  if (stream->query_cursor != NULL) {
+    ts_query_cursor_delete(stream->query_cursor);
+    query_cache_release(stream->query, stream->predicates, stream->query_entry);
+    memory_free(stream->source);
+  } else {
+    ts_tree_cursor_delete(&stream->tree_cursor);
+  }
+  ts_tree_delete(stream->tree);
+  memory_free(stream);
+}
@@ -47,20 +47,185 @@ FFI_PLUGIN_EXPORT char* ts_parse_sexp(const char* utf8_source, int32_t language)
 // The returned string is heap-allocated; release it by calling [ts_free].
 FFI_PLUGIN_EXPORT char* ts_tokens(const char* utf8_source, int32_t language);
 
+// Returns the tokens of [ts_tokens] as packed binary records instead of text:
+// an array of `*out_count` records, four uint32 words each:
+//   <start_byte> <end_byte> <symbol> <named:0|1>
+// in document order. `symbol` indexes the table of
+// [ts_language_symbol_names], which callers only need to fetch once per
+// language.
+//
+// The returned array is heap-allocated; release it by calling [ts_free].
+// Returns NULL (and sets `*out_count` to 0) on failure or for an empty tree.
+FFI_PLUGIN_EXPORT uint32_t* ts_tokens_packed(
+    const char* utf8_source,
+    int32_t language,
+    uint32_t* out_count);
+
+// Returns the node type name of every symbol of [language], indexed by symbol
+// id, as `*out_count` NUL-terminated strings laid end to end (`*out_length`
+// bytes in all). Names are NUL- rather than newline-separated because some
+// anonymous tokens are a literal newline.
+//
+// The returned buffer is heap-allocated; release it by calling [ts_free].
+FFI_PLUGIN_EXPORT char* ts_language_symbol_names(
+    int32_t language,
+    uint32_t* out_count,
+    uint32_t* out_length);
+
 // Runs a tree-sitter query and returns newline-delimited captures.
 //
 // Each line is:
 //   <start_byte>\t<end_byte>\t<capture_name>\n
 //
+// The `#eq?`, `#not-eq?`, `#any-of?`, `#not-any-of?`, `#match?` and
+// `#not-match?` predicates are evaluated natively, so captures of matches that
+// fail them are left out. Their regexes are compiled once per query; a regex
+// outside the supported subset (classes, anchors, groups, alternation and the
+// usual quantifiers) makes the query invalid. Other predicates, such
+// as `#is-not? local`, never filter.
+//
 // The returned string is heap-allocated; release it by calling [ts_free].
 FFI_PLUGIN_EXPORT char* ts_query_captures(
     const char* utf8_source,
     int32_t language,
     const char* utf8_query);
 
+// Runs a tree-sitter query and returns captures as packed binary records
+// instead of text.
+//
+// The result is an array of `*out_count` records, three uint32 words each:
+//   <start_byte> <end_byte> <capture_id>
+// sorted by start byte (longest capture first on ties). `capture_id` indexes
+// the query's capture-name table. Predicates are applied as for
+// [ts_query_captures].
+//
+// If [out_capture_names] is non-NULL it receives the capture-name table as a
+// newline-delimited string, one name per capture id; release it with
+// [ts_free]. Callers only need to fetch it once per query.
+//
+// The returned array is heap-allocated; release it by calling [ts_free].
+// Returns NULL (and sets `*out_count` to 0) on failure or if nothing matched.
+FFI_PLUGIN_EXPORT uint32_t* ts_query_captures_packed(
+    const char* utf8_source,
+    int32_t language,
+    const char* utf8_query,
+    uint32_t* out_count,
+    char** out_capture_names);
+
+// Batch variants of [ts_tokens], [ts_tokens_packed] and
+// [ts_query_captures_packed]: item `i` is `utf8_sources[i]` in language
+// `languages[i]`, `lengths[i]` bytes long (or NUL-terminated when [lengths]
+// is NULL). Items are spread over [thread_count] native threads, or one per
+// core when [thread_count] <= 0, and the call returns once every item is
+// done. Run it off the UI isolate.
+//
+// Item `i`'s result goes to `out_results[i]` (NULL on failure). The packed
+// variants also write its record count to `out_counts[i]` and the capture
+// variant, if [out_capture_names] is non-NULL, its capture-name table to
+// `out_capture_names[i]`. Release every non-NULL entry with [ts_free].
+FFI_PLUGIN_EXPORT void ts_batch_tokens(
+    const char* const* utf8_sources,
+    const uint32_t* lengths,
+    const int32_t* languages,
+    uint32_t item_count,
+    int32_t thread_count,
+    char** out_results);
+
+FFI_PLUGIN_EXPORT void ts_batch_tokens_packed(
+    const char* const* utf8_sources,
+    const uint32_t* lengths,
+    const int32_t* languages,
+    uint32_t item_count,
+    int32_t thread_count,
+    uint32_t** out_results,
+    uint32_t* out_counts);
+
+// `utf8_queries[i]` is the query run on item `i`. Items sharing a query may
+// share the pointer; it is compiled once per language either way.
+FFI_PLUGIN_EXPORT void ts_batch_query_captures_packed(
+    const char* const* utf8_sources,
+    const uint32_t* lengths,
+    const int32_t* languages,
+    const char* const* utf8_queries,
+    uint32_t item_count,
+    int32_t thread_count,
+    uint32_t** out_results,
+    uint32_t* out_counts,
+    char** out_capture_names);
+
+// Streaming variants of [ts_tokens_packed] and [ts_query_captures_packed]
+// for sources whose full result would not fit comfortably in memory. The
+// source is parsed when the stream is created and need not outlive the call;
+// records are then pulled in caller-sized batches with
+// [ts_stream_next_batch], so only the tree and one batch are held at a time.
+//
+// Token streams yield the four-word records of [ts_tokens_packed] in the
+// same order. Capture streams yield the three-word records of
+// [ts_query_captures_packed] in the order the query cursor reports them
+// (by start byte), without the longest-first tie-break, since that would
+// need the whole result. [out_capture_names] is as in
+// [ts_query_captures_packed].
+//
+// Returns NULL on failure. Release the stream with [ts_stream_delete].
+FFI_PLUGIN_EXPORT void* ts_stream_tokens_new(
+    const char* utf8_source,
+    uint32_t length,
+    int32_t language);
+
+FFI_PLUGIN_EXPORT void* ts_stream_captures_new(
+    const char* utf8_source,
+    uint32_t length,
+    int32_t language,
+    const char* utf8_query,
+    char** out_capture_names);
+
+// Writes up to [max_records] records to [out_records], which must hold
+// `max_records` times the stream's record size in uint32 words, and returns
+// how many were written. Returns 0 once the stream is exhausted.
+FFI_PLUGIN_EXPORT uint32_t ts_stream_next_batch(
+    void* stream,
+    uint32_t* out_records,
+    uint32_t max_records);
+
+// Releases a stream created by [ts_stream_tokens_new] or
+// [ts_stream_captures_new]. Safe to call before it is exhausted.
+FFI_PLUGIN_EXPORT void ts_stream_delete(void* stream);
+
 // Frees memory returned by this library (e.g. [ts_parse_sexp]).
 FFI_PLUGIN_EXPORT void ts_free(void* ptr);
 
+// Every allocation of the library and of tree-sitter goes through a tracked
+// allocator. [out_shared_bytes] receives the bytes not charged to any
+// document (pooled parsers, cached queries, results not yet released with
+// [ts_free]) and [out_pooled_bytes] the freed small blocks kept for reuse.
+// Either may be NULL. Each thread tallies its shared bytes and keeps up to
+// 16 KiB of freed blocks per size class before handing them over in a batch,
+// so both figures can lag behind other threads by that much.
+FFI_PLUGIN_EXPORT void ts_memory_usage(
+    uint64_t* out_shared_bytes,
+    uint64_t* out_pooled_bytes);
+
+// Returns the freed blocks kept for reuse, by the shared pools and by the
+// calling thread, to the system allocator.
+FFI_PLUGIN_EXPORT void ts_memory_trim(void);
+
+// Called on the warm-up thread once [ts_warm_up] is done. [ok] is false if a
+// built-in query could not be compiled or a parser could not be created.
+typedef void (*TsWarmUpCallback)(bool ok);
+
+// Compiles the built-in queries of every language (see [ts_doc_select_query])
+// and puts [parsers_per_language] parsers (at most the pool size) in the
+// parser pool, on a new background thread, so the first highlight of a file
+// and the first stateless calls skip that work. From Dart, pass a
+// NativeCallable.listener as [on_complete] (or NULL) to learn when it is done.
+// Calling it again is cheap: only what is missing is created.
+//
+// Returns false if the thread could not be started; [on_complete] is then
+// never called.
+FFI_PLUGIN_EXPORT bool ts_warm_up(
+    uint32_t parsers_per_language,
+    TsWarmUpCallback on_complete);
+
 // --- tree-sitter incremental document API -----------------------------------
 //
 // Creates a document (TSParser + last TSTree) for a given language.
@@ -84,13 +249,442 @@ FFI_PLUGIN_EXPORT void ts_doc_edit(
     uint32_t new_end_row,
     uint32_t new_end_col);
 
+// Words written by [ts_doc_set_text] and [ts_doc_replace_text].
+#define TS_TEXT_EDIT_WORDS 12
+
+// Replaces the text the document tracks with [utf8_text] ([length] bytes) and
+// writes the edit between the two to [out_edit] as TS_TEXT_EDIT_WORDS words:
+//   <start_byte> <old_end_byte> <new_end_byte>
+//   <start_row> <start_col> <old_end_row> <old_end_col>
+//   <new_end_row> <new_end_col>
+//   <start_utf16> <old_end_utf16> <new_end_utf16>
+// The first nine are the arguments of [ts_doc_edit]; columns are in bytes.
+// Finding the edit compares the texts a word at a time; rows come from a line
+// index updated in place rather than from rescanning the text.
+//
+// The syntax tree is not touched: pass the edit to [ts_doc_edit], then reparse
+// with a NULL source to parse the tracked text, which is read in place rather
+// than copied. May be called while [ts_doc_reparse_async] is pending; since
+// the reparse still reads the old revision, edits during it copy the chunks
+// of the text they change instead of writing them in place. Returns false on
+// allocation failure.
+FFI_PLUGIN_EXPORT bool ts_doc_set_text(
+    void* doc,
+    const char* utf8_text,
+    uint32_t length,
+    uint32_t* out_edit);
+
+// Replaces [start, end) of the tracked text with [utf8_replacement] ([length]
+// bytes) and writes the edit to [out_edit] as [ts_doc_set_text] does.
+// [start] and [end] are in the document's offset encoding and are moved to
+// code point boundaries. The text is kept in chunks of up to 16 KiB, so only
+// the replacement crosses the FFI boundary and an edit rewrites the chunks it
+// touches rather than the document.
+FFI_PLUGIN_EXPORT bool ts_doc_replace_text(
+    void* doc,
+    uint32_t start,
+    uint32_t end,
+    const char* utf8_replacement,
+    uint32_t length,
+    uint32_t* out_edit);
+
+// Copies [start, end) of the tracked text (offsets in the document's offset
+// encoding) into a NUL-terminated UTF-8 string of [out_length] bytes. Free it
+// with [ts_free].
+FFI_PLUGIN_EXPORT char* ts_doc_text_range(
+    void* doc,
+    uint32_t start,
+    uint32_t end,
+    uint32_t* out_length);
+
+// Maps the file at [utf8_path] read-only and makes it the tracked text,
+// dropping the current tree so the next reparse with a NULL source parses the
+// file from scratch. Parsing reads the mapping in place; an edit copies only
+// the chunks of it that it changes, and the file is unmapped once no revision
+// of the text reads it. The file must not be truncated while it is mapped.
+//
+// Returns false if the file can't be mapped or is 4 GB or larger. Must not be
+// called while [ts_doc_reparse_async] is pending.
+FFI_PLUGIN_EXPORT bool ts_doc_open_file(void* doc, const char* utf8_path);
+
 // Re-parses the full source string, reusing the previous tree for incremental
 // parsing. Returns true on success.
+//
+// On success the document remembers which byte ranges differ from the
+// previous tree (see [ts_doc_changed_ranges]).
 FFI_PLUGIN_EXPORT bool ts_doc_reparse(void* doc, const char* utf8_source);
 
+// Statuses of [ts_doc_reparse_with_budget] and [ts_doc_reparse_async].
+#define TS_REPARSE_FAILED 0
+#define TS_REPARSE_OK 1
+#define TS_REPARSE_CANCELLED 2
+#define TS_REPARSE_TIMED_OUT 3
+
+// Like [ts_doc_reparse], but parses the tracked text (see [ts_doc_set_text])
+// in place when [utf8_source] is NULL, and gives up after [timeout_micros] (0 = no limit) or
+// once [ts_doc_cancel_reparse] is called, returning TS_REPARSE_TIMED_OUT or
+// TS_REPARSE_CANCELLED. The document keeps its previous (edited) tree, so
+// the next reparse is still incremental; reparsing the same source resumes
+// where the halted parse stopped, unless the tracked text changed or
+// [ts_doc_edit] was called in between.
+FFI_PLUGIN_EXPORT int32_t ts_doc_reparse_with_budget(
+    void* doc,
+    const char* utf8_source,
+    uint64_t timeout_micros);
+
+// Asks the reparse running on [doc] (or the pending [ts_doc_reparse_async]
+// request) to stop. Safe to call from any thread. Has no effect on reparses
+// requested later.
+FFI_PLUGIN_EXPORT void ts_doc_cancel_reparse(void* doc);
+
+// Result kinds for [ts_doc_reparse_async].
+#define TS_ASYNC_RESULT_NONE 0
+#define TS_ASYNC_RESULT_CAPTURES 1
+#define TS_ASYNC_RESULT_HIGHLIGHT_SPANS 2
+
+// Called on the document's worker thread once an asynchronous reparse is done
+// and the document is idle again. From Dart, pass a NativeCallable.listener so
+// completion is posted to the isolate that made the request.
+// [status] is one of the TS_REPARSE_* values.
+typedef void (*TsDocReparseCallback)(void* doc, int64_t request_id, int32_t status);
+
+// Starts [ts_doc_reparse_with_budget] of [utf8_source] ([length] bytes, copied
+// before returning; NULL for the tracked text, which is shared with the
+// request rather than copied) on a background thread owned by the document,
+// optionally followed by [utf8_query] producing [result_kind]:
+//   TS_ASYNC_RESULT_CAPTURES        - as [ts_doc_query_captures_packed]
+//   TS_ASYNC_RESULT_HIGHLIGHT_SPANS - as [ts_doc_highlight_spans] over the
+//                                     whole document
+// [on_complete] then receives [request_id]; fetch the result with
+// [ts_doc_take_async_result].
+//
+// Only one request runs at a time: returns false if one is still pending (or
+// on failure). Until [on_complete] runs, only [ts_doc_set_text],
+// [ts_doc_replace_text], [ts_doc_cancel_reparse], [ts_doc_take_async_result]
+// and [ts_doc_delete] may be called on the document. [ts_doc_delete] waits for a
+// running request to finish first.
+FFI_PLUGIN_EXPORT bool ts_doc_reparse_async(
+    void* doc,
+    const char* utf8_source,
+    uint32_t length,
+    const char* utf8_query,
+    int32_t result_kind,
+    uint64_t timeout_micros,
+    int64_t request_id,
+    TsDocReparseCallback on_complete);
+
+// Hands over the result of the finished [ts_doc_reparse_async] with
+// [request_id]: `*out_count` records (and, for captures, the capture-name
+// table in [out_capture_names] if non-NULL). Returns NULL if there is none or
+// it was already taken.
+//
+// Returned array is heap-allocated; free with ts_free.
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_take_async_result(
+    void* doc,
+    int64_t request_id,
+    uint32_t* out_count,
+    char** out_capture_names);
+
+// Kinds of the queries built into the library for every language. The build
+// hook embeds them from queries/<language>/.
+#define TS_QUERY_KIND_HIGHLIGHTS 0
+
+// Selects the built-in query of [kind] (a TS_QUERY_KIND_* value) for the
+// document's language. The query functions below then run it when passed a
+// NULL [utf8_query], so no query text crosses the FFI boundary and nothing
+// is compared or compiled per call. Each built-in query is compiled once per
+// process, by its first use or by [ts_warm_up], and shared by all documents;
+// it is not part of [ts_doc_memory_usage]. If it was not embedded or fails to
+// compile, those queries return NULL.
+//
+// Returns false for an unknown [kind].
+FFI_PLUGIN_EXPORT bool ts_doc_select_query(void* doc, int32_t kind);
+
 // Returns newline-delimited query captures for the currently stored tree.
 // Each line is:
 //   <start_byte>\t<end_byte>\t<capture_name>\n
 //
+// A NULL [utf8_query] runs the query chosen with [ts_doc_select_query]; the
+// same holds for the other ts_doc_* query functions and [ts_doc_reparse_async].
+//
 // Returned string is heap-allocated; free with ts_free.
 FFI_PLUGIN_EXPORT char* ts_doc_query_captures(void* doc, const char* utf8_query);
+
+// Packed-record variant of [ts_doc_query_captures]. See
+// [ts_query_captures_packed] for the record layout and [out_capture_names].
+//
+// Returned array is heap-allocated; free with ts_free.
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_query_captures_packed(
+    void* doc,
+    const char* utf8_query,
+    uint32_t* out_count,
+    char** out_capture_names);
+
+// Like [ts_doc_query_captures_packed], but only returns captures that
+// intersect the byte range [start_byte, end_byte). Use this to highlight the
+// visible part of a large document first.
+//
+// Returned array is heap-allocated; free with ts_free.
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_query_captures_byte_range(
+    void* doc,
+    const char* utf8_query,
+    uint32_t start_byte,
+    uint32_t end_byte,
+    uint32_t* out_count,
+    char** out_capture_names);
+
+// Like [ts_doc_query_captures_byte_range], but the range is given as rows:
+// captures intersecting lines [start_row, end_row) are returned.
+//
+// Returned array is heap-allocated; free with ts_free.
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_query_captures_row_range(
+    void* doc,
+    const char* utf8_query,
+    uint32_t start_row,
+    uint32_t end_row,
+    uint32_t* out_count,
+    char** out_capture_names);
+
+// Returns the byte ranges that changed with the last successful
+// [ts_doc_reparse], as `*out_count` pairs of uint32 words:
+//   <start_byte> <end_byte>
+// sorted and non-overlapping. This is the union of the ranges whose syntax
+// tree changed and the text touched by [ts_doc_edit] since the reparse
+// before it (widened by one byte on each side). After the first parse the
+// whole document is one range.
+//
+// Returned array is heap-allocated; free with ts_free. Returns NULL if
+// nothing changed.
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_changed_ranges(void* doc, uint32_t* out_count);
+
+// Returns the packed captures (see [ts_query_captures_packed]) intersecting
+// [ts_doc_changed_ranges]. Replacing the highlights inside those ranges with
+// these captures brings a highlighter up to date with the last reparse.
+//
+// Returned array is heap-allocated; free with ts_free.
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_query_captures_changed(
+    void* doc,
+    const char* utf8_query,
+    uint32_t* out_count,
+    char** out_capture_names);
+
+// Sets the highlight table used by [ts_doc_highlight_spans]: entry i maps the
+// capture name on line i of the newline-delimited [utf8_names] to
+// ([priorities][i], [style_ids][i]). A capture uses the longest entry that
+// equals its name or is a dot-separated prefix of it, so "keyword" also
+// styles "keyword.control". Captures without an entry are not highlighted.
+//
+// Call once per document; [count] == 0 clears the table. Returns false on
+// allocation failure.
+FFI_PLUGIN_EXPORT bool ts_doc_set_highlight_styles(
+    void* doc,
+    const char* utf8_names,
+    const uint32_t* priorities,
+    const uint32_t* style_ids,
+    uint32_t count);
+
+// Resolves the captures of [utf8_query] intersecting [start_byte, end_byte)
+// into highlight spans, as `*out_count` records of three uint32 words:
+//   <start_byte> <end_byte> <style_id>
+// Spans are sorted, non-overlapping and adjacent spans with the same style
+// are merged. Where captures overlap, the higher priority wins, then the
+// earlier start, then the longer capture. Spans may extend past the range.
+//
+// Pass 0 and UINT32_MAX to highlight the whole document.
+//
+// Returned array is heap-allocated; free with ts_free.
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_highlight_spans(
+    void* doc,
+    const char* utf8_query,
+    uint32_t start_byte,
+    uint32_t end_byte,
+    uint32_t* out_count);
+
+// Like [ts_doc_highlight_spans], for the lines [start_row, end_row).
+//
+// Returned array is heap-allocated; free with ts_free.
+FFI_PLUGIN_EXPORT uint32_t* ts_doc_highlight_spans_rows(
+    void* doc,
+    const char* utf8_query,
+    uint32_t start_row,
+    uint32_t end_row,
+    uint32_t* out_count);
+
+// Offset encodings for [ts_doc_set_offset_encoding].
+#define TS_OFFSET_ENCODING_UTF8 0
+#define TS_OFFSET_ENCODING_UTF16 1
+
+// Selects the unit of the offsets a document reports and accepts: packed
+// captures, changed ranges, highlight spans and the byte-range arguments of
+// the range queries. UTF-16 code units match Dart string indices, so callers
+// need no byte/UTF-16 table of their own. [ts_doc_edit] and the text-based
+// [ts_doc_query_captures] always use UTF-8 bytes.
+//
+// Returns false for an unknown [encoding].
+FFI_PLUGIN_EXPORT bool ts_doc_set_offset_encoding(void* doc, int32_t encoding);
+
+// Converts a UTF-8 byte offset into the text of the document's tree to a
+// UTF-16 offset: the source of the last successful [ts_doc_reparse], or the
+// tracked text if that reparse was given a NULL source. The line index of the
+// text gives the line start, so only the rest of the line is scanned. Offsets
+// past the end are clamped.
+FFI_PLUGIN_EXPORT uint32_t ts_doc_byte_to_utf16(void* doc, uint32_t byte_offset);
+
+// Converts a UTF-16 offset into the text of the document's tree (see
+// [ts_doc_byte_to_utf16]) to a UTF-8 byte offset. An offset inside a
+// surrogate pair maps to the end of that code point.
+FFI_PLUGIN_EXPORT uint32_t ts_doc_utf16_to_byte(void* doc, uint32_t utf16_offset);
+
+// Bytes currently charged to [doc]: its parser, trees, source copies,
+// tracked text, line index, query and highlight tables, rounded up to the
+// allocator's size classes. Results returned to the caller are charged to the
+// shared account instead (see [ts_memory_usage]). Safe to call from any
+// thread while the document is alive.
+FFI_PLUGIN_EXPORT uint64_t ts_doc_memory_usage(void* doc);
+
+// Counters of a document's recent work, see [ts_doc_stats]. Times are in
+// microseconds; the rolling ones average roughly the last eight samples.
+typedef struct TsDocStats {
+  // Completed reparses. Halted (timed out or cancelled) ones don't count.
+  uint64_t parse_count;
+  uint64_t last_parse_micros;
+  uint64_t rolling_parse_micros;
+  // Packed capture queries and highlight span requests.
+  uint64_t query_count;
+  uint64_t last_query_micros;
+  uint64_t rolling_query_micros;
+  // Time spent turning captures into the returned records; not part of the
+  // query times.
+  uint64_t last_serialize_micros;
+  uint64_t rolling_serialize_micros;
+  // Shape of the current tree. Nodes touching a range the last reparse
+  // changed count as recreated, the rest as reused from the previous tree.
+  uint64_t node_count;
+  uint64_t reused_nodes;
+  uint64_t recreated_nodes;
+  uint64_t source_bytes;
+  // As [ts_doc_memory_usage].
+  uint64_t memory_bytes;
+} TsDocStats;
+
+// Copies the counters of [doc] to [out_stats]. Safe to call from any thread,
+// including while an asynchronous reparse runs. Returns false on NULL
+// arguments.
+FFI_PLUGIN_EXPORT bool ts_doc_stats(void* doc, TsDocStats* out_stats);
+
+// --- document snapshots ------------------------------------------------------
+//
+// Makes every successful reparse of [doc] publish an immutable snapshot of
+// the new tree, and publishes the current one (if any) right away. A
+// snapshot holds a copy of the tree, the source it was parsed from, and
+// the offset encoding and selected built-in query of the document at that
+// time, so it can be queried from any thread while the document is edited
+// and reparsed. The source is shared with the document, not copied; the
+// document's later edits copy only the chunks of text they change.
+//
+// Must be called while no [ts_doc_reparse_async] is pending. Returns false
+// on a NULL [doc].
+FFI_PLUGIN_EXPORT bool ts_doc_enable_snapshots(void* doc);
+
+// Retains the latest published snapshot of [doc] and returns it, or NULL if
+// none was published yet. Safe to call from any thread, including while a
+// reparse runs. Release it with [ts_snapshot_release]; it stays valid after
+// [ts_doc_delete].
+FFI_PLUGIN_EXPORT void* ts_doc_snapshot(void* doc);
+
+// Adds a reference to [snapshot], e.g. before handing it to another thread.
+FFI_PLUGIN_EXPORT void ts_snapshot_retain(void* snapshot);
+
+// Drops a reference to [snapshot]; the last one frees it.
+FFI_PLUGIN_EXPORT void ts_snapshot_release(void* snapshot);
+
+// Number of successful reparses of the document before [snapshot] was
+// published, so later snapshots have higher revisions. -1 for NULL.
+FFI_PLUGIN_EXPORT int64_t ts_snapshot_revision(void* snapshot);
+
+// Packed captures (see [ts_query_captures_packed]) of [utf8_query] on
+// [snapshot] intersecting lines [start_row, end_row); pass 0 and UINT32_MAX
+// for the whole tree. A NULL [utf8_query] runs the built-in query the
+// document had selected (see [ts_doc_select_query]). Offsets are in the
+// document's offset encoding at the time of the snapshot.
+//
+// Takes no lock on the document, so any number of threads may query the
+// same snapshot at once. A [utf8_query] is looked up in the shared query
+// cache, whose lock is only held for the lookup. Memory comes from the
+// calling thread's allocator cache, which takes the shared pool's lock only
+// to refill or flush a batch of blocks.
+//
+// Returned array is heap-allocated; free with ts_free.
+FFI_PLUGIN_EXPORT uint32_t* ts_snapshot_query_captures(
+    void* snapshot,
+    const char* utf8_query,
+    uint32_t start_row,
+    uint32_t end_row,
+    uint32_t* out_count,
+    char** out_capture_names);
+
+// --- workspaces --------------------------------------------------------------
+//
+// Creates a workspace: a set of documents whose combined memory (as
+// [ts_doc_memory_usage]) is kept under [memory_budget_bytes] by evicting the
+// trees and parsers of the least recently activated ones. Text queries of its
+// documents are shared through the process-wide cache of recently used
+// queries, like those of the stateless entry points. Returns NULL on failure;
+// free with [ts_workspace_delete].
+FFI_PLUGIN_EXPORT void* ts_workspace_new(uint64_t memory_budget_bytes);
+
+// Deletes [workspace] and every document still open in it.
+FFI_PLUGIN_EXPORT void ts_workspace_delete(void* workspace);
+
+// Creates a document (see [ts_doc_new]) owned by [workspace], as the most
+// recently activated one. [ts_doc_delete] closes it and removes it from the
+// workspace. Returns NULL on failure.
+FFI_PLUGIN_EXPORT void* ts_workspace_open(void* workspace, int32_t language);
+
+// Marks [doc] as the most recently activated document of [workspace], then
+// evicts others until the workspace fits its budget. The active document is
+// never evicted.
+//
+// An evicted document keeps a single copy of the text its tree was parsed
+// from (a source passed to [ts_doc_reparse] becomes its tracked text) but
+// has no tree: its queries return nothing until it is activated again. The
+// activation then parses that text again on the document's worker thread,
+// as a [ts_doc_reparse_async] request with [request_id] would, and the
+// revision and offsets are unchanged. [on_complete] receives [request_id]
+// once the document has its tree back, or right away, on the calling thread,
+// when nothing had to be parsed. If it was edited while evicted, its next
+// reparse is a full parse instead. A document with an asynchronous reparse
+// pending is neither evicted nor restored.
+//
+// Call from the thread that uses the documents; until [on_complete] runs the
+// document is restricted as during [ts_doc_reparse_async]. Returns false if
+// [doc] is not open in [workspace] or its worker thread could not start, and
+// then [on_complete] is not called.
+FFI_PLUGIN_EXPORT bool ts_workspace_activate(
+    void* workspace,
+    void* doc,
+    int64_t request_id,
+    TsDocReparseCallback on_complete);
+
+// Changes the budget of [workspace] and evicts documents to meet it.
+FFI_PLUGIN_EXPORT void ts_workspace_set_memory_budget(
+    void* workspace,
+    uint64_t memory_budget_bytes);
+
+// Counters of a workspace, see [ts_workspace_stats].
+typedef struct TsWorkspaceStats {
+  uint32_t document_count;
+  // Documents that have a tree, or have not been parsed yet.
+  uint32_t resident_count;
+  // Bytes charged to all documents, evicted ones included.
+  uint64_t memory_bytes;
+  uint64_t memory_budget_bytes;
+  // Documents evicted, and evicted documents whose parse was started by an
+  // activation.
+  uint64_t evictions;
+  uint64_t restores;
+} TsWorkspaceStats;
+
+// Copies the counters of [workspace] to [out_stats]. Returns false on NULL
+// arguments.
+FFI_PLUGIN_EXPORT bool ts_workspace_stats(void* workspace, TsWorkspaceStats* out_stats);
@@ -1,4 +1,6 @@
 import 'dart:convert';
+import 'dart:io';
+import 'dart:isolate';
 import 'dart:math';
 
 import 'package:test/test.dart';
@@ -122,6 +124,678 @@ void main() {
     expect(tree, contains('program'));
   });
 
+  test('pooled parsers give stable results across isolates', () async {
+    const query = '(identifier) @variable\n(number) @number';
+    const src = 'function main() { return 1 + 2; }\nmain();\n';
+    const language = TreeSitterLanguage.javascript;
+
+    final captures = parseQueryCaptures(src, language: language, query: query)
+        .map((c) => (c.startByte, c.endByte, c.name))
+        .toList();
+    final tokens = parseTokens(src, language: language)
+        .map((t) => (t.startByte, t.endByte, t.type))
+        .toList();
+
+    final results = await Future.wait([
+      for (var i = 0; i < 16; i++)
+        i.isEven
+            ? parseQueryCapturesAsync(src, language: language, query: query)
+                .then((r) => r.map((c) => (c.startByte, c.endByte, c.name)))
+            : parseTokensAsync(src, language: language)
+                .then((r) => r.map((t) => (t.startByte, t.endByte, t.type))),
+    ]);
+    for (var i = 0; i < results.length; i++) {
+      expect(results[i].toList(), i.isEven ? captures : tokens);
+    }
+  });
+
+  test('batch entry points match per-source calls', () async {
+    const queries = {
+      TreeSitterLanguage.c: '(identifier) @variable\n(number_literal) @number',
+      TreeSitterLanguage.javascript: '(identifier) @variable\n(number) @number',
+    };
+    final sources = [
+      for (var i = 0; i < 40; i++)
+        i % 3 == 0
+            ? TreeSitterSource(
+                'int f$i(void) { return $i; } // é',
+                language: TreeSitterLanguage.c,
+              )
+            : TreeSitterSource(
+                'const v$i = $i + f($i); // 日本',
+                language: TreeSitterLanguage.javascript,
+              ),
+      const TreeSitterSource('void main() {}', language: TreeSitterLanguage.dart),
+    ];
+
+    final tokens = await parseTokensBatchAsync(sources, threads: 4);
+    final captures = parseQueryCapturesBatch(sources, queries: queries);
+    expect(tokens, hasLength(sources.length));
+    expect(captures, hasLength(sources.length));
+    for (var i = 0; i < sources.length; i++) {
+      final source = sources[i];
+      expect(
+        tokens[i].map((t) => (t.startByte, t.endByte, t.type)).toList(),
+        parseTokens(source.text, language: source.language)
+            .map((t) => (t.startByte, t.endByte, t.type))
+            .toList(),
+      );
+
+      final query = queries[source.language];
+      if (query == null) {
+        expect(captures[i].length, 0);
+        continue;
+      }
+      final single = parseQueryCapturesPacked(
+        source.text,
+        language: source.language,
+        query: query,
+      );
+      expect(captures[i].records, single.records);
+      expect(captures[i].captureNames, single.captureNames);
+    }
+  });
+
+  test('packed tokens use the shared symbol-name table', () async {
+    const src = 'function main() { return a + 2; }\nmain();\n';
+    const language = TreeSitterLanguage.javascript;
+
+    final names = treeSitterSymbolNames(language);
+    expect(identical(names, treeSitterSymbolNames(language)), isTrue);
+    expect(names, containsAll(['program', 'identifier', 'number', '{', 'return']));
+
+    final packed = parseTokensPacked(src, language: language);
+    expect(identical(packed.symbolNames, names), isTrue);
+    final leaves = [
+      for (var i = 0; i < packed.length; i++)
+        if (packed.endByte(i) > packed.startByte(i))
+          (src.substring(packed.startByte(i), packed.endByte(i)), packed.type(i), packed.named(i)),
+    ];
+    // Anonymous tokens are named after their own text.
+    for (final (text, type, named) in leaves) {
+      if (!named) expect(type, text);
+    }
+    expect(leaves, containsAll([('main', 'identifier', true), ('a', 'identifier', true), ('2', 'number', true)]));
+    for (var i = 1; i < packed.length; i++) {
+      expect(packed.startByte(i), greaterThanOrEqualTo(packed.endByte(i - 1)));
+    }
+
+    expect(
+      parseTokens(src, language: language).map((t) => (t.startByte, t.endByte, t.type, t.named)).toList(),
+      packed.toTokens().map((t) => (t.startByte, t.endByte, t.type, t.named)).toList(),
+    );
+    final fromIsolate = await parseTokensPackedAsync(src, language: language);
+    expect(fromIsolate.records, packed.records);
+    final batch = parseTokensPackedBatch(const [TreeSitterSource(src, language: language)]);
+    expect(batch.single.records, packed.records);
+  });
+
+  test('streams hand out the packed results in bounded batches', () {
+    const query = '(identifier) @variable\n(number) @number';
+    final src = List.generate(200, (i) => 'let v$i = $i + f(v$i);').join('\n');
+    const language = TreeSitterLanguage.javascript;
+
+    final tokens = TreeSitterTokenStream(src, language: language, batchSize: 7);
+    final streamedTokens = <int>[];
+    while (true) {
+      final batch = tokens.nextBatch();
+      if (batch.length == 0) break;
+      expect(batch.length, lessThanOrEqualTo(7));
+      streamedTokens.addAll(batch.records);
+    }
+    expect(tokens.nextBatch().length, 0);
+    tokens.dispose();
+    expect(streamedTokens, parseTokensPacked(src, language: language).records);
+
+    final captures = TreeSitterCaptureStream(src, language: language, query: query, batchSize: 5);
+    final streamedCaptures = <(int, int, String)>[];
+    for (var batch = captures.nextBatch(); batch.length > 0; batch = captures.nextBatch()) {
+      for (var i = 0; i < batch.length; i++) {
+        streamedCaptures.add((batch.startByte(i), batch.endByte(i), batch.name(i)));
+      }
+    }
+    captures.dispose();
+    final packed = parseQueryCapturesPacked(src, language: language, query: query);
+    expect(streamedCaptures.toSet(), {
+      for (var i = 0; i < packed.length; i++) (packed.startByte(i), packed.endByte(i), packed.name(i)),
+    });
+    expect(streamedCaptures.length, packed.length);
+
+    // Closing before the stream is drained is fine.
+    TreeSitterTokenStream(src, language: language).dispose();
+  });
+
+  test('packed captures match text captures', () {
+    const query = '(identifier) @variable\n(number) @number';
+    const src = 'function main() { return 1 + 2; }\nmain();\n';
+
+    final text = parseQueryCaptures(
+      src,
+      language: TreeSitterLanguage.javascript,
+      query: query,
+    ).map((c) => (c.startByte, c.endByte, c.name)).toList();
+
+    final packed = parseQueryCapturesPacked(
+      src,
+      language: TreeSitterLanguage.javascript,
+      query: query,
+    );
+    expect(packed.captureNames, ['variable', 'number']);
+    expect([
+      for (var i = 0; i < packed.length; i++)
+        (packed.startByte(i), packed.endByte(i), packed.name(i)),
+    ], text);
+
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    expect(doc.reparse(src), isTrue);
+    for (var pass = 0; pass < 2; pass++) {
+      final fromDoc = doc.queryCapturesPacked(query);
+      expect(fromDoc.records, packed.records);
+      expect(fromDoc.captureNames, packed.captureNames);
+    }
+  });
+
+  test('text predicates filter captures natively', () {
+    const query = '''
+((identifier) @constant (#match? @constant "^[A-Z_][A-Z\\\\d_]+\$"))
+((identifier) @builtin (#eq? @builtin "console"))
+((identifier) @keyword (#any-of? @keyword "require" "module"))
+((identifier) @plain (#not-match? @plain "^[A-Z]"))
+''';
+    const src = 'const MAX_SIZE = Foo(console, require, x1);\n';
+    String at(TreeSitterCapture c) => src.substring(c.startByte, c.endByte);
+
+    final captures = parseQueryCaptures(
+      src,
+      language: TreeSitterLanguage.javascript,
+      query: query,
+    );
+    Set<String> named(String name) =>
+        {for (final c in captures) if (c.name == name) at(c)};
+    expect(named('constant'), {'MAX_SIZE'});
+    expect(named('builtin'), {'console'});
+    expect(named('keyword'), {'require'});
+    expect(named('plain'), {'console', 'require', 'x1'});
+
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    expect(doc.reparse(src), isTrue);
+    final packed = parseQueryCapturesPacked(
+      src,
+      language: TreeSitterLanguage.javascript,
+      query: query,
+    );
+    expect(doc.queryCapturesPacked(query).records, packed.records);
+    expect(packed.length, captures.length);
+  });
+
+  test('regex predicates cope with long node text and catastrophic patterns', () {
+    Set<String> matching(String src, String regex) => {
+          for (final c in parseQueryCaptures(
+            src,
+            language: TreeSitterLanguage.javascript,
+            query: '((identifier) @id (#match? @id "$regex"))',
+          ))
+            src.substring(c.startByte, c.endByte),
+        };
+
+    // Far longer than any recursion limit would allow.
+    final long = 'a' * 100000;
+    expect(matching('$long;\n', r'^a+$'), {long});
+    expect(matching('${long}z;\n', r'^[a-z]+z$'), {'${long}z'});
+    expect(matching('${long}z;\n', r'^a+$'), isEmpty);
+
+    // Patterns that make a backtracker explode answer in linear time.
+    final almost = '${'a' * 31}b';
+    expect(matching('$almost;\n', r'^(a+)+$'), isEmpty);
+    expect(matching('${'a' * 2048};\n', '[a-z]+z'), isEmpty);
+    expect(matching('${'a' * 2048};\n', '(a|aa)*b'), isEmpty);
+
+    // However long the node, the search runs to the end and answers.
+    final huge = 'a' * 400000;
+    expect(matching('$huge;\n', '(a|b|c|d|e|f)*z'), isEmpty);
+    expect(matching('${huge}z;\n', '(a|b|c|d|e|f)*z'), {'${huge}z'});
+
+    // A regex the engine does not support fails the query, as a syntax
+    // error would, instead of letting every capture through.
+    expect(matching('abc;\n', '(?=a)'), isEmpty);
+    expect(matching('abc;\n', r'(a)\\1'), isEmpty);
+    expect(
+      parseQueryCaptures(
+        'abc;\n',
+        language: TreeSitterLanguage.javascript,
+        query: '(identifier) @id\n((identifier) @x (#match? @x "(?=a)"))',
+      ),
+      isEmpty,
+    );
+  });
+
+  test('built-in highlight queries match the bundled query files', () {
+    const sources = {
+      TreeSitterLanguage.c: 'int main(void) { return MAX_SIZE + 1; }\n',
+      TreeSitterLanguage.javascript: 'const x = require("y");\nconsole.log(x);\n',
+      TreeSitterLanguage.dart: 'void main() { final x = 1; print(x); }\n',
+    };
+    for (final MapEntry(key: language, value: src) in sources.entries) {
+      final query = File(
+        'queries/${language.name}/highlights.scm',
+      ).readAsStringSync();
+      final doc = TreeSitterDocument.create(language: language);
+      addTearDown(doc.dispose);
+      expect(doc.reparse(src), isTrue);
+      final expected = doc.queryCapturesPacked(query);
+
+      doc.selectQuery(TreeSitterQueryKind.highlights);
+      final builtin = doc.queryCapturesPacked(null);
+      expect(builtin.records, expected.records, reason: language.name);
+      expect(builtin.captureNames, expected.captureNames, reason: language.name);
+      expect(
+        doc.queryCaptures(null).map((c) => (c.startByte, c.endByte, c.name)),
+        doc.queryCaptures(query).map((c) => (c.startByte, c.endByte, c.name)),
+      );
+    }
+
+    // Without a selected query a null query returns nothing.
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.c);
+    addTearDown(doc.dispose);
+    expect(doc.reparse(sources[TreeSitterLanguage.c]!), isTrue);
+    expect(doc.queryCaptures(null), isEmpty);
+  });
+
+  test('warm-up compiles the built-in queries in the background', () async {
+    expect(await treeSitterWarmUp(), isTrue);
+    // A second call finds everything in place.
+    expect(await treeSitterWarmUp(parsersPerLanguage: 1), isTrue);
+
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.dart);
+    addTearDown(doc.dispose);
+    doc.selectQuery(TreeSitterQueryKind.highlights);
+    expect(doc.reparse('void main() {}\n'), isTrue);
+    expect(doc.queryCaptures(null), isNotEmpty);
+  });
+
+  test('snapshots keep their revision while the document moves on', () async {
+    const query = '(identifier) @variable\n(number) @number';
+    const before = 'const a = 1;\nconst b = 2;\n';
+    const after = 'const a = 1;\nconst renamed = 2;\n';
+
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    expect(doc.snapshot(), isNull);
+    doc.enableSnapshots();
+    expect(doc.reparse(before), isTrue);
+    final expected = doc.queryCapturesPacked(query).records;
+
+    final first = doc.snapshot()!;
+    addTearDown(first.dispose);
+    doc.edit(
+      startByte: 19,
+      oldEndByte: 20,
+      newEndByte: 26,
+      startRow: 1,
+      startCol: 6,
+      oldEndRow: 1,
+      oldEndCol: 7,
+      newEndRow: 1,
+      newEndCol: 13,
+    );
+    expect(doc.reparse(after), isTrue);
+
+    final second = doc.snapshot()!;
+    addTearDown(second.dispose);
+    expect(second.revision, greaterThan(first.revision));
+    expect(first.queryCaptures(query).records, expected);
+    expect(second.queryCaptures(query).records, doc.queryCapturesPacked(query).records);
+    expect(first.queryCaptures(query, startRow: 1, endRow: 2).length, 2);
+
+    // Another isolate reads the old revision through its own reference.
+    final address = first.address;
+    final records = await Isolate.run(() {
+      final snapshot = TreeSitterSnapshot.retain(address);
+      final records = snapshot.queryCaptures(query).records;
+      snapshot.dispose();
+      return records;
+    });
+    expect(records, expected);
+  });
+
+  test('workspaces evict inactive documents and restore them on activation', () async {
+    const query = '(identifier) @variable\n(number) @number';
+    final sources = [
+      for (var i = 0; i < 4; i++) List.generate(200, (j) => 'const v${i}_$j = $j;').join('\n'),
+    ];
+
+    final workspace = TreeSitterWorkspace();
+    addTearDown(workspace.dispose);
+    final docs = [
+      for (final _ in sources) workspace.open(language: TreeSitterLanguage.javascript),
+    ];
+    final expected = <List<int>>[];
+    for (var i = 0; i < docs.length; i++) {
+      expect(await workspace.activate(docs[i]), isTrue);
+      expect(docs[i].reparse(sources[i]), isTrue);
+      expected.add(docs[i].queryCapturesPacked(query).records);
+    }
+    expect(workspace.stats.residentCount, 4);
+    final before = workspace.stats.memoryBytes;
+
+    // Only the most recently activated document keeps its tree.
+    workspace.memoryBudgetBytes = 0;
+    var stats = workspace.stats;
+    expect(stats.residentCount, 1);
+    expect(stats.evictions, 3);
+    expect(stats.memoryBytes, lessThan(before));
+
+    // The restore parses on the document's worker; the caller only waits.
+    final restoring = workspace.activate(docs[0]);
+    expect(docs[0].isReparsing, isTrue);
+    expect(await restoring, isTrue);
+    expect(docs[0].queryCapturesPacked(query).records, expected[0]);
+    stats = workspace.stats;
+    expect(stats.restores, 1);
+    expect(stats.residentCount, 1);
+    // Activating a resident document parses nothing.
+    expect(await workspace.activate(docs[0]), isTrue);
+    expect(workspace.stats.restores, 1);
+
+    // An edit while evicted leaves the tree to the next (full) reparse.
+    const appended = '\nconst extra = 1;';
+    final end = sources[1].length;
+    docs[1].edit(
+      startByte: end,
+      oldEndByte: end,
+      newEndByte: end + appended.length,
+      startRow: 199,
+      startCol: end - sources[1].lastIndexOf('\n') - 1,
+      oldEndRow: 199,
+      oldEndCol: end - sources[1].lastIndexOf('\n') - 1,
+      newEndRow: 200,
+      newEndCol: appended.length - 1,
+    );
+    expect(await workspace.activate(docs[1]), isTrue);
+    expect(workspace.stats.restores, 1);
+    expect(docs[1].reparse(sources[1] + appended), isTrue);
+    expect(docs[1].queryCapturesPacked(query).length, expected[1].length ~/ TreeSitterPackedCaptures.recordWords + 2);
+
+    docs[2].dispose();
+    expect(workspace.stats.documentCount, 3);
+  });
+
+  test('range-limited doc captures only cover the requested rows', () {
+    const query = '(identifier) @variable';
+    final src = List.generate(50, (i) => 'const v$i = $i;').join('\n');
+
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    expect(doc.reparse(src), isTrue);
+
+    final all = doc.queryCapturesPacked(query);
+    final rows = doc.queryCapturesInRows(query, startRow: 10, endRow: 12);
+    final rowStart = src.indexOf('const v10 ');
+    final rowEnd = src.indexOf('const v12 ');
+    expect(rows.length, 2);
+    for (var i = 0; i < rows.length; i++) {
+      expect(rows.startByte(i), inInclusiveRange(rowStart, rowEnd));
+    }
+
+    final bytes = doc.queryCapturesInByteRange(
+      query,
+      startByte: rowStart,
+      endByte: rowEnd,
+    );
+    expect(bytes.records, rows.records);
+    expect(all.length, 50);
+  });
+
+  test('capture delta patches highlights to match a full query', () {
+    const query = '(identifier) @variable\n(number) @number';
+    final rnd = Random(7);
+
+    String text = 'function main() { return 1 + 2; }\nmain();\n';
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    expect(doc.reparse(text), isTrue);
+
+    List<(int, int, String)> all(TreeSitterPackedCaptures c) => [
+      for (var i = 0; i < c.length; i++) (c.startByte(i), c.endByte(i), c.name(i)),
+    ];
+
+    final first = doc.queryDelta(query);
+    expect(first.rangeCount, 1);
+    expect(first.rangeStartByte(0), 0);
+    var spans = all(first.captures);
+
+    for (var step = 0; step < 30; step++) {
+      final oldText = text;
+      text = _mutateText(oldText, rnd);
+      if (text == oldText) continue;
+      _applyDiffEdit(doc, oldText: oldText, newText: text);
+      expect(doc.reparse(text), isTrue);
+
+      // Shift spans after the edit, drop those inside it, then splice in the
+      // delta for every changed range.
+      final d = _diffUtf16(oldText, text);
+      final editStart = utf8.encode(oldText.substring(0, d.start)).length;
+      final editOldEnd = utf8.encode(oldText.substring(0, d.oldEnd)).length;
+      final editNewEnd = utf8.encode(text.substring(0, d.newEnd)).length;
+      spans = [
+        for (final s in spans)
+          if (s.$2 <= editStart)
+            s
+          else if (s.$1 >= editOldEnd)
+            (s.$1 - editOldEnd + editNewEnd, s.$2 - editOldEnd + editNewEnd, s.$3),
+      ];
+
+      final delta = doc.queryDelta(query);
+      bool inChanged(int start, int end) {
+        for (var r = 0; r < delta.rangeCount; r++) {
+          if (start < delta.rangeEndByte(r) && end > delta.rangeStartByte(r)) {
+            return true;
+          }
+        }
+        return false;
+      }
+
+      spans = [
+        for (final s in spans)
+          if (!inChanged(s.$1, s.$2)) s,
+        ...all(delta.captures),
+      ]..sort((a, b) {
+          final start = a.$1.compareTo(b.$1);
+          if (start != 0) return start;
+          return b.$2.compareTo(a.$2);
+        });
+
+      final full = all(doc.queryCapturesPacked(query));
+      expect(spans.toSet(), full.toSet());
+    }
+  });
+
+  test('native highlight spans resolve priorities and overlaps', () {
+    const query = '(string) @string\n(identifier) @variable\n'
+        '(call_expression function: (identifier) @function.call)';
+    const src = 'log("a" + b);\nlog(c);\n';
+
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    expect(doc.reparse(src), isTrue);
+    doc.setHighlightStyles(const {
+      'string': TreeSitterHighlightStyle(priority: 80, styleId: 1),
+      'function': TreeSitterHighlightStyle(priority: 50, styleId: 2),
+      'variable': TreeSitterHighlightStyle(priority: 30, styleId: 3),
+    });
+
+    final spans = doc.highlightSpans(query);
+    final triples = [
+      for (var i = 0; i < spans.length; i++)
+        (spans.start(i), spans.end(i), spans.styleId(i)),
+    ];
+    expect(triples, [
+      (0, 3, 2), // log: function.call beats variable
+      (4, 7, 1), // "a"
+      (10, 11, 3), // b
+      (14, 17, 2),
+      (18, 19, 3),
+    ]);
+    for (var i = 1; i < triples.length; i++) {
+      expect(triples[i].$1, greaterThanOrEqualTo(triples[i - 1].$2));
+    }
+
+    final secondLine = doc.highlightSpansInRows(query, startRow: 1, endRow: 2);
+    expect(secondLine.records, spans.records.sublist(9));
+  });
+
+  test('async reparse matches a synchronous document', () async {
+    const query = '(identifier) @variable\n(number) @number';
+    const styles = {
+      'variable': TreeSitterHighlightStyle(priority: 10, styleId: 1),
+      'number': TreeSitterHighlightStyle(priority: 10, styleId: 2),
+    };
+    const before = 'let a = 1;\nlet b = a + 2;\n';
+    const middle = 'let a = 1;\nlet bc = a + 2;\n';
+    const after = 'let a = 1;\nlet bc = a + 23;\n';
+    void applyEdits(TreeSitterDocument doc) {
+      _applyInsertEdit(
+        doc,
+        oldText: before,
+        newText: middle,
+        insertAtUtf16: 16,
+        insertedText: 'c',
+      );
+      _applyInsertEdit(
+        doc,
+        oldText: middle,
+        newText: after,
+        insertAtUtf16: 25,
+        insertedText: '3',
+      );
+    }
+
+    final sync = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    final async = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(sync.dispose);
+    addTearDown(async.dispose);
+    sync.setHighlightStyles(styles);
+    async.setHighlightStyles(styles);
+
+    expect(sync.reparse(before), isTrue);
+    final first = async.reparseAndHighlightAsync(before, query);
+    expect(async.isReparsing, isTrue);
+    expect(() => async.highlightSpans(query), throwsStateError);
+    // Edits made while the worker runs are applied once it is done.
+    applyEdits(async);
+    expect((await first)!.records, sync.highlightSpans(query).records);
+    expect(async.isReparsing, isFalse);
+
+    applyEdits(sync);
+    expect(sync.reparse(after), isTrue);
+    final captures = await async.reparseAndQueryAsync(after, query);
+    final expected = sync.queryCapturesPacked(query);
+    expect(captures!.records, expected.records);
+    expect(captures.captureNames, expected.captureNames);
+    expect(async.changedRanges(), sync.changedRanges());
+  });
+
+  test('halted reparses keep the document incremental', () async {
+    const query = '(identifier) @variable';
+    const head = 'let x = 1;\n';
+    final big = List.generate(
+      100000,
+      (i) => 'function f$i(a) { return a * $i + g(a, "$i"); }',
+    ).join('\n');
+    final text = '$head$big';
+
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    expect(doc.reparse(head), isTrue);
+    _applyInsertEdit(
+      doc,
+      oldText: head,
+      newText: text,
+      insertAtUtf16: head.length,
+      insertedText: big,
+    );
+
+    expect(
+      doc.reparseWithBudget(text, timeout: const Duration(microseconds: 1)),
+      TreeSitterReparseStatus.timedOut,
+    );
+    final pending = doc.reparseAsync(text);
+    doc.cancelReparse();
+    expect(await pending, TreeSitterReparseStatus.cancelled);
+
+    // Finishing the halted parse gives the same tree as a fresh parse.
+    expect(doc.reparseWithBudget(text), TreeSitterReparseStatus.ok);
+    final expected = parseQueryCapturesPacked(
+      text,
+      language: TreeSitterLanguage.javascript,
+      query: query,
+    );
+    expect(doc.queryCapturesPacked(query).records, expected.records);
+
+    // An edit after a halted parse starts the next one over.
+    _applyInsertEdit(
+      doc,
+      oldText: text,
+      newText: '$text;',
+      insertAtUtf16: text.length,
+      insertedText: ';',
+    );
+    expect(
+      doc.reparseWithBudget('$text;', timeout: const Duration(microseconds: 1)),
+      TreeSitterReparseStatus.timedOut,
+    );
+    _applyInsertEdit(
+      doc,
+      oldText: '$text;',
+      newText: '$text;;',
+      insertAtUtf16: text.length + 1,
+      insertedText: ';',
+    );
+    expect(doc.reparseWithBudget('$text;;'), TreeSitterReparseStatus.ok);
+    expect(
+      doc.queryCapturesPacked(query).records,
+      parseQueryCapturesPacked(
+        '$text;;',
+        language: TreeSitterLanguage.javascript,
+        query: query,
+      ).records,
+    );
+  });
+
+  test('doc reports UTF-16 offsets when asked', () {
+    const query = '(string) @string\n(identifier) @variable';
+    const src = 'const s = "héllo 😀";\nconst t = s;\n';
+
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    expect(doc.reparse(src), isTrue);
+    final bytes = doc.queryCapturesPacked(query);
+
+    doc.offsetEncoding = TreeSitterOffsetEncoding.utf16;
+    final units = doc.queryCapturesPacked(query);
+    expect(units.length, bytes.length);
+    for (var i = 0; i < units.length; i++) {
+      final start = units.startByte(i);
+      final end = units.endByte(i);
+      expect(
+        utf8.encode(src.substring(0, start)).length,
+        bytes.startByte(i),
+      );
+      expect(doc.utf16ToByte(start), bytes.startByte(i));
+      expect(doc.byteToUtf16(bytes.endByte(i)), end);
+    }
+    final t = src.lastIndexOf('t');
+    final inRange = doc.queryCapturesInByteRange(
+      query,
+      startByte: t,
+      endByte: t + 1,
+    );
+    expect(inRange.length, 1);
+    expect(src.substring(inRange.startByte(0), inRange.endByte(0)), 't');
+  });
+
   test('tree-sitter incremental doc matches full parse (js insert)', () {
     const query = r'(identifier) @variable';
     const src1 = 'function main() { return 1 + 2; }\nmain();\n';
@@ -222,6 +896,213 @@ void main() {
     expect(afterIncremental, afterFresh);
   });
 
+  test('setText edits match a Dart-side diff', () {
+    const query = r'(identifier) @variable';
+    final rnd = Random(7);
+
+    var text = 'const caf\u00e9 = "\u4e2d\u6587";\nfunction main() { return caf\u00e9; }\n';
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    expect(doc.setText(text).newEndByte, utf8.encode(text).length);
+    expect(doc.reparseText(), TreeSitterReparseStatus.ok);
+
+    for (var step = 0; step < 80; step++) {
+      final oldText = text;
+      text = _mutateText(oldText, rnd);
+      if (step % 3 == 0) {
+        final at = rnd.nextInt(text.length + 1);
+        const multibyte = ['\u00e9', '\u4e2d', '\u00fc\n'];
+        text = text.replaceRange(at, at, multibyte[rnd.nextInt(multibyte.length)]);
+      }
+
+      final edit = doc.setText(text);
+      final d = _diffUtf16(oldText, text);
+      final start = _byteAndPointAtUtf16(oldText, d.start);
+      final oldEnd = _byteAndPointAtUtf16(oldText, d.oldEnd);
+      final newEnd = _byteAndPointAtUtf16(text, d.newEnd);
+      expect(
+        (
+          edit.startUtf16, edit.oldEndUtf16, edit.newEndUtf16,
+          edit.startByte, edit.oldEndByte, edit.newEndByte,
+          edit.startRow, edit.startCol,
+          edit.oldEndRow, edit.oldEndCol,
+          edit.newEndRow, edit.newEndCol,
+        ),
+        (
+          d.start, d.oldEnd, d.newEnd,
+          start.startByte, oldEnd.startByte, newEnd.startByte,
+          start.row, start.colBytes,
+          oldEnd.row, oldEnd.colBytes,
+          newEnd.row, newEnd.colBytes,
+        ),
+        reason: 'step $step',
+      );
+
+      if (step % 8 == 7) {
+        expect(doc.reparseText(), TreeSitterReparseStatus.ok);
+        final fresh = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+        addTearDown(fresh.dispose);
+        expect(fresh.reparse(text), isTrue);
+        expect(
+          doc.queryCaptures(query).map((c) => (c.startByte, c.endByte, c.name)).toList(),
+          fresh.queryCaptures(query).map((c) => (c.startByte, c.endByte, c.name)).toList(),
+        );
+      }
+    }
+  });
+
+  test('replaceText keeps the tracked text in sync', () {
+    const query = r'(identifier) @variable';
+    final rnd = Random(11);
+
+    var text = 'let \u00e9t\u00e9 = "\u{1F600}";\nfunction f(a) { return a; }\n';
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    doc.offsetEncoding = TreeSitterOffsetEncoding.utf16;
+    doc.replaceText(0, 0, text);
+    expect(doc.reparseText(), TreeSitterReparseStatus.ok);
+
+    const pieces = ['x', '\n', '\u00e9', '\u{1F600}', '(a)', '{ }', ''];
+    for (var step = 0; step < 80; step++) {
+      var start = rnd.nextInt(text.length + 1);
+      var end = (start + rnd.nextInt(5)).clamp(0, text.length);
+      // Keep surrogate pairs whole, as an editor would.
+      if (start > 0 && start < text.length && text.codeUnitAt(start) >= 0xDC00 && text.codeUnitAt(start) <= 0xDFFF) start--;
+      if (end > 0 && end < text.length && text.codeUnitAt(end) >= 0xDC00 && text.codeUnitAt(end) <= 0xDFFF) end++;
+      final replacement = pieces[rnd.nextInt(pieces.length)];
+      final oldText = text;
+      text = oldText.replaceRange(start, end, replacement);
+
+      final edit = doc.replaceText(start, end, replacement);
+      final startPoint = _byteAndPointAtUtf16(oldText, start);
+      final oldEndPoint = _byteAndPointAtUtf16(oldText, end);
+      final newEndPoint = _byteAndPointAtUtf16(text, start + replacement.length);
+      expect(
+        (edit.startUtf16, edit.oldEndUtf16, edit.newEndUtf16, edit.startByte, edit.oldEndByte, edit.newEndByte),
+        (start, end, start + replacement.length, startPoint.startByte, oldEndPoint.startByte, newEndPoint.startByte),
+        reason: 'step $step',
+      );
+      expect(
+        (edit.startRow, edit.startCol, edit.oldEndRow, edit.oldEndCol, edit.newEndRow, edit.newEndCol),
+        (startPoint.row, startPoint.colBytes, oldEndPoint.row, oldEndPoint.colBytes, newEndPoint.row, newEndPoint.colBytes),
+        reason: 'step $step',
+      );
+
+      if (step % 8 == 7) {
+        expect(doc.reparseText(), TreeSitterReparseStatus.ok);
+        final fresh = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+        addTearDown(fresh.dispose);
+        fresh.offsetEncoding = TreeSitterOffsetEncoding.utf16;
+        expect(fresh.reparse(text), isTrue);
+        expect(
+          doc.queryCaptures(query).map((c) => (c.startByte, c.endByte, c.name)).toList(),
+          fresh.queryCaptures(query).map((c) => (c.startByte, c.endByte, c.name)).toList(),
+        );
+        // Setting the same text again finds no edit.
+        expect(doc.setText(text).isEmpty, isTrue);
+      }
+    }
+  });
+
+  test('openFile parses a mapped file and edits it like tracked text', () {
+    const query = r'(identifier) @variable';
+    final dir = Directory.systemTemp.createTempSync('ts_open_file');
+    addTearDown(() => dir.deleteSync(recursive: true));
+    final file = File('${dir.path}/big.js');
+    final text = List.generate(400, (i) => 'const v$i = "\u00e9\u{1F600}" + f($i);\n').join();
+    file.writeAsStringSync(text);
+
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    doc.offsetEncoding = TreeSitterOffsetEncoding.utf16;
+    expect(doc.openFile('${dir.path}/missing.js'), isFalse);
+    expect(doc.openFile(file.path), isTrue);
+    expect(doc.reparseText(), TreeSitterReparseStatus.ok);
+
+    List<(int, int, String)> captures(TreeSitterDocument d) =>
+        d.queryCaptures(query).map((c) => (c.startByte, c.endByte, c.name)).toList();
+    TreeSitterDocument freshFor(String source) {
+      final fresh = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+      addTearDown(fresh.dispose);
+      fresh.offsetEncoding = TreeSitterOffsetEncoding.utf16;
+      expect(fresh.reparse(source), isTrue);
+      return fresh;
+    }
+
+    expect(captures(doc), captures(freshFor(text)));
+    final line = text.indexOf('const v7 ');
+    expect(doc.textRange(line, line + 30), text.substring(line, line + 30));
+
+    // The first edit moves the text off the mapping; parsing stays incremental.
+    final edited = text.replaceRange(line + 6, line + 8, 'renamed');
+    doc.replaceText(line + 6, line + 8, 'renamed');
+    expect(doc.reparseText(), TreeSitterReparseStatus.ok);
+    expect(doc.changedRanges(), isNotEmpty);
+    expect(captures(doc), captures(freshFor(edited)));
+    expect(doc.textRange(0, edited.length), edited);
+  });
+
+  test('document stats track parses, queries and subtree reuse', () {
+    const query = r'(identifier) @variable';
+    final doc = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(doc.dispose);
+    expect(doc.stats.parseCount, 0);
+
+    final text = List.generate(500, (i) => 'let v$i = f($i);\n').join();
+    doc.setText(text);
+    expect(doc.reparseText(), TreeSitterReparseStatus.ok);
+    var stats = doc.stats;
+    expect(stats.parseCount, 1);
+    expect(stats.sourceBytes, utf8.encode(text).length);
+    expect(stats.nodeCount, greaterThan(500));
+    expect(stats.recreatedNodes, stats.nodeCount);
+    expect(stats.memoryBytes, doc.memoryUsage);
+
+    // A one-character edit reuses almost the whole tree.
+    final at = text.indexOf('v250');
+    doc.replaceText(at + 1, at + 2, '9');
+    expect(doc.reparseText(), TreeSitterReparseStatus.ok);
+    stats = doc.stats;
+    expect(stats.parseCount, 2);
+    expect(stats.reusedNodes + stats.recreatedNodes, stats.nodeCount);
+    expect(stats.recreatedNodes, greaterThan(0));
+    expect(stats.reuseRatio, greaterThan(0.9));
+
+    expect(doc.queryCapturesPacked(query).length, 1000);
+    stats = doc.stats;
+    expect(stats.queryCount, 1);
+    expect(stats.rollingQuery, stats.lastQuery);
+  });
+
+  test('documents report the native memory they hold', () {
+    const query = r'(identifier) @variable';
+    final small = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(small.dispose);
+    final large = TreeSitterDocument.create(language: TreeSitterLanguage.javascript);
+    addTearDown(large.dispose);
+    final empty = large.memoryUsage;
+    expect(empty, greaterThan(0));
+
+    small.setText('let a = 1;\n');
+    expect(small.reparseText(), TreeSitterReparseStatus.ok);
+    large.setText(List.generate(2000, (i) => 'let v$i = f($i);\n').join());
+    expect(large.reparseText(), TreeSitterReparseStatus.ok);
+    expect(large.memoryUsage, greaterThan(small.memoryUsage * 10));
+
+    // Results handed to Dart are not charged to the document.
+    final before = large.memoryUsage;
+    final captures = large.queryCapturesPacked(query);
+    expect(captures.length, 4000);
+    expect(large.memoryUsage - before, lessThan(captures.records.lengthInBytes));
+
+    large.setText('');
+    expect(large.reparseText(), TreeSitterReparseStatus.ok);
+    expect(large.memoryUsage, lessThan(before));
+
+    treeSitterTrimMemory();
+    expect(treeSitterMemoryUsage().pooledBytes, 0);
+  });
+
   test('tree-sitter incremental doc fuzz (js identifiers)', () {
     const query = r'(identifier) @variable';
     final rnd = Random(1);